@@ -0,0 +1,236 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "image.h"
+#include "opencl_image.h"
+
+
+// Bounded multi-producer / multi-consumer ring buffer (Vyukov style).
+// Capacity is rounded up to a power of two. try_push fails when full, which is
+// what gives the batch pipeline its backpressure. push and pop sleep on a
+// condition variable until they can go ahead; the lock behind it is only
+// taken when a thread sleeps or there is a sleeper to wake.
+template<typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity) {
+		size_t cap = 2;
+		while (cap < capacity) cap <<= 1;
+		mask = cap - 1;
+		cells.reset(new Cell[cap]);
+		for (size_t i = 0; i < cap; ++i) {
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		enqueue_pos.store(0, std::memory_order_relaxed);
+		dequeue_pos.store(0, std::memory_order_relaxed);
+	}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	bool try_push(const T& item) {
+		if (!push_ring(item)) {
+			return false;
+		}
+		wake(pop_waiters, not_empty);
+		return true;
+	}
+
+	bool try_pop(T& item) {
+		if (!pop_ring(item)) {
+			return false;
+		}
+		wake(push_waiters, not_full);
+		return true;
+	}
+
+	// Blocking push, sleeps while the queue is full
+	void push(const T& item) {
+		if (!push_ring(item)) {
+			sleep_until(push_waiters, not_full, [&] { return push_ring(item); });
+		}
+		wake(pop_waiters, not_empty);
+	}
+
+	// Blocking pop, sleeps while the queue is empty
+	void pop(T& item) {
+		if (!pop_ring(item)) {
+			sleep_until(pop_waiters, not_empty, [&] { return pop_ring(item); });
+		}
+		wake(push_waiters, not_full);
+	}
+
+	size_t capacity() const { return mask + 1; }
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+	alignas(64) std::atomic<size_t> enqueue_pos;
+	alignas(64) std::atomic<size_t> dequeue_pos;
+
+	// Only threads that found the ring full or empty touch wait_lock. A
+	// sleeper counts itself before checking the ring again, and a thread that
+	// changed the ring reads the count after, with a fence on each side: so
+	// either the recheck sees the change or the wake sees the sleeper.
+	std::mutex wait_lock;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+	std::atomic<int> push_waiters{0};
+	std::atomic<int> pop_waiters{0};
+
+	template<typename Ready>
+	void sleep_until(std::atomic<int>& waiters, std::condition_variable& cv, Ready ready) {
+		std::unique_lock<std::mutex> lk(wait_lock);
+		waiters.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		cv.wait(lk, ready);
+		waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void wake(std::atomic<int>& waiters, std::condition_variable& cv) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiters.load(std::memory_order_relaxed) == 0) {
+			return;
+		}
+		// A sleeper holds wait_lock from counting itself until it waits
+		{
+			std::lock_guard<std::mutex> lk(wait_lock);
+		}
+		cv.notify_one();
+	}
+
+	bool push_ring(const T& item) {
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells[pos & mask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if (dif == 0) {
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.data = item;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (dif < 0) {
+				return false;
+			}
+			else {
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool pop_ring(T& item) {
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells[pos & mask];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (dif == 0) {
+				if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					item = cell.data;
+					cell.sequence.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (dif < 0) {
+				return false;
+			}
+			else {
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+};
+
+
+// Fixed size pool where every worker owns a deque. Workers pop their own deque
+// from the front and steal from the back of the others when they run dry.
+// submit() blocks once `max_pending` tasks are queued.
+class ThreadPool {
+public:
+	explicit ThreadPool(size_t threads = 0, size_t max_pending = 1024);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void submit(std::function<void()> task);
+	void wait_idle();
+	size_t size() const { return threads.size(); }
+
+private:
+	struct Worker {
+		std::deque<std::function<void()>> tasks;
+		std::mutex lock;
+	};
+
+	void worker_loop(size_t index);
+	bool pop_task(size_t index, std::function<void()>& task);
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+	size_t max_pending;
+	std::atomic<size_t> next_worker{0};
+
+	// Guarded by sleep_lock. `pending` counts queued plus running tasks.
+	size_t pending = 0;
+	size_t queued = 0;
+	bool stopping = false;
+	std::mutex sleep_lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+};
+
+
+struct BatchJob {
+	std::string input;
+	std::string output;
+};
+
+struct BatchConfig {
+	size_t io_threads = 0;      // 0 uses the hardware thread count
+	size_t queue_depth = 8;     // images allowed in flight between decode and encode
+	int channel_force = 0;
+	int jpg_quality = 90;
+};
+
+struct BatchReport {
+	size_t images = 0;
+	size_t failed = 0;
+	size_t pixel_bytes = 0;
+	double seconds = 0;
+
+	double images_per_second() const { return seconds > 0 ? images / seconds : 0; }
+	double mb_per_second() const { return seconds > 0 ? pixel_bytes / (1024.0 * 1024.0) / seconds : 0; }
+	void print() const;
+};
+
+// Decodes and encodes on a ThreadPool while a single thread owns the
+// OpenCLImageProcessor. Stages are connected with BoundedQueue.
+class BatchProcessor {
+public:
+	using Operation = std::function<void(OpenCLImageProcessor&, Image&)>;
+
+	BatchProcessor(OpenCLImageProcessor& processor, BatchConfig config = BatchConfig());
+
+	BatchReport run(const std::vector<BatchJob>& jobs, const Operation& op);
+
+private:
+	OpenCLImageProcessor& processor;
+	BatchConfig config;
+};
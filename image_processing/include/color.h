@@ -0,0 +1,35 @@
+#pragma once
+#include "image.h"
+#include "masks.h"
+
+// 8 bit encodings of the colour spaces RGB can be converted to:
+//  YCbCr: full range, chroma centred on 128
+//  HSV:   hue over the whole 0-255 range, 0 and 255 both red
+//  Lab:   L scaled from 0-100 to 0-255, a and b offset by 128
+enum ColorSpace { COLOR_YCBCR_601, COLOR_YCBCR_709, COLOR_HSV, COLOR_LAB };
+
+namespace ImageOps {
+	// Converts the first three channels, any further channel is copied. src and
+	// dst need the same size and channel count but not the same layout, so
+	// converting into a planar image deinterleaves in the same pass.
+	void convert_from_rgb(const ImageView& src, const ImageView& dst, ColorSpace space);
+	void convert_to_rgb(const ImageView& src, const ImageView& dst, ColorSpace space);
+
+	// Clamp to border convolution of the luminance only: converts to planar
+	// YCbCr, filters the Y plane and recombines it with the untouched chroma
+	void convolve_luma(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask, ColorSpace space = COLOR_YCBCR_601);
+}
+
+namespace Color {
+	// YCbCr coefficients in 2.14 fixed point, shared with the device kernels so
+	// both give identical results
+	const int FIXED_SHIFT = 14;
+	struct YCbCrCoefficients {
+		// Rows Y, Cb, Cr times R, G, B
+		int forward[9];
+		// Cr to R, Cb to G, Cr to G, Cb to B
+		int inverse[4];
+	};
+	const YCbCrCoefficients& ycbcr(ColorSpace space);
+	bool is_ycbcr(ColorSpace space);
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include "image.h"
+#include "masks.h"
+#include <complex>
+#include <memory>
+#include <vector>
+
+// How ImageOps::convolve and OpenCLImageProcessor::convolve filter. AUTO
+// takes whichever of the other three the cost model in Convolution::choose
+// expects to be cheapest for the mask and image size.
+enum ConvolutionMethod { CONVOLVE_AUTO, CONVOLVE_DIRECT, CONVOLVE_SEPARABLE, CONVOLVE_FFT };
+
+// What lies outside the image, as in std_convolve_clamp_to_0 and _to_border
+enum ConvolutionBorder { CLAMP_TO_0, CLAMP_TO_BORDER };
+
+namespace Fft {
+	typedef std::complex<double> Complex;
+
+	// Smallest power of two of at least n
+	int size_for(int n);
+	// Stockham autosort FFT of n = 2^k values: radix 4 stages, and a last
+	// radix 2 stage when k is odd. work holds n values. The inverse is unscaled.
+	void transform(Complex* data, Complex* work, int n, bool inverse);
+	// Rows of length w, then columns of length h. The result is left
+	// transposed, w rows of h, and the inverse takes it back.
+	void transform_2d(Complex* data, Complex* work, int w, int h);
+	void inverse_2d(Complex* data, Complex* work, int w, int h);
+}
+
+namespace Convolution {
+	// Whether the mask is the outer product of a column and a row, as Gaussians
+	// are. column and row are filled in when it is.
+	bool separable(const Mask::BaseMask* mask, std::vector<double>& column, std::vector<double>& row);
+
+	// Direct costs O(k^2) per pixel, separable O(2k) and FFT O(log n) per pixel
+	// of the padded image, independently of the mask
+	ConvolutionMethod choose(int w, int h, const Mask::BaseMask* mask);
+
+	// A w x h image sits in a W x H transform with room around it for the mask,
+	// the filtered pixel x, y comes out at x + ox, y + oy. correlate places the
+	// mask the way convolution.cl reads it rather than flipped like the CPU loops.
+	struct FftLayout {
+		int W, H, ox, oy;
+	};
+	FftLayout layout(int w, int h, const Mask::BaseMask* mask, bool correlate);
+
+	// Transform of the mask for layout, transposed like Fft::transform_2d
+	// leaves the image and scaled by 1/(W*H). The last few are kept, keyed by
+	// mask content and layout, so the frames of a stream reuse one.
+	uint64_t spectrum_key(const Mask::BaseMask* mask, const FftLayout& layout, bool correlate);
+	std::shared_ptr<const std::vector<Fft::Complex>> mask_spectrum(const Mask::BaseMask* mask,
+		const FftLayout& layout, bool correlate);
+}
+
+namespace ImageOps {
+	// Every channel of src filtered into dst, which may be src. Separable and
+	// FFT sum in a different order than direct, so a pixel whose exact value
+	// lands on a half can round the other way.
+	void convolve(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask,
+		ConvolutionBorder border, ConvolutionMethod method = CONVOLVE_AUTO);
+
+	// A StaticMask straight from its constexpr definition
+	template<int W, int H, typename T>
+	void convolve(const ImageView& src, const ImageView& dst, const Mask::StaticMask<W, H, T>& mask,
+		ConvolutionBorder border, ConvolutionMethod method = CONVOLVE_AUTO) {
+		Mask::StaticBase<W, H, T> base(mask);
+		convolve(src, dst, &base, border, method);
+	}
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include "image.h"
+
+// Instruction sets the CPU kernels are built for, in increasing order
+enum CpuIsa {
+	ISA_SSE2, ISA_AVX2, ISA_AVX512
+};
+
+// Hot CPU loops. src/cpu_kernels.inc is compiled once per instruction set
+// (src/cpu_kernels_*.cpp, each with its own -m flags) and every build fills
+// one of these tables.
+struct CpuKernels {
+	// One channel, read as src[row*sstride + col*sstep] and written as dst[row*dstride + col*dstep]
+	void (*convolve_0)(const uint8_t* src, size_t sstep, size_t sstride, int w, int h,
+		const double* ker, int ker_w, int ker_h, int cr, int cc, uint8_t* dst, size_t dstep, size_t dstride);
+	void (*convolve_border)(const uint8_t* src, size_t sstep, size_t sstride, int w, int h,
+		const double* ker, int ker_w, int ker_h, int cr, int cc, uint8_t* dst, size_t dstep, size_t dstride);
+	// The same for 3x3 and 5x5 masks, their taps unrolled. Results match the
+	// two above exactly.
+	void (*convolve_3x3_0)(const uint8_t* src, size_t sstep, size_t sstride, int w, int h,
+		const double* ker, int ker_w, int ker_h, int cr, int cc, uint8_t* dst, size_t dstep, size_t dstride);
+	void (*convolve_3x3_border)(const uint8_t* src, size_t sstep, size_t sstride, int w, int h,
+		const double* ker, int ker_w, int ker_h, int cr, int cc, uint8_t* dst, size_t dstep, size_t dstride);
+	void (*convolve_5x5_0)(const uint8_t* src, size_t sstep, size_t sstride, int w, int h,
+		const double* ker, int ker_w, int ker_h, int cr, int cc, uint8_t* dst, size_t dstep, size_t dstride);
+	void (*convolve_5x5_border)(const uint8_t* src, size_t sstep, size_t sstride, int w, int h,
+		const double* ker, int ker_w, int ker_h, int cr, int cc, uint8_t* dst, size_t dstep, size_t dstride);
+
+	// One output row of a bilinear resize from source rows row0 and row1
+	void (*resize_bilinear_row)(const uint8_t* row0, const uint8_t* row1, size_t sstep, int w, float fy1,
+		float scaleX, uint8_t* out, size_t dstep, int nw);
+
+	// Gray values of w pixels starting at src, pixels step bytes apart and
+	// channels plane bytes apart (0 for interleaved)
+	void (*gray_row)(const uint8_t* src, size_t step, size_t plane, int w, uint8_t* out, GrayWeights weights);
+	// The first three channels of w pixels converted, both sides addressed
+	// like gray_row's src. m is Color::YCbCrCoefficients' forward or inverse,
+	// the HSV ones take no coefficients. src may be dst.
+	void (*rgb_to_ycbcr_row)(const uint8_t* src, size_t sstep, size_t splane, int w, const int* m,
+		uint8_t* dst, size_t dstep, size_t dplane);
+	void (*ycbcr_to_rgb_row)(const uint8_t* src, size_t sstep, size_t splane, int w, const int* m,
+		uint8_t* dst, size_t dstep, size_t dplane);
+	void (*rgb_to_hsv_row)(const uint8_t* src, size_t sstep, size_t splane, int w,
+		uint8_t* dst, size_t dstep, size_t dplane);
+	void (*hsv_to_rgb_row)(const uint8_t* src, size_t sstep, size_t splane, int w,
+		uint8_t* dst, size_t dstep, size_t dplane);
+
+	// a[i] = |a[i] - b[i]|
+	void (*absdiff)(uint8_t* a, const uint8_t* b, size_t n);
+
+	// dst gets src's w pixels of step bytes in reverse order, not in place
+	void (*reverse_pixels)(const uint8_t* src, uint8_t* dst, int w, size_t step);
+
+	// Cache blocked transpose of w x h pixels of step bytes. Pixel x, y lands
+	// in row x (w-1-x with flip_rows) and column y (h-1-y with flip_cols) of dst.
+	void (*transpose)(const uint8_t* src, size_t sstride, int w, int h, uint8_t* dst, size_t dstride,
+		bool flip_rows, bool flip_cols, size_t step);
+
+	// Source positions, in 1/32 pixels, of pixels 0..n-1 of row y under the
+	// row major 3x3 destination to source matrix m. xy holds x, y pairs.
+	void (*warp_positions)(const float* m, int y, int n, int32_t* xy);
+	// Samples channels bytes per pixel at n positions, black outside the w x h source
+	void (*remap_row)(const uint8_t* src, size_t sstep, size_t sstride, int w, int h, int channels,
+		const int32_t* xy, int n, bool bicubic, uint8_t* dst, size_t dstep);
+
+	// out[i] = min or max of a[i] and b[i]
+	void (*extreme)(const uint8_t* a, const uint8_t* b, uint8_t* out, size_t n, bool take_max);
+	// Min or max over the 2 radius + 1 rows around each of h rows of n bytes,
+	// or over the pixels around each of the w pixels of step bytes in a row.
+	// work holds (h + 2 radius + 2) * n bytes, or w + 2 radius for a row.
+	void (*extreme_columns)(const uint8_t* src, size_t sstride, size_t n, int h, int radius, bool take_max,
+		uint8_t* dst, size_t dstride, uint8_t* work);
+	void (*extreme_row)(const uint8_t* src, size_t step, int w, int radius, bool take_max, uint8_t* dst, uint8_t* work);
+
+	// out[i] = sum of taps[t] * rows[t][i] over n_taps rows of n bytes
+	void (*weighted_rows)(const uint8_t* const* rows, const float* taps, int n_taps, size_t n, float* out);
+	// The row taps, 2 radius + 1 of them, over column's w pixels of step
+	// values, edge pixels repeated, give blur. dst gets src + amount * (src -
+	// blur) where |src - blur| is at least threshold and src elsewhere.
+	// work holds (w + 2 radius) * step + w * step floats.
+	void (*unsharp_row)(const uint8_t* src, const float* column, const float* taps, int radius, size_t step, int w,
+		float amount, float threshold, uint8_t* dst, float* work);
+};
+
+namespace CpuDispatch {
+	// Best set this CPU runs
+	CpuIsa detected();
+	// The set in use, chosen on first use: detected(), or the one named by the
+	// IMAGE_CPU_ISA environment variable (sse2, avx2, avx512) if the CPU runs it
+	CpuIsa active();
+	// Switches sets, lowering isa to detected() if needed. Returns the set now in use.
+	CpuIsa select(CpuIsa isa);
+	const char* name(CpuIsa isa);
+
+	const CpuKernels& kernels();
+}
+
+const CpuKernels& cpu_kernels_sse2();
+const CpuKernels& cpu_kernels_avx2();
+const CpuKernels& cpu_kernels_avx512();
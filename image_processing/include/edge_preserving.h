@@ -0,0 +1,39 @@
+#pragma once
+#include "image.h"
+
+// Smoothing that stops at edges. Both filters take a spatial sigma, in
+// pixels as for GaussianDynamic2D, and a range sigma in 0-255 intensity
+// units: differences well under sigma_range are smoothed over, those well
+// above it are kept.
+namespace EdgePreserving {
+	// Window radius of the bilateral filter, 3 ceil(sigma) as the Gaussian masks use
+	int bilateral_radius(double sigma_space);
+	// Box radius of the guided filter, the box with the spread of the Gaussian
+	int guided_radius(double sigma_space);
+
+	// dst of src's shape and layout, at most 4 channels and positive sigmas,
+	// printing what is wrong otherwise
+	bool valid_args(const ImageView& src, const ImageView& dst, double sigma_space, double sigma_range, const char* op);
+
+	// exp(-d^2 / 2 sigma^2) for d = 0..255, the device keeps it in __constant
+	void range_weights(double sigma_range, float lut[256]);
+	// MaskFactory's Gaussian row for sigma_space, bilateral_radius taps each
+	// side. The spatial weight of an offset is the product of the weights of
+	// its two components. Empty, after printing why, for sigma_space past 64.
+	std::vector<float> spatial_weights(double sigma_space);
+}
+
+namespace ImageOps {
+	// Window average weighted by distance and by colour difference over all
+	// channels, edge pixels repeated outside the image. The colour weight is
+	// the product of each channel's range weight, which is the Gaussian of the
+	// Euclidean colour distance. dst has src's shape and layout and may be src.
+	void bilateral(const ImageView& src, const ImageView& dst, double sigma_space, double sigma_range);
+
+	// He, Sun and Tang's guided filter: each channel of src is fitted as a*I + b
+	// over every box around a pixel, I the guide's matching channel (or its only
+	// one), regularised by sigma_range^2. Box means come from running sums, so
+	// the cost per pixel does not depend on the radius. The guide has src's size
+	// and layout and may be src.
+	void guided(const ImageView& src, const ImageView& guide, const ImageView& dst, double sigma_space, double sigma_range);
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "image.h"
+
+// Gradient directions quantised to 45 degrees, y down. DIAGONAL_DOWN points
+// to the lower right, DIAGONAL_UP to the upper right.
+enum GradientDirection {
+	GRADIENT_HORIZONTAL, GRADIENT_DIAGONAL_DOWN, GRADIENT_VERTICAL, GRADIENT_DIAGONAL_UP
+};
+
+namespace Edges {
+	// Sector of gx, gy, in integers so CPU and device always agree: a gradient
+	// within 22.5 degrees of an axis goes to that axis
+	inline GradientDirection direction(int gx, int gy) {
+		// tan(22.5) in 1.15 fixed point, tan(67.5) = tan(22.5) + 2
+		const int TAN_22 = 13573;
+		int ax = abs(gx), ay = abs(gy) << 15;
+		int tan_22 = ax * TAN_22;
+		if(ay < tan_22) {
+			return GRADIENT_HORIZONTAL;
+		}
+		if(ay > tan_22 + (ax << 16)) {
+			return GRADIENT_VERTICAL;
+		}
+		return (gx ^ gy) < 0 ? GRADIENT_DIAGONAL_UP : GRADIENT_DIAGONAL_DOWN;
+	}
+
+	// Argument checks printing what is wrong
+	bool single_channel(const ImageView& src, const ImageView& dst, const char* op);
+	bool valid_thresholds(int low, int high, const char* op);
+}
+
+namespace ImageOps {
+	// Sobel gradient of a single channel image, edge pixels repeated outside
+	// it: gx and gy as EdgeSobelX and EdgeSobelY weigh the 3x3 neighbourhood,
+	// both from one pass. magnitude gets sqrt(gx^2 + gy^2), saturated, and
+	// orientation, if given, the GradientDirection of each pixel.
+	void sobel(const ImageView& src, const ImageView& magnitude, const ImageView& orientation = ImageView());
+
+	// Canny edges of a single channel image, 255 on edges and 0 elsewhere.
+	// Gradients that are not the largest across their edge are dropped, those
+	// of at least high are edges and those of at least low are edges when
+	// connected to one through others. dst may be src.
+	void canny(const ImageView& src, const ImageView& dst, int low, int high);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include "image.h"
+
+// Histograms are channels * 256 bins, channel c starting at hist + c * 256.
+// Planar and interleaved views give the same result.
+namespace ImageOps {
+	void histogram(const ImageView& src, uint32_t* hist);
+
+	// Spreads every channel's values over the full range
+	void equalize(const ImageView& src, const ImageView& dst);
+
+	// Contrast limited adaptive equalization. Each of tiles_x * tiles_y tiles
+	// gets its own clipped mapping and pixels blend the four nearest tiles'
+	// mappings bilinearly. clip_limit is in multiples of a flat histogram's height.
+	void clahe(const ImageView& src, const ImageView& dst, int tiles_x = 8, int tiles_y = 8, double clip_limit = 2.0);
+
+	// Maps every sample through lut + c * 256 for its channel c
+	void apply_lut(const ImageView& src, const ImageView& dst, const uint8_t* lut);
+}
+
+namespace Histogram {
+	// clip_limit in 16.16 fixed point, as the device kernels take it
+	uint32_t clip_q16_of(double clip_limit);
+	// Equalizing mapping for one channel's histogram of pixels samples
+	void equalize_lut(const uint32_t* hist, size_t pixels, uint8_t* lut);
+	// CLAHE mapping for one tile, hist is clipped and redistributed in place
+	void clahe_lut(uint32_t* hist, size_t pixels, double clip_limit, uint8_t* lut);
+}
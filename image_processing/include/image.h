@@ -3,9 +3,11 @@
 #include <cstdio>
 #include <complex>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <omp.h>
 #include "masks.h"
+#include "image_allocator.h"
 
 
 //legacy feature of C
@@ -17,9 +19,119 @@
 #endif
 
 enum ImageType {
-	PNG, JPG, BMP, JPEG
+	PNG, JPG, BMP, JPEG, RAW
 };
 
+// INTERLEAVED stores RGBRGB.., PLANAR stores every channel as its own w*h plane
+enum PixelLayout {
+	INTERLEAVED, PLANAR
+};
+
+// (r+g+b)/3, or BT.709 luminance in 8.8 fixed point
+enum GrayWeights {
+	GRAY_AVERAGE, GRAY_LUMINANCE
+};
+
+// Clockwise quarter turns
+enum Rotation {
+	ROTATE_90, ROTATE_180, ROTATE_270
+};
+
+// Structuring elements of morphology: the (2 rx + 1) x (2 ry + 1) rectangle,
+// or the horizontal and vertical lines through its centre
+enum StructuringElement {
+	MORPH_RECT, MORPH_CROSS
+};
+
+// OPEN erodes then dilates, CLOSE the reverse. GRADIENT is dilation minus
+// erosion, TOPHAT the image minus its opening, BLACKHAT its closing minus the image.
+enum MorphologyOp {
+	MORPH_ERODE, MORPH_DILATE, MORPH_OPEN, MORPH_CLOSE, MORPH_GRADIENT, MORPH_TOPHAT, MORPH_BLACKHAT
+};
+
+
+// Non-owning window onto pixels. Rows are stride bytes apart and, for planar
+// pixels, channels are plane_pitch bytes apart, so a sub-rectangle of a larger
+// image is just a different origin with the parent's pitches. Ops on a view
+// only touch the pixels inside it.
+struct ImageView {
+	uint8_t* data = NULL;
+	int w = 0;
+	int h = 0;
+	int channels = 0;
+	size_t stride = 0;
+	PixelLayout layout = INTERLEAVED;
+	size_t plane_pitch = 0;
+
+	ImageView() {}
+	// A stride or plane_pitch of 0 means densely packed
+	ImageView(uint8_t* data, int w, int h, int channels, size_t stride = 0,
+		PixelLayout layout = INTERLEAVED, size_t plane_pitch = 0);
+
+	size_t row_bytes() const { return layout == PLANAR ? (size_t)w : (size_t)w * channels; }
+	int planes() const { return layout == PLANAR ? channels : 1; }
+	size_t bytes() const { return row_bytes() * h * planes(); }
+	bool contiguous() const { return stride == row_bytes() && (planes() == 1 || plane_pitch == stride * h); }
+
+	// Start of row y, of plane c when planar
+	uint8_t* row(int y, int c = 0) const { return data + (layout == PLANAR ? c * plane_pitch : 0) + y * stride; }
+	// First sample of a channel and the distance between its samples in a row
+	uint8_t* channel_start(int c) const { return layout == PLANAR ? data + c * plane_pitch : data + c; }
+	size_t pixel_step() const { return layout == PLANAR ? 1 : channels; }
+
+	// x, y, w, h clipped to this view, never copies
+	ImageView sub(int x, int y, int w, int h) const;
+	// Copies the overlapping top-left region into dst, which must share the layout
+	void copy_to(const ImageView& dst) const;
+
+	void grayscale_avg() const;
+	void grayscale_lum() const;
+
+	void diffmap(const ImageView& img) const;
+	void diffmap_scale(const ImageView& img, uint8_t scl = 0) const;
+
+	void flipX() const;
+	void flipY() const;
+
+	void std_convolve_clamp_to_0(uint8_t channel, const Mask::BaseMask* mask) const;
+	void std_convolve_clamp_to_border(uint8_t channel, const Mask::BaseMask* mask) const;
+
+private:
+	bool require_interleaved(const char* op) const;
+};
+
+
+// Out-of-place variants of the CPU ops. src is only read and dst, which must
+// already have the output size, is written, so a hot loop can ping-pong
+// between two preallocated images without touching the heap. Passing the same
+// view as src and dst falls back to the in-place op.
+namespace ImageOps {
+	void grayscale_avg(const ImageView& src, const ImageView& dst);
+	void grayscale_lum(const ImageView& src, const ImageView& dst);
+	// dst either has src's shape, getting gray in its first three channels, or
+	// a single channel. SIMD rows picked for the CPU at runtime.
+	void grayscale(const ImageView& src, const ImageView& dst, GrayWeights weights);
+
+	void diffmap(const ImageView& src, const ImageView& img, const ImageView& dst);
+
+	void flipX(const ImageView& src, const ImageView& dst);
+	void flipY(const ImageView& src, const ImageView& dst);
+	// dst has src's width and height swapped (kept for ROTATE_180) and must
+	// not overlap src. Cache blocked, SIMD for 4 byte pixels.
+	void transpose(const ImageView& src, const ImageView& dst);
+	void rotate(const ImageView& src, const ImageView& dst, Rotation rotation);
+
+	// Only the given channel of dst is written
+	void std_convolve_clamp_to_0(const ImageView& src, const ImageView& dst, uint8_t channel, const Mask::BaseMask* mask);
+	void std_convolve_clamp_to_border(const ImageView& src, const ImageView& dst, uint8_t channel, const Mask::BaseMask* mask);
+
+	// dst.w x dst.h region starting at cx, cy
+	void crop(const ImageView& src, const ImageView& dst, int cx, int cy);
+	// Scale src to the size of dst
+	void resizeNN(const ImageView& src, const ImageView& dst);
+	void resizeBilinear(const ImageView& src, const ImageView& dst);
+}
+
 
 struct Image {
 	uint8_t* data = NULL;
@@ -27,16 +139,51 @@ struct Image {
 	int w;
 	int h;
 	int channels;
+	PixelLayout layout = INTERLEAVED;
 
-	Image(const char* filename, int channel_force = 0);
-	Image(int w, int h, int channels = 3);
-	Image(const Image& img);
+	// Pixels live in 64 byte aligned storage from allocator, which must outlive the image
+	Image(const char* filename, int channel_force = 0, ImageAllocator* allocator = ImageAllocator::heap());
+	Image(int w, int h, int channels = 3, ImageAllocator* allocator = ImageAllocator::heap());
+	// Packs the pixels of a view into a new dense image
+	explicit Image(const ImageView& view, ImageAllocator* allocator = ImageAllocator::heap());
 	~Image();
 
-	bool write(const char* filename);
+	// Images are moved, deep copies are explicit
+	Image(Image&& img) noexcept;
+	Image& operator=(Image&& img) noexcept;
+	Image(const Image&) = delete;
+	Image& operator=(const Image&) = delete;
+	Image clone() const { return clone(allocator); }
+	Image clone(ImageAllocator* allocator) const;
+
+	bool write(const char* filename, int jpg_quality = 100) const;
+
+	// Bytes between rows, of a single plane when planar
+	size_t row_stride() const { return layout == PLANAR ? (size_t)w : (size_t)w * channels; }
+	uint8_t* plane(int c) const { return data + (size_t)c * w * h; }
+
+	ImageView view() const { return ImageView(data, w, h, channels, row_stride(), layout, (size_t)w * h); }
+	// Region of interest, clipped to the image
+	ImageView view(int x, int y, int rw, int rh) const { return view().sub(x, y, rw, rh); }
+
+	// True when data points into a mapped .rimg file
+	bool is_mapped() const { return map_base != NULL; }
+	// Storage for replace_data, from this image's allocator
+	uint8_t* allocate(size_t bytes) const { return allocator->allocate(bytes); }
+	// Frees the current pixels and takes ownership of buffer, which came from allocate(bytes)
+	void replace_data(uint8_t* buffer, size_t bytes);
+
+	ImageAllocator* get_allocator() const { return allocator; }
 
 private:
+	ImageAllocator* allocator = ImageAllocator::heap();
+	size_t capacity = 0;
+	void* map_base = NULL;
+	size_t map_length = 0;
+
 	bool read(const char* filename, int channel_force = 0);
+	bool read_raw(const char* filename, int channel_force = 0);
+	void free_data();
 
 	void mask_calc(double* mask, double filter_factor, int w, int h) {
 		for (int i = 0; i < w*h; ++i) {
@@ -46,22 +193,54 @@ private:
 	
 
 public:
-	ImageType get_file_type(const char* filename);
+	ImageType get_file_type(const char* filename) const;
+
+	Image& to_planar_cpu();
+	Image& to_interleaved_cpu();
 
 	Image& grayscale_avg_cpu();
 	Image& grayscale_lum_cpu();
+	// Single channel copy
+	Image grayscale_channel_cpu(GrayWeights weights = GRAY_LUMINANCE) const;
 
 	Image& diffmap_cpu(Image& img);
 	Image& diffmap_scale_cpu(Image& img, uint8_t scl = 0);
 
 	Image& flipX_cpu();
 	Image& flipY_cpu();
+	Image& transpose_cpu();
+	Image& rotate_cpu(Rotation rotation);
 
 	Image& std_convolve_clamp_to_0_cpu(uint8_t channel, const Mask::BaseMask* mask);
 	Image& std_convolve_clamp_to_border_cpu(uint8_t channel, const Mask::BaseMask* mask);
+
+	// Rank filters over a (2 radius + 1)^2 window, see ImageOps::rank_filter
+	Image& median_cpu(int radius);
+	Image& rank_filter_cpu(int radius, double percent);
+	// Erosion, dilation and their composites, see ImageOps::morphology
+	Image& morphology_cpu(MorphologyOp op, int rx, int ry, StructuringElement shape = MORPH_RECT);
+	// Edge preserving smoothing, the guided filter guided by the image itself.
+	// See ImageOps::bilateral and ImageOps::guided.
+	Image& bilateral_cpu(double sigma_space, double sigma_range);
+	Image& guided_cpu(double sigma_space, double sigma_range);
+	// Single channel Sobel magnitude and Canny edges of the image, or of its
+	// luminance when it has colour. See ImageOps::sobel and ImageOps::canny.
+	Image sobel_cpu() const;
+	Image canny_cpu(int low, int high) const;
+	// src + amount (src - Gaussian blur) where the difference reaches threshold,
+	// see ImageOps::unsharp
+	Image& unsharp_cpu(double amount, double radius, int threshold);
 	
 	Image& crop(uint16_t cx, uint16_t cy, uint16_t cw, uint16_t ch);
 	Image& resizeNN(uint16_t nw, uint16_t nh);
 	Image& resizeBilinear_cpu(uint16_t nw, uint16_t nh);
 
 };
+
+
+namespace ImageOps {
+	// Owning copy of src when any of its bytes, first to last of each plane,
+	// overlap dst's, NULL otherwise. Ops that read around each pixel take
+	// their input from it to work in place or between overlapping sub views.
+	std::unique_ptr<Image> unaliased(const ImageView& src, const ImageView& dst);
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+// Pixel buffers are aligned to a cache line so SIMD loads never split one
+constexpr size_t IMAGE_ALIGNMENT = 64;
+
+// Source of Image pixel storage. deallocate is always given the size that was
+// asked for, and may run on a different thread than allocate.
+class ImageAllocator {
+public:
+	virtual ~ImageAllocator() {}
+
+	virtual uint8_t* allocate(size_t bytes) = 0;
+	virtual void deallocate(uint8_t* data, size_t bytes) = 0;
+
+	// Plain aligned heap memory, the default for every Image
+	static ImageAllocator* heap();
+};
+
+
+// Recycles buffers of the sizes a stream of frames keeps asking for. Freed
+// buffers first go to a small per-thread cache, which needs no locking, and
+// spill into a shared pool so a frame decoded on one thread and released on
+// another still comes back around.
+//
+//	Image frame("in.png", 0, FramePoolAllocator::instance());
+class FramePoolAllocator : public ImageAllocator {
+public:
+	static FramePoolAllocator* instance();
+
+	uint8_t* allocate(size_t bytes) override;
+	void deallocate(uint8_t* data, size_t bytes) override;
+
+	// Buffers held by each thread before the shared pool is used
+	static constexpr size_t LOCAL_BUFFERS = 4;
+
+	// Bytes kept in the shared pool, buffers beyond that go back to the heap
+	void set_capacity(size_t bytes);
+	// Hands the shared pool and the calling thread's cache back to the heap.
+	// Other threads' caches are not touched, they spill into the shared pool
+	// when their thread exits.
+	void trim();
+
+	// Buffers that had to come from the heap
+	size_t fresh_allocations() const { return fresh; }
+
+private:
+	FramePoolAllocator() {}
+
+	friend struct LocalFrameCache;
+	void give_back(uint8_t* data, size_t bytes);
+
+	std::mutex lock;
+	std::unordered_multimap<size_t, uint8_t*> pool;
+	size_t pooled_bytes = 0;
+	size_t capacity = (size_t)512 << 20;
+	std::atomic<size_t> fresh{0};
+};
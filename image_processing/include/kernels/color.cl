@@ -0,0 +1,243 @@
+// RGB to and from YCbCr, HSV and Lab, one work-item per pixel. Source and
+// destination each say whether they are planar, so a conversion can
+// deinterleave or interleave on the way. Channels past the third are copied.
+
+#define FIXED_SHIFT 14
+#define FIXED_BIAS (512 << FIXED_SHIFT)
+#define FIXED_HALF (1 << (FIXED_SHIFT - 1))
+
+int channel_index(int i, int c, int plane, int channels, int planar) {
+    return planar ? c * plane + i : i * channels + c;
+}
+
+uchar descale(int v) {
+    return (uchar)clamp(((v + FIXED_HALF + FIXED_BIAS) >> FIXED_SHIFT) - 512, 0, 255);
+}
+
+void store(__global uchar* dst, int i, int plane, int channels, int planar, uchar3 v) {
+    dst[channel_index(i, 0, plane, channels, planar)] = v.x;
+    dst[channel_index(i, 1, plane, channels, planar)] = v.y;
+    dst[channel_index(i, 2, plane, channels, planar)] = v.z;
+}
+
+int3 load(__global const uchar* src, int i, int plane, int channels, int planar) {
+    return (int3)(src[channel_index(i, 0, plane, channels, planar)],
+                  src[channel_index(i, 1, plane, channels, planar)],
+                  src[channel_index(i, 2, plane, channels, planar)]);
+}
+
+void copy_extra(__global const uchar* src, __global uchar* dst, int i, int plane, int channels, int src_planar, int dst_planar) {
+    for (int c = 3; c < channels; ++c) {
+        dst[channel_index(i, c, plane, channels, dst_planar)] = src[channel_index(i, c, plane, channels, src_planar)];
+    }
+}
+
+// m holds the forward rows Y, Cb, Cr times R, G, B in 2.14 fixed point
+__kernel void rgb_to_ycbcr(
+    __global const uchar* src,
+    __global uchar* dst,
+    int w,
+    int h,
+    int channels,
+    int src_planar,
+    int dst_planar,
+    __constant int* m
+)
+{
+    int i = get_global_id(0);
+    int plane = w * h;
+    if (i >= plane) {
+        return;
+    }
+
+    int3 rgb = load(src, i, plane, channels, src_planar);
+    int3 y = rgb * (int3)(m[0], m[1], m[2]);
+    int3 cb = rgb * (int3)(m[3], m[4], m[5]);
+    int3 cr = rgb * (int3)(m[6], m[7], m[8]);
+    uchar3 out = (uchar3)(descale(y.x + y.y + y.z),
+                          descale(cb.x + cb.y + cb.z + (128 << FIXED_SHIFT)),
+                          descale(cr.x + cr.y + cr.z + (128 << FIXED_SHIFT)));
+
+    store(dst, i, plane, channels, dst_planar, out);
+    copy_extra(src, dst, i, plane, channels, src_planar, dst_planar);
+}
+
+// m holds Cr to R, Cb to G, Cr to G and Cb to B
+__kernel void ycbcr_to_rgb(
+    __global const uchar* src,
+    __global uchar* dst,
+    int w,
+    int h,
+    int channels,
+    int src_planar,
+    int dst_planar,
+    __constant int* m
+)
+{
+    int i = get_global_id(0);
+    int plane = w * h;
+    if (i >= plane) {
+        return;
+    }
+
+    int3 ycc = load(src, i, plane, channels, src_planar);
+    int y = ycc.x << FIXED_SHIFT;
+    int cb = ycc.y - 128;
+    int cr = ycc.z - 128;
+    uchar3 out = (uchar3)(descale(y + m[0] * cr),
+                          descale(y - m[1] * cb - m[2] * cr),
+                          descale(y + m[3] * cb));
+
+    store(dst, i, plane, channels, dst_planar, out);
+    copy_extra(src, dst, i, plane, channels, src_planar, dst_planar);
+}
+
+__kernel void rgb_to_hsv(
+    __global const uchar* src,
+    __global uchar* dst,
+    int w,
+    int h,
+    int channels,
+    int src_planar,
+    int dst_planar
+)
+{
+    int i = get_global_id(0);
+    int plane = w * h;
+    if (i >= plane) {
+        return;
+    }
+
+    int3 rgb = load(src, i, plane, channels, src_planar);
+    int v = max(rgb.x, max(rgb.y, rgb.z));
+    int diff = v - min(rgb.x, min(rgb.y, rgb.z));
+    int hue = 0;
+    if (diff != 0) {
+        int pos = v == rgb.x ? rgb.y - rgb.z : v == rgb.y ? 2 * diff + rgb.z - rgb.x : 4 * diff + rgb.x - rgb.y;
+        if (pos < 0) {
+            pos += 6 * diff;
+        }
+        hue = ((pos * 256 + 3 * diff) / (6 * diff)) & 255;
+    }
+    int s = v == 0 ? 0 : (255 * diff + v / 2) / v;
+
+    store(dst, i, plane, channels, dst_planar, (uchar3)(hue, s, v));
+    copy_extra(src, dst, i, plane, channels, src_planar, dst_planar);
+}
+
+__kernel void hsv_to_rgb(
+    __global const uchar* src,
+    __global uchar* dst,
+    int w,
+    int h,
+    int channels,
+    int src_planar,
+    int dst_planar
+)
+{
+    int i = get_global_id(0);
+    int plane = w * h;
+    if (i >= plane) {
+        return;
+    }
+
+    int3 hsv = load(src, i, plane, channels, src_planar);
+    int s = hsv.y, v = hsv.z;
+    int h6 = hsv.x * 6;
+    int sector = h6 >> 8, f = h6 & 255;
+    int p = (v * (255 - s) + 127) / 255;
+    int q = (v * (255 * 256 - s * f) + 255 * 128) / (255 * 256);
+    int t = (v * (255 * 256 - s * (256 - f)) + 255 * 128) / (255 * 256);
+
+    int3 rgb;
+    switch (sector) {
+        case 0: rgb = (int3)(v, t, p); break;
+        case 1: rgb = (int3)(q, v, p); break;
+        case 2: rgb = (int3)(p, v, t); break;
+        case 3: rgb = (int3)(p, q, v); break;
+        case 4: rgb = (int3)(t, p, v); break;
+        default: rgb = (int3)(v, p, q); break;
+    }
+
+    store(dst, i, plane, channels, dst_planar, convert_uchar3(rgb));
+    copy_extra(src, dst, i, plane, channels, src_planar, dst_planar);
+}
+
+
+// ---------- Lab, sRGB with the D65 white point -----------
+
+#define LAB_XN 0.950456f
+#define LAB_ZN 1.088754f
+
+float lab_f(float t) {
+    return t > 0.008856f ? cbrt(t) : 7.787f * t + 16.0f / 116;
+}
+
+float lab_f_inverse(float t) {
+    return t > 0.206893f ? t * t * t : (t - 16.0f / 116) / 7.787f;
+}
+
+float3 linearize(float3 c) {
+    return select(pow((c + 0.055f) / 1.055f, (float3)(2.4f)), c / 12.92f, islessequal(c, (float3)(0.04045f)));
+}
+
+float3 gamma_encode(float3 c) {
+    c = clamp(c, 0.0f, 1.0f);
+    return 255 * select(1.055f * pow(c, (float3)(1 / 2.4f)) - 0.055f, 12.92f * c, islessequal(c, (float3)(0.0031308f)));
+}
+
+__kernel void rgb_to_lab(
+    __global const uchar* src,
+    __global uchar* dst,
+    int w,
+    int h,
+    int channels,
+    int src_planar,
+    int dst_planar
+)
+{
+    int i = get_global_id(0);
+    int plane = w * h;
+    if (i >= plane) {
+        return;
+    }
+
+    float3 l = linearize(convert_float3(load(src, i, plane, channels, src_planar)) / 255.0f);
+    float x = dot(l, (float3)(0.412453f, 0.357580f, 0.180423f)) / LAB_XN;
+    float y = dot(l, (float3)(0.212671f, 0.715160f, 0.072169f));
+    float z = dot(l, (float3)(0.019334f, 0.119193f, 0.950227f)) / LAB_ZN;
+    float fx = lab_f(x), fy = lab_f(y), fz = lab_f(z);
+    float3 lab = (float3)((116 * fy - 16) * 255 / 100, 500 * (fx - fy) + 128, 200 * (fy - fz) + 128);
+
+    store(dst, i, plane, channels, dst_planar, convert_uchar3_sat_rte(lab));
+    copy_extra(src, dst, i, plane, channels, src_planar, dst_planar);
+}
+
+__kernel void lab_to_rgb(
+    __global const uchar* src,
+    __global uchar* dst,
+    int w,
+    int h,
+    int channels,
+    int src_planar,
+    int dst_planar
+)
+{
+    int i = get_global_id(0);
+    int plane = w * h;
+    if (i >= plane) {
+        return;
+    }
+
+    float3 lab = convert_float3(load(src, i, plane, channels, src_planar));
+    float fy = (lab.x * 100.0f / 255 + 16) / 116;
+    float fx = fy + (lab.y - 128) / 500.0f;
+    float fz = fy - (lab.z - 128) / 200.0f;
+    float3 xyz = (float3)(lab_f_inverse(fx) * LAB_XN, lab_f_inverse(fy), lab_f_inverse(fz) * LAB_ZN);
+    float3 rgb = (float3)(dot(xyz, (float3)(3.240479f, -1.537150f, -0.498535f)),
+                          dot(xyz, (float3)(-0.969256f, 1.875992f, 0.041556f)),
+                          dot(xyz, (float3)(0.055648f, -0.204043f, 1.057311f)));
+
+    store(dst, i, plane, channels, dst_planar, convert_uchar3_sat_rte(gamma_encode(rgb)));
+    copy_extra(src, dst, i, plane, channels, src_planar, dst_planar);
+}
@@ -155,4 +155,144 @@ __kernel void convolution_circular(
 
     write_imagef(result, coords, clampedSum);
 
-}
\ No newline at end of file
+}
+
+// ---------- Static masks -----------
+
+#ifdef MASK_TAPS
+
+// Masks fixed at compile time arrive as -D constants: MASK_W, MASK_H, the
+// centre MASK_CR, MASK_CC and the taps row by row. The tap loops have
+// constant bounds and unroll with the taps folded in. Sums run in
+// convolution_0's and convolution_border's order, one work-item per sample.
+__constant double static_mask[MASK_W * MASK_H] = { MASK_TAPS };
+
+int sample_index(int x, int y, int c, int w, int h, int channels, int planar) {
+    return planar ? c * w * h + y * w + x : (y * w + x) * channels + c;
+}
+
+__kernel void convolution_static(
+    __global const uchar* matrix,
+    __global uchar* result,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    int clamp_border
+)
+{
+    int col = get_global_id(0);
+    int row = get_global_id(1);
+    int ch = get_global_id(2);
+
+    if (col >= w || row >= h) {
+        return;
+    }
+
+    double temp = 0;
+    #pragma unroll
+    for (int i = 0; i < MASK_H; ++i) {
+        int r = row - MASK_CR + i;
+        if (r < 0 || r >= h) {
+            if (!clamp_border) {
+                continue;
+            }
+            r = clamp(r, 0, h - 1);
+        }
+        #pragma unroll
+        for (int j = 0; j < MASK_W; ++j) {
+            int c = col - MASK_CC + j;
+            if (c < 0 || c >= w) {
+                if (!clamp_border) {
+                    continue;
+                }
+                c = clamp(c, 0, w - 1);
+            }
+            temp += matrix[sample_index(c, r, ch, w, h, channels, planar)] * static_mask[i * MASK_W + j];
+        }
+    }
+    result[sample_index(col, row, ch, w, h, channels, planar)] = (uchar)clamp((int)round(temp), 0, 255);
+}
+
+#endif
+
+
+// ---------- Separable -----------
+
+// Masks that are a column times a row, in two passes over a double buffer.
+// taps holds the row's mask_w values followed by the column's, read the same
+// way round as convolution_0 and convolution_border read the whole mask.
+// Planar images run each plane, stacked along the third dimension, with
+// channels 1.
+__kernel void convolution_rows(
+    __global const uchar* matrix,
+    __global double* tmp,
+    __constant double* taps,
+    int w,
+    int h,
+    int channels,
+    int mask_w,
+    int mask_offset_w,
+    int clamp_border
+)
+{
+    int col = get_global_id(0);
+    int row = get_global_id(1);
+    size_t plane = (size_t)get_global_id(2) * w * h * channels;
+
+    if (col >= w || row >= h) {
+        return;
+    }
+
+    for (int ch = 0; ch < channels; ++ch) {
+        double temp = 0;
+        for (int j = 0; j < mask_w; ++j) {
+            int c = col - mask_offset_w + j;
+            if (c < 0 || c >= w) {
+                if (!clamp_border) {
+                    continue;
+                }
+                c = clamp(c, 0, w - 1);
+            }
+            temp += matrix[plane + (row * w + c) * channels + ch] * taps[j];
+        }
+        tmp[plane + (row * w + col) * channels + ch] = temp;
+    }
+}
+
+__kernel void convolution_cols(
+    __global const double* tmp,
+    __global uchar* result,
+    __constant double* taps,
+    int w,
+    int h,
+    int channels,
+    int mask_w,
+    int mask_h,
+    int mask_offset_h,
+    int clamp_border
+)
+{
+    int col = get_global_id(0);
+    int row = get_global_id(1);
+    size_t plane = (size_t)get_global_id(2) * w * h * channels;
+
+    if (col >= w || row >= h) {
+        return;
+    }
+
+    for (int ch = 0; ch < channels; ++ch) {
+        double temp = 0;
+        for (int i = 0; i < mask_h; ++i) {
+            int r = row - mask_offset_h + i;
+            if (r < 0 || r >= h) {
+                if (!clamp_border) {
+                    continue;
+                }
+                r = clamp(r, 0, h - 1);
+            }
+            temp += tmp[plane + (r * w + col) * channels + ch] * taps[mask_w + i];
+        }
+        result[plane + (row * w + col) * channels + ch] = (uchar)clamp((int)round(temp), 0, 255);
+    }
+}
@@ -24,3 +24,17 @@ __kernel void diffmap(
     }
 
 }
+
+// Multiplies every sample by scl, wrapping like the CPU version
+__kernel void scale(
+    __global uchar* data,
+    int n,
+    int scl
+)
+{
+    int i = get_global_id(0);
+
+    if (i < n) {
+        data[i] = (uchar)(data[i] * scl);
+    }
+}
@@ -0,0 +1,227 @@
+// Bilateral and guided filters, see ImageOps::bilateral and ImageOps::guided
+
+#ifndef TILE
+#define TILE 16
+#endif
+
+int sample_index(int x, int y, int c, int w, int h, int channels, int planar) {
+    return planar ? c * w * h + y * w + x : (y * w + x) * channels + c;
+}
+
+#ifdef RADIUS
+
+#define SPAN (TILE + 2 * RADIUS)
+
+// The tile and its border of RADIUS pixels are staged in local memory, up to
+// 4 channels a pixel. weights holds the weight of every intensity difference
+// followed by the weight of every offset along one axis.
+__kernel void bilateral(
+    __global const uchar* in,
+    __global uchar* out,
+    __constant float* weights,
+    int w,
+    int h,
+    int channels,
+    int planar
+)
+{
+    __local uchar4 tile[SPAN * SPAN];
+
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int x0 = get_group_id(0) * TILE - RADIUS;
+    int y0 = get_group_id(1) * TILE - RADIUS;
+
+    for (int i = ly * TILE + lx; i < SPAN * SPAN; i += TILE * TILE) {
+        int sx = clamp(x0 + i % SPAN, 0, w - 1);
+        int sy = clamp(y0 + i / SPAN, 0, h - 1);
+        uchar v[4] = { 0, 0, 0, 0 };
+        for (int c = 0; c < channels; ++c) {
+            v[c] = in[sample_index(sx, sy, c, w, h, channels, planar)];
+        }
+        tile[i] = (uchar4)(v[0], v[1], v[2], v[3]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    __constant float* range = weights;
+    __constant float* spatial = weights + 256;
+    // Unused channels are 0 everywhere and weigh range[0] = 1
+    int4 center = convert_int4(tile[(ly + RADIUS) * SPAN + lx + RADIUS]);
+    float4 sum = (float4)(0.0f);
+    float total = 0.0f;
+    for (int i = 0; i <= 2 * RADIUS; ++i) {
+        __local const uchar4* line = tile + (ly + i) * SPAN + lx;
+        float wy = spatial[i];
+        for (int j = 0; j <= 2 * RADIUS; ++j) {
+            int4 v = convert_int4(line[j]);
+            int4 d = abs(v - center);
+            float weight = wy * spatial[j] * range[d.x] * range[d.y] * range[d.z] * range[d.w];
+            total += weight;
+            sum += weight * convert_float4(v);
+        }
+    }
+
+    float4 result = fmin(sum / total + 0.5f, 255.0f);
+    float r[4] = { result.x, result.y, result.z, result.w };
+    for (int c = 0; c < channels; ++c) {
+        out[sample_index(x, y, c, w, h, channels, planar)] = (uchar)r[c];
+    }
+}
+
+#endif
+
+
+// ---------- Guided filter -----------
+//
+// Float planes of w x h values: I, p, I p and I I for every channel, then a
+// and b. Box means come from running sums, one work-item per row or column.
+
+__kernel void guided_stats(
+    __global const uchar* src,
+    __global const uchar* guide,
+    __global float* stats,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    int guide_channels
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    size_t plane = (size_t)w * h;
+    size_t k = (size_t)y * w + x;
+    float vi = guide[sample_index(x, y, guide_channels == 1 ? 0 : c, w, h, guide_channels, planar)];
+    float vp = src[sample_index(x, y, c, w, h, channels, planar)];
+    stats[c * plane + k] = vi;
+    stats[(channels + c) * plane + k] = vp;
+    stats[(2 * channels + c) * plane + k] = vi * vp;
+    stats[(3 * channels + c) * plane + k] = vi * vi;
+}
+
+// Box mean along each row of plane z, clipped to the row
+__kernel void box_rows(
+    __global const float* in,
+    __global float* out,
+    int w,
+    int h,
+    int radius
+)
+{
+    int y = get_global_id(0);
+    if (y >= h) {
+        return;
+    }
+    size_t row = ((size_t)get_global_id(1) * h + y) * w;
+    in += row;
+    out += row;
+
+    float sum = 0.0f;
+    for (int x = 0; x <= min(radius, w - 1); ++x) {
+        sum += in[x];
+    }
+    for (int x = 0; x < w; ++x) {
+        out[x] = sum / (min(x + radius, w - 1) - max(x - radius, 0) + 1);
+        if (x + radius + 1 < w) {
+            sum += in[x + radius + 1];
+        }
+        if (x - radius >= 0) {
+            sum -= in[x - radius];
+        }
+    }
+}
+
+// Box mean down each column of plane z. Neighbouring work-items take
+// neighbouring columns, so every step reads along a row.
+__kernel void box_cols(
+    __global const float* in,
+    __global float* out,
+    int w,
+    int h,
+    int radius
+)
+{
+    int x = get_global_id(0);
+    if (x >= w) {
+        return;
+    }
+    size_t plane = (size_t)get_global_id(1) * w * h;
+    in += plane + x;
+    out += plane + x;
+
+    float sum = 0.0f;
+    for (int y = 0; y <= min(radius, h - 1); ++y) {
+        sum += in[(size_t)y * w];
+    }
+    for (int y = 0; y < h; ++y) {
+        out[(size_t)y * w] = sum / (min(y + radius, h - 1) - max(y - radius, 0) + 1);
+        if (y + radius + 1 < h) {
+            sum += in[(size_t)(y + radius + 1) * w];
+        }
+        if (y - radius >= 0) {
+            sum -= in[(size_t)(y - radius) * w];
+        }
+    }
+}
+
+// a and b of every channel from the means of I, p, I p and I I
+__kernel void guided_coefficients(
+    __global const float* means,
+    __global float* coefficients,
+    int n,
+    int channels,
+    float eps
+)
+{
+    int k = get_global_id(0);
+    int c = get_global_id(1);
+    if (k >= n) {
+        return;
+    }
+
+    float mi = means[(size_t)c * n + k];
+    float mp = means[(size_t)(channels + c) * n + k];
+    float mip = means[(size_t)(2 * channels + c) * n + k];
+    float mii = means[(size_t)(3 * channels + c) * n + k];
+    float a = (mip - mi * mp) / (mii - mi * mi + eps);
+    coefficients[(size_t)c * n + k] = a;
+    coefficients[(size_t)(channels + c) * n + k] = mp - a * mi;
+}
+
+__kernel void guided_output(
+    __global const float* coefficients,
+    __global const uchar* guide,
+    __global uchar* out,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    int guide_channels
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    size_t n = (size_t)w * h;
+    size_t k = (size_t)y * w + x;
+    float vi = guide[sample_index(x, y, guide_channels == 1 ? 0 : c, w, h, guide_channels, planar)];
+    float value = coefficients[c * n + k] * vi + coefficients[(channels + c) * n + k];
+    out[sample_index(x, y, c, w, h, channels, planar)] = (uchar)clamp(value + 0.5f, 0.0f, 255.0f);
+}
@@ -0,0 +1,207 @@
+// Sobel gradients and the Canny edge pipeline on single channel images,
+// see ImageOps::sobel and ImageOps::canny. Directions and thresholds are
+// decided in integers, the same way as on the CPU.
+
+#ifndef TILE
+#define TILE 16
+#endif
+
+#define SPAN (TILE + 2)
+
+#define GRADIENT_HORIZONTAL 0
+#define GRADIENT_DIAGONAL_DOWN 1
+#define GRADIENT_VERTICAL 2
+#define GRADIENT_DIAGONAL_UP 3
+
+// The work-group's tile and a pixel of border around it, edge pixels
+// repeated outside the image
+void load_tile(__global const uchar* in, __local uchar* tile, int w, int h) {
+    int x0 = get_group_id(0) * TILE - 1;
+    int y0 = get_group_id(1) * TILE - 1;
+    for (int i = get_local_id(1) * TILE + get_local_id(0); i < SPAN * SPAN; i += TILE * TILE) {
+        int sx = clamp(x0 + i % SPAN, 0, w - 1);
+        int sy = clamp(y0 + i / SPAN, 0, h - 1);
+        tile[i] = in[sy * w + sx];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// Gx and Gy of the work-item's pixel from the tile
+int2 tile_gradient(__local const uchar* tile) {
+    __local const uchar* up = tile + get_local_id(1) * SPAN + get_local_id(0);
+    __local const uchar* mid = up + SPAN;
+    __local const uchar* down = mid + SPAN;
+    int gx = (up[2] + 2 * mid[2] + down[2]) - (up[0] + 2 * mid[0] + down[0]);
+    int gy = (down[0] + 2 * down[1] + down[2]) - (up[0] + 2 * up[1] + up[2]);
+    return (int2)(gx, gy);
+}
+
+int gradient_direction(int gx, int gy) {
+    // tan(22.5) in 1.15 fixed point, tan(67.5) = tan(22.5) + 2
+    int ax = abs(gx), ay = abs(gy) << 15;
+    int tan_22 = ax * 13573;
+    if (ay < tan_22) {
+        return GRADIENT_HORIZONTAL;
+    }
+    if (ay > tan_22 + (ax << 16)) {
+        return GRADIENT_VERTICAL;
+    }
+    return (gx ^ gy) < 0 ? GRADIENT_DIAGONAL_UP : GRADIENT_DIAGONAL_DOWN;
+}
+
+// Gx and Gy from one tile read, magnitude saturated to a byte
+__kernel void sobel(
+    __global const uchar* in,
+    __global uchar* magnitude,
+    __global uchar* orientation,
+    int w,
+    int h,
+    int with_orientation
+)
+{
+    __local uchar tile[SPAN * SPAN];
+    load_tile(in, tile, w, h);
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    int2 g = tile_gradient(tile);
+    magnitude[y * w + x] = (uchar)min((int)round(sqrt((float)(g.x * g.x + g.y * g.y))), 255);
+    if (with_orientation) {
+        orientation[y * w + x] = (uchar)gradient_direction(g.x, g.y);
+    }
+}
+
+
+// ---------- Canny -----------
+
+// Squared magnitude and direction of every pixel
+__kernel void canny_gradient(
+    __global const uchar* in,
+    __global int* magnitude2,
+    __global uchar* direction,
+    int w,
+    int h
+)
+{
+    __local uchar tile[SPAN * SPAN];
+    load_tile(in, tile, w, h);
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    int2 g = tile_gradient(tile);
+    magnitude2[y * w + x] = g.x * g.x + g.y * g.y;
+    direction[y * w + x] = (uchar)gradient_direction(g.x, g.y);
+}
+
+int magnitude_at(__global const int* magnitude2, int x, int y, int w, int h) {
+    return x >= 0 && x < w && y >= 0 && y < h ? magnitude2[y * w + x] : 0;
+}
+
+// Label 2 for edges and 1 for candidates of pixels larger than their
+// neighbours across the edge, the first neighbour strictly
+__kernel void canny_suppress(
+    __global const int* magnitude2,
+    __global const uchar* direction,
+    __global uchar* label,
+    int w,
+    int h,
+    int low2,
+    int high2
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    int dx, dy;
+    switch (direction[y * w + x]) {
+        case GRADIENT_HORIZONTAL: dx = 1; dy = 0; break;
+        case GRADIENT_DIAGONAL_DOWN: dx = 1; dy = 1; break;
+        case GRADIENT_VERTICAL: dx = 0; dy = 1; break;
+        default: dx = -1; dy = 1; break;
+    }
+    int m = magnitude2[y * w + x];
+    int a = magnitude_at(magnitude2, x - dx, y - dy, w, h);
+    int b = magnitude_at(magnitude2, x + dx, y + dy, w, h);
+    bool peak = m > a && m >= b;
+    label[y * w + x] = !peak || m < low2 ? 0 : m >= high2 ? 2 : 1;
+}
+
+// One round of hysteresis. Candidates next to an edge become edges, repeated
+// inside the work-group's tile in local memory until nothing changes there,
+// so a launch carries edges across whole tiles. changed is set when any
+// pixel was promoted and the host launches again until a round sets nothing.
+// Labels only ever go from 1 to 2, so tiles reading each other's borders
+// while they are written still converge.
+__kernel void canny_hysteresis(
+    __global uchar* label,
+    __global int* changed,
+    int w,
+    int h
+)
+{
+    __local uchar tile[SPAN * SPAN];
+    __local int tile_changed;
+
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int x0 = get_group_id(0) * TILE - 1;
+    int y0 = get_group_id(1) * TILE - 1;
+    for (int i = ly * TILE + lx; i < SPAN * SPAN; i += TILE * TILE) {
+        int sx = x0 + i % SPAN, sy = y0 + i / SPAN;
+        tile[i] = sx >= 0 && sx < w && sy >= 0 && sy < h ? label[sy * w + sx] : 0;
+    }
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int center = (ly + 1) * SPAN + lx + 1;
+    bool inside = x < w && y < h;
+    bool promoted = false;
+
+    do {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lx == 0 && ly == 0) {
+            tile_changed = 0;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (inside && tile[center] == 1) {
+            __local const uchar* up = tile + center - SPAN;
+            __local const uchar* mid = tile + center;
+            __local const uchar* down = tile + center + SPAN;
+            if (up[-1] == 2 || up[0] == 2 || up[1] == 2 || mid[-1] == 2 || mid[1] == 2 ||
+                down[-1] == 2 || down[0] == 2 || down[1] == 2) {
+                tile[center] = 2;
+                promoted = true;
+                tile_changed = 1;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    } while (tile_changed);
+
+    if (promoted) {
+        label[y * w + x] = 2;
+        *changed = 1;
+    }
+}
+
+__kernel void canny_output(
+    __global const uchar* label,
+    __global uchar* out,
+    int n
+)
+{
+    int i = get_global_id(0);
+    if (i < n) {
+        out[i] = label[i] == 2 ? 255 : 0;
+    }
+}
@@ -0,0 +1,223 @@
+// Stockham FFTs over rows of complex values and the passes around them for
+// FFT convolution. Same stages as Fft::transform on the CPU: radix 4 while
+// the remaining length divides by 4, then a radix 2 stage.
+
+#ifndef TILE
+#define TILE 16
+#endif
+
+float2 cmul(float2 a, float2 b) {
+    return (float2)(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x);
+}
+
+// e^(-2 pi i k / n), conjugated for the inverse
+float2 twiddle(int k, int n, int inverse) {
+    float c;
+    float s = sincos(-2.0f * M_PI_F * ((float)k / n), &c);
+    return (float2)(c, inverse ? -s : s);
+}
+
+// j * v forward, -j * v inverse
+float2 rotate_j(float2 v, int inverse) {
+    return inverse ? (float2)(v.y, -v.x) : (float2)(-v.y, v.x);
+}
+
+// Butterfly i of the stage with remaining length len and stride s, over
+// buffers of any address space
+#define RADIX4(in, out, i, len, s, inverse) { \
+    int m = (len) / 4, p = (i) / (s), q = (i) % (s); \
+    float2 a = in[q + (s) * p], b = in[q + (s) * (p + m)]; \
+    float2 c = in[q + (s) * (p + 2 * m)], d = in[q + (s) * (p + 3 * m)]; \
+    float2 apc = a + c, amc = a - c, bpd = b + d, jbmd = rotate_j(b - d, inverse); \
+    out[q + (s) * (4 * p)] = apc + bpd; \
+    out[q + (s) * (4 * p + 1)] = cmul(twiddle(p, len, inverse), amc - jbmd); \
+    out[q + (s) * (4 * p + 2)] = cmul(twiddle(2 * p, len, inverse), apc - bpd); \
+    out[q + (s) * (4 * p + 3)] = cmul(twiddle(3 * p, len, inverse), amc + jbmd); \
+}
+
+#define RADIX2(in, out, q, s) { \
+    float2 a = in[q], b = in[q + (s)]; \
+    out[q] = a + b; \
+    out[q + (s)] = a - b; \
+}
+
+// Whole transform of one row per work-group, every stage between two local
+// buffers of n values
+__kernel void fft_rows_local(
+    __global float2* data,
+    int n,
+    int inverse,
+    __local float2* buf0,
+    __local float2* buf1
+)
+{
+    int lid = get_local_id(0);
+    int lsize = get_local_size(0);
+    __global float2* line = data + (size_t)get_group_id(0) * n;
+
+    for (int i = lid; i < n; i += lsize) {
+        buf0[i] = line[i];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    __local float2* in = buf0;
+    __local float2* out = buf1;
+    for (int len = n, s = 1; len > 1; ) {
+        if (len % 4 == 0) {
+            for (int i = lid; i < n / 4; i += lsize) {
+                RADIX4(in, out, i, len, s, inverse);
+            }
+            len /= 4;
+            s *= 4;
+        }
+        else {
+            for (int i = lid; i < n / 2; i += lsize) {
+                RADIX2(in, out, i, s);
+            }
+            len = 1;
+            s *= 2;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        __local float2* t = in;
+        in = out;
+        out = t;
+    }
+
+    for (int i = lid; i < n; i += lsize) {
+        line[i] = in[i];
+    }
+}
+
+// One stage over rows too long for local memory, the host swaps in and out
+// between launches
+__kernel void fft_stage(
+    __global const float2* in,
+    __global float2* out,
+    int n,
+    int len,
+    int s,
+    int inverse
+)
+{
+    int i = get_global_id(0);
+    size_t row = (size_t)get_global_id(1) * n;
+    in += row;
+    out += row;
+
+    if (len % 4 == 0) {
+        if (i < n / 4) {
+            RADIX4(in, out, i, len, s, inverse);
+        }
+    }
+    else if (i < n / 2) {
+        RADIX2(in, out, i, s);
+    }
+}
+
+// w x h to h x w through a local tile, so reads and writes both run along rows
+__kernel void transpose_complex(
+    __global const float2* in,
+    __global float2* out,
+    int w,
+    int h
+)
+{
+    __local float2 tile[TILE][TILE + 1];
+
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int x0 = get_group_id(0) * TILE;
+    int y0 = get_group_id(1) * TILE;
+
+    if (x0 + lx < w && y0 + ly < h) {
+        tile[ly][lx] = in[(size_t)(y0 + ly) * w + x0 + lx];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (x0 + ly < w && y0 + lx < h) {
+        out[(size_t)(x0 + ly) * h + y0 + lx] = tile[lx][ly];
+    }
+}
+
+__kernel void spectrum_multiply(
+    __global float2* data,
+    __global const float2* spectrum,
+    int n
+)
+{
+    int i = get_global_id(0);
+    if (i < n) {
+        data[i] = cmul(data[i], spectrum[i]);
+    }
+}
+
+
+// ---------- Packing -----------
+
+int sample_index(int x, int y, int c, int w, int h, int channels, int planar) {
+    return planar ? c * w * h + y * w + x : (y * w + x) * channels + c;
+}
+
+// Channel c0 as the real and c1, if any, as the imaginary part of a W wide
+// transform, with the image starting at ox, oy and the border around it
+__kernel void fft_pack(
+    __global const uchar* image,
+    __global float2* data,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    int c0,
+    int c1,
+    int W,
+    int H,
+    int ox,
+    int oy,
+    int clamp_border
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    if (x >= W || y >= H) {
+        return;
+    }
+
+    int sx = x - ox, sy = y - oy;
+    float2 value = (float2)(0.0f, 0.0f);
+    if (clamp_border || (sx >= 0 && sx < w && sy >= 0 && sy < h)) {
+        sx = clamp(sx, 0, w - 1);
+        sy = clamp(sy, 0, h - 1);
+        value.x = image[sample_index(sx, sy, c0, w, h, channels, planar)];
+        if (c1 >= 0) {
+            value.y = image[sample_index(sx, sy, c1, w, h, channels, planar)];
+        }
+    }
+    data[(size_t)y * W + x] = value;
+}
+
+__kernel void fft_unpack(
+    __global const float2* data,
+    __global uchar* image,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    int c0,
+    int c1,
+    int W,
+    int ox,
+    int oy
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    if (x < w && y < h) {
+        float2 value = data[(size_t)(y + oy) * W + x + ox];
+        image[sample_index(x, y, c0, w, h, channels, planar)] = (uchar)clamp((int)round(value.x), 0, 255);
+        if (c1 >= 0) {
+            image[sample_index(x, y, c1, w, h, channels, planar)] = (uchar)clamp((int)round(value.y), 0, 255);
+        }
+    }
+}
@@ -43,6 +43,8 @@ __kernel void flipX2d(
     
 }
 
+// Planar images flip each plane, stacked along the third dimension, as a
+// single channel image
 __kernel void flipY2d(
     __global uchar* data, 
     int w,
@@ -52,10 +54,11 @@ __kernel void flipY2d(
 {
     int x = get_global_id(0);
     int y = get_global_id(1);
+    data += get_global_id(2) * w * h * channels;
 
     if (x < w  && y < h / 2) {
         int left = (x + y*w) * channels;
-        int right = (x + (h - y + 1)*w) * channels;
+        int right = (x + (h - 1 - y)*w) * channels;
 
         for (int c=0; c < channels; ++c) {
             uchar tmp = data[left + c];
@@ -65,5 +68,3 @@ __kernel void flipY2d(
     }
     
 }
-
-
@@ -0,0 +1,76 @@
+// Transpose and rotations between dense buffers, interleaved or planar. Planar
+// images run each plane, stacked along the third dimension, as a single
+// channel image.
+
+#ifndef TILE
+#define TILE 16
+#endif
+
+// A work-group reads a TILE x TILE block of source rows into local memory and
+// writes it back out as rows of the destination, so both global accesses run
+// along rows. Pixel x, y lands in row x (w-1-x with flip_rows) and column y
+// (h-1-y with flip_cols). The padding byte keeps the column reads of the tile
+// off a single bank. Up to 4 channels.
+__kernel void transpose_tiled(
+    __global const uchar* data,
+    __global uchar* output,
+    int w,
+    int h,
+    int channels,
+    int flip_rows,
+    int flip_cols
+)
+{
+    __local uchar tile[TILE][TILE * 4 + 1];
+
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int x0 = get_group_id(0) * TILE;
+    int y0 = get_group_id(1) * TILE;
+    size_t plane = (size_t)w * h * channels * get_global_id(2);
+    data += plane;
+    output += plane;
+
+    int x = x0 + lx, y = y0 + ly;
+    if (x < w && y < h) {
+        for (int c = 0; c < channels; ++c) {
+            tile[ly][lx * channels + c] = data[(y * w + x) * channels + c];
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Neighbouring work-items now take neighbouring source rows, which are
+    // neighbouring pixels of one destination row
+    x = x0 + ly;
+    y = y0 + lx;
+    if (x < w && y < h) {
+        int row = flip_rows ? w - 1 - x : x;
+        int col = flip_cols ? h - 1 - y : y;
+        for (int c = 0; c < channels; ++c) {
+            output[(row * h + col) * channels + c] = tile[lx][ly * channels + c];
+        }
+    }
+}
+
+// Reversed rows land in reversed order. Work-items next to each other still
+// touch neighbouring bytes on both sides.
+__kernel void rotate_180(
+    __global const uchar* data,
+    __global uchar* output,
+    int w,
+    int h,
+    int channels
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    size_t plane = (size_t)w * h * channels * get_global_id(2);
+
+    if (x < w && y < h) {
+        int in = (y * w + x) * channels;
+        int out = ((h - 1 - y) * w + (w - 1 - x)) * channels;
+        for (int c = 0; c < channels; ++c) {
+            output[plane + out + c] = data[plane + in + c];
+        }
+    }
+}
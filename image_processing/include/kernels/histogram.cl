@@ -0,0 +1,188 @@
+// Per-channel 256 bin histograms. Buffers are dense, interleaved or planar.
+
+#ifndef SUB_HISTOGRAMS
+#define SUB_HISTOGRAMS 4
+#endif
+
+// Each work-group keeps SUB_HISTOGRAMS copies of the histogram in local memory,
+// work-items spread over them so atomics on popular bins collide less, and the
+// copies are merged into the global histogram with one atomic per bin.
+__kernel void histogram(
+    __global const uchar* data,
+    __global uint* hist,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    __local uint* sub
+)
+{
+    int lid = get_local_id(0);
+    int lsize = get_local_size(0);
+    int bins = channels * 256;
+
+    for (int i = lid; i < bins * SUB_HISTOGRAMS; i += lsize) {
+        sub[i] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    __local uint* mine = sub + (lid % SUB_HISTOGRAMS) * bins;
+    int plane = w * h;
+    int n = plane * channels;
+
+    for (int i = get_global_id(0); i < n; i += get_global_size(0)) {
+        int c = planar ? i / plane : i % channels;
+        atomic_inc(&mine[c * 256 + data[i]]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = lid; i < bins; i += lsize) {
+        uint sum = 0;
+        for (int k = 0; k < SUB_HISTOGRAMS; ++k) {
+            sum += sub[k * bins + i];
+        }
+        if (sum != 0) {
+            atomic_add(&hist[i], sum);
+        }
+    }
+}
+
+__kernel void apply_lut(
+    __global const uchar* data,
+    __global uchar* output,
+    __global const uchar* lut,
+    int w,
+    int h,
+    int channels,
+    int planar
+)
+{
+    int i = get_global_id(0);
+    int plane = w * h;
+
+    if (i < plane * channels) {
+        int c = planar ? i / plane : i % channels;
+        output[i] = lut[c * 256 + data[i]];
+    }
+}
+
+
+// ---------- CLAHE -----------
+
+int sample_index(int x, int y, int c, int w, int h, int channels, int planar) {
+    return planar ? c * w * h + y * w + x : (y * w + x) * channels + c;
+}
+
+// One work-group of 256 per tile and channel. Builds the tile's histogram in
+// local memory, then clips it and writes the tile's mapping. The clip limit
+// comes in 16.16 fixed point so no double support is needed.
+__kernel void clahe_tiles(
+    __global const uchar* data,
+    __global uchar* luts,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    int tiles_x,
+    int tiles_y,
+    uint clip_q16,
+    __local uint* hist
+)
+{
+    int tx = get_group_id(0);
+    int ty = get_group_id(1);
+    int c = get_group_id(2);
+    int lid = get_local_id(0);
+
+    hist[lid] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int x0 = tx * w / tiles_x, x1 = (tx + 1) * w / tiles_x;
+    int y0 = ty * h / tiles_y, y1 = (ty + 1) * h / tiles_y;
+    int tw = x1 - x0;
+    int n = tw * (y1 - y0);
+
+    for (int i = lid; i < n; i += 256) {
+        int x = x0 + i % tw;
+        int y = y0 + i / tw;
+        atomic_inc(&hist[data[sample_index(x, y, c, w, h, channels, planar)]]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // 256 bins, cheaper done by one work-item than synchronised across all
+    if (lid == 0) {
+        __global uchar* lut = luts + ((ty * tiles_x + tx) * channels + c) * 256;
+        if (n == 0) {
+            for (int v = 0; v < 256; ++v) {
+                lut[v] = (uchar)v;
+            }
+            return;
+        }
+
+        uint limit = max(1u, (uint)((ulong)clip_q16 * n >> 24));
+        uint excess = 0;
+        for (int v = 0; v < 256; ++v) {
+            if (hist[v] > limit) {
+                excess += hist[v] - limit;
+                hist[v] = limit;
+            }
+        }
+        uint bonus = excess / 256, rest = excess % 256;
+
+        ulong cdf = 0;
+        for (int v = 0; v < 256; ++v) {
+            cdf += hist[v] + bonus + (v < (int)rest ? 1 : 0);
+            lut[v] = (uchar)min((ulong)255, (cdf * 255 + n / 2) / n);
+        }
+    }
+}
+
+// Lower and upper tile around a pixel and the upper one's weight in 1/256ths
+int3 tile_axis(int x, int size, int tiles) {
+    long num = (long)(2 * x + 1) * tiles - size;
+    if (num <= 0) {
+        return (int3)(0, 0, 0);
+    }
+    long g = num * 256 / (2L * size);
+    int t0 = (int)(g >> 8);
+    if (t0 >= tiles - 1) {
+        return (int3)(tiles - 1, tiles - 1, 0);
+    }
+    return (int3)(t0, t0 + 1, (int)(g & 255));
+}
+
+__kernel void clahe_apply(
+    __global const uchar* data,
+    __global uchar* output,
+    __global const uchar* luts,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    int tiles_x,
+    int tiles_y
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    int3 ax = tile_axis(x, w, tiles_x);
+    int3 ay = tile_axis(y, h, tiles_y);
+
+    int i = sample_index(x, y, c, w, h, channels, planar);
+    int v = data[i];
+
+    int top_left = luts[((ay.x * tiles_x + ax.x) * channels + c) * 256 + v];
+    int top_right = luts[((ay.x * tiles_x + ax.y) * channels + c) * 256 + v];
+    int bottom_left = luts[((ay.y * tiles_x + ax.x) * channels + c) * 256 + v];
+    int bottom_right = luts[((ay.y * tiles_x + ax.y) * channels + c) * 256 + v];
+
+    int top = top_left * (256 - ax.z) + top_right * ax.z;
+    int bottom = bottom_left * (256 - ax.z) + bottom_right * ax.z;
+    output[i] = (uchar)((top * (256 - ay.z) + bottom * ay.z + 32768) >> 16);
+}
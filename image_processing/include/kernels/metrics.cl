@@ -0,0 +1,145 @@
+// Image comparison metrics. Both images are dense, same shape and layout.
+
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 256
+#endif
+
+// Sum of squared differences, one partial per work-group
+__kernel void squared_error(
+    __global const uchar* a,
+    __global const uchar* b,
+    int n,
+    __global ulong* partials
+)
+{
+    __local ulong sums[LOCAL_SIZE];
+    int lid = get_local_id(0);
+
+    ulong sum = 0;
+    for (int i = get_global_id(0); i < n; i += get_global_size(0)) {
+        int d = (int)a[i] - (int)b[i];
+        sum += (ulong)(d * d);
+    }
+
+    sums[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int s = LOCAL_SIZE / 2; s > 0; s >>= 1) {
+        if (lid < s) {
+            sums[lid] += sums[lid + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        partials[get_group_id(0)] = sums[0];
+    }
+}
+
+
+// ---------- SSIM -----------
+
+#ifndef SSIM_RADIUS
+#define SSIM_RADIUS 5
+#endif
+
+int sample_index(int x, int y, int c, int w, int h, int channels, int planar) {
+    return planar ? c * w * h + y * w + x : (y * w + x) * channels + c;
+}
+
+// Horizontal pass of the windowed moments. moments holds five planes per
+// channel: means of a and b, then a^2, b^2 and ab.
+__kernel void ssim_moments(
+    __global const uchar* a,
+    __global const uchar* b,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    __constant float* weights,
+    __global float* moments
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    float sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+    for (int d = -SSIM_RADIUS; d <= SSIM_RADIUS; ++d) {
+        int xx = clamp(x + d, 0, w - 1);
+        int i = sample_index(xx, y, c, w, h, channels, planar);
+        float va = a[i], vb = b[i];
+        float k = weights[d + SSIM_RADIUS];
+        sa += k * va;
+        sb += k * vb;
+        saa += k * va * va;
+        sbb += k * vb * vb;
+        sab += k * va * vb;
+    }
+
+    int plane = w * h;
+    __global float* m = moments + c * 5 * plane + y * w + x;
+    m[0] = sa;
+    m[plane] = sb;
+    m[2 * plane] = saa;
+    m[3 * plane] = sbb;
+    m[4 * plane] = sab;
+}
+
+// Vertical pass, SSIM at every sample summed into one partial per work-group
+__kernel void ssim_map(
+    __global const float* moments,
+    int w,
+    int h,
+    int channels,
+    __constant float* weights,
+    float c1,
+    float c2,
+    __global float* partials
+)
+{
+    __local float sums[LOCAL_SIZE];
+    int lid = get_local_id(0);
+    int plane = w * h;
+    int n = plane * channels;
+
+    float sum = 0;
+    for (int i = get_global_id(0); i < n; i += get_global_size(0)) {
+        int c = i / plane;
+        int y = (i % plane) / w;
+        int x = i % w;
+        __global const float* m = moments + c * 5 * plane + x;
+
+        float ma = 0, mb = 0, saa = 0, sbb = 0, sab = 0;
+        for (int d = -SSIM_RADIUS; d <= SSIM_RADIUS; ++d) {
+            int row = clamp(y + d, 0, h - 1) * w;
+            float k = weights[d + SSIM_RADIUS];
+            ma += k * m[row];
+            mb += k * m[plane + row];
+            saa += k * m[2 * plane + row];
+            sbb += k * m[3 * plane + row];
+            sab += k * m[4 * plane + row];
+        }
+
+        float var_a = saa - ma * ma;
+        float var_b = sbb - mb * mb;
+        float cov = sab - ma * mb;
+        sum += ((2 * ma * mb + c1) * (2 * cov + c2)) / ((ma * ma + mb * mb + c1) * (var_a + var_b + c2));
+    }
+
+    sums[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int s = LOCAL_SIZE / 2; s > 0; s >>= 1) {
+        if (lid < s) {
+            sums[lid] += sums[lid + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        partials[get_group_id(0)] = sums[0];
+    }
+}
@@ -0,0 +1,122 @@
+// Erosion and dilation along one axis with van Herk / Gil-Werman. Lines run
+// along x, or along y when vertical, padded with radius identity samples at
+// both ends and cut into blocks of 2 radius + 1. extreme_blocks leaves each
+// block's running extremes from its start and from its end, extreme_combine
+// takes the window at each pixel from the end of one block and the start of
+// the next. Prefix and suffix buffers hold channels x padded length x lines,
+// lines innermost so neighbouring work-items touch neighbouring values.
+
+int sample_index(int x, int y, int c, int w, int h, int channels, int planar) {
+    return planar ? c * w * h + y * w + x : (y * w + x) * channels + c;
+}
+
+uchar extreme(uchar a, uchar b, int take_max) {
+    return take_max ? max(a, b) : min(a, b);
+}
+
+__kernel void extreme_blocks(
+    __global const uchar* in,
+    __global uchar* prefix,
+    __global uchar* suffix,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    int vertical,
+    int radius,
+    int take_max
+)
+{
+    int line = get_global_id(0);
+    int block = get_global_id(1);
+    int c = get_global_id(2);
+
+    int lines = vertical ? w : h;
+    int length = vertical ? h : w;
+    int padded = length + 2 * radius;
+    int k = 2 * radius + 1;
+    int start = block * k;
+    if (line >= lines || start >= padded) {
+        return;
+    }
+    int end = min(start + k, padded);
+    uchar identity = take_max ? 0 : 255;
+    size_t base = (size_t)c * padded * lines + line;
+
+    uchar run = identity;
+    for (int p = start; p < end; ++p) {
+        int i = p - radius;
+        uchar v = i < 0 || i >= length ? identity :
+            in[vertical ? sample_index(line, i, c, w, h, channels, planar) : sample_index(i, line, c, w, h, channels, planar)];
+        run = extreme(run, v, take_max);
+        prefix[base + (size_t)p * lines] = run;
+    }
+    run = identity;
+    for (int p = end - 1; p >= start; --p) {
+        int i = p - radius;
+        uchar v = i < 0 || i >= length ? identity :
+            in[vertical ? sample_index(line, i, c, w, h, channels, planar) : sample_index(i, line, c, w, h, channels, planar)];
+        run = extreme(run, v, take_max);
+        suffix[base + (size_t)p * lines] = run;
+    }
+}
+
+__kernel void extreme_combine(
+    __global const uchar* prefix,
+    __global const uchar* suffix,
+    __global uchar* out,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    int vertical,
+    int radius,
+    int take_max
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    int lines = vertical ? w : h;
+    int padded = (vertical ? h : w) + 2 * radius;
+    int line = vertical ? x : y;
+    int i = vertical ? y : x;
+    size_t base = (size_t)c * padded * lines + line;
+
+    // The window of pixel i covers padded samples i to i + 2 radius
+    out[sample_index(x, y, c, w, h, channels, planar)] =
+        extreme(suffix[base + (size_t)i * lines], prefix[base + (size_t)(i + 2 * radius) * lines], take_max);
+}
+
+// b = min or max of a and b
+__kernel void extreme_images(
+    __global const uchar* a,
+    __global uchar* b,
+    int n,
+    int take_max
+)
+{
+    int i = get_global_id(0);
+    if (i < n) {
+        b[i] = extreme(a[i], b[i], take_max);
+    }
+}
+
+// out = a - b, saturating. out may be a or b.
+__kernel void subtract_images(
+    __global const uchar* a,
+    __global const uchar* b,
+    __global uchar* out,
+    int n
+)
+{
+    int i = get_global_id(0);
+    if (i < n) {
+        out[i] = sub_sat(a[i], b[i]);
+    }
+}
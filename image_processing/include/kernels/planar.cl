@@ -0,0 +1,258 @@
+// Layout conversion between interleaved RGB(A) and one plane per channel.
+// Every work-item moves 4 pixels so 3 and 4 channel pixels are loaded as whole
+// vectors and split with swizzles.
+
+__kernel void deinterleave(
+    __global const uchar* src,
+    __global uchar* dst,
+    int w,
+    int h,
+    int channels
+)
+{
+    int x = get_global_id(0) * 4;
+    int y = get_global_id(1);
+
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    int plane = w * h;
+    int p = y * w + x;
+    __global const uchar* in = src + p * channels;
+
+    if (x + 4 <= w && channels == 4) {
+        uchar16 v = vload16(0, in);
+        vstore4(v.s048c, 0, dst + p);
+        vstore4(v.s159d, 0, dst + plane + p);
+        vstore4(v.s26ae, 0, dst + 2 * plane + p);
+        vstore4(v.s37bf, 0, dst + 3 * plane + p);
+    }
+    else if (x + 4 <= w && channels == 3) {
+        uchar8 a = vload8(0, in);
+        uchar4 b = vload4(0, in + 8);
+        vstore4((uchar4)(a.s0, a.s3, a.s6, b.s1), 0, dst + p);
+        vstore4((uchar4)(a.s1, a.s4, a.s7, b.s2), 0, dst + plane + p);
+        vstore4((uchar4)(a.s2, a.s5, b.s0, b.s3), 0, dst + 2 * plane + p);
+    }
+    else {
+        for (int i = 0; i < 4 && x + i < w; ++i) {
+            for (int c = 0; c < channels; ++c) {
+                dst[c * plane + p + i] = in[i * channels + c];
+            }
+        }
+    }
+}
+
+__kernel void interleave(
+    __global const uchar* src,
+    __global uchar* dst,
+    int w,
+    int h,
+    int channels
+)
+{
+    int x = get_global_id(0) * 4;
+    int y = get_global_id(1);
+
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    int plane = w * h;
+    int p = y * w + x;
+    __global uchar* out = dst + p * channels;
+
+    if (x + 4 <= w && channels == 4) {
+        uchar16 v;
+        v.s048c = vload4(0, src + p);
+        v.s159d = vload4(0, src + plane + p);
+        v.s26ae = vload4(0, src + 2 * plane + p);
+        v.s37bf = vload4(0, src + 3 * plane + p);
+        vstore16(v, 0, out);
+    }
+    else if (x + 4 <= w && channels == 3) {
+        uchar4 r = vload4(0, src + p);
+        uchar4 g = vload4(0, src + plane + p);
+        uchar4 b = vload4(0, src + 2 * plane + p);
+        vstore8((uchar8)(r.s0, g.s0, b.s0, r.s1, g.s1, b.s1, r.s2, g.s2), 0, out);
+        vstore4((uchar4)(b.s2, r.s3, g.s3, b.s3), 0, out + 8);
+    }
+    else {
+        for (int i = 0; i < 4 && x + i < w; ++i) {
+            for (int c = 0; c < channels; ++c) {
+                out[i * channels + c] = src[c * plane + p + i];
+            }
+        }
+    }
+}
+
+
+// ---------- Planar convolution -----------
+// Same arguments as the interleaved kernels, the plane comes from get_global_id(2)
+// so neighbouring work-items read neighbouring bytes.
+
+__kernel void convolution_planar_0(
+    __global uchar *matrix,
+    __global uchar *result,
+    __constant double* mask,
+    int w,
+    int h,
+    int channels,
+    int mask_w,
+    int mask_h,
+    int mask_offset_w,
+    int mask_offset_h
+)
+{
+    int col = get_global_id(0);
+    int row = get_global_id(1);
+    int ch = get_global_id(2);
+
+    __global const uchar* plane = matrix + ch * w * h;
+
+    int start_r = row - mask_offset_h;
+    int start_c = col - mask_offset_w;
+
+    double temp = 0;
+
+    for (int i = 0; i < mask_h; i++) {
+        int r = start_r + i;
+        if (r < 0 || r >= h) {
+            continue;
+        }
+        for (int j = 0; j < mask_w; ++j) {
+            int c = start_c + j;
+            if (c >= 0 && c < w) {
+                temp += plane[r * w + c] * mask[i * mask_w + j];
+            }
+        }
+    }
+
+    result[ch * w * h + row * w + col] = (uchar)clamp((int)round(temp), 0, 255);
+}
+
+__kernel void convolution_planar_border(
+    __global uchar *matrix,
+    __global uchar *result,
+    __constant double* mask,
+    int w,
+    int h,
+    int channels,
+    int mask_w,
+    int mask_h,
+    int mask_offset_w,
+    int mask_offset_h
+)
+{
+    int col = get_global_id(0);
+    int row = get_global_id(1);
+    int ch = get_global_id(2);
+
+    __global const uchar* plane = matrix + ch * w * h;
+
+    int start_r = row - mask_offset_h;
+    int start_c = col - mask_offset_w;
+
+    double temp = 0;
+
+    for (int i = 0; i < mask_h; i++) {
+        int r = clamp(start_r + i, 0, h - 1);
+        for (int j = 0; j < mask_w; ++j) {
+            int c = clamp(start_c + j, 0, w - 1);
+            temp += plane[r * w + c] * mask[i * mask_w + j];
+        }
+    }
+
+    result[ch * w * h + row * w + col] = (uchar)clamp((int)round(temp), 0, 255);
+}
+
+
+// ---------- Planar resize -----------
+
+__kernel void resize_bilinear_planar(
+    __global uchar* data,
+    __global uchar* output,
+    int nw,
+    int nh,
+    int w,
+    int h,
+    int channels,
+    float scaleX,
+    float scaleY
+)
+{
+    int col = get_global_id(0);
+    int row = get_global_id(1);
+    int ch = get_global_id(2);
+
+    if (row < nh && col < nw) {
+        __global const uchar* plane = data + ch * w * h;
+
+        float float_pos_x = col * scaleX;
+        float float_pos_y = row * scaleY;
+
+        int low_x = (int)floor(float_pos_x);
+        int low_y = (int)floor(float_pos_y);
+        int high_x = min(low_x + 1, w - 1);
+        int high_y = min(low_y + 1, h - 1);
+
+        float offset_x = float_pos_x - low_x;
+        float offset_y = float_pos_y - low_y;
+
+        float value = (1-offset_x) * (1-offset_y) * plane[low_x + low_y * w] +
+                    offset_x * (1-offset_y) * plane[high_x + low_y * w] +
+                    (1-offset_x) * offset_y * plane[low_x + high_y * w] +
+                    offset_x * offset_y * plane[high_x + high_y * w];
+
+        output[ch * nw * nh + col + row * nw] = (uchar) clamp(value, 0.0f, 255.0f);
+    }
+}
+
+float cubicPlanar(float p0, float p1, float p2, float p3, float t) {
+    return p1 + 0.5f * t * (p2 - p0 + t * (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3 + t * (3.0f * (p1 - p2) + p3 - p0)));
+}
+
+__kernel void resize_bicubic_planar(
+    __global uchar* data,
+    __global uchar* output,
+    int nw,
+    int nh,
+    int w,
+    int h,
+    int channels,
+    float scaleX,
+    float scaleY
+)
+{
+    int col = get_global_id(0);
+    int row = get_global_id(1);
+    int ch = get_global_id(2);
+
+    if (row < nh && col < nw) {
+        __global const uchar* plane = data + ch * w * h;
+
+        float float_pos_x = col * scaleX;
+        float float_pos_y = row * scaleY;
+
+        int low_x = (int)floor(float_pos_x);
+        int low_y = (int)floor(float_pos_y);
+
+        float delta_x = float_pos_x - low_x;
+        float delta_y = float_pos_y - low_y;
+
+        int x0 = clamp(low_x - 1, 0, w - 1);
+        int x1 = clamp(low_x, 0, w - 1);
+        int x2 = clamp(low_x + 1, 0, w - 1);
+        int x3 = clamp(low_x + 2, 0, w - 1);
+
+        float rows[4];
+        for (int i = -1; i < 3; i++) {
+            __global const uchar* line = plane + clamp(low_y + i, 0, h - 1) * w;
+            rows[i + 1] = cubicPlanar(line[x0], line[x1], line[x2], line[x3], delta_x);
+        }
+
+        float value = cubicPlanar(rows[0], rows[1], rows[2], rows[3], delta_y);
+        output[ch * nw * nh + col + row * nw] = (uchar) clamp(value, 0.0f, 255.0f);
+    }
+}
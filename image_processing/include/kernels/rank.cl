@@ -0,0 +1,141 @@
+// Rank filters over the (2 RADIUS + 1)^2 square around each pixel, edge
+// pixels repeated outside the image. RANK indexes the sorted window, built
+// in along with RADIUS so loops over the window unroll.
+
+#ifndef TILE
+#define TILE 16
+#endif
+
+#define WINDOW ((2 * RADIUS + 1) * (2 * RADIUS + 1))
+
+int sample_index(int x, int y, int c, int w, int h, int channels, int planar) {
+    return planar ? c * w * h + y * w + x : (y * w + x) * channels + c;
+}
+
+#if RADIUS <= 2
+
+// Window padded to a power of two with samples that sort last
+#if WINDOW <= 16
+#define NETWORK 16
+#else
+#define NETWORK 32
+#endif
+
+#define SORT2(a, b) { uchar4 t = min(a, b); b = max(a, b); a = t; }
+
+// 3x3 and 5x5 windows sorted in registers. Each work-item takes 4 neighbouring
+// pixels, one per lane, so every compare-exchange is a vector min and max.
+__kernel void rank_network(
+    __global const uchar* in,
+    __global uchar* out,
+    int w,
+    int h,
+    int channels,
+    int planar
+)
+{
+    int x = get_global_id(0) * 4;
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    uchar4 v[NETWORK];
+    int k = 0;
+    for (int dy = -RADIUS; dy <= RADIUS; ++dy) {
+        int sy = clamp(y + dy, 0, h - 1);
+        for (int dx = -RADIUS; dx <= RADIUS; ++dx) {
+            v[k++] = (uchar4)(
+                in[sample_index(clamp(x + dx, 0, w - 1), sy, c, w, h, channels, planar)],
+                in[sample_index(clamp(x + 1 + dx, 0, w - 1), sy, c, w, h, channels, planar)],
+                in[sample_index(clamp(x + 2 + dx, 0, w - 1), sy, c, w, h, channels, planar)],
+                in[sample_index(clamp(x + 3 + dx, 0, w - 1), sy, c, w, h, channels, planar)]);
+        }
+    }
+    for (; k < NETWORK; ++k) {
+        v[k] = (uchar4)(255);
+    }
+
+    // Batcher's odd-even merge sort, constant bounds so it unrolls into
+    // straight compare-exchanges
+    for (int p = 1; p < NETWORK; p <<= 1) {
+        for (int q = p; q > 0; q >>= 1) {
+            for (int j = q % p; j + q < NETWORK; j += 2 * q) {
+                for (int i = 0; i < q && i + j + q < NETWORK; ++i) {
+                    if ((i + j) / (2 * p) == (i + j + q) / (2 * p)) {
+                        SORT2(v[i + j], v[i + j + q]);
+                    }
+                }
+            }
+        }
+    }
+
+    uchar4 r = v[RANK];
+    out[sample_index(x, y, c, w, h, channels, planar)] = r.x;
+    if (x + 1 < w) {
+        out[sample_index(x + 1, y, c, w, h, channels, planar)] = r.y;
+    }
+    if (x + 2 < w) {
+        out[sample_index(x + 2, y, c, w, h, channels, planar)] = r.z;
+    }
+    if (x + 3 < w) {
+        out[sample_index(x + 3, y, c, w, h, channels, planar)] = r.w;
+    }
+}
+
+#endif
+
+#define SPAN (TILE + 2 * RADIUS)
+
+// Larger windows from a tile staged in local memory. The value is found a bit
+// at a time from the top: the answer has the bit set when no more than RANK
+// samples are below the value with it set, so 8 counting passes over the
+// window give the exact rank for any radius.
+__kernel void rank_tiled(
+    __global const uchar* in,
+    __global uchar* out,
+    int w,
+    int h,
+    int channels,
+    int planar
+)
+{
+    __local uchar tile[SPAN * SPAN];
+
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int x0 = get_group_id(0) * TILE - RADIUS;
+    int y0 = get_group_id(1) * TILE - RADIUS;
+    int c = get_global_id(2);
+
+    for (int i = ly * TILE + lx; i < SPAN * SPAN; i += TILE * TILE) {
+        int sx = clamp(x0 + i % SPAN, 0, w - 1);
+        int sy = clamp(y0 + i / SPAN, 0, h - 1);
+        tile[i] = in[sample_index(sx, sy, c, w, h, channels, planar)];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    int value = 0;
+    for (int bit = 128; bit > 0; bit >>= 1) {
+        int candidate = value | bit;
+        int below = 0;
+        for (int dy = 0; dy <= 2 * RADIUS; ++dy) {
+            __local const uchar* line = tile + (ly + dy) * SPAN + lx;
+            for (int dx = 0; dx <= 2 * RADIUS; ++dx) {
+                below += line[dx] < candidate;
+            }
+        }
+        if (below <= RANK) {
+            value = candidate;
+        }
+    }
+    out[sample_index(x, y, c, w, h, channels, planar)] = (uchar)value;
+}
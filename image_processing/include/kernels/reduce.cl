@@ -0,0 +1,155 @@
+// Min, max, sum, sum of squares and count above a threshold over a block of
+// an interleaved image, in two passes: every work-group reduces its share to
+// five partials, then a single work-group reduces the partials.
+
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 256
+#endif
+
+#if defined(cl_khr_subgroups)
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#define USE_SUBGROUPS
+#endif
+
+#define PARTIALS 5
+
+// Combines every work-item's values into work-item 0's. With sub-groups each
+// one reduces in registers first, so the tree in local memory is only as wide
+// as the number of sub-groups.
+void reduce_group(
+    uint* mn, uint* mx, ulong* sum, ulong* sq, ulong* above,
+    __local uint* lmin, __local uint* lmax, __local ulong* lsum, __local ulong* lsq, __local ulong* labove
+)
+{
+    int lid = get_local_id(0);
+
+#ifdef USE_SUBGROUPS
+    uint smin = sub_group_reduce_min(*mn);
+    uint smax = sub_group_reduce_max(*mx);
+    ulong ssum = sub_group_reduce_add(*sum);
+    ulong ssq = sub_group_reduce_add(*sq);
+    ulong sabove = sub_group_reduce_add(*above);
+    int count = get_num_sub_groups();
+    if (get_sub_group_local_id() == 0) {
+        int slot = get_sub_group_id();
+        lmin[slot] = smin;
+        lmax[slot] = smax;
+        lsum[slot] = ssum;
+        lsq[slot] = ssq;
+        labove[slot] = sabove;
+    }
+#else
+    int count = LOCAL_SIZE;
+    lmin[lid] = *mn;
+    lmax[lid] = *mx;
+    lsum[lid] = *sum;
+    lsq[lid] = *sq;
+    labove[lid] = *above;
+#endif
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int s = LOCAL_SIZE / 2; s > 0; s >>= 1) {
+        if (lid < s && lid + s < count) {
+            lmin[lid] = min(lmin[lid], lmin[lid + s]);
+            lmax[lid] = max(lmax[lid], lmax[lid + s]);
+            lsum[lid] += lsum[lid + s];
+            lsq[lid] += lsq[lid + s];
+            labove[lid] += labove[lid + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    *mn = lmin[0];
+    *mx = lmax[0];
+    *sum = lsum[0];
+    *sq = lsq[0];
+    *above = labove[0];
+}
+
+// Reduces the first region_w x region_h pixels and region_ch channels of a
+// w wide image into partials[group * PARTIALS ...]
+__kernel void reduce_stats(
+    __global const uchar* data,
+    int w,
+    int channels,
+    int region_w,
+    int region_h,
+    int region_ch,
+    int threshold,
+    __global ulong* partials
+)
+{
+    __local uint lmin[LOCAL_SIZE];
+    __local uint lmax[LOCAL_SIZE];
+    __local ulong lsum[LOCAL_SIZE];
+    __local ulong lsq[LOCAL_SIZE];
+    __local ulong labove[LOCAL_SIZE];
+
+    uint mn = 255, mx = 0;
+    ulong sum = 0, sq = 0, above = 0;
+
+    // 64 bit so images past 2^31 samples do not wrap
+    ulong n = (ulong)region_w * region_h * region_ch;
+    int dense = region_w == w && region_ch == channels;
+
+    for (ulong i = get_global_id(0); i < n; i += get_global_size(0)) {
+        ulong index = i;
+        if (!dense) {
+            ulong p = i / region_ch;
+            index = ((p / region_w) * w + p % region_w) * channels + i % region_ch;
+        }
+        uint v = data[index];
+        mn = min(mn, v);
+        mx = max(mx, v);
+        sum += v;
+        sq += v * v;
+        above += v > (uint)threshold;
+    }
+
+    reduce_group(&mn, &mx, &sum, &sq, &above, lmin, lmax, lsum, lsq, labove);
+
+    if (get_local_id(0) == 0) {
+        __global ulong* out = partials + get_group_id(0) * PARTIALS;
+        out[0] = mn;
+        out[1] = mx;
+        out[2] = sum;
+        out[3] = sq;
+        out[4] = above;
+    }
+}
+
+// Final pass, run as a single work-group
+__kernel void reduce_partials(
+    __global const ulong* partials,
+    int groups,
+    __global ulong* result
+)
+{
+    __local uint lmin[LOCAL_SIZE];
+    __local uint lmax[LOCAL_SIZE];
+    __local ulong lsum[LOCAL_SIZE];
+    __local ulong lsq[LOCAL_SIZE];
+    __local ulong labove[LOCAL_SIZE];
+
+    uint mn = 255, mx = 0;
+    ulong sum = 0, sq = 0, above = 0;
+
+    for (int g = get_local_id(0); g < groups; g += LOCAL_SIZE) {
+        __global const ulong* in = partials + g * PARTIALS;
+        mn = min(mn, (uint)in[0]);
+        mx = max(mx, (uint)in[1]);
+        sum += in[2];
+        sq += in[3];
+        above += in[4];
+    }
+
+    reduce_group(&mn, &mx, &sum, &sq, &above, lmin, lmax, lsum, lsq, labove);
+
+    if (get_local_id(0) == 0) {
+        result[0] = mn;
+        result[1] = mx;
+        result[2] = sum;
+        result[3] = sq;
+        result[4] = above;
+    }
+}
@@ -61,11 +61,12 @@ float cubicInterpolate(float p[4], float t) {
 float bicubicInterpolate(float p[4][4], float x, float y) {
     float arr[4];
 
-    arr[0] = cubicInterpolate(p[0], y);
-    arr[1] = cubicInterpolate(p[1], y);
-    arr[2] = cubicInterpolate(p[2], y);
-    arr[3] = cubicInterpolate(p[3], y);
-    return cubicInterpolate(arr, x);
+    // p[row][col], interpolate along each row first then down the column
+    arr[0] = cubicInterpolate(p[0], x);
+    arr[1] = cubicInterpolate(p[1], x);
+    arr[2] = cubicInterpolate(p[2], x);
+    arr[3] = cubicInterpolate(p[3], x);
+    return cubicInterpolate(arr, y);
 }
 
 
@@ -105,7 +106,7 @@ __kernel void resize_bicubic(
                 for (int j=-1; j<3; j++) {
                     int x = clamp(low_x+j, 0, w-1);
                     int y = clamp(low_y+i, 0, h-1);
-                    filter[i+1][j+1] = data[(low_x + low_y * w) * channels + c];
+                    filter[i+1][j+1] = data[(x + y * w) * channels + c];
                 }
             }
 
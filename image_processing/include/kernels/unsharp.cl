@@ -0,0 +1,153 @@
+// Unsharp masking, see ImageOps::unsharp. taps holds the 2 RADIUS + 1
+// normalised Gaussian taps, edge pixels are repeated outside the image.
+
+#ifndef TILE
+#define TILE 16
+#endif
+
+int sample_index(int x, int y, int c, int w, int h, int channels, int planar) {
+    return planar ? c * w * h + y * w + x : (y * w + x) * channels + c;
+}
+
+float4 sharpen(float4 v, float4 blur, float amount, float threshold) {
+    float4 d = v - blur;
+    float4 r = select(v + amount * d, v, isless(fabs(d), (float4)(threshold)));
+    return clamp(r, 0.0f, 255.0f) + 0.5f;
+}
+
+#ifdef RADIUS
+
+#define SPAN (TILE + 2 * RADIUS)
+
+// Everything in one work-group: the tile and its border of RADIUS pixels, up
+// to 4 channels a pixel, go to local memory, the column pass leaves the
+// tile's TILE rows of SPAN column sums there too, and the row pass and the
+// combine read them back. Nothing but the result goes to global memory.
+__kernel void unsharp(
+    __global const uchar* in,
+    __global uchar* out,
+    __constant float* taps,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    float amount,
+    float threshold
+)
+{
+    __local uchar4 tile[SPAN * SPAN];
+    __local float4 columns[TILE * SPAN];
+
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int x0 = get_group_id(0) * TILE - RADIUS;
+    int y0 = get_group_id(1) * TILE - RADIUS;
+
+    for (int i = ly * TILE + lx; i < SPAN * SPAN; i += TILE * TILE) {
+        int sx = clamp(x0 + i % SPAN, 0, w - 1);
+        int sy = clamp(y0 + i / SPAN, 0, h - 1);
+        uchar v[4] = { 0, 0, 0, 0 };
+        for (int c = 0; c < channels; ++c) {
+            v[c] = in[sample_index(sx, sy, c, w, h, channels, planar)];
+        }
+        tile[i] = (uchar4)(v[0], v[1], v[2], v[3]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = ly * TILE + lx; i < TILE * SPAN; i += TILE * TILE) {
+        __local const uchar4* column = tile + (i / SPAN) * SPAN + i % SPAN;
+        float4 sum = (float4)(0.0f);
+        for (int t = 0; t <= 2 * RADIUS; ++t) {
+            sum += taps[t] * convert_float4(column[t * SPAN]);
+        }
+        columns[i] = sum;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    __local const float4* line = columns + ly * SPAN + lx;
+    float4 blur = (float4)(0.0f);
+    for (int t = 0; t <= 2 * RADIUS; ++t) {
+        blur += taps[t] * line[t];
+    }
+
+    float4 v = convert_float4(tile[(ly + RADIUS) * SPAN + lx + RADIUS]);
+    float4 result = sharpen(v, blur, amount, threshold);
+    float r[4] = { result.x, result.y, result.z, result.w };
+    for (int c = 0; c < channels; ++c) {
+        out[sample_index(x, y, c, w, h, channels, planar)] = (uchar)r[c];
+    }
+}
+
+#endif
+
+
+// ---------- Through global memory -----------
+//
+// For radii whose tile does not fit in local memory, or more than 4
+// channels: column sums of every sample to a float plane per channel, then
+// the row pass and the combine.
+
+__kernel void unsharp_columns(
+    __global const uchar* in,
+    __global float* columns,
+    __constant float* taps,
+    int radius,
+    int w,
+    int h,
+    int channels,
+    int planar
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    float sum = 0.0f;
+    for (int t = -radius; t <= radius; ++t) {
+        int sy = clamp(y + t, 0, h - 1);
+        sum += taps[t + radius] * in[sample_index(x, sy, c, w, h, channels, planar)];
+    }
+    columns[((size_t)c * h + y) * w + x] = sum;
+}
+
+__kernel void unsharp_rows(
+    __global const uchar* in,
+    __global const float* columns,
+    __global uchar* out,
+    __constant float* taps,
+    int radius,
+    int w,
+    int h,
+    int channels,
+    int planar,
+    float amount,
+    float threshold
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int c = get_global_id(2);
+
+    if (x >= w || y >= h) {
+        return;
+    }
+
+    __global const float* line = columns + ((size_t)c * h + y) * w;
+    float blur = 0.0f;
+    for (int t = -radius; t <= radius; ++t) {
+        blur += taps[t + radius] * line[clamp(x + t, 0, w - 1)];
+    }
+
+    int k = sample_index(x, y, c, w, h, channels, planar);
+    out[k] = (uchar)sharpen((float4)(in[k]), (float4)(blur), amount, threshold).x;
+}
@@ -0,0 +1,121 @@
+// Affine and perspective warps between dense buffers, interleaved or planar.
+// Planar images run each plane, stacked along the third dimension, as a single
+// channel image. Every step mirrors the CPU kernels in cpu_kernels.inc so the
+// results agree to the bit.
+
+#pragma OPENCL FP_CONTRACT OFF
+
+#define WARP_BITS 5
+#define WARP_ONE 32
+#define WARP_LIMIT 2097152.0f
+
+// Source position of pixel x, y in 1/32ths under the destination to source matrix m
+int2 source_position(__global const float* m, int x, int y) {
+    float fx = (float)x, fy = (float)y;
+    float px = m[0] * fx + (m[1] * fy + m[2]);
+    float py = m[3] * fx + (m[4] * fy + m[5]);
+    if (m[6] != 0 || m[7] != 0 || m[8] != 1) {
+        float pw = m[6] * fx + (m[7] * fy + m[8]);
+        px = px / pw;
+        py = py / pw;
+    }
+    px = fmin(fmax(px * WARP_ONE, -WARP_LIMIT), WARP_LIMIT);
+    py = fmin(fmax(py * WARP_ONE, -WARP_LIMIT), WARP_LIMIT);
+    return (int2)((int)rint(px), (int)rint(py));
+}
+
+// Catmull-Rom weights of fraction k/32 in 1/2048ths
+int4 cubic_weights(int k) {
+    int k2 = k * k, k3 = k2 * k;
+    int4 wt;
+    wt.x = (-k3 + 64 * k2 - 1024 * k + 16) >> 5;
+    wt.z = (-3 * k3 + 128 * k2 + 1024 * k + 16) >> 5;
+    wt.w = (k3 - 32 * k2 + 16) >> 5;
+    wt.y = 2048 - wt.x - wt.z - wt.w;
+    return wt;
+}
+
+// Pixels outside the source read as black
+int tap(__global const uchar* data, int w, int h, int channels, int c, int x, int y) {
+    return (uint)x < (uint)w && (uint)y < (uint)h ? data[(y * w + x) * channels + c] : 0;
+}
+
+uchar sample(__global const uchar* data, int w, int h, int channels, int c, int2 p, int bicubic) {
+    int x0 = p.x >> WARP_BITS, fx = p.x & (WARP_ONE - 1);
+    int y0 = p.y >> WARP_BITS, fy = p.y & (WARP_ONE - 1);
+
+    if (!bicubic) {
+        int top = tap(data, w, h, channels, c, x0, y0) * (WARP_ONE - fx)
+            + tap(data, w, h, channels, c, x0 + 1, y0) * fx;
+        int bottom = tap(data, w, h, channels, c, x0, y0 + 1) * (WARP_ONE - fx)
+            + tap(data, w, h, channels, c, x0 + 1, y0 + 1) * fx;
+        return (uchar)((top * (WARP_ONE - fy) + bottom * fy + 512) >> 10);
+    }
+
+    int4 wx = cubic_weights(fx);
+    int4 wy = cubic_weights(fy);
+    int wys[4] = { wy.x, wy.y, wy.z, wy.w };
+    int sum = 0;
+    for (int j = 0; j < 4; ++j) {
+        int y = y0 - 1 + j;
+        int row = tap(data, w, h, channels, c, x0 - 1, y) * wx.x
+            + tap(data, w, h, channels, c, x0, y) * wx.y
+            + tap(data, w, h, channels, c, x0 + 1, y) * wx.z
+            + tap(data, w, h, channels, c, x0 + 2, y) * wx.w;
+        sum += row * wys[j];
+    }
+    return (uchar)clamp((sum + (1 << 21)) >> 22, 0, 255);
+}
+
+__kernel void warp(
+    __global const uchar* data,
+    __global uchar* output,
+    __global const float* m,
+    int w,
+    int h,
+    int nw,
+    int nh,
+    int channels,
+    int bicubic
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int z = get_global_id(2);
+
+    if (x < nw && y < nh) {
+        data += (size_t)z * w * h * channels;
+        output += (size_t)z * nw * nh * channels;
+        int2 p = source_position(m, x, y);
+        for (int c = 0; c < channels; ++c) {
+            output[(y * nw + x) * channels + c] = sample(data, w, h, channels, c, p, bicubic);
+        }
+    }
+}
+
+// Positions precomputed on the host, see WarpMap
+__kernel void remap(
+    __global const uchar* data,
+    __global uchar* output,
+    __global const int2* positions,
+    int w,
+    int h,
+    int nw,
+    int nh,
+    int channels,
+    int bicubic
+)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int z = get_global_id(2);
+
+    if (x < nw && y < nh) {
+        data += (size_t)z * w * h * channels;
+        output += (size_t)z * nw * nh * channels;
+        int2 p = positions[y * nw + x];
+        for (int c = 0; c < channels; ++c) {
+            output[(y * nw + x) * channels + c] = sample(data, w, h, channels, c, p, bicubic);
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "masks.h"
+#include <cstdint>
+#include <memory>
+
+// Kinds of mask the factory makes. A box has the spread of the Gaussian of
+// the same sigma, half width max(1, ceil(sigma sqrt(3))).
+enum MaskType { MASK_GAUSSIAN, MASK_BOX };
+
+// A full 2D mask, or its row (1 x n) or column (n x 1) alone
+enum MaskOrientation { MASK_2D, MASK_ROW, MASK_COLUMN };
+
+// Immutable mask made by MaskFactory. Besides the double taps it keeps float
+// and fixed-point copies for kernels that work in those.
+class FactoryMask : public Mask::BaseMask {
+public:
+	// Fractional bits of the fixed-point taps
+	static const int FIXED_BITS = 14;
+
+	FactoryMask(std::vector<double> taps, int w, int h);
+
+	int getWidth() const override { return w; }
+	int getHeight() const override { return h; }
+	int getCenterRow() const override { return h / 2; }
+	int getCenterColumn() const override { return w / 2; }
+	double getFilterFactor() const override { return 1.0; }
+	const double* getData() const override { return taps.data(); }
+
+	const float* getFloatData() const { return float_taps.data(); }
+	// Rounded to FIXED_BITS, the centre tap taking up the rounding so the
+	// taps still sum to 1 << FIXED_BITS
+	const int16_t* getFixedData() const { return fixed_taps.data(); }
+
+private:
+	int w, h;
+	std::vector<double> taps;
+	std::vector<float> float_taps;
+	std::vector<int16_t> fixed_taps;
+};
+
+// Masks by (type, sigma, orientation), shared between threads. The last
+// CACHE_SIZE are kept, and a 2D mask is the outer product of its cached row.
+namespace MaskFactory {
+	const size_t CACHE_SIZE = 64;
+
+	// NULL, after printing why, for sigma outside (0, 64]
+	std::shared_ptr<const FactoryMask> get(MaskType type, double sigma, MaskOrientation orientation = MASK_2D);
+	std::shared_ptr<const FactoryMask> gaussian(double sigma, MaskOrientation orientation = MASK_2D);
+	std::shared_ptr<const FactoryMask> box(double sigma, MaskOrientation orientation = MASK_2D);
+
+	size_t size();
+	void clear();
+}
@@ -1,6 +1,5 @@
 #pragma once
 #include "pch.h"
-#include <Eigen/Dense>
 
 
 
@@ -15,440 +14,232 @@ namespace Mask {
         virtual int getCenterColumn() const = 0;
         virtual double getFilterFactor() const = 0;
         virtual const double* getData() const = 0;
+        // Taps fixed at compile time, which a device program may build in
+        virtual bool isStatic() const { return false; }
     };
 
-    class GaussianBlur3 : public BaseMask {
-    private:
-        static constexpr int width = 3;
-        static constexpr int height = 3;
-        static constexpr int cr = 1;
-        static constexpr int cc = 1;
-        static constexpr double filter_factor = 16;
-        std::array<double, 9> mask;
-
-    public:
+    // Coefficients known at compile time. Tap i is taps[i] / divisor, so
+    // integer masks are written as they are printed and stay exact.
+    template<int W, int H, typename T = double>
+    struct StaticMask {
+        static constexpr int width = W;
+        static constexpr int height = H;
+        std::array<T, W * H> taps{};
+        T divisor = 1;
+        int cr = H / 2;
+        int cc = W / 2;
 
-        GaussianBlur3() {
-            double filter[9] = {
-            1.0, 2.0, 1.0,
-            2.0, 4.0, 2.0,
-            1.0, 2.0, 1.0
-            };
-
-            for (int i = 0; i < width*height; ++i) {
-                mask[i] = filter[i] / filter_factor;
-            }
-        }
-
-        int getWidth() const override {
-            return width;
-        }
-
-        int getHeight() const override {
-            return height;
-        }
-
-        int getCenterRow() const override {
-            return cr;
-        }
-
-        int getCenterColumn() const override {
-            return cc;
-        }
-
-        double getFilterFactor() const override {
-            return filter_factor;
-        }
-
-        const double* getData() const override {
-            return mask.data();
+        constexpr double operator[](int i) const {
+            return (double)taps[i] / divisor;
         }
     };
 
-    class GaussianBlur5 : public BaseMask {
-    private:
-        static constexpr int width = 5;
-        static constexpr int height = 5;
-        static constexpr int cr = 2;
-        static constexpr int cc = 2;
-        static constexpr double filter_factor = 273;
-        std::array<double, 25> mask;
-    public:
-        GaussianBlur5() {
-            double filter[25] = {
-            1.0f,  4.0f,  7.0f,  4.0f, 1.0f,
-            4.0f, 16.0f, 26.0f, 16.0f, 4.0f,
-            7.0f, 26.0f, 41.0f, 26.0f, 7.0f,
-            4.0f, 16.0f, 26.0f, 16.0f, 4.0f,
-            1.0f,  4.0f,  7.0f,  4.0f, 1.0f
-            };
-
-            for (int i = 0; i < width*height; ++i) {
-                mask[i] = filter[i] / filter_factor;
+    // exp(x) for x <= 0 in constant expressions: halved until small, a Taylor
+    // series, then squared back
+    constexpr double constexpr_exp(double x) {
+        int halvings = 0;
+        while (x < -0.5) {
+            x /= 2;
+            ++halvings;
+        }
+        double term = 1, sum = 1;
+        for (int n = 1; n < 20; ++n) {
+            term *= x / n;
+            sum += term;
+        }
+        while (halvings-- > 0) {
+            sum *= sum;
+        }
+        return sum;
+    }
+
+    // Normalised Gaussian of 2 R + 1 taps a side, as GaussianDynamic2D with
+    // R = 3 ceil(sigma) but built by the compiler
+    template<int R>
+    constexpr StaticMask<2 * R + 1, 2 * R + 1> gaussian(double sigma) {
+        StaticMask<2 * R + 1, 2 * R + 1> mask{};
+        double sum = 0;
+        for (int i = -R; i <= R; ++i) {
+            for (int j = -R; j <= R; ++j) {
+                double v = constexpr_exp(-(i * i + j * j) / (2 * sigma * sigma));
+                mask.taps[(i + R) * (2 * R + 1) + j + R] = v;
+                sum += v;
             }
         }
-
-        int getWidth() const override {
-            return width;
-        }
-
-        int getHeight() const override {
-            return height;
-        }
-
-        int getCenterRow() const override {
-            return cr;
-        }
-
-        int getCenterColumn() const override {
-            return cc;
-        }
-
-        double getFilterFactor() const override {
-            return filter_factor;
+        for (double& v : mask.taps) {
+            v /= sum;
         }
+        return mask;
+    }
 
-        const double* getData() const override {
-            return mask.data();
-        }
-    };
-
-    class SharpenMask : public BaseMask {
+    // A StaticMask behind the BaseMask interface, for everything that takes
+    // masks at run time
+    template<int W, int H, typename T = double>
+    class StaticBase : public BaseMask {
     private:
-        static constexpr int width = 5;
-        static constexpr int height = 5;
-        static constexpr int cr = 2;
-        static constexpr int cc = 2;
-        static constexpr double filter_factor = 8.0;
-        std::array<double, 25> mask;
+        StaticMask<W, H, T> mask;
+        std::array<double, W * H> values;
+
     public:
-        SharpenMask() {
-            double filter[25] = {
-            -1.0f, -1.0f, -1.0f, -1.0f, -1.0f,
-            -1.0f,  2.0f,  2.0f,  2.0f, -1.0f,
-            -1.0f,  2.0f,  8.0f,  2.0f, -1.0f,
-            -1.0f,  2.0f,  2.0f,  2.0f, -1.0f,
-            -1.0f, -1.0f, -1.0f, -1.0f, -1.0f
-            };
-
-            for (int i = 0; i < width*height; ++i) {
-                mask[i] = filter[i] / filter_factor;
+        explicit StaticBase(const StaticMask<W, H, T>& mask) : mask(mask) {
+            for (int i = 0; i < W * H; ++i) {
+                values[i] = mask[i];
             }
         }
 
-        int getWidth() const override {
-            return width;
-        }
-
-        int getHeight() const override {
-            return height;
-        }
-
-        int getCenterRow() const override {
-            return cr;
-        }
-
-        int getCenterColumn() const override {
-            return cc;
-        }
-
-        double getFilterFactor() const override {
-            return filter_factor;
-        }
-
-        const double* getData() const override {
-            return mask.data();
-        }
-    };
-
-    class VertEdgeDetect : public BaseMask {
-    private:
-        static constexpr int width = 5;
-        static constexpr int height = 5;
-        static constexpr int cr = 2;
-        static constexpr int cc = 2;
-        static constexpr double filter_factor = 1.0;
-        std::array<double, 25> mask;
-
-    public:
-        VertEdgeDetect() {
-            double filter[25] = {
-            0,  0, -1.0f,  0,  0,
-            0,  0, -1.0f,  0,  0,
-            0,  0,  4.0f,  0,  0,
-            0,  0, -1.0f,  0,  0,
-            0,  0, -1.0f,  0,  0
-            };
-
-            for (int i = 0; i < width*height; ++i) {
-                mask[i] = filter[i] / filter_factor;
-            }
+        const StaticMask<W, H, T>& coefficients() const {
+            return mask;
         }
 
         int getWidth() const override {
-            return width;
+            return W;
         }
 
         int getHeight() const override {
-            return height;
+            return H;
         }
 
         int getCenterRow() const override {
-            return cr;
+            return mask.cr;
         }
 
         int getCenterColumn() const override {
-            return cc;
+            return mask.cc;
         }
 
         double getFilterFactor() const override {
-            return filter_factor;
+            return (double)mask.divisor;
         }
 
         const double* getData() const override {
-            return mask.data();
+            return values.data();
         }
-    };
-
-    class EdgeSharpen : public BaseMask {
-    private:
-        static constexpr int width = 3;
-        static constexpr int height = 3;
-        static constexpr int cr = 1;
-        static constexpr int cc = 1;
-        static constexpr double filter_factor = 1.0;
-        std::array<double, 9> mask;
-
-    public:
-
-        EdgeSharpen() {
-            double filter[9] = {
-            1.0f,  1.0f, 1.0f,
-            1.0f, -7.0f, 1.0f,
-            1.0f,  1.0f, 1.0f
-            };
 
-            for (int i = 0; i < width*height; ++i) {
-                mask[i] = filter[i] / filter_factor;
-            }
-        }
-
-        int getWidth() const override {
-            return width;
-        }
-
-        int getHeight() const override {
-            return height;
-        }
-
-        int getCenterRow() const override {
-            return cr;
-        }
-
-        int getCenterColumn() const override {
-            return cc;
-        }
-
-        double getFilterFactor() const override {
-            return filter_factor;
-        }
-
-        const double* getData() const override {
-            return mask.data();
+        bool isStatic() const override {
+            return true;
         }
     };
 
-    class Emboss3D : public BaseMask {
-    private:
-        static constexpr int width = 3;
-        static constexpr int height = 3;
-        static constexpr int cr = 1;
-        static constexpr int cc = 1;
-        static constexpr double filter_factor = 1.0;
-        std::array<double, 9> mask;
-
+    constexpr StaticMask<3, 3, int> GAUSSIAN_BLUR_3 = {{
+        1, 2, 1,
+        2, 4, 2,
+        1, 2, 1
+    }, 16};
+
+    constexpr StaticMask<5, 5, int> GAUSSIAN_BLUR_5 = {{
+        1,  4,  7,  4, 1,
+        4, 16, 26, 16, 4,
+        7, 26, 41, 26, 7,
+        4, 16, 26, 16, 4,
+        1,  4,  7,  4, 1
+    }, 273};
+
+    constexpr StaticMask<5, 5, int> SHARPEN = {{
+        -1, -1, -1, -1, -1,
+        -1,  2,  2,  2, -1,
+        -1,  2,  8,  2, -1,
+        -1,  2,  2,  2, -1,
+        -1, -1, -1, -1, -1
+    }, 8};
+
+    constexpr StaticMask<5, 5, int> VERT_EDGE_DETECT = {{
+        0, 0, -1, 0, 0,
+        0, 0, -1, 0, 0,
+        0, 0,  4, 0, 0,
+        0, 0, -1, 0, 0,
+        0, 0, -1, 0, 0
+    }};
+
+    constexpr StaticMask<3, 3, int> EDGE_SHARPEN = {{
+        1,  1, 1,
+        1, -7, 1,
+        1,  1, 1
+    }};
+
+    constexpr StaticMask<3, 3, int> EMBOSS_3D = {{
+        2,  0,  0,
+        0, -1,  0,
+        0,  0, -1
+    }};
+
+    constexpr StaticMask<3, 3, int> EDGE_SOBEL_X = {{
+        -1, 0, 1,
+        -2, 0, 2,
+        -1, 0, 1
+    }};
+
+    constexpr StaticMask<3, 3, int> EDGE_SOBEL_Y = {{
+        -1, -2, -1,
+         0,  0,  0,
+         1,  2,  1
+    }};
+
+    constexpr StaticMask<3, 3, int> BOX_BLUR = {{
+        1, 1, 1,
+        1, 1, 1,
+        1, 1, 1
+    }, 9};
+
+    class GaussianBlur3 : public StaticBase<3, 3, int> {
     public:
-
-        Emboss3D() {
-            double filter[9] = {
-            2.0f,  0.0f,  0.0f,
-            0.0f, -1.0f,  0.0f,
-            0.0f,  0.0f, -1.0f
-            };
-
-            for (int i = 0; i < width*height; ++i) {
-                mask[i] = filter[i] / filter_factor;
-            }
-        }
-
-        int getWidth() const override {
-            return width;
-        }
-
-        int getHeight() const override {
-            return height;
-        }
-
-        int getCenterRow() const override {
-            return cr;
-        }
-
-        int getCenterColumn() const override {
-            return cc;
-        }
-
-        double getFilterFactor() const override {
-            return filter_factor;
-        }
-
-        const double* getData() const override {
-            return mask.data();
-        }
+        GaussianBlur3() : StaticBase(GAUSSIAN_BLUR_3) {}
     };
 
-    class EdgeSobelX : public BaseMask {
-    private:
-        static constexpr int width = 3;
-        static constexpr int height = 3;
-        static constexpr int cr = 1;
-        static constexpr int cc = 1;
-        static constexpr double filter_factor = 1.0;
-        std::array<double, 9> mask;
-
+    class GaussianBlur5 : public StaticBase<5, 5, int> {
     public:
-
-        EdgeSobelX() {
-            double filter[9] = {
-                -1.0f, 0.0f, 1.0f,
-                -2.0f, 0.0f, 2.0f,
-                -1.0f, 0.0f, 1.0f
-            };
-
-            for (int i = 0; i < width*height; ++i) {
-                mask[i] = filter[i] / filter_factor;
-            }
-        }
-
-        int getWidth() const override {
-            return width;
-        }
-
-        int getHeight() const override {
-            return height;
-        }
-
-        int getCenterRow() const override {
-            return cr;
-        }
-
-        int getCenterColumn() const override {
-            return cc;
-        }
-
-        double getFilterFactor() const override {
-            return filter_factor;
-        }
-
-        const double* getData() const override {
-            return mask.data();
-        }
+        GaussianBlur5() : StaticBase(GAUSSIAN_BLUR_5) {}
     };
 
-    class EdgeSobelY : public BaseMask {
-    private:
-        static constexpr int width = 3;
-        static constexpr int height = 3;
-        static constexpr int cr = 1;
-        static constexpr int cc = 1;
-        static constexpr double filter_factor = 1.0;
-        std::array<double, 9> mask;
-
+    class SharpenMask : public StaticBase<5, 5, int> {
     public:
-
-        EdgeSobelY() {
-            double filter[9] = {
-                -1.0f, -2.0f, -1.0f,
-                0.0f,  0.0f,  0.0f,
-                1.0f,  2.0f,  1.0f
-            };
-
-            for (int i = 0; i < width*height; ++i) {
-                mask[i] = filter[i] / filter_factor;
-            }
-        }
-
-        int getWidth() const override {
-            return width;
-        }
-
-        int getHeight() const override {
-            return height;
-        }
-
-        int getCenterRow() const override {
-            return cr;
-        }
-
-        int getCenterColumn() const override {
-            return cc;
-        }
-
-        double getFilterFactor() const override {
-            return filter_factor;
-        }
-
-        const double* getData() const override {
-            return mask.data();
-        }
+        SharpenMask() : StaticBase(SHARPEN) {}
     };
 
-    class BoxBlur : public BaseMask {
-    private:
-        static constexpr int width = 3;
-        static constexpr int height = 3;
-        static constexpr int cr = 1;
-        static constexpr int cc = 1;
-        static constexpr double filter_factor = 9.0;
-        std::array<double, 9> mask;
-
+    class VertEdgeDetect : public StaticBase<5, 5, int> {
     public:
+        VertEdgeDetect() : StaticBase(VERT_EDGE_DETECT) {}
+    };
 
-        BoxBlur() {
-            double filter[9] = {
-                1, 1, 1,
-                1, 1, 1,
-                1, 1, 1
-            };
-
-            for (int i = 0; i < width*height; ++i) {
-                mask[i] = filter[i] / filter_factor;
-            }
-        }
+    class EdgeSharpen : public StaticBase<3, 3, int> {
+    public:
+        EdgeSharpen() : StaticBase(EDGE_SHARPEN) {}
+    };
 
-        int getWidth() const override {
-            return width;
-        }
+    class Emboss3D : public StaticBase<3, 3, int> {
+    public:
+        Emboss3D() : StaticBase(EMBOSS_3D) {}
+    };
 
-        int getHeight() const override {
-            return height;
-        }
+    class EdgeSobelX : public StaticBase<3, 3, int> {
+    public:
+        EdgeSobelX() : StaticBase(EDGE_SOBEL_X) {}
+    };
 
-        int getCenterRow() const override {
-            return cr;
-        }
+    class EdgeSobelY : public StaticBase<3, 3, int> {
+    public:
+        EdgeSobelY() : StaticBase(EDGE_SOBEL_Y) {}
+    };
 
-        int getCenterColumn() const override {
-            return cc;
-        }
+    class BoxBlur : public StaticBase<3, 3, int> {
+    public:
+        BoxBlur() : StaticBase(BOX_BLUR) {}
+    };
 
-        double getFilterFactor() const override {
-            return filter_factor;
+    // Normalised Gaussian of 2 * 3 ceil(sigma) + 1 taps, the row and column
+    // the dynamic masks are made of: one exp() per tap
+    inline std::vector<double> gaussian_taps(double sigma) {
+        int radius = (int) std::ceil(sigma) * 3;
+        std::vector<double> taps(2 * radius + 1);
+        double sum = 0;
+        for (int i = -radius; i <= radius; ++i) {
+            taps[i + radius] = std::exp(-(double) i * i / (2.0 * sigma * sigma));
+            sum += taps[i + radius];
         }
-
-        const double* getData() const override {
-            return mask.data();
+        for (double& t : taps) {
+            t /= sum;
         }
-    };
+        return taps;
+    }
 
     class GaussianDynamic2D : public BaseMask {
     private:
@@ -463,41 +254,22 @@ namespace Mask {
 
     public:
 
-        GaussianDynamic2D(double sigma) {
-            double kernel_radius = std::ceil(sigma) * 3;
-            cr = cc = (int) kernel_radius;
-            width = height = (int) kernel_radius * 2 + 1;
-
-            // Generate matrix
-            Eigen::VectorXf ax = Eigen::VectorXf::LinSpaced(width, -kernel_radius, kernel_radius);
-
-            Eigen::MatrixXf xx(width, height);
-            Eigen::MatrixXf yy(width, height);
+        // The outer product of the 1D Gaussian with itself, which is the 2D
+        // Gaussian already normalised
+        GaussianDynamic2D(double sigma) : sigma(sigma) {
+            std::vector<double> taps = gaussian_taps(sigma);
+            width = height = (int) taps.size();
+            cr = cc = width / 2;
 
+            mask.resize(width * height);
             for (int i = 0; i < height; ++i) {
                 for (int j = 0; j < width; ++j) {
-                    xx(i, j) = ax(j);
-                    yy(i, j) = ax(i);
-                }
-            }
-
-            Eigen::MatrixXf kernel = (-(xx.array().square() + yy.array().square()) / (2.0 * sigma * sigma)).exp();
-            // Normalize the kernel
-            kernel /= kernel.sum();
-
-            // Flatten the 2D kernel matrix into a 1D vector
-            mask.resize(width * height);
-            for (int i = 0; i < width; ++i) {
-                for (int j = 0; j < height; ++j) {
-                    mask[i * width + j] = kernel(i, j);
+                    mask[i * width + j] = taps[i] * taps[j];
                 }
             }
-
         }
 
-        GaussianDynamic2D() {
-            GaussianDynamic2D(1);
-        }
+        GaussianDynamic2D() : GaussianDynamic2D(1) {}
 
         int getWidth() const override {
             return width;
@@ -537,37 +309,19 @@ namespace Mask {
 
     public:
 
-        GaussianDynamic1D(double sigma, bool transpose) {
-            double kernel_radius = std::ceil(sigma) * 3;
-            int kernel_size = (int) kernel_radius * 2 + 1;
+        GaussianDynamic1D(double sigma, bool transpose) : sigma(sigma), mask(gaussian_taps(sigma)) {
+            int kernel_size = (int) mask.size();
             if (transpose) {
-                cr = (int) kernel_radius;
+                cr = kernel_size / 2;
                 cc = 0;
                 height = kernel_size;
                 width = 1;
             } else {
-                cc = (int) kernel_radius;
+                cc = kernel_size / 2;
                 cr = 0;
                 width = kernel_size;
                 height = 1;
             }
-            
-            
-            // Generate matrix
-            Eigen::VectorXf ax = Eigen::VectorXf::LinSpaced(kernel_size, -kernel_radius, kernel_radius);
-
-            Eigen::VectorXf kernel = (-(ax.array().square()) / (2.0f * sigma * sigma)).exp();
-            // Normalize the kernel
-            kernel /= kernel.sum();
-
-            if (transpose) kernel = kernel.transpose();
-
-            // Flatten the 2D kernel matrix into a 1D vector
-            mask.resize(kernel_size);
-            for (int i = 0; i < kernel_size; ++i) {
-                mask[i] = static_cast<double>(kernel(i));
-            }
-
         }
 
 
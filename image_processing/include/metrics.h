@@ -0,0 +1,25 @@
+#pragma once
+#include "image.h"
+
+// Full-reference quality metrics between two views of the same shape and
+// layout, over every channel. A shape mismatch prints a message and returns -1.
+namespace ImageOps {
+	double mse(const ImageView& a, const ImageView& b);
+	// In dB, infinity for identical images
+	double psnr(const ImageView& a, const ImageView& b);
+	// Mean structural similarity with the usual 11x11, sigma 1.5 Gaussian
+	// window, 1 for identical images
+	double ssim(const ImageView& a, const ImageView& b);
+}
+
+namespace Metrics {
+	const int SSIM_RADIUS = 5;
+	const float SSIM_SIGMA = 1.5f;
+	const float SSIM_C1 = (0.01f * 255) * (0.01f * 255);
+	const float SSIM_C2 = (0.03f * 255) * (0.03f * 255);
+
+	// Normalized window taps -SSIM_RADIUS..SSIM_RADIUS
+	void ssim_weights(float* weights);
+
+	double psnr_from_mse(double mse);
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "image.h"
+
+namespace Morphology {
+	// Largest rx or ry
+	const int MAX_RADIUS = 255;
+
+	bool valid_radii(int rx, int ry, const char* op);
+}
+
+namespace ImageOps {
+	// Min (erode) or max (dilate) over the structuring element around each
+	// pixel, pixels outside the image left out. Rectangles are a row pass then
+	// a column pass, crosses the extreme of the two, each van Herk / Gil-Werman
+	// at three comparisons per sample whatever the radius. src and dst share
+	// shape and layout, and may be the same view.
+	void erode(const ImageView& src, const ImageView& dst, int rx, int ry, StructuringElement shape = MORPH_RECT);
+	void dilate(const ImageView& src, const ImageView& dst, int rx, int ry, StructuringElement shape = MORPH_RECT);
+	void morphology(const ImageView& src, const ImageView& dst, MorphologyOp op, int rx, int ry,
+		StructuringElement shape = MORPH_RECT);
+}
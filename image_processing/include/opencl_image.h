@@ -4,6 +4,18 @@
 #define CL_HPP_TARGET_OPENCL_VERSION 200
 #include <CL/cl2.hpp>
 #include "image.h"
+#include "histogram.h"
+#include "reduce.h"
+#include "metrics.h"
+#include "color.h"
+#include "warp.h"
+#include "convolution.h"
+#include "rank.h"
+#include "morphology.h"
+#include "edge_preserving.h"
+#include "edges.h"
+#include "unsharp.h"
+#include <list>
 #include <stdint.h>
 // #include "PNG.h"
 
@@ -12,20 +24,175 @@ public:
     OpenCLImageProcessor();
     ~OpenCLImageProcessor();
 
+    // Picks the device, see IMAGE_CL_DEVICE
     void init();
-    void grayscale_avg(Image& image);
+    std::string deviceName() const { return device.getInfo<CL_DEVICE_NAME>(); }
 
-    void diffmap(Image& image1, Image& image2);
+    // Device time, from the queue's profiling events, of the image uploads
+    // and read backs and of the kernels run since the last resetTimings().
+    // What an op took beyond these is host overhead. builds counts the
+    // programs compiled meanwhile and table_uploads the masks, spectra and
+    // warp maps written to the device, neither counts what came from a cache.
+    struct Timings {
+        double transfer_ms = 0;
+        double kernel_ms = 0;
+        int builds = 0;
+        int table_uploads = 0;
+    };
+    Timings timings() const { return device_timings; }
+    void resetTimings() { device_timings = Timings(); }
 
-    void flipX(Image& image);
-    void flipY(Image& image);
+    // Every op takes a source and a destination view, dst must already have the
+    // output size. Regions of interest are gathered with rect transfers and
+    // only dst's region is written back. Passing the same view twice, or an
+    // Image, works in place.
+    void grayscale_avg(const ImageView& src, const ImageView& dst);
+    void grayscale_avg(const ImageView& image) { grayscale_avg(image, image); }
+    void grayscale_avg(Image& image) { grayscale_avg(image.view()); }
 
+    void diffmap(const ImageView& image1, const ImageView& image2, const ImageView& dst);
+    void diffmap(const ImageView& image1, const ImageView& image2) { diffmap(image1, image2, image1); }
+    void diffmap(Image& image1, Image& image2) { diffmap(image1.view(), image2.view()); }
+    // Difference map stretched so its largest value (or scl if larger) maps to 255
+    void diffmap_scale(const ImageView& image1, const ImageView& image2, const ImageView& dst, uint8_t scl = 0);
+    void diffmap_scale(Image& image1, Image& image2, uint8_t scl = 0) { diffmap_scale(image1.view(), image2.view(), image1.view(), scl); }
+
+    void flipX(const ImageView& src, const ImageView& dst);
+    void flipY(const ImageView& src, const ImageView& dst);
+    void flipX(const ImageView& image) { flipX(image, image); }
+    void flipY(const ImageView& image) { flipY(image, image); }
+    void flipX(Image& image) { flipX(image.view()); }
+    void flipY(Image& image) { flipY(image.view()); }
+
+    // dst has src's width and height swapped (kept for ROTATE_180). Tiles
+    // staged in local memory keep reads and writes along rows.
+    void transpose(const ImageView& src, const ImageView& dst);
+    void rotate(const ImageView& src, const ImageView& dst, Rotation rotation);
+    void transpose(Image& image);
+    void rotate(Image& image, Rotation rotation);
+
+    // Scale src to the size of dst
+    void resizeBilinear(const ImageView& src, const ImageView& dst);
+    void resizeBicubic(const ImageView& src, const ImageView& dst);
     void resizeBilinear(Image& image, int nw, int nh);
     void resizeBicubic(Image& image, int nw, int nh);
 
-    void std_convolve_clamp_to_0(Image& image, const Mask::BaseMask* mask);
-    void std_convolve_clamp_to_border(Image& image, const Mask::BaseMask* mask);
+    void std_convolve_clamp_to_0(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask);
+    void std_convolve_clamp_to_border(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask);
+    void std_convolve_clamp_to_0(const ImageView& image, const Mask::BaseMask* mask) { std_convolve_clamp_to_0(image, image, mask); }
+    void std_convolve_clamp_to_border(const ImageView& image, const Mask::BaseMask* mask) { std_convolve_clamp_to_border(image, image, mask); }
+    void std_convolve_clamp_to_0(Image& image, const Mask::BaseMask* mask) { std_convolve_clamp_to_0(image.view(), mask); }
+    void std_convolve_clamp_to_border(Image& image, const Mask::BaseMask* mask) { std_convolve_clamp_to_border(image.view(), mask); }
     void std_convolve_clamp_to_cyclic(Image& image, const Mask::BaseMask* mask);
+    // Direct, separable or FFT, see ImageOps::convolve. Masks are read the
+    // way round std_convolve_* reads them here. FFT keeps the last few mask
+    // spectra on the device, so the frames of a stream only transform pixels.
+    void convolve(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask,
+        ConvolutionBorder border, ConvolutionMethod method = CONVOLVE_AUTO);
+    void convolve(Image& image, const Mask::BaseMask* mask, ConvolutionBorder border,
+        ConvolutionMethod method = CONVOLVE_AUTO) {
+        convolve(image.view(), image.view(), mask, border, method);
+    }
+
+    // Rank filters, see ImageOps::rank_filter. 3x3 and 5x5 windows are sorted
+    // in registers four pixels at a time, larger ones counted from a tile in
+    // local memory.
+    void rank_filter(const ImageView& src, const ImageView& dst, int radius, double percent);
+    void median(const ImageView& src, const ImageView& dst, int radius) { rank_filter(src, dst, radius, 50); }
+    void min_filter(const ImageView& src, const ImageView& dst, int radius) { rank_filter(src, dst, radius, 0); }
+    void max_filter(const ImageView& src, const ImageView& dst, int radius) { rank_filter(src, dst, radius, 100); }
+    void rank_filter(Image& image, int radius, double percent) { rank_filter(image.view(), image.view(), radius, percent); }
+    void median(Image& image, int radius) { median(image.view(), image.view(), radius); }
+
+    // Erosion, dilation and their composites, see ImageOps::morphology. Every
+    // pass of a composite runs between device buffers, only the result is read back.
+    void morphology(const ImageView& src, const ImageView& dst, MorphologyOp op, int rx, int ry,
+        StructuringElement shape = MORPH_RECT);
+    void erode(const ImageView& src, const ImageView& dst, int rx, int ry, StructuringElement shape = MORPH_RECT) {
+        morphology(src, dst, MORPH_ERODE, rx, ry, shape);
+    }
+    void dilate(const ImageView& src, const ImageView& dst, int rx, int ry, StructuringElement shape = MORPH_RECT) {
+        morphology(src, dst, MORPH_DILATE, rx, ry, shape);
+    }
+    void morphology(Image& image, MorphologyOp op, int rx, int ry, StructuringElement shape = MORPH_RECT) {
+        morphology(image.view(), image.view(), op, rx, ry, shape);
+    }
+
+    // Edge preserving smoothing, see ImageOps::bilateral and ImageOps::guided.
+    // The bilateral filter reads a tile staged in local memory with its weight
+    // tables in __constant, the guided filter keeps all its planes on the device.
+    void bilateral(const ImageView& src, const ImageView& dst, double sigma_space, double sigma_range);
+    void guided(const ImageView& src, const ImageView& guide, const ImageView& dst, double sigma_space, double sigma_range);
+    void bilateral(Image& image, double sigma_space, double sigma_range) {
+        bilateral(image.view(), image.view(), sigma_space, sigma_range);
+    }
+    void guided(Image& image, double sigma_space, double sigma_range) {
+        guided(image.view(), image.view(), image.view(), sigma_space, sigma_range);
+    }
+
+    // Sobel gradients and Canny edges, see ImageOps::sobel and ImageOps::canny.
+    // Gx and Gy come from one tile in local memory, and Canny keeps every
+    // stage on the device until the edges are read back.
+    void sobel(const ImageView& src, const ImageView& magnitude, const ImageView& orientation = ImageView());
+    void canny(const ImageView& src, const ImageView& dst, int low, int high);
+    void canny(Image& image, int low, int high) { canny(image.view(), image.view(), low, high); }
+
+    // Unsharp masking, see ImageOps::unsharp. Blur and combine run in one
+    // kernel with the tile and its column sums in local memory, or in two
+    // through a device buffer when the tile does not fit.
+    void unsharp(const ImageView& src, const ImageView& dst, double amount, double radius, int threshold);
+    void unsharp(Image& image, double amount, double radius, int threshold) {
+        unsharp(image.view(), image.view(), amount, radius, threshold);
+    }
+
+    // Per-channel 256 bin histograms, hist holds channels * 256 counts
+    void histogram(const ImageView& src, uint32_t* hist);
+    void histogram(const Image& image, uint32_t* hist) { histogram(image.view(), hist); }
+
+    // Global and tiled contrast limited equalization, see ImageOps::clahe
+    void equalize(const ImageView& src, const ImageView& dst);
+    void equalize(Image& image) { equalize(image.view(), image.view()); }
+    void clahe(const ImageView& src, const ImageView& dst, int tiles_x = 8, int tiles_y = 8, double clip_limit = 2.0);
+    void clahe(Image& image, int tiles_x = 8, int tiles_y = 8, double clip_limit = 2.0) {
+        clahe(image.view(), image.view(), tiles_x, tiles_y, clip_limit);
+    }
+
+    // Min, max, sum, sum of squares and count above threshold, reduced on the
+    // device so only the totals are read back
+    ImageStats reduce(const ImageView& src, uint8_t threshold = 255);
+    ImageStats reduce(const Image& image, uint8_t threshold = 255) { return reduce(image.view(), threshold); }
+    bool is_black(const ImageView& src, uint8_t threshold = 5);
+    bool is_black(const Image& image, uint8_t threshold = 5) { return is_black(image.view(), threshold); }
+
+    // Quality metrics, see ImageOps::mse. Everything up to the per work-group
+    // sums stays on the device.
+    double mse(const ImageView& a, const ImageView& b);
+    double psnr(const ImageView& a, const ImageView& b);
+    double ssim(const ImageView& a, const ImageView& b);
+    double mse(const Image& a, const Image& b) { return mse(a.view(), b.view()); }
+    double psnr(const Image& a, const Image& b) { return psnr(a.view(), b.view()); }
+    double ssim(const Image& a, const Image& b) { return ssim(a.view(), b.view()); }
+
+    // Colour conversions, see ImageOps::convert_from_rgb. dst may have a
+    // different layout than src.
+    void convert_from_rgb(const ImageView& src, const ImageView& dst, ColorSpace space);
+    void convert_to_rgb(const ImageView& src, const ImageView& dst, ColorSpace space);
+    // Filters only the luminance, the whole YCbCr round trip runs on the device
+    void convolve_luma(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask, ColorSpace space = COLOR_YCBCR_601);
+    void convolve_luma(Image& image, const Mask::BaseMask* mask, ColorSpace space = COLOR_YCBCR_601) {
+        convolve_luma(image.view(), image.view(), mask, space);
+    }
+
+    // Affine and perspective warps, see ImageOps::warp. A WarpMap's positions
+    // are uploaded on first use and stay on the device for later frames.
+    void warp(const ImageView& src, const ImageView& dst, const Eigen::Matrix3d& transform,
+        Interpolation interpolation = INTERP_BILINEAR);
+    void remap(const ImageView& src, const ImageView& dst, const WarpMap& map);
+
+    // Convert between RGBRGB... and one plane per channel on the device.
+    // Convolution and resize run per plane when given a planar image.
+    void to_planar(Image& image);
+    void to_interleaved(Image& image);
 
 private:
     cl::Context context;
@@ -35,6 +202,84 @@ private:
 
     void loadKernels();
     std::string loadKernelSource(const std::string& fileName);
+    // Compiles the files, concatenated, with options. Programs are kept by
+    // files and options, most recently used first, so an op called every
+    // frame compiles once; -D constants cost one build per distinct value.
+    static const size_t PROGRAM_CACHE_SIZE = 64;
+    std::list<std::pair<std::string, cl::Program>> program_cache;
+    cl::Program buildProgram(const std::string& fileName, const std::string& options = "");
+    cl::Program buildProgram(const std::vector<std::string>& fileNames, const std::string& options = "");
+    Timings device_timings;
+    static double eventMs(const cl::Event& event);
+    // Enqueues and waits, printing the kernel time when built with PROFILE
+    void runKernel(const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local = cl::NullRange);
+    // Reusable device buffers, one per role an op's arguments can play
+    // WORK_A to WORK_D hold the intermediates of multi-pass ops.
+    enum ScratchSlot { SCRATCH_INPUT, SCRATCH_SECOND, SCRATCH_OUTPUT, SCRATCH_MASK, SCRATCH_PARTIALS,
+        SCRATCH_WORK_A, SCRATCH_WORK_B, SCRATCH_WORK_C, SCRATCH_WORK_D, SCRATCH_SLOTS };
+    cl::Buffer scratch_buffers[SCRATCH_SLOTS];
+    size_t scratch_bytes[SCRATCH_SLOTS] = {};
+    cl::Buffer scratch(ScratchSlot slot, size_t bytes);
+    // Read-only wrappers of page aligned host pixels, per slot, reused while
+    // a slot keeps being given the same pointer and size
+    cl::Buffer host_buffers[SCRATCH_SLOTS];
+    uint8_t* host_data[SCRATCH_SLOTS] = {};
+    size_t host_bytes[SCRATCH_SLOTS] = {};
+    cl::Buffer hostBuffer(uint8_t* data, size_t bytes, ScratchSlot slot);
+    // Device copies of warp maps by id, most recently used first
+    static const size_t REMAP_CACHE_SIZE = 4;
+    std::list<std::pair<uint64_t, cl::Buffer>> remap_cache;
+    cl::Buffer remapBuffer(const WarpMap& map);
+    // Runs warp or remap, whose arguments only differ in the third buffer
+    void warpDevice(const ImageView& src, const ImageView& dst, const char* kernel_name,
+        const cl::Buffer& params_d, Interpolation interpolation);
+
+    // Dense device copy of a view, and the way back into the view's rows.
+    // Kernels that write their input need read_only = false.
+    cl::Buffer uploadView(const ImageView& view, ScratchSlot slot, bool read_only = true);
+    void downloadView(const cl::Buffer& buffer, const ImageView& view);
+    void convertLayout(Image& image, PixelLayout target);
+    // Reduction over the first region_w x region_h pixels and region_ch
+    // channels of a dense interleaved buffer already on the device
+    ImageStats reduceBuffer(const cl::Buffer& data_d, int w, int channels,
+        int region_w, int region_h, int region_ch, uint8_t threshold);
+    // Work-groups for a grid-stride reduction over items
+    size_t reductionGroups(size_t items, size_t local_size);
+    // Runs one colour conversion kernel between two dense device buffers
+    void convertColor(const cl::Buffer& src_d, const cl::Buffer& dst_d, int w, int h, int channels,
+        bool src_planar, bool dst_planar, ColorSpace space, bool from_rgb);
+    // Tiled transpose of a whole view, see transpose_tiled in geometry.cl
+    void transposeDevice(const ImageView& src, const ImageView& dst, bool flip_rows, bool flip_cols);
+    // Device copies of direct convolution masks by shape and taps, most
+    // recently used first, so repeated masks are not written again
+    static const size_t MASK_CACHE_SIZE = 8;
+    std::list<std::pair<uint64_t, cl::Buffer>> mask_cache;
+    cl::Buffer maskBuffer(const Mask::BaseMask* mask);
+    // Device copies of mask spectra by Convolution::spectrum_key, most recently used first
+    static const size_t SPECTRUM_CACHE_SIZE = 4;
+    std::list<std::pair<uint64_t, cl::Buffer>> spectrum_cache;
+    cl::Buffer spectrumBuffer(const Mask::BaseMask* mask, const Convolution::FftLayout& layout);
+    void convolveSeparable(const ImageView& src, const ImageView& dst, const std::vector<double>& column,
+        const std::vector<double>& row, int cr, int cc, ConvolutionBorder border);
+    void convolveFft(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask, ConvolutionBorder border);
+    // Direct convolution of a mask with isStatic(), its taps built into the program
+    void convolveStatic(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask, ConvolutionBorder border);
+    // Transforms rows rows of n values in data, work is a buffer of the same size
+    void fftRows(const cl::Program& program, const cl::Buffer& data, const cl::Buffer& work, int n, int rows, bool inverse);
+    void transposeComplex(const cl::Program& program, const cl::Buffer& in, const cl::Buffer& out, int w, int h);
+    // Erosion or dilation of a dense image shaped like view from in_d into
+    // out_d, with WORK_A to WORK_C as intermediates
+    void extremeDevice(const cl::Program& program, const ImageView& view, const cl::Buffer& in_d, const cl::Buffer& out_d,
+        int rx, int ry, StructuringElement shape, bool take_max);
+    // One van Herk / Gil-Werman pass along rows, or columns when vertical
+    void extremeLine(const cl::Program& program, const ImageView& view, const cl::Buffer& in_d, const cl::Buffer& out_d,
+        int radius, bool vertical, bool take_max);
+    // Box means of planes w x h float planes in data_d, tmp_d holds as many
+    void boxMeans(const cl::Program& program, const cl::Buffer& data_d, const cl::Buffer& tmp_d,
+        int w, int h, int planes, int radius);
+    static bool rotatedShape(const ImageView& src, const ImageView& dst, bool swapped, const char* op);
+    static bool colorShape(const ImageView& src, const ImageView& dst, const char* op);
+    static bool sameShape(const ImageView& src, const ImageView& dst, const char* op);
     
     std::string getErrorString(cl_int error);
 };
\ No newline at end of file
@@ -0,0 +1,46 @@
+#pragma once
+#include <map>
+#include <string>
+#include <vector>
+
+// Throughput regression checks against a stored baseline. A workload is
+// summarised by the median megapixels/s of its repetitions and their median
+// absolute deviation, so one slow repetition moves neither.
+namespace PerfGate {
+	struct Sample {
+		double median = 0;
+		// Median absolute deviation over the median
+		double mad = 0;
+	};
+
+	// Medians by workload name. cpu (see cpu_fingerprint) and device name the
+	// machine they were measured on, they only compare against runs on the
+	// same one. device is empty when no OpenCL platform was found.
+	struct Baseline {
+		std::string cpu;
+		std::string device;
+		std::map<std::string, Sample> workloads;
+	};
+
+	// Smallest drop that fails however quiet the runs were
+	const double MIN_DROP = 0.10;
+	// Drops within this many standard deviations (1.4826 MAD) of the
+	// noisier of the two runs pass
+	const double NOISE_SIGMAS = 3;
+
+	Sample summarize(std::vector<double> values);
+	// Largest fraction of the baseline's median current may lose and pass
+	double allowed_drop(const Sample& baseline, const Sample& current);
+	bool regressed(const Sample& baseline, const Sample& current);
+
+	// In the JSON write() produces. False, after printing why, when the
+	// file cannot be read or has no workloads.
+	bool read(const char* path, Baseline& baseline);
+	bool write(const char* path, const Baseline& baseline);
+
+	// Model name and cache size from /proc/cpuinfo and the OpenMP thread
+	// count, e.g. "Intel(R) Xeon(R) Processor, 16384 KB cache, 8 threads".
+	// The model alone is too generic on cloud runners, where one name covers
+	// many core counts. Parts /proc/cpuinfo lacks are left out.
+	std::string cpu_fingerprint();
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "image.h"
+
+// Rank filters over the (2 radius + 1)^2 square around each pixel, with the
+// edge pixels repeated outside the image. percent picks the sample: 0 is the
+// minimum, 100 the maximum and 50 the median, the window sorted and indexed
+// at percent / 100 * (size - 1) rounded to nearest.
+namespace Rank {
+	// Largest radius, so the counts of a window fit 16 bit histogram bins
+	const int MAX_RADIUS = 127;
+
+	// Index into the sorted window, false with a message when radius is out of range
+	bool window_rank(int radius, double percent, int& rank, const char* op);
+}
+
+namespace ImageOps {
+	// Every channel of src into dst, which has src's shape and may be src.
+	// Windows of up to 25 samples are selected directly, larger ones from
+	// running column histograms (Perreault and Hebert), so the cost per pixel
+	// does not grow with the radius. Column strips run in parallel.
+	void rank_filter(const ImageView& src, const ImageView& dst, int radius, double percent);
+	void median(const ImageView& src, const ImageView& dst, int radius);
+	void min_filter(const ImageView& src, const ImageView& dst, int radius);
+	void max_filter(const ImageView& src, const ImageView& dst, int radius);
+}
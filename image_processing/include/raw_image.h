@@ -0,0 +1,45 @@
+#pragma once
+#include <stdint.h>
+#include <cstddef>
+
+// Uncompressed container used for intermediates and cached reference images.
+// Pixel data starts on a page boundary so a file can be mapped straight into
+// an Image and handed to OpenCL with CL_MEM_USE_HOST_PTR.
+namespace RawImage {
+
+	constexpr uint32_t MAGIC = 0x474D4952; // "RIMG"
+	constexpr uint32_t VERSION = 1;
+
+	enum Layout : uint32_t {
+		INTERLEAVED = 0,
+		PLANAR = 1
+	};
+
+	struct Header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t w;
+		uint32_t h;
+		uint32_t channels;
+		uint32_t layout;
+		uint64_t stride;       // bytes per row, per plane row when planar
+		uint64_t data_offset;  // page aligned offset of the first pixel
+		uint64_t data_size;
+	};
+
+	struct Mapping {
+		Header header;
+		void* base = nullptr;
+		size_t length = 0;
+		uint8_t* pixels = nullptr;
+	};
+
+	size_t page_size();
+
+	// Maps the file copy-on-write, in-place edits never reach the file
+	bool map(const char* filename, Mapping& mapping);
+	void unmap(Mapping& mapping);
+
+	bool write(const char* filename, const uint8_t* data, int w, int h, int channels, size_t stride, Layout layout = INTERLEAVED);
+
+}
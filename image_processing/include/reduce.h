@@ -0,0 +1,23 @@
+#pragma once
+#include "image.h"
+
+// Summary of every sample in a view, all channels together
+struct ImageStats {
+	uint8_t min = 255;
+	uint8_t max = 0;
+	uint64_t sum = 0;
+	uint64_t sum_sq = 0;
+	// Samples strictly greater than the threshold the reduction was run with
+	uint64_t above = 0;
+	uint64_t count = 0;
+
+	double mean() const { return count ? (double)sum / count : 0.0; }
+	double stddev() const;
+};
+
+namespace ImageOps {
+	ImageStats reduce(const ImageView& src, uint8_t threshold = 255);
+
+	// No sample above threshold
+	bool is_black(const ImageView& src, uint8_t threshold = 5);
+}
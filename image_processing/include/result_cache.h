@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "image.h"
+#include "masks.h"
+
+// XXH64 of a byte range
+uint64_t fast_hash(const void* data, size_t len, uint64_t seed = 0);
+// XXH64 over 1 MiB chunks in parallel, then over the chunk hashes
+uint64_t parallel_hash(const void* data, size_t len, uint64_t seed = 0);
+
+
+// Identifies one operation on one input: pixel hash, dimensions, operation name
+// and every parameter that changes the result.
+class CacheKey {
+public:
+	CacheKey(const Image& input, const char* operation);
+
+	CacheKey& add(int value) { return add((int64_t)value); }
+	CacheKey& add(int64_t value);
+	CacheKey& add(double value);
+	CacheKey& add(const Mask::BaseMask* mask);
+
+	uint64_t value() const { return hash; }
+
+private:
+	uint64_t hash;
+	void mix(const void* bytes, size_t len);
+};
+
+
+// Bounded LRU of operation results, optionally backed by a directory of .rimg
+// files so results survive between runs.
+//
+//	ResultCache cache(512 << 20, "output/cache");
+//	cache.apply(img, CacheKey(img, "convolve_border").add(&mask), [&](Image& i) {
+//		processor.std_convolve_clamp_to_border(i, &mask);
+//	});
+class ResultCache {
+public:
+	explicit ResultCache(size_t capacity_bytes = 256 << 20, const std::string& disk_dir = "");
+	~ResultCache();
+
+	ResultCache(const ResultCache&) = delete;
+	ResultCache& operator=(const ResultCache&) = delete;
+
+	// Replaces image with the cached result, or runs compute and stores its output
+	template<typename Fn>
+	Image& apply(Image& image, const CacheKey& key, Fn&& compute) {
+		if (lookup(key.value(), image)) {
+			return image;
+		}
+		compute(image);
+		store(key.value(), image);
+		return image;
+	}
+
+	bool lookup(uint64_t key, Image& image);
+	void store(uint64_t key, const Image& image);
+	void clear();
+
+	size_t hits() const { return hit_count; }
+	size_t disk_hits() const { return disk_hit_count; }
+	size_t misses() const { return miss_count; }
+	size_t entries() const;
+	size_t bytes() const;
+
+private:
+	struct Entry {
+		uint64_t key;
+		std::unique_ptr<Image> image;
+	};
+
+	std::string disk_path(uint64_t key) const;
+	void insert(uint64_t key, const Image& image);
+	static void copy_into(const Image& src, Image& dst);
+
+	size_t capacity;
+	size_t used = 0;
+	std::string disk_dir;
+	std::list<Entry> lru;
+	std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+	mutable std::mutex lock;
+
+	std::atomic<size_t> hit_count{0};
+	std::atomic<size_t> disk_hit_count{0};
+	std::atomic<size_t> miss_count{0};
+};
@@ -0,0 +1,24 @@
+#pragma once
+#include "image.h"
+#include "mask_factory.h"
+
+// Unsharp masking: src + amount (src - blur), the blur a Gaussian of
+// standard deviation radius pixels. Differences under threshold are left
+// alone, so flat noise is not sharpened. A radius of a few pixels sharpens
+// detail, a large radius with a small amount raises local contrast.
+namespace Unsharp {
+	// Largest radius, MaskFactory's largest sigma. The blur is its Gaussian
+	// row, reaching 3 ceil(radius) pixels.
+	const int MAX_RADIUS = 64;
+
+	// dst of src's shape and layout, 0 < radius <= MAX_RADIUS, amount >= 0
+	// and threshold 0-255, printing what is wrong otherwise
+	bool valid_args(const ImageView& src, const ImageView& dst, double amount, double radius, int threshold, const char* op);
+}
+
+namespace ImageOps {
+	// Blur and combine in one pass over the image: a row's column sums, its
+	// row sums and the result are made in row buffers, edge pixels repeated
+	// outside the image. dst may be src.
+	void unsharp(const ImageView& src, const ImageView& dst, double amount, double radius, int threshold);
+}
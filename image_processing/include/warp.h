@@ -0,0 +1,61 @@
+#pragma once
+#include "image.h"
+#include <Eigen/Geometry>
+#include <vector>
+
+// How the source is sampled between pixels. Source positions are rounded to
+// 1/32 pixel and weighted in integers, the same way on the device, so CPU and
+// GPU results agree.
+enum Interpolation { INTERP_BILINEAR, INTERP_BICUBIC };
+
+// Transforms take source pixel coordinates to destination coordinates, x
+// right and y down, so positive angles turn clockwise on screen.
+namespace Warp {
+	// Turn by degrees and scale about cx, cy
+	Eigen::Matrix3d rotation(double cx, double cy, double degrees, double scale = 1.0);
+	// x += kx * y and y += ky * x, e.g. undoing the slant of scanned text
+	Eigen::Matrix3d shear(double kx, double ky);
+	// Homography taking each of the four from points onto the matching to point
+	Eigen::Matrix3d perspective(const Eigen::Vector2d from[4], const Eigen::Vector2d to[4]);
+
+	// Destination to source matrix in single precision, row major, as the
+	// kernels take it. False when the transform cannot be inverted.
+	bool inverse_of(const Eigen::Matrix3d& transform, float m[9]);
+}
+
+
+// Source position of every destination pixel, computed once. A stream warped
+// with the same parameters every frame reuses one map and skips the
+// transform math, and the device keeps its copy of the map between calls.
+class WarpMap {
+public:
+	WarpMap(const Eigen::Matrix3d& transform, int dst_w, int dst_h, Interpolation interpolation = INTERP_BILINEAR);
+
+	int width() const { return w; }
+	int height() const { return h; }
+	Interpolation interpolation() const { return interp; }
+	// x, y pairs in 1/32 pixels, row by row. Empty when the transform was singular.
+	const int32_t* positions() const { return xy.data(); }
+	size_t bytes() const { return xy.size() * sizeof(int32_t); }
+	bool valid() const { return !xy.empty(); }
+	// Unique per constructed map, copies share it
+	uint64_t id() const { return map_id; }
+
+private:
+	int w;
+	int h;
+	Interpolation interp;
+	std::vector<int32_t> xy;
+	uint64_t map_id;
+};
+
+
+namespace ImageOps {
+	// dst pixel x, y takes the source pixel the transform maps onto it, black
+	// where that falls outside src. src and dst share channels and layout but
+	// not size, and must not overlap.
+	void warp(const ImageView& src, const ImageView& dst, const Eigen::Matrix3d& transform,
+		Interpolation interpolation = INTERP_BILINEAR);
+	// Same with the positions of a prebuilt map, dst must have the map's size
+	void remap(const ImageView& src, const ImageView& dst, const WarpMap& map);
+}
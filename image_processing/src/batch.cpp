@@ -0,0 +1,205 @@
+#include "batch.h"
+#include <algorithm>
+#include <chrono>
+
+static thread_local ThreadPool* current_pool = nullptr;
+static thread_local size_t current_worker = 0;
+
+ThreadPool::ThreadPool(size_t thread_count, size_t max_pending) : max_pending(max_pending) {
+	if (thread_count == 0) {
+		thread_count = std::max(1u, std::thread::hardware_concurrency());
+	}
+	for (size_t i = 0; i < thread_count; ++i) {
+		workers.emplace_back(new Worker());
+	}
+	for (size_t i = 0; i < thread_count; ++i) {
+		threads.emplace_back(&ThreadPool::worker_loop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lk(sleep_lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& t : threads) {
+		t.join();
+	}
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+	{
+		std::unique_lock<std::mutex> lk(sleep_lock);
+		done.wait(lk, [&] { return pending < max_pending; });
+		++pending;
+		++queued;
+	}
+
+	// Tasks spawned by a worker stay on that worker's deque
+	size_t index = current_pool == this ? current_worker : next_worker++ % workers.size();
+	{
+		std::lock_guard<std::mutex> lk(workers[index]->lock);
+		workers[index]->tasks.push_back(std::move(task));
+	}
+	wake.notify_one();
+}
+
+void ThreadPool::wait_idle() {
+	std::unique_lock<std::mutex> lk(sleep_lock);
+	done.wait(lk, [&] { return pending == 0; });
+}
+
+bool ThreadPool::pop_task(size_t index, std::function<void()>& task) {
+	// Own deque from the front, then steal from the back of the others
+	{
+		Worker& own = *workers[index];
+		std::lock_guard<std::mutex> lk(own.lock);
+		if (!own.tasks.empty()) {
+			task = std::move(own.tasks.front());
+			own.tasks.pop_front();
+			return true;
+		}
+	}
+	for (size_t k = 1; k < workers.size(); ++k) {
+		Worker& victim = *workers[(index + k) % workers.size()];
+		std::lock_guard<std::mutex> lk(victim.lock);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.back());
+			victim.tasks.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::worker_loop(size_t index) {
+	current_pool = this;
+	current_worker = index;
+
+	std::function<void()> task;
+	for (;;) {
+		if (pop_task(index, task)) {
+			{
+				std::lock_guard<std::mutex> lk(sleep_lock);
+				--queued;
+			}
+			task();
+			task = nullptr;
+			{
+				std::lock_guard<std::mutex> lk(sleep_lock);
+				--pending;
+			}
+			done.notify_all();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lk(sleep_lock);
+		if (stopping && queued == 0) {
+			return;
+		}
+		// A task may be queued but not yet visible in a deque, spin instead of sleeping
+		if (queued == 0) {
+			wake.wait(lk, [&] { return stopping || queued > 0; });
+		}
+	}
+}
+
+
+void BatchReport::print() const {
+	printf("\e[32mBatch\e[0m %zu images (%zu failed) in %.3f s: \e[36m%.2f images/s, %.2f MB/s\e[0m\n",
+		images, failed, seconds, images_per_second(), mb_per_second());
+}
+
+
+BatchProcessor::BatchProcessor(OpenCLImageProcessor& processor, BatchConfig config)
+	: processor(processor), config(config) {
+	if (this->config.queue_depth == 0) {
+		this->config.queue_depth = 1;
+	}
+}
+
+BatchReport BatchProcessor::run(const std::vector<BatchJob>& jobs, const Operation& op) {
+	// A null image marks a failed decode, it still flows through so every stage sees every job
+	struct Item {
+		const BatchJob* job;
+		std::shared_ptr<Image> image;
+	};
+
+	BatchReport report;
+	ThreadPool pool(config.io_threads);
+	BoundedQueue<Item> decoded(config.queue_depth);
+	BoundedQueue<Item> processed(config.queue_depth);
+	std::atomic<size_t> failed{0};
+	std::atomic<size_t> pixel_bytes{0};
+
+	// Images between decode and the end of their encode
+	size_t in_flight = 0;
+	std::mutex flight_lock;
+	std::condition_variable landed;
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	auto encode = [&]() {
+		Item item;
+		processed.pop(item);
+		if (item.image && !item.image->write(item.job->output.c_str(), config.jpg_quality)) {
+			++failed;
+		}
+		item.image.reset();
+		{
+			std::lock_guard<std::mutex> lk(flight_lock);
+			--in_flight;
+		}
+		landed.notify_one();
+	};
+
+	// Only this thread touches the OpenCL context
+	std::thread submitter([&]() {
+		for (size_t n = 0; n < jobs.size(); ++n) {
+			Item item;
+			decoded.pop(item);
+			if (item.image) {
+				op(processor, *item.image);
+			}
+			processed.push(item);
+			pool.submit(encode);
+		}
+	});
+
+	for (const BatchJob& job : jobs) {
+		// Backpressure, never hold more than queue_depth decoded images
+		{
+			std::unique_lock<std::mutex> lk(flight_lock);
+			landed.wait(lk, [&] { return in_flight < config.queue_depth; });
+			++in_flight;
+		}
+
+		const BatchJob* job_ptr = &job;
+		pool.submit([&, job_ptr]() {
+			// Frames are recycled, a steady stream of same sized images stops allocating
+			std::shared_ptr<Image> image = std::make_shared<Image>(job_ptr->input.c_str(), config.channel_force,
+				FramePoolAllocator::instance());
+			if (image->data == NULL) {
+				image.reset();
+				++failed;
+			}
+			else {
+				pixel_bytes += image->size;
+			}
+			decoded.push({ job_ptr, image });
+		});
+	}
+
+	submitter.join();
+	pool.wait_idle();
+
+	auto end = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<double> elapsed = end - start;
+
+	report.images = jobs.size();
+	report.failed = failed;
+	report.pixel_bytes = pixel_bytes;
+	report.seconds = elapsed.count();
+	return report;
+}
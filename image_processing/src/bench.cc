@@ -0,0 +1,838 @@
+#include <benchmark/benchmark.h>
+
+#include "image.h"
+#include "opencl_image.h"
+#include "masks.h"
+#include "histogram.h"
+#include "reduce.h"
+#include "metrics.h"
+#include "color.h"
+#include "warp.h"
+#include "convolution.h"
+#include "rank.h"
+#include "morphology.h"
+#include "edge_preserving.h"
+#include "edges.h"
+#include "unsharp.h"
+#include "mask_factory.h"
+#include "perf_gate.h"
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <unistd.h>
+
+// Throughput of the CPU ops and their OpenCL counterparts in megapixels of
+// source per second. Arguments are the image size (an index into SIZES), the
+// channel count and, for filters, the mask size. Device benchmarks also
+// report the mean transfer, kernel and host milliseconds of a call, host
+// being whatever the call took beyond the device's own events.
+//
+// Run from this directory so the kernels are found, e.g.
+//   ./ImageProcessing_bench --benchmark_filter='convolve_.*/3/3/' --benchmark_format=json
+// --benchmark_out=results.json keeps the JSON next to the console output.
+
+struct BenchSize {
+    const char* name;
+    int w;
+    int h;
+};
+
+static const BenchSize SIZES[] = {
+    { "VGA", 640, 480 }, { "720p", 1280, 720 }, { "1080p", 1920, 1080 }, { "4K", 3840, 2160 }, { "8K", 7680, 4320 },
+};
+static const int SIZE_COUNT = sizeof(SIZES) / sizeof(SIZES[0]);
+
+// A gradient with some noise, so ranks, edges and thresholds see varied input
+static Image bench_image(int w, int h, int channels, uint32_t seed = 1) {
+    Image image(w, h, channels);
+    uint32_t state = seed * 2654435761u;
+    for (size_t i = 0; i < image.size; ++i) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        size_t p = i / channels;
+        image.data[i] = (uint8_t)((p % w) * 127 / w + (p / w) * 63 / h + (state & 63));
+    }
+    return image;
+}
+
+static Image bench_image(const benchmark::State& state, uint32_t seed = 1) {
+    const BenchSize& size = SIZES[state.range(0)];
+    return bench_image(size.w, size.h, (int)state.range(1), seed);
+}
+
+// Masks by width: the fixed 3x3 and 5x5 Gaussians, or a cached dynamic one
+// of 6 sigma + 1 taps
+static const Mask::BaseMask* bench_mask(int width) {
+    static Mask::GaussianBlur3 blur3;
+    static Mask::GaussianBlur5 blur5;
+    if (width == 3) {
+        return &blur3;
+    }
+    if (width == 5) {
+        return &blur5;
+    }
+    static std::shared_ptr<const FactoryMask> masks[3];
+    int i = width == 7 ? 0 : width == 13 ? 1 : 2;
+    if (!masks[i]) {
+        masks[i] = MaskFactory::gaussian((width - 1) / 6.0);
+    }
+    return masks[i].get();
+}
+
+// Spatial sigma whose Gaussian taps span width pixels
+static double bench_sigma(const benchmark::State& state) {
+    return (state.range(2) - 1) / 6.0;
+}
+
+static int bench_radius(const benchmark::State& state) {
+    return (int)state.range(2) / 2;
+}
+
+// Built by the first device benchmark that runs, init() exits without a
+// platform so has_platform() is checked first
+static OpenCLImageProcessor& device() {
+    static OpenCLImageProcessor processor;
+    return processor;
+}
+
+static bool has_platform() {
+    static bool found = []() {
+        std::vector<cl::Platform> platforms;
+        cl::Platform::get(&platforms);
+        return !platforms.empty();
+    }();
+    return found;
+}
+
+static void set_throughput(benchmark::State& state) {
+    const BenchSize& size = SIZES[state.range(0)];
+    state.SetLabel(std::string(size.name) + " " + std::to_string(state.range(1)) + "ch");
+    state.counters["MP"] = benchmark::Counter((double)size.w * size.h * state.iterations() / 1e6,
+        benchmark::Counter::kIsRate);
+}
+
+// Image's ops work in place, so each iteration gets a fresh copy of the
+// source. Copying and freeing it are not timed.
+template <typename Op>
+static void run_cpu(benchmark::State& state, Op op) {
+    Image src = bench_image(state);
+    std::unique_ptr<Image> image;
+    for (auto _ : state) {
+        state.PauseTiming();
+        image.reset(new Image(src.clone()));
+        state.ResumeTiming();
+        op(*image);
+        benchmark::ClobberMemory();
+    }
+    set_throughput(state);
+}
+
+// Shape of the destination of an out of place op
+enum DstShape { DST_SAME, DST_TRANSPOSED, DST_HALF };
+
+static Image dst_image(const Image& src, DstShape shape) {
+    int w = shape == DST_TRANSPOSED ? src.h : shape == DST_HALF ? src.w / 2 : src.w;
+    int h = shape == DST_TRANSPOSED ? src.w : shape == DST_HALF ? src.h / 2 : src.h;
+    return Image(w, h, src.channels);
+}
+
+// Out of place ops, src is only read
+template <typename Op>
+static void run_cpu_views(benchmark::State& state, Op op, DstShape shape = DST_SAME) {
+    Image src = bench_image(state);
+    Image dst = dst_image(src, shape);
+    for (auto _ : state) {
+        op(src.view(), dst.view());
+        benchmark::ClobberMemory();
+    }
+    set_throughput(state);
+}
+
+template <typename Op>
+static void run_device(benchmark::State& state, Op op, DstShape shape = DST_SAME) {
+    if (!has_platform()) {
+        state.SkipWithError("no OpenCL platform");
+        return;
+    }
+    Image src = bench_image(state);
+    Image dst = dst_image(src, shape);
+
+    // The first call sizes the scratch buffers
+    OpenCLImageProcessor& processor = device();
+    op(processor, src.view(), dst.view());
+    processor.resetTimings();
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (auto _ : state) {
+        op(processor, src.view(), dst.view());
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+    double n = (double)state.iterations();
+    OpenCLImageProcessor::Timings timings = processor.timings();
+    state.counters["transfer_ms"] = timings.transfer_ms / n;
+    state.counters["kernel_ms"] = timings.kernel_ms / n;
+    state.counters["host_ms"] = (elapsed.count() - timings.transfer_ms - timings.kernel_ms) / n;
+    set_throughput(state);
+}
+
+static void image_args(benchmark::internal::Benchmark* b) {
+    for (int size = 0; size < SIZE_COUNT; ++size) {
+        for (int channels : { 1, 3, 4 }) {
+            b->Args({ size, channels });
+        }
+    }
+}
+
+// Colour ops need at least three channels
+static void color_args(benchmark::internal::Benchmark* b) {
+    for (int size = 0; size < SIZE_COUNT; ++size) {
+        for (int channels : { 3, 4 }) {
+            b->Args({ size, channels });
+        }
+    }
+}
+
+static void gray_args(benchmark::internal::Benchmark* b) {
+    for (int size = 0; size < SIZE_COUNT; ++size) {
+        b->Args({ size, 1 });
+    }
+}
+
+// Mask and window widths
+static void mask_args(benchmark::internal::Benchmark* b) {
+    for (int size = 0; size < SIZE_COUNT; ++size) {
+        for (int channels : { 1, 3, 4 }) {
+            for (int width : { 3, 5, 13, 25 }) {
+                b->Args({ size, channels, width });
+            }
+        }
+    }
+}
+
+static void color_mask_args(benchmark::internal::Benchmark* b) {
+    for (int size = 0; size < SIZE_COUNT; ++size) {
+        for (int channels : { 3, 4 }) {
+            for (int width : { 3, 5, 13, 25 }) {
+                b->Args({ size, channels, width });
+            }
+        }
+    }
+}
+
+// Widths of Gaussians of sigma 1, 2 and 4
+static void sigma_args(benchmark::internal::Benchmark* b) {
+    for (int size = 0; size < SIZE_COUNT; ++size) {
+        for (int channels : { 1, 3, 4 }) {
+            for (int width : { 7, 13, 25 }) {
+                b->Args({ size, channels, width });
+            }
+        }
+    }
+}
+
+#define IMAGE_BENCHMARK(fn, args) BENCHMARK(fn)->Apply(args)->UseRealTime()->Unit(benchmark::kMillisecond)
+
+
+// ---------- CPU -----------
+
+static void grayscale_avg_cpu(benchmark::State& state) {
+    run_cpu(state, [](Image& image) { image.grayscale_avg_cpu(); });
+}
+IMAGE_BENCHMARK(grayscale_avg_cpu, color_args);
+
+static void grayscale_lum_cpu(benchmark::State& state) {
+    run_cpu(state, [](Image& image) { image.grayscale_lum_cpu(); });
+}
+IMAGE_BENCHMARK(grayscale_lum_cpu, color_args);
+
+static void grayscale_channel_cpu(benchmark::State& state) {
+    run_cpu(state, [](Image& image) { benchmark::DoNotOptimize(image.grayscale_channel_cpu()); });
+}
+IMAGE_BENCHMARK(grayscale_channel_cpu, color_args);
+
+static void layout_cpu(benchmark::State& state) {
+    run_cpu(state, [](Image& image) { image.to_planar_cpu(); });
+}
+IMAGE_BENCHMARK(layout_cpu, color_args);
+
+static void diffmap_cpu(benchmark::State& state) {
+    Image other = bench_image(state, 2);
+    run_cpu(state, [&](Image& image) { image.diffmap_cpu(other); });
+}
+IMAGE_BENCHMARK(diffmap_cpu, image_args);
+
+static void diffmap_scale_cpu(benchmark::State& state) {
+    Image other = bench_image(state, 2);
+    run_cpu(state, [&](Image& image) { image.diffmap_scale_cpu(other); });
+}
+IMAGE_BENCHMARK(diffmap_scale_cpu, image_args);
+
+static void flipX_cpu(benchmark::State& state) {
+    run_cpu(state, [](Image& image) { image.flipX_cpu(); });
+}
+IMAGE_BENCHMARK(flipX_cpu, image_args);
+
+static void flipY_cpu(benchmark::State& state) {
+    run_cpu(state, [](Image& image) { image.flipY_cpu(); });
+}
+IMAGE_BENCHMARK(flipY_cpu, image_args);
+
+static void transpose_cpu(benchmark::State& state) {
+    run_cpu(state, [](Image& image) { image.transpose_cpu(); });
+}
+IMAGE_BENCHMARK(transpose_cpu, image_args);
+
+static void rotate_cpu(benchmark::State& state) {
+    run_cpu(state, [](Image& image) { image.rotate_cpu(ROTATE_90); });
+}
+IMAGE_BENCHMARK(rotate_cpu, image_args);
+
+static void resizeBilinear_cpu(benchmark::State& state) {
+    run_cpu(state, [](Image& image) { image.resizeBilinear_cpu(image.w / 2, image.h / 2); });
+}
+IMAGE_BENCHMARK(resizeBilinear_cpu, image_args);
+
+// Every channel, as the device convolves them all
+static void std_convolve_clamp_to_0_cpu(benchmark::State& state) {
+    const Mask::BaseMask* mask = bench_mask((int)state.range(2));
+    run_cpu(state, [&](Image& image) {
+        for (int c = 0; c < image.channels; ++c) {
+            image.std_convolve_clamp_to_0_cpu(c, mask);
+        }
+    });
+}
+IMAGE_BENCHMARK(std_convolve_clamp_to_0_cpu, mask_args);
+
+static void std_convolve_clamp_to_border_cpu(benchmark::State& state) {
+    const Mask::BaseMask* mask = bench_mask((int)state.range(2));
+    run_cpu(state, [&](Image& image) {
+        for (int c = 0; c < image.channels; ++c) {
+            image.std_convolve_clamp_to_border_cpu(c, mask);
+        }
+    });
+}
+IMAGE_BENCHMARK(std_convolve_clamp_to_border_cpu, mask_args);
+
+static void convolve_cpu(benchmark::State& state) {
+    const Mask::BaseMask* mask = bench_mask((int)state.range(2));
+    run_cpu_views(state, [&](const ImageView& src, const ImageView& dst) {
+        ImageOps::convolve(src, dst, mask, CLAMP_TO_BORDER);
+    });
+}
+IMAGE_BENCHMARK(convolve_cpu, mask_args);
+
+static void median_cpu(benchmark::State& state) {
+    run_cpu(state, [&](Image& image) { image.median_cpu(bench_radius(state)); });
+}
+IMAGE_BENCHMARK(median_cpu, mask_args);
+
+static void rank_filter_cpu(benchmark::State& state) {
+    run_cpu(state, [&](Image& image) { image.rank_filter_cpu(bench_radius(state), 25); });
+}
+IMAGE_BENCHMARK(rank_filter_cpu, mask_args);
+
+static void morphology_cpu(benchmark::State& state) {
+    int radius = bench_radius(state);
+    run_cpu(state, [&](Image& image) { image.morphology_cpu(MORPH_OPEN, radius, radius); });
+}
+IMAGE_BENCHMARK(morphology_cpu, mask_args);
+
+static void bilateral_cpu(benchmark::State& state) {
+    run_cpu(state, [&](Image& image) { image.bilateral_cpu(bench_sigma(state), 30); });
+}
+IMAGE_BENCHMARK(bilateral_cpu, sigma_args);
+
+static void guided_cpu(benchmark::State& state) {
+    run_cpu(state, [&](Image& image) { image.guided_cpu(bench_sigma(state), 30); });
+}
+IMAGE_BENCHMARK(guided_cpu, sigma_args);
+
+static void unsharp_cpu(benchmark::State& state) {
+    run_cpu(state, [&](Image& image) { image.unsharp_cpu(1.0, bench_sigma(state), 2); });
+}
+IMAGE_BENCHMARK(unsharp_cpu, sigma_args);
+
+static void sobel_cpu(benchmark::State& state) {
+    run_cpu(state, [](Image& image) { benchmark::DoNotOptimize(image.sobel_cpu()); });
+}
+IMAGE_BENCHMARK(sobel_cpu, gray_args);
+
+static void canny_cpu(benchmark::State& state) {
+    run_cpu(state, [](Image& image) { benchmark::DoNotOptimize(image.canny_cpu(40, 100)); });
+}
+IMAGE_BENCHMARK(canny_cpu, gray_args);
+
+static void histogram_cpu(benchmark::State& state) {
+    std::vector<uint32_t> hist(state.range(1) * 256);
+    run_cpu_views(state, [&](const ImageView& src, const ImageView&) { ImageOps::histogram(src, hist.data()); });
+}
+IMAGE_BENCHMARK(histogram_cpu, image_args);
+
+static void equalize_cpu(benchmark::State& state) {
+    run_cpu_views(state, [](const ImageView& src, const ImageView& dst) { ImageOps::equalize(src, dst); });
+}
+IMAGE_BENCHMARK(equalize_cpu, image_args);
+
+static void clahe_cpu(benchmark::State& state) {
+    run_cpu_views(state, [](const ImageView& src, const ImageView& dst) { ImageOps::clahe(src, dst); });
+}
+IMAGE_BENCHMARK(clahe_cpu, image_args);
+
+static void reduce_cpu(benchmark::State& state) {
+    run_cpu_views(state, [](const ImageView& src, const ImageView&) {
+        benchmark::DoNotOptimize(ImageOps::reduce(src, 128));
+    });
+}
+IMAGE_BENCHMARK(reduce_cpu, image_args);
+
+static void ssim_cpu(benchmark::State& state) {
+    Image other = bench_image(state, 2);
+    run_cpu_views(state, [&](const ImageView& src, const ImageView&) {
+        benchmark::DoNotOptimize(ImageOps::ssim(src, other.view()));
+    });
+}
+IMAGE_BENCHMARK(ssim_cpu, image_args);
+
+static void convert_from_rgb_cpu(benchmark::State& state) {
+    run_cpu_views(state, [](const ImageView& src, const ImageView& dst) {
+        ImageOps::convert_from_rgb(src, dst, COLOR_YCBCR_601);
+    });
+}
+IMAGE_BENCHMARK(convert_from_rgb_cpu, color_args);
+
+static void convolve_luma_cpu(benchmark::State& state) {
+    const Mask::BaseMask* mask = bench_mask((int)state.range(2));
+    run_cpu_views(state, [&](const ImageView& src, const ImageView& dst) { ImageOps::convolve_luma(src, dst, mask); });
+}
+IMAGE_BENCHMARK(convolve_luma_cpu, color_mask_args);
+
+// Bicubic resize to half size, as a scaling warp
+static void resize_bicubic_cpu(benchmark::State& state) {
+    Eigen::Matrix3d transform = Warp::rotation(0, 0, 0, 0.5);
+    run_cpu_views(state, [&](const ImageView& src, const ImageView& dst) {
+        ImageOps::warp(src, dst, transform, INTERP_BICUBIC);
+    }, DST_HALF);
+}
+IMAGE_BENCHMARK(resize_bicubic_cpu, image_args);
+
+static void warp_cpu(benchmark::State& state) {
+    const BenchSize& size = SIZES[state.range(0)];
+    Eigen::Matrix3d transform = Warp::rotation(size.w / 2.0, size.h / 2.0, 10);
+    run_cpu_views(state, [&](const ImageView& src, const ImageView& dst) { ImageOps::warp(src, dst, transform); });
+}
+IMAGE_BENCHMARK(warp_cpu, image_args);
+
+
+// ---------- OpenCL -----------
+//
+// std_convolve_clamp_to_cyclic is left out while it is broken.
+
+static void grayscale_avg_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) { p.grayscale_avg(src, dst); });
+}
+IMAGE_BENCHMARK(grayscale_avg_cl, color_args);
+
+static void layout_cl(benchmark::State& state) {
+    Image image = bench_image(state);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView&, const ImageView&) {
+        if (image.layout == PLANAR) {
+            p.to_interleaved(image);
+        }
+        else {
+            p.to_planar(image);
+        }
+    });
+}
+IMAGE_BENCHMARK(layout_cl, color_args);
+
+static void diffmap_cl(benchmark::State& state) {
+    Image other = bench_image(state, 2);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.diffmap(src, other.view(), dst);
+    });
+}
+IMAGE_BENCHMARK(diffmap_cl, image_args);
+
+static void diffmap_scale_cl(benchmark::State& state) {
+    Image other = bench_image(state, 2);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.diffmap_scale(src, other.view(), dst);
+    });
+}
+IMAGE_BENCHMARK(diffmap_scale_cl, image_args);
+
+static void flipX_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) { p.flipX(src, dst); });
+}
+IMAGE_BENCHMARK(flipX_cl, image_args);
+
+static void flipY_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) { p.flipY(src, dst); });
+}
+IMAGE_BENCHMARK(flipY_cl, image_args);
+
+static void transpose_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) { p.transpose(src, dst); },
+        DST_TRANSPOSED);
+}
+IMAGE_BENCHMARK(transpose_cl, image_args);
+
+static void rotate_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.rotate(src, dst, ROTATE_90);
+    }, DST_TRANSPOSED);
+}
+IMAGE_BENCHMARK(rotate_cl, image_args);
+
+static void resizeBilinear_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.resizeBilinear(src, dst);
+    }, DST_HALF);
+}
+IMAGE_BENCHMARK(resizeBilinear_cl, image_args);
+
+static void resizeBicubic_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.resizeBicubic(src, dst);
+    }, DST_HALF);
+}
+IMAGE_BENCHMARK(resizeBicubic_cl, image_args);
+
+static void std_convolve_clamp_to_0_cl(benchmark::State& state) {
+    const Mask::BaseMask* mask = bench_mask((int)state.range(2));
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.std_convolve_clamp_to_0(src, dst, mask);
+    });
+}
+IMAGE_BENCHMARK(std_convolve_clamp_to_0_cl, mask_args);
+
+static void std_convolve_clamp_to_border_cl(benchmark::State& state) {
+    const Mask::BaseMask* mask = bench_mask((int)state.range(2));
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.std_convolve_clamp_to_border(src, dst, mask);
+    });
+}
+IMAGE_BENCHMARK(std_convolve_clamp_to_border_cl, mask_args);
+
+static void convolve_cl(benchmark::State& state) {
+    const Mask::BaseMask* mask = bench_mask((int)state.range(2));
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.convolve(src, dst, mask, CLAMP_TO_BORDER);
+    });
+}
+IMAGE_BENCHMARK(convolve_cl, mask_args);
+
+static void convolve_luma_cl(benchmark::State& state) {
+    const Mask::BaseMask* mask = bench_mask((int)state.range(2));
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.convolve_luma(src, dst, mask);
+    });
+}
+IMAGE_BENCHMARK(convolve_luma_cl, color_mask_args);
+
+static void median_cl(benchmark::State& state) {
+    int radius = bench_radius(state);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.median(src, dst, radius);
+    });
+}
+IMAGE_BENCHMARK(median_cl, mask_args);
+
+static void rank_filter_cl(benchmark::State& state) {
+    int radius = bench_radius(state);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.rank_filter(src, dst, radius, 25);
+    });
+}
+IMAGE_BENCHMARK(rank_filter_cl, mask_args);
+
+static void morphology_cl(benchmark::State& state) {
+    int radius = bench_radius(state);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.morphology(src, dst, MORPH_OPEN, radius, radius);
+    });
+}
+IMAGE_BENCHMARK(morphology_cl, mask_args);
+
+static void bilateral_cl(benchmark::State& state) {
+    double sigma = bench_sigma(state);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.bilateral(src, dst, sigma, 30);
+    });
+}
+IMAGE_BENCHMARK(bilateral_cl, sigma_args);
+
+static void guided_cl(benchmark::State& state) {
+    double sigma = bench_sigma(state);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.guided(src, src, dst, sigma, 30);
+    });
+}
+IMAGE_BENCHMARK(guided_cl, sigma_args);
+
+static void unsharp_cl(benchmark::State& state) {
+    double sigma = bench_sigma(state);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.unsharp(src, dst, 1.0, sigma, 2);
+    });
+}
+IMAGE_BENCHMARK(unsharp_cl, sigma_args);
+
+static void sobel_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) { p.sobel(src, dst); });
+}
+IMAGE_BENCHMARK(sobel_cl, gray_args);
+
+static void canny_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.canny(src, dst, 40, 100);
+    });
+}
+IMAGE_BENCHMARK(canny_cl, gray_args);
+
+static void histogram_cl(benchmark::State& state) {
+    std::vector<uint32_t> hist(state.range(1) * 256);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView&) {
+        p.histogram(src, hist.data());
+    });
+}
+IMAGE_BENCHMARK(histogram_cl, image_args);
+
+static void equalize_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) { p.equalize(src, dst); });
+}
+IMAGE_BENCHMARK(equalize_cl, image_args);
+
+static void clahe_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) { p.clahe(src, dst); });
+}
+IMAGE_BENCHMARK(clahe_cl, image_args);
+
+static void reduce_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView&) {
+        benchmark::DoNotOptimize(p.reduce(src, 128));
+    });
+}
+IMAGE_BENCHMARK(reduce_cl, image_args);
+
+static void is_black_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView&) {
+        benchmark::DoNotOptimize(p.is_black(src));
+    });
+}
+IMAGE_BENCHMARK(is_black_cl, image_args);
+
+static void mse_cl(benchmark::State& state) {
+    Image other = bench_image(state, 2);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView&) {
+        benchmark::DoNotOptimize(p.mse(src, other.view()));
+    });
+}
+IMAGE_BENCHMARK(mse_cl, image_args);
+
+static void psnr_cl(benchmark::State& state) {
+    Image other = bench_image(state, 2);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView&) {
+        benchmark::DoNotOptimize(p.psnr(src, other.view()));
+    });
+}
+IMAGE_BENCHMARK(psnr_cl, image_args);
+
+static void ssim_cl(benchmark::State& state) {
+    Image other = bench_image(state, 2);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView&) {
+        benchmark::DoNotOptimize(p.ssim(src, other.view()));
+    });
+}
+IMAGE_BENCHMARK(ssim_cl, image_args);
+
+static void convert_from_rgb_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.convert_from_rgb(src, dst, COLOR_YCBCR_601);
+    });
+}
+IMAGE_BENCHMARK(convert_from_rgb_cl, color_args);
+
+static void convert_to_rgb_cl(benchmark::State& state) {
+    run_device(state, [](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.convert_to_rgb(src, dst, COLOR_YCBCR_601);
+    });
+}
+IMAGE_BENCHMARK(convert_to_rgb_cl, color_args);
+
+static void warp_cl(benchmark::State& state) {
+    const BenchSize& size = SIZES[state.range(0)];
+    Eigen::Matrix3d transform = Warp::rotation(size.w / 2.0, size.h / 2.0, 10);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) {
+        p.warp(src, dst, transform);
+    });
+}
+IMAGE_BENCHMARK(warp_cl, image_args);
+
+static void remap_cl(benchmark::State& state) {
+    const BenchSize& size = SIZES[state.range(0)];
+    WarpMap map(Warp::rotation(size.w / 2.0, size.h / 2.0, 10), size.w, size.h);
+    run_device(state, [&](OpenCLImageProcessor& p, const ImageView& src, const ImageView& dst) { p.remap(src, dst, map); });
+}
+IMAGE_BENCHMARK(remap_cl, image_args);
+
+
+
+// ---------- Regression gate -----------
+//
+// --baseline=FILE runs a fixed set of workloads GATE_REPETITIONS times
+// instead of the benchmarks above and fails when the median throughput of
+// any falls beyond PerfGate::allowed_drop of FILE's. Workloads are only
+// compared on the CPU (and OpenCL device, for _cl ones) the baseline was
+// measured on, when nothing can be compared or FILE does not exist it exits
+// with GATE_SKIPPED. Without an OpenCL platform the device workloads are
+// left out. --update_baseline rewrites FILE with this machine's medians.
+// IMAGE_CL_DEVICE=cpu runs the device workloads on a CPU OpenCL runtime.
+// Baselines belong to the runner that gates, none is kept in the tree.
+
+struct GateWorkload {
+    const char* name;
+    void (*run)(benchmark::State&);
+    std::vector<int64_t> args;
+};
+
+// 4K, 3 channels
+static const GateWorkload GATE_WORKLOADS[] = {
+    { "blur_4k_cpu", convolve_cpu, { 3, 3, 13 } },
+    { "blur_4k_cl", convolve_cl, { 3, 3, 13 } },
+    { "resize_bicubic_4k_cpu", resize_bicubic_cpu, { 3, 3 } },
+    { "resize_bicubic_4k_cl", resizeBicubic_cl, { 3, 3 } },
+    { "diffmap_4k_cpu", diffmap_cpu, { 3, 3 } },
+    { "diffmap_4k_cl", diffmap_cl, { 3, 3 } },
+};
+static const int GATE_REPETITIONS = 7;
+static const int GATE_SKIPPED = 77;
+
+static bool is_device_workload(const std::string& name) {
+    return name.size() > 3 && name.compare(name.size() - 3, 3, "_cl") == 0;
+}
+
+// Prints as usual and keeps the MP/s of every repetition
+class GateReporter : public benchmark::ConsoleReporter {
+public:
+    std::map<std::string, std::vector<double>> throughput;
+
+    // No colour codes in ctest logs
+    GateReporter() : ConsoleReporter(isatty(STDOUT_FILENO) ? OO_Defaults : OO_Tabular) {}
+
+    void ReportRuns(const std::vector<Run>& runs) override {
+        ConsoleReporter::ReportRuns(runs);
+        for (const Run& run : runs) {
+            // Skipped runs never set MP
+            if (run.run_type == Run::RT_Iteration && run.counters.count("MP")) {
+                throughput[run.run_name.function_name.substr(5)].push_back(run.counters.at("MP"));
+            }
+        }
+    }
+};
+
+static int run_gate(const std::string& path, bool update) {
+    PerfGate::Baseline baseline;
+    if (!update && access(path.c_str(), F_OK) != 0) {
+        printf("No baseline at %s. Record one on this machine with --update_baseline.\n", path.c_str());
+        return GATE_SKIPPED;
+    }
+    if (!update && !PerfGate::read(path.c_str(), baseline)) {
+        return 1;
+    }
+
+    PerfGate::Baseline current;
+    current.cpu = PerfGate::cpu_fingerprint();
+    if (has_platform()) {
+        current.device = device().deviceName();
+    }
+
+    for (const GateWorkload& workload : GATE_WORKLOADS) {
+        if (is_device_workload(workload.name) && current.device.empty()) {
+            continue;
+        }
+        benchmark::RegisterBenchmark((std::string("gate/") + workload.name).c_str(), workload.run)
+            ->Args(workload.args)->Repetitions(GATE_REPETITIONS)->UseRealTime()->Unit(benchmark::kMillisecond);
+    }
+    GateReporter reporter;
+    benchmark::RunSpecifiedBenchmarks(&reporter, "^gate/");
+
+    for (const auto& workload : reporter.throughput) {
+        current.workloads[workload.first] = PerfGate::summarize(workload.second);
+    }
+    if (update) {
+        return PerfGate::write(path.c_str(), current) ? 0 : 1;
+    }
+
+    int compared = 0, failed = 0;
+    for (const auto& workload : current.workloads) {
+        const std::string& name = workload.first;
+        const PerfGate::Sample& now = workload.second;
+        auto base = baseline.workloads.find(name);
+        bool same_machine = is_device_workload(name) ? current.device == baseline.device : current.cpu == baseline.cpu;
+        if (base == baseline.workloads.end() || !same_machine) {
+            printf("%-24s %10.1f MP/s  not compared, %s\n", name.c_str(), now.median,
+                same_machine ? "no baseline" : "baseline is from another machine");
+            continue;
+        }
+        bool slower = PerfGate::regressed(base->second, now);
+        printf("%-24s %10.1f MP/s  baseline %10.1f, allowed drop %.0f%%%s\n", name.c_str(), now.median,
+            base->second.median, 100 * PerfGate::allowed_drop(base->second, now), slower ? "  REGRESSED" : "");
+        compared++;
+        failed += slower;
+    }
+
+    for (const auto& workload : baseline.workloads) {
+        if (current.workloads.count(workload.first) == 0) {
+            printf("%-24s not run%s\n", workload.first.c_str(),
+                is_device_workload(workload.first) && current.device.empty() ? ", no OpenCL platform" : "");
+        }
+    }
+
+    if (compared == 0) {
+        printf("Nothing compared against %s, measured on %s / %s. Rerun with --update_baseline on this machine.\n",
+            path.c_str(), baseline.cpu.c_str(), baseline.device.c_str());
+        return GATE_SKIPPED;
+    }
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+
+    std::string baseline;
+    bool update = false;
+    int kept = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--baseline=", 11) == 0) {
+            baseline = argv[i] + 11;
+        }
+        else if (strcmp(argv[i], "--update_baseline") == 0) {
+            update = true;
+        }
+        else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+
+    if (!baseline.empty()) {
+        int result = run_gate(baseline, update);
+        benchmark::Shutdown();
+        return result;
+    }
+    if (update) {
+        printf("--update_baseline needs --baseline=FILE\n");
+        return 1;
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,221 @@
+#include "color.h"
+#include "cpu_dispatch.h"
+#include <algorithm>
+#include <cmath>
+
+namespace Color {
+
+static constexpr int fixed(double v) {
+	return (int)(v * (1 << FIXED_SHIFT) + (v < 0 ? -0.5 : 0.5));
+}
+
+// Kr and Kb of each standard give every other coefficient
+static constexpr YCbCrCoefficients make_ycbcr(double kr, double kb) {
+	return {
+		{
+			fixed(kr), fixed(1 - kr - kb), fixed(kb),
+			fixed(-0.5 * kr / (1 - kb)), fixed(-0.5 * (1 - kr - kb) / (1 - kb)), fixed(0.5),
+			fixed(0.5), fixed(-0.5 * (1 - kr - kb) / (1 - kr)), fixed(-0.5 * kb / (1 - kr)),
+		},
+		{
+			fixed(2 * (1 - kr)),
+			fixed(2 * kb * (1 - kb) / (1 - kr - kb)),
+			fixed(2 * kr * (1 - kr) / (1 - kr - kb)),
+			fixed(2 * (1 - kb)),
+		},
+	};
+}
+
+static constexpr YCbCrCoefficients BT601 = make_ycbcr(0.299, 0.114);
+static constexpr YCbCrCoefficients BT709 = make_ycbcr(0.2126, 0.0722);
+
+const YCbCrCoefficients& ycbcr(ColorSpace space) {
+	return space == COLOR_YCBCR_709 ? BT709 : BT601;
+}
+
+bool is_ycbcr(ColorSpace space) {
+	return space == COLOR_YCBCR_601 || space == COLOR_YCBCR_709;
+}
+
+// sRGB with the D65 white point
+static const float LAB_XN = 0.950456f, LAB_ZN = 1.088754f;
+
+struct LabTables {
+	float linear[256];
+	LabTables() {
+		for(int i = 0; i < 256; ++i) {
+			float c = i / 255.0f;
+			linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+		}
+	}
+};
+
+static inline float lab_f(float t) {
+	return t > 0.008856f ? cbrtf(t) : 7.787f * t + 16.0f / 116;
+}
+
+static inline float lab_f_inverse(float t) {
+	return t > 0.206893f ? t * t * t : (t - 16.0f / 116) / 7.787f;
+}
+
+static inline uint8_t to_byte(float v) {
+	return (uint8_t)std::min(std::max((int)lrintf(v), 0), 255);
+}
+
+static inline void rgb_to_lab(const LabTables& tables, int r, int g, int b, uint8_t* out) {
+	float lr = tables.linear[r], lg = tables.linear[g], lb = tables.linear[b];
+	float x = (0.412453f * lr + 0.357580f * lg + 0.180423f * lb) / LAB_XN;
+	float y = 0.212671f * lr + 0.715160f * lg + 0.072169f * lb;
+	float z = (0.019334f * lr + 0.119193f * lg + 0.950227f * lb) / LAB_ZN;
+	float fx = lab_f(x), fy = lab_f(y), fz = lab_f(z);
+	out[0] = to_byte((116 * fy - 16) * 255 / 100);
+	out[1] = to_byte(500 * (fx - fy) + 128);
+	out[2] = to_byte(200 * (fy - fz) + 128);
+}
+
+static inline float gamma_encode(float c) {
+	c = std::min(std::max(c, 0.0f), 1.0f);
+	return 255 * (c <= 0.0031308f ? 12.92f * c : 1.055f * powf(c, 1 / 2.4f) - 0.055f);
+}
+
+static inline void lab_to_rgb(int l8, int a8, int b8, uint8_t* out) {
+	float fy = (l8 * 100.0f / 255 + 16) / 116;
+	float fx = fy + (a8 - 128) / 500.0f;
+	float fz = fy - (b8 - 128) / 200.0f;
+	float x = lab_f_inverse(fx) * LAB_XN, y = lab_f_inverse(fy), z = lab_f_inverse(fz) * LAB_ZN;
+	out[0] = to_byte(gamma_encode(3.240479f * x - 1.537150f * y - 0.498535f * z));
+	out[1] = to_byte(gamma_encode(-0.969256f * x + 1.875992f * y + 0.041556f * z));
+	out[2] = to_byte(gamma_encode(0.055648f * x - 0.204043f * y + 1.057311f * z));
+}
+
+static const LabTables& lab_tables() {
+	static LabTables tables;
+	return tables;
+}
+
+}
+
+
+namespace ImageOps {
+
+static bool convertible(const ImageView& src, const ImageView& dst, const char* op) {
+	if(src.w != dst.w || src.h != dst.h || src.channels != dst.channels) {
+		printf("%s needs a destination with the size and channels of the source\n", op);
+		return false;
+	}
+	if(src.channels < 3) {
+		printf("%s needs at least 3 channels\n", op);
+		return false;
+	}
+	return true;
+}
+
+// Copies the channels past the third, which no conversion touches
+static void copy_extra_channels(const ImageView& src, const ImageView& dst, int y) {
+	size_t sstep = src.pixel_step(), dstep = dst.pixel_step();
+	for(int c = 3; c < src.channels; ++c) {
+		const uint8_t* s = src.channel_start(c) + y * src.stride;
+		uint8_t* d = dst.channel_start(c) + y * dst.stride;
+		for(int x = 0; x < src.w; ++x) {
+			d[x * dstep] = s[x * sstep];
+		}
+	}
+}
+
+// Runs convert(a, b, c, out) on every pixel, reading and writing through
+// each view's own channel pointers so either side may be planar
+template<typename Convert>
+static void convert_pixels(const ImageView& src, const ImageView& dst, Convert convert) {
+	size_t sstep = src.pixel_step(), dstep = dst.pixel_step();
+
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < src.h; ++y) {
+		const uint8_t* s[3];
+		uint8_t* d[3];
+		for(int c = 0; c < 3; ++c) {
+			s[c] = src.channel_start(c) + y * src.stride;
+			d[c] = dst.channel_start(c) + y * dst.stride;
+		}
+		for(int x = 0; x < src.w; ++x) {
+			uint8_t out[3];
+			convert(s[0][x * sstep], s[1][x * sstep], s[2][x * sstep], out);
+			d[0][x * dstep] = out[0];
+			d[1][x * dstep] = out[1];
+			d[2][x * dstep] = out[2];
+		}
+		copy_extra_channels(src, dst, y);
+	}
+}
+
+// Runs a CpuKernels colour row on every row, convert(src, sstep, splane, w, dst, dstep, dplane)
+template<typename Convert>
+static void convert_rows(const ImageView& src, const ImageView& dst, Convert convert) {
+	size_t splane = src.layout == PLANAR ? src.plane_pitch : 0;
+	size_t dplane = dst.layout == PLANAR ? dst.plane_pitch : 0;
+
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < src.h; ++y) {
+		convert(src.row(y), src.pixel_step(), splane, src.w, dst.row(y), dst.pixel_step(), dplane);
+		copy_extra_channels(src, dst, y);
+	}
+}
+
+void convert_from_rgb(const ImageView& src, const ImageView& dst, ColorSpace space) {
+	if(!convertible(src, dst, "convert_from_rgb")) {
+		return;
+	}
+	const CpuKernels& kernels = CpuDispatch::kernels();
+	if(Color::is_ycbcr(space)) {
+		const int* m = Color::ycbcr(space).forward;
+		convert_rows(src, dst, [&kernels, m](const uint8_t* s, size_t sstep, size_t splane, int w, uint8_t* d, size_t dstep, size_t dplane) {
+			kernels.rgb_to_ycbcr_row(s, sstep, splane, w, m, d, dstep, dplane);
+		});
+	}
+	else if(space == COLOR_HSV) {
+		convert_rows(src, dst, kernels.rgb_to_hsv_row);
+	}
+	else {
+		const Color::LabTables& tables = Color::lab_tables();
+		convert_pixels(src, dst, [&tables](int r, int g, int b, uint8_t* out) { Color::rgb_to_lab(tables, r, g, b, out); });
+	}
+}
+
+void convert_to_rgb(const ImageView& src, const ImageView& dst, ColorSpace space) {
+	if(!convertible(src, dst, "convert_to_rgb")) {
+		return;
+	}
+	const CpuKernels& kernels = CpuDispatch::kernels();
+	if(Color::is_ycbcr(space)) {
+		const int* m = Color::ycbcr(space).inverse;
+		convert_rows(src, dst, [&kernels, m](const uint8_t* s, size_t sstep, size_t splane, int w, uint8_t* d, size_t dstep, size_t dplane) {
+			kernels.ycbcr_to_rgb_row(s, sstep, splane, w, m, d, dstep, dplane);
+		});
+	}
+	else if(space == COLOR_HSV) {
+		convert_rows(src, dst, kernels.hsv_to_rgb_row);
+	}
+	else {
+		convert_pixels(src, dst, Color::lab_to_rgb);
+	}
+}
+
+void convolve_luma(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask, ColorSpace space) {
+	if(!convertible(src, dst, "convolve_luma")) {
+		return;
+	}
+	if(!Color::is_ycbcr(space)) {
+		printf("convolve_luma needs a YCbCr colour space\n");
+		return;
+	}
+	Image ycc(src.w, src.h, src.channels);
+	ycc.layout = PLANAR;
+	convert_from_rgb(src, ycc.view(), space);
+
+	// The Y plane on its own is a single channel image
+	ImageView luma(ycc.plane(0), ycc.w, ycc.h, 1);
+	std_convolve_clamp_to_border(luma, luma, 0, mask);
+
+	convert_to_rgb(ycc.view(), dst, space);
+}
+
+}
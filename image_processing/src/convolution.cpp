@@ -0,0 +1,443 @@
+#include "convolution.h"
+#include "result_cache.h"
+#include <algorithm>
+#include <cmath>
+#include <list>
+#include <map>
+#include <mutex>
+
+namespace Fft {
+
+int size_for(int n) {
+	int size = 1;
+	while(size < n) {
+		size <<= 1;
+	}
+	return size;
+}
+
+// e^(-2 pi i k / n) for k < n, built once per length
+static const Complex* twiddles(int n) {
+	static std::mutex lock;
+	static std::map<int, std::vector<Complex>> tables;
+
+	std::lock_guard<std::mutex> guard(lock);
+	std::vector<Complex>& table = tables[n];
+	if(table.empty()) {
+		table.resize(n);
+		for(int k = 0; k < n; ++k) {
+			double angle = -2.0 * M_PI * k / n;
+			table[k] = Complex(cos(angle), sin(angle));
+		}
+	}
+	return table.data();
+}
+
+// Every stage reads one buffer and writes the other in natural order, so no
+// bit reversal pass is needed. Stage of length len with stride s combines
+// elements len/4 apart into the 4 outputs of each butterfly.
+static void stockham(Complex* data, Complex* work, int n, const Complex* tw, bool inverse) {
+	Complex* in = data;
+	Complex* out = work;
+	// Multiplying by j, or -j for the inverse
+	const Complex j = inverse ? Complex(0, -1) : Complex(0, 1);
+
+	for(int len = n, s = 1; len > 1; ) {
+		if(len % 4 == 0) {
+			int m = len / 4;
+			for(int p = 0; p < m; ++p) {
+				Complex w1 = tw[p * s], w2 = tw[2 * p * s], w3 = tw[3 * p * s];
+				if(inverse) {
+					w1 = std::conj(w1);
+					w2 = std::conj(w2);
+					w3 = std::conj(w3);
+				}
+				for(int q = 0; q < s; ++q) {
+					Complex a = in[q + s * p], b = in[q + s * (p + m)];
+					Complex c = in[q + s * (p + 2 * m)], d = in[q + s * (p + 3 * m)];
+					Complex apc = a + c, amc = a - c, bpd = b + d, jbmd = j * (b - d);
+					out[q + s * (4 * p)] = apc + bpd;
+					out[q + s * (4 * p + 1)] = w1 * (amc - jbmd);
+					out[q + s * (4 * p + 2)] = w2 * (apc - bpd);
+					out[q + s * (4 * p + 3)] = w3 * (amc + jbmd);
+				}
+			}
+			len = m;
+			s *= 4;
+		}
+		else {
+			for(int q = 0; q < s; ++q) {
+				Complex a = in[q], b = in[q + s];
+				out[q] = a + b;
+				out[q + s] = a - b;
+			}
+			len = 1;
+			s *= 2;
+		}
+		std::swap(in, out);
+	}
+	if(in != data) {
+		std::copy(in, in + n, data);
+	}
+}
+
+void transform(Complex* data, Complex* work, int n, bool inverse) {
+	stockham(data, work, n, twiddles(n), inverse);
+}
+
+static void transform_rows(Complex* data, int w, int h, bool inverse) {
+	const Complex* tw = twiddles(w);
+
+	#pragma omp parallel
+	{
+		std::vector<Complex> work(w);
+		#pragma omp for schedule(static)
+		for(int y = 0; y < h; ++y) {
+			stockham(data + (size_t)y * w, work.data(), w, tw, inverse);
+		}
+	}
+}
+
+// 32 x 32 blocks so the column side of the copy stays in cache
+static void transpose(const Complex* src, Complex* dst, int w, int h) {
+	const int block = 32;
+
+	#pragma omp parallel for collapse(2) schedule(static)
+	for(int by = 0; by < h; by += block) {
+		for(int bx = 0; bx < w; bx += block) {
+			for(int x = bx; x < std::min(bx + block, w); ++x) {
+				for(int y = by; y < std::min(by + block, h); ++y) {
+					dst[(size_t)x * h + y] = src[(size_t)y * w + x];
+				}
+			}
+		}
+	}
+}
+
+void transform_2d(Complex* data, Complex* work, int w, int h) {
+	transform_rows(data, w, h, false);
+	transpose(data, work, w, h);
+	transform_rows(work, h, w, false);
+	std::copy(work, work + (size_t)w * h, data);
+}
+
+void inverse_2d(Complex* data, Complex* work, int w, int h) {
+	transform_rows(data, h, w, true);
+	transpose(data, work, h, w);
+	transform_rows(work, w, h, true);
+	std::copy(work, work + (size_t)w * h, data);
+}
+
+}
+
+
+namespace Convolution {
+
+bool separable(const Mask::BaseMask* mask, std::vector<double>& column, std::vector<double>& row) {
+	int kw = mask->getWidth(), kh = mask->getHeight();
+	const double* k = mask->getData();
+
+	// Largest tap picks the row and column the others are a multiple of
+	int peak = 0;
+	for(int i = 1; i < kw * kh; ++i) {
+		if(fabs(k[i]) > fabs(k[peak])) {
+			peak = i;
+		}
+	}
+	double p = k[peak];
+	if(p == 0) {
+		return false;
+	}
+
+	std::vector<double> c(kh), r(kw);
+	for(int i = 0; i < kh; ++i) {
+		c[i] = k[i * kw + peak % kw];
+	}
+	for(int j = 0; j < kw; ++j) {
+		r[j] = k[(peak / kw) * kw + j] / p;
+	}
+	// Masks built in single precision are only rank one to about 1e-7
+	for(int i = 0; i < kh; ++i) {
+		for(int j = 0; j < kw; ++j) {
+			if(fabs(k[i * kw + j] - c[i] * r[j]) > 1e-6 * fabs(p)) {
+				return false;
+			}
+		}
+	}
+	column.swap(c);
+	row.swap(r);
+	return true;
+}
+
+ConvolutionMethod choose(int w, int h, const Mask::BaseMask* mask) {
+	int kw = mask->getWidth(), kh = mask->getHeight();
+	double pixels = (double)w * h;
+
+	// Floating point operations per channel. A multiply-add is 2, a complex
+	// transform about 5 n log2 n, and each transform carries two channels.
+	// The separable pass through its intermediate buffer counts as 8 more
+	// per pixel, which keeps 3x3 masks direct.
+	double direct = 2.0 * pixels * kw * kh;
+	std::vector<double> column, row;
+	double separate = separable(mask, column, row) ? pixels * (2.0 * (kw + kh) + 8) : HUGE_VAL;
+	FftLayout fft_layout = layout(w, h, mask, false);
+	double n = (double)fft_layout.W * fft_layout.H;
+	double fft = (2 * 5.0 * n * log2(n) + 6.0 * n) / 2;
+
+	if(direct <= separate && direct <= fft) {
+		return CONVOLVE_DIRECT;
+	}
+	return separate <= fft ? CONVOLVE_SEPARABLE : CONVOLVE_FFT;
+}
+
+FftLayout layout(int w, int h, const Mask::BaseMask* mask, bool correlate) {
+	int kw = mask->getWidth(), kh = mask->getHeight();
+	int cr = mask->getCenterRow(), cc = mask->getCenterColumn();
+
+	// The output needs the taps reaching furthest to its right and below
+	// already padded in front of it, so nothing wraps around
+	FftLayout l;
+	l.W = Fft::size_for(w + kw - 1);
+	l.H = Fft::size_for(h + kh - 1);
+	l.ox = correlate ? cc : kw - 1 - cc;
+	l.oy = correlate ? cr : kh - 1 - cr;
+	return l;
+}
+
+uint64_t spectrum_key(const Mask::BaseMask* mask, const FftLayout& layout, bool correlate) {
+	int shape[] = { mask->getWidth(), mask->getHeight(), mask->getCenterRow(), mask->getCenterColumn(),
+		layout.W, layout.H, correlate };
+	uint64_t seed = fast_hash(shape, sizeof(shape));
+	return fast_hash(mask->getData(), sizeof(double) * mask->getWidth() * mask->getHeight(), seed);
+}
+
+typedef std::shared_ptr<const std::vector<Fft::Complex>> Spectrum;
+
+static Spectrum compute_spectrum(const Mask::BaseMask* mask, const FftLayout& l, bool correlate) {
+	int kw = mask->getWidth(), kh = mask->getHeight();
+	int cr = mask->getCenterRow(), cc = mask->getCenterColumn();
+	const double* k = mask->getData();
+
+	// Tap i, j lands at its offset from the centre, negative offsets wrapping
+	std::vector<Fft::Complex> spectrum((size_t)l.W * l.H), work(spectrum.size());
+	for(int i = 0; i < kh; ++i) {
+		for(int j = 0; j < kw; ++j) {
+			int u = correlate ? cr - i : i - cr;
+			int v = correlate ? cc - j : j - cc;
+			spectrum[(size_t)((u + l.H) % l.H) * l.W + (v + l.W) % l.W] = k[i * kw + j];
+		}
+	}
+	Fft::transform_2d(spectrum.data(), work.data(), l.W, l.H);
+
+	double scale = 1.0 / ((double)l.W * l.H);
+	for(Fft::Complex& value : spectrum) {
+		value *= scale;
+	}
+	return std::make_shared<const std::vector<Fft::Complex>>(std::move(spectrum));
+}
+
+Spectrum mask_spectrum(const Mask::BaseMask* mask, const FftLayout& layout, bool correlate) {
+	static const size_t CACHED_SPECTRA = 8;
+	static std::mutex lock;
+	static std::list<std::pair<uint64_t, Spectrum>> cache;
+
+	uint64_t key = spectrum_key(mask, layout, correlate);
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for(auto it = cache.begin(); it != cache.end(); ++it) {
+			if(it->first == key) {
+				cache.splice(cache.begin(), cache, it);
+				return it->second;
+			}
+		}
+	}
+
+	Spectrum spectrum = compute_spectrum(mask, layout, correlate);
+
+	std::lock_guard<std::mutex> guard(lock);
+	cache.emplace_front(key, spectrum);
+	if(cache.size() > CACHED_SPECTRA) {
+		cache.pop_back();
+	}
+	return spectrum;
+}
+
+}
+
+
+namespace ImageOps {
+
+using Fft::Complex;
+
+static inline uint8_t round_to_byte(double v) {
+	return (uint8_t)std::min(std::max((int)round(v), 0), 255);
+}
+
+// Column x - d of a row, what the border gives outside 0..w-1
+static inline double border_sample(const uint8_t* line, size_t step, int w, int x, ConvolutionBorder border) {
+	if(x < 0 || x >= w) {
+		if(border == CLAMP_TO_0) {
+			return 0;
+		}
+		x = x < 0 ? 0 : w - 1;
+	}
+	return line[x * step];
+}
+
+// The row taps into a double buffer, then the column taps out of it. Clamping
+// both passes is the same as clamping the 2D position.
+static void convolve_separable(const ImageView& src, const ImageView& dst, int channel, const std::vector<double>& column,
+	const std::vector<double>& row, int cr, int cc, ConvolutionBorder border) {
+	int w = src.w, h = src.h, kw = (int)row.size(), kh = (int)column.size();
+	size_t step = src.pixel_step();
+	std::vector<double> tmp((size_t)w * h);
+
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < h; ++y) {
+		const uint8_t* line = src.channel_start(channel) + y * src.stride;
+		double* acc = &tmp[(size_t)y * w];
+		for(int x = 0; x < w; ++x) {
+			acc[x] = 0;
+		}
+		for(int j = 0; j < kw; ++j) {
+			double k = row[j];
+			int d = j - cc;
+			// Columns x - d inside the image for x in [left, right)
+			int left = std::min(std::max(d, 0), w), right = std::max(std::min(w + d, w), left);
+			for(int x = 0; x < left; ++x) {
+				acc[x] += k * border_sample(line, step, w, x - d, border);
+			}
+			const uint8_t* shifted = line - (long)d * (long)step;
+			for(int x = left; x < right; ++x) {
+				acc[x] += k * shifted[x * step];
+			}
+			for(int x = right; x < w; ++x) {
+				acc[x] += k * border_sample(line, step, w, x - d, border);
+			}
+		}
+	}
+
+	#pragma omp parallel
+	{
+		std::vector<double> acc(w);
+		#pragma omp for schedule(static)
+		for(int y = 0; y < h; ++y) {
+			std::fill(acc.begin(), acc.end(), 0.0);
+			for(int i = 0; i < kh; ++i) {
+				int sy = y - (i - cr);
+				if(sy < 0 || sy >= h) {
+					if(border == CLAMP_TO_0) {
+						continue;
+					}
+					sy = sy < 0 ? 0 : h - 1;
+				}
+				double k = column[i];
+				const double* in = &tmp[(size_t)sy * w];
+				#pragma omp simd
+				for(int x = 0; x < w; ++x) {
+					acc[x] += k * in[x];
+				}
+			}
+			uint8_t* out = dst.channel_start(channel) + y * dst.stride;
+			for(int x = 0; x < w; ++x) {
+				out[x * step] = round_to_byte(acc[x]);
+			}
+		}
+	}
+}
+
+// Two channels per transform, one as the real and one as the imaginary part.
+// The mask is real, so its spectrum scales both halves alike and they come
+// back apart.
+static void convolve_fft(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask, ConvolutionBorder border) {
+	int w = src.w, h = src.h;
+	Convolution::FftLayout l = Convolution::layout(w, h, mask, false);
+	auto spectrum = Convolution::mask_spectrum(mask, l, false);
+	std::vector<Complex> data((size_t)l.W * l.H), work(data.size());
+	size_t step = src.pixel_step();
+
+	for(int c0 = 0; c0 < src.channels; c0 += 2) {
+		int c1 = c0 + 1 < src.channels ? c0 + 1 : -1;
+
+		#pragma omp parallel for schedule(static)
+		for(int y = 0; y < l.H; ++y) {
+			int sy = y - l.oy;
+			bool outside = sy < 0 || sy >= h;
+			if(outside && border == CLAMP_TO_BORDER) {
+				sy = sy < 0 ? 0 : h - 1;
+				outside = false;
+			}
+			Complex* line = &data[(size_t)y * l.W];
+			if(outside) {
+				std::fill(line, line + l.W, Complex(0, 0));
+				continue;
+			}
+			const uint8_t* a = src.channel_start(c0) + sy * src.stride;
+			const uint8_t* b = c1 < 0 ? NULL : src.channel_start(c1) + sy * src.stride;
+			for(int x = 0; x < l.W; ++x) {
+				int sx = x - l.ox;
+				line[x] = Complex(border_sample(a, step, w, sx, border), b ? border_sample(b, step, w, sx, border) : 0);
+			}
+		}
+
+		Fft::transform_2d(data.data(), work.data(), l.W, l.H);
+		const Complex* m = spectrum->data();
+		#pragma omp parallel for schedule(static)
+		for(size_t i = 0; i < data.size(); ++i) {
+			data[i] *= m[i];
+		}
+		Fft::inverse_2d(data.data(), work.data(), l.W, l.H);
+
+		#pragma omp parallel for schedule(static)
+		for(int y = 0; y < h; ++y) {
+			const Complex* line = &data[(size_t)(y + l.oy) * l.W + l.ox];
+			uint8_t* a = dst.channel_start(c0) + y * dst.stride;
+			uint8_t* b = c1 < 0 ? NULL : dst.channel_start(c1) + y * dst.stride;
+			for(int x = 0; x < w; ++x) {
+				a[x * step] = round_to_byte(line[x].real());
+				if(b) {
+					b[x * step] = round_to_byte(line[x].imag());
+				}
+			}
+		}
+	}
+}
+
+void convolve(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask,
+	ConvolutionBorder border, ConvolutionMethod method) {
+	if(src.w != dst.w || src.h != dst.h || src.channels != dst.channels || src.layout != dst.layout) {
+		printf("convolve needs a destination with the shape and layout of the source\n");
+		return;
+	}
+	if(method == CONVOLVE_AUTO) {
+		method = Convolution::choose(src.w, src.h, mask);
+	}
+
+	std::vector<double> column, row;
+	if(method == CONVOLVE_SEPARABLE && !Convolution::separable(mask, column, row)) {
+		printf("convolve: mask is not separable, filtering directly\n");
+		method = CONVOLVE_DIRECT;
+	}
+
+	switch(method) {
+		case CONVOLVE_SEPARABLE:
+			for(int c = 0; c < src.channels; ++c) {
+				convolve_separable(src, dst, c, column, row, mask->getCenterRow(), mask->getCenterColumn(), border);
+			}
+			break;
+		case CONVOLVE_FFT:
+			convolve_fft(src, dst, mask, border);
+			break;
+		default:
+			for(int c = 0; c < src.channels; ++c) {
+				if(border == CLAMP_TO_0) {
+					std_convolve_clamp_to_0(src, dst, c, mask);
+				}
+				else {
+					std_convolve_clamp_to_border(src, dst, c, mask);
+				}
+			}
+	}
+}
+
+}
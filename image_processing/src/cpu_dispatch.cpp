@@ -0,0 +1,75 @@
+#include "cpu_dispatch.h"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+namespace CpuDispatch {
+
+static const char* NAMES[] = { "sse2", "avx2", "avx512" };
+
+const char* name(CpuIsa isa) {
+	return NAMES[isa];
+}
+
+CpuIsa detected() {
+	static const CpuIsa isa = [] {
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+			return ISA_AVX512;
+		}
+		if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+			return ISA_AVX2;
+		}
+		return ISA_SSE2;
+	}();
+	return isa;
+}
+
+static CpuIsa from_environment() {
+	const char* requested = getenv("IMAGE_CPU_ISA");
+	if(requested == NULL || *requested == '\0') {
+		return detected();
+	}
+	for(int i = ISA_SSE2; i <= ISA_AVX512; ++i) {
+		if(strcmp(requested, NAMES[i]) == 0) {
+			if(i > detected()) {
+				printf("IMAGE_CPU_ISA=%s is not supported by this CPU, using %s\n", requested, name(detected()));
+				return detected();
+			}
+			return (CpuIsa)i;
+		}
+	}
+	printf("Unknown IMAGE_CPU_ISA=%s, expected sse2, avx2 or avx512\n", requested);
+	return detected();
+}
+
+// -1 until the first kernel lookup
+static std::atomic<int> current{-1};
+
+CpuIsa active() {
+	int isa = current.load(std::memory_order_acquire);
+	if(isa < 0) {
+		int expected = -1;
+		current.compare_exchange_strong(expected, from_environment());
+		isa = current.load(std::memory_order_acquire);
+	}
+	return (CpuIsa)isa;
+}
+
+CpuIsa select(CpuIsa isa) {
+	if(isa > detected()) {
+		isa = detected();
+	}
+	current.store(isa, std::memory_order_release);
+	return isa;
+}
+
+const CpuKernels& kernels() {
+	switch(active()) {
+		case ISA_AVX512: return cpu_kernels_avx512();
+		case ISA_AVX2: return cpu_kernels_avx2();
+		default: return cpu_kernels_sse2();
+	}
+}
+
+}
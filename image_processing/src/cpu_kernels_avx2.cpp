@@ -0,0 +1,4 @@
+// CPU kernels built with the AVX2 flags set for this file in CMakeLists.txt and the Makefile
+#define CPU_KERNELS_NAMESPACE cpu_kernels_avx2_impl
+#define CPU_KERNELS_TABLE cpu_kernels_avx2
+#include "cpu_kernels.inc"
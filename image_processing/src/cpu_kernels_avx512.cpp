@@ -0,0 +1,4 @@
+// CPU kernels built with the AVX512 flags set for this file in CMakeLists.txt and the Makefile
+#define CPU_KERNELS_NAMESPACE cpu_kernels_avx512_impl
+#define CPU_KERNELS_TABLE cpu_kernels_avx512
+#include "cpu_kernels.inc"
@@ -0,0 +1,231 @@
+#include "edge_preserving.h"
+#include "mask_factory.h"
+#include <algorithm>
+#include <memory>
+
+namespace EdgePreserving {
+
+int bilateral_radius(double sigma_space) {
+	return (int)std::ceil(sigma_space) * 3;
+}
+
+int guided_radius(double sigma_space) {
+	// A box of half width r spreads like a Gaussian of sigma r / sqrt(3)
+	return std::max(1, (int)std::ceil(sigma_space * std::sqrt(3.0)));
+}
+
+void range_weights(double sigma_range, float lut[256]) {
+	for(int d = 0; d < 256; ++d) {
+		lut[d] = (float)exp(-(double)d * d / (2.0 * sigma_range * sigma_range));
+	}
+}
+
+std::vector<float> spatial_weights(double sigma_space) {
+	std::shared_ptr<const FactoryMask> row = MaskFactory::gaussian(sigma_space, MASK_ROW);
+	if(!row) {
+		return std::vector<float>();
+	}
+	// Normalised, which the bilateral's division by the total weight undoes
+	return std::vector<float>(row->getFloatData(), row->getFloatData() + row->getWidth());
+}
+
+bool valid_args(const ImageView& src, const ImageView& dst, double sigma_space, double sigma_range, const char* op) {
+	if(src.w != dst.w || src.h != dst.h || src.channels != dst.channels || src.layout != dst.layout) {
+		printf("%s needs a destination with the shape and layout of the source\n", op);
+		return false;
+	}
+	if(src.channels > 4) {
+		printf("%s takes at most 4 channels\n", op);
+		return false;
+	}
+	if(sigma_space <= 0 || sigma_range <= 0) {
+		printf("%s needs positive sigmas\n", op);
+		return false;
+	}
+	return true;
+}
+
+}
+
+
+namespace ImageOps {
+
+void bilateral(const ImageView& src, const ImageView& dst, double sigma_space, double sigma_range) {
+	if(!EdgePreserving::valid_args(src, dst, sigma_space, sigma_range, "bilateral")) {
+		return;
+	}
+
+	std::vector<float> spatial = EdgePreserving::spatial_weights(sigma_space);
+	if(spatial.empty()) {
+		return;
+	}
+
+	// Windows read around each pixel, so filtering in place works from a copy
+	std::unique_ptr<Image> copy = unaliased(src, dst);
+	ImageView input = copy ? copy->view() : src;
+
+	int radius = EdgePreserving::bilateral_radius(sigma_space);
+	float lut[256];
+	EdgePreserving::range_weights(sigma_range, lut);
+	int channels = src.channels;
+	size_t step = input.pixel_step();
+	const uint8_t* in[4];
+	uint8_t* out[4];
+	for(int c = 0; c < channels; ++c) {
+		in[c] = input.channel_start(c);
+		out[c] = dst.channel_start(c);
+	}
+
+	#pragma omp parallel for schedule(dynamic, 4)
+	for(int y = 0; y < src.h; ++y) {
+		for(int x = 0; x < src.w; ++x) {
+			size_t center = (size_t)y * input.stride + x * step;
+			float sum[4] = {};
+			float total = 0;
+
+			for(int i = -radius; i <= radius; ++i) {
+				size_t row = (size_t)std::min(std::max(y + i, 0), src.h - 1) * input.stride;
+				float wy = spatial[i + radius];
+				for(int j = -radius; j <= radius; ++j) {
+					size_t at = row + std::min(std::max(x + j, 0), src.w - 1) * step;
+					float weight = wy * spatial[j + radius];
+					for(int c = 0; c < channels; ++c) {
+						weight *= lut[abs(in[c][at] - in[c][center])];
+					}
+					total += weight;
+					for(int c = 0; c < channels; ++c) {
+						sum[c] += weight * in[c][at];
+					}
+				}
+			}
+
+			// The centre's own weight is 1, so total is never 0
+			for(int c = 0; c < channels; ++c) {
+				out[c][(size_t)y * dst.stride + x * dst.pixel_step()] = (uint8_t)std::min(sum[c] / total + 0.5f, 255.0f);
+			}
+		}
+	}
+}
+
+// Mean over the (2 radius + 1)^2 box around each value of a w x h plane,
+// clipped to the plane. Running sums along rows into tmp, then down columns
+// back into data, in double so long rows don't drift.
+static void box_mean(float* data, float* tmp, int w, int h, int radius) {
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < h; ++y) {
+		const float* in = data + (size_t)y * w;
+		float* out = tmp + (size_t)y * w;
+		double sum = 0;
+		for(int x = 0; x <= std::min(radius, w - 1); ++x) {
+			sum += in[x];
+		}
+		for(int x = 0; x < w; ++x) {
+			out[x] = (float)(sum / (std::min(x + radius, w - 1) - std::max(x - radius, 0) + 1));
+			if(x + radius + 1 < w) {
+				sum += in[x + radius + 1];
+			}
+			if(x - radius >= 0) {
+				sum -= in[x - radius];
+			}
+		}
+	}
+
+	// Strips of columns, each a row of running sums moved down the plane
+	const int strip = 256;
+	#pragma omp parallel for schedule(static)
+	for(int x0 = 0; x0 < w; x0 += strip) {
+		int n = std::min(strip, w - x0);
+		std::vector<double> sum(n, 0.0);
+		for(int y = 0; y <= std::min(radius, h - 1); ++y) {
+			const float* in = tmp + (size_t)y * w + x0;
+			for(int x = 0; x < n; ++x) {
+				sum[x] += in[x];
+			}
+		}
+		for(int y = 0; y < h; ++y) {
+			double count = std::min(y + radius, h - 1) - std::max(y - radius, 0) + 1;
+			float* out = data + (size_t)y * w + x0;
+			for(int x = 0; x < n; ++x) {
+				out[x] = (float)(sum[x] / count);
+			}
+			if(y + radius + 1 < h) {
+				const float* in = tmp + (size_t)(y + radius + 1) * w + x0;
+				for(int x = 0; x < n; ++x) {
+					sum[x] += in[x];
+				}
+			}
+			if(y - radius >= 0) {
+				const float* in = tmp + (size_t)(y - radius) * w + x0;
+				for(int x = 0; x < n; ++x) {
+					sum[x] -= in[x];
+				}
+			}
+		}
+	}
+}
+
+void guided(const ImageView& src, const ImageView& guide, const ImageView& dst, double sigma_space, double sigma_range) {
+	if(!EdgePreserving::valid_args(src, dst, sigma_space, sigma_range, "guided")) {
+		return;
+	}
+	if(guide.w != src.w || guide.h != src.h || (guide.channels != 1 && guide.channels != src.channels)) {
+		printf("guided needs a guide of the source's size with one channel or as many as the source\n");
+		return;
+	}
+
+	int w = src.w, h = src.h, radius = EdgePreserving::guided_radius(sigma_space);
+	float eps = (float)(sigma_range * sigma_range);
+	size_t n = (size_t)w * h;
+	// Means of I, p, I p and I I, then of a and b in the first two
+	std::vector<float> mean_i(n), mean_p(n), mean_ip(n), mean_ii(n), tmp(n);
+
+	for(int c = 0; c < src.channels; ++c) {
+		const uint8_t* p_start = src.channel_start(c);
+		const uint8_t* i_start = guide.channel_start(guide.channels == 1 ? 0 : c);
+		size_t p_step = src.pixel_step(), i_step = guide.pixel_step();
+
+		#pragma omp parallel for schedule(static)
+		for(int y = 0; y < h; ++y) {
+			const uint8_t* p = p_start + (size_t)y * src.stride;
+			const uint8_t* g = i_start + (size_t)y * guide.stride;
+			for(int x = 0; x < w; ++x) {
+				float vi = g[x * i_step], vp = p[x * p_step];
+				size_t k = (size_t)y * w + x;
+				mean_i[k] = vi;
+				mean_p[k] = vp;
+				mean_ip[k] = vi * vp;
+				mean_ii[k] = vi * vi;
+			}
+		}
+		box_mean(mean_i.data(), tmp.data(), w, h, radius);
+		box_mean(mean_p.data(), tmp.data(), w, h, radius);
+		box_mean(mean_ip.data(), tmp.data(), w, h, radius);
+		box_mean(mean_ii.data(), tmp.data(), w, h, radius);
+
+		#pragma omp parallel for schedule(static)
+		for(size_t k = 0; k < n; ++k) {
+			float variance = mean_ii[k] - mean_i[k] * mean_i[k];
+			float covariance = mean_ip[k] - mean_i[k] * mean_p[k];
+			float a = covariance / (variance + eps);
+			mean_p[k] = mean_p[k] - a * mean_i[k];
+			mean_i[k] = a;
+		}
+		box_mean(mean_i.data(), tmp.data(), w, h, radius);
+		box_mean(mean_p.data(), tmp.data(), w, h, radius);
+
+		// dst may be src or the guide, both were last read above
+		uint8_t* q_start = dst.channel_start(c);
+		#pragma omp parallel for schedule(static)
+		for(int y = 0; y < h; ++y) {
+			const uint8_t* g = i_start + (size_t)y * guide.stride;
+			uint8_t* q = q_start + (size_t)y * dst.stride;
+			for(int x = 0; x < w; ++x) {
+				size_t k = (size_t)y * w + x;
+				float value = mean_i[k] * g[x * i_step] + mean_p[k];
+				q[x * dst.pixel_step()] = (uint8_t)std::min(std::max(value + 0.5f, 0.0f), 255.0f);
+			}
+		}
+	}
+}
+
+}
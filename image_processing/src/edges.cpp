@@ -0,0 +1,135 @@
+#include "edges.h"
+#include <algorithm>
+
+namespace Edges {
+
+bool single_channel(const ImageView& src, const ImageView& dst, const char* op) {
+	if(src.channels != 1 || dst.channels != 1 || src.w != dst.w || src.h != dst.h) {
+		printf("%s takes a single channel source and a destination of its size\n", op);
+		return false;
+	}
+	return true;
+}
+
+bool valid_thresholds(int low, int high, const char* op) {
+	if(low < 0 || high < low) {
+		printf("%s needs 0 <= low <= high, got %d and %d\n", op, low, high);
+		return false;
+	}
+	return true;
+}
+
+}
+
+
+namespace ImageOps {
+
+// Neighbours compared across the edge for each GradientDirection, the first
+// one must be strictly smaller so a flat ridge keeps one pixel
+static const int ACROSS[4][4] = {
+	{ -1, 0, 1, 0 },
+	{ -1, -1, 1, 1 },
+	{ 0, -1, 0, 1 },
+	{ 1, -1, -1, 1 },
+};
+
+// Squared magnitude and direction of every pixel
+static void gradients(const ImageView& src, std::vector<int>& magnitude2, std::vector<uint8_t>& direction) {
+	int w = src.w, h = src.h;
+	magnitude2.resize((size_t)w * h);
+	direction.resize((size_t)w * h);
+
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < h; ++y) {
+		const uint8_t* up = src.row(std::max(y - 1, 0));
+		const uint8_t* mid = src.row(y);
+		const uint8_t* down = src.row(std::min(y + 1, h - 1));
+		for(int x = 0; x < w; ++x) {
+			int l = std::max(x - 1, 0), r = std::min(x + 1, w - 1);
+			int gx = (up[r] + 2 * mid[r] + down[r]) - (up[l] + 2 * mid[l] + down[l]);
+			int gy = (down[l] + 2 * down[x] + down[r]) - (up[l] + 2 * up[x] + up[r]);
+			magnitude2[(size_t)y * w + x] = gx * gx + gy * gy;
+			direction[(size_t)y * w + x] = (uint8_t)Edges::direction(gx, gy);
+		}
+	}
+}
+
+void sobel(const ImageView& src, const ImageView& magnitude, const ImageView& orientation) {
+	if(!Edges::single_channel(src, magnitude, "sobel") || (orientation.data && !Edges::single_channel(src, orientation, "sobel"))) {
+		return;
+	}
+
+	std::vector<int> magnitude2;
+	std::vector<uint8_t> direction;
+	gradients(src, magnitude2, direction);
+
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < src.h; ++y) {
+		uint8_t* out = magnitude.row(y);
+		for(int x = 0; x < src.w; ++x) {
+			out[x] = (uint8_t)std::min((int)lround(sqrt((double)magnitude2[(size_t)y * src.w + x])), 255);
+		}
+		if(orientation.data) {
+			std::copy(&direction[(size_t)y * src.w], &direction[(size_t)(y + 1) * src.w], orientation.row(y));
+		}
+	}
+}
+
+void canny(const ImageView& src, const ImageView& dst, int low, int high) {
+	if(!Edges::single_channel(src, dst, "canny") || !Edges::valid_thresholds(low, high, "canny")) {
+		return;
+	}
+
+	int w = src.w, h = src.h;
+	std::vector<int> magnitude2;
+	std::vector<uint8_t> direction;
+	gradients(src, magnitude2, direction);
+
+	// 2 for edges, 1 for candidates. Neighbours outside the image count as 0.
+	std::vector<uint8_t> label((size_t)w * h);
+	int low2 = low * low, high2 = high * high;
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < h; ++y) {
+		for(int x = 0; x < w; ++x) {
+			size_t k = (size_t)y * w + x;
+			int m = magnitude2[k];
+			const int* across = ACROSS[direction[k]];
+			int ax = x + across[0], ay = y + across[1], bx = x + across[2], by = y + across[3];
+			int a = ax >= 0 && ax < w && ay >= 0 && ay < h ? magnitude2[(size_t)ay * w + ax] : 0;
+			int b = bx >= 0 && bx < w && by >= 0 && by < h ? magnitude2[(size_t)by * w + bx] : 0;
+			bool peak = m > a && m >= b;
+			label[k] = !peak || m < low2 ? 0 : m >= high2 ? 2 : 1;
+		}
+	}
+
+	// Hysteresis: candidates connected to an edge become edges
+	std::vector<size_t> stack;
+	for(size_t k = 0; k < label.size(); ++k) {
+		if(label[k] == 2) {
+			stack.push_back(k);
+		}
+	}
+	while(!stack.empty()) {
+		size_t k = stack.back();
+		stack.pop_back();
+		int x = (int)(k % w), y = (int)(k / w);
+		for(int ny = std::max(y - 1, 0); ny <= std::min(y + 1, h - 1); ++ny) {
+			for(int nx = std::max(x - 1, 0); nx <= std::min(x + 1, w - 1); ++nx) {
+				size_t n = (size_t)ny * w + nx;
+				if(label[n] == 1) {
+					label[n] = 2;
+					stack.push_back(n);
+				}
+			}
+		}
+	}
+
+	for(int y = 0; y < h; ++y) {
+		uint8_t* out = dst.row(y);
+		for(int x = 0; x < w; ++x) {
+			out[x] = label[(size_t)y * w + x] == 2 ? 255 : 0;
+		}
+	}
+}
+
+}
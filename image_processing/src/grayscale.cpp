@@ -0,0 +1,55 @@
+#include "image.h"
+#include "cpu_dispatch.h"
+#include <vector>
+
+namespace ImageOps {
+
+void grayscale(const ImageView& src, const ImageView& dst, GrayWeights weights) {
+	if(src.channels < 3) {
+		printf("Image %p has less than 3 channels, it is assumed to already be grayscale.", src.data);
+		return;
+	}
+	bool compact = dst.channels == 1;
+	if(src.w != dst.w || src.h != dst.h || (!compact && (dst.channels != src.channels || dst.layout != src.layout))) {
+		printf("grayscale needs a 1 channel destination or one with the shape and layout of the source\n");
+		return;
+	}
+
+	size_t step = src.pixel_step();
+	size_t plane = src.layout == PLANAR ? src.plane_pitch : 0;
+	auto gray_row = CpuDispatch::kernels().gray_row;
+
+	// The hardware thread count, OpenMP's default
+	#pragma omp parallel
+	{
+		std::vector<uint8_t> buffer(compact ? 0 : src.w);
+
+		#pragma omp for schedule(static)
+		for(int y = 0; y < src.h; ++y) {
+			const uint8_t* in = src.row(y);
+			uint8_t* gray = compact ? dst.row(y) : buffer.data();
+			gray_row(in, step, plane, src.w, gray, weights);
+
+			if(compact) {
+				continue;
+			}
+			// Gray into the first three channels, anything past them copied
+			for(int c = 0; c < src.channels; ++c) {
+				uint8_t* out = dst.channel_start(c) + y * dst.stride;
+				if(c < 3) {
+					for(int i = 0; i < src.w; ++i) {
+						out[i * step] = gray[i];
+					}
+				}
+				else if(src.data != dst.data) {
+					const uint8_t* extra = src.channel_start(c) + y * src.stride;
+					for(int i = 0; i < src.w; ++i) {
+						out[i * step] = extra[i * step];
+					}
+				}
+			}
+		}
+	}
+}
+
+}
@@ -0,0 +1,229 @@
+#include "histogram.h"
+#include <algorithm>
+#include <cstring>
+
+namespace Histogram {
+
+uint32_t clip_q16_of(double clip_limit) {
+	return (uint32_t)std::min(std::max(clip_limit, 0.0) * 65536.0 + 0.5, 4294967295.0);
+}
+
+void equalize_lut(const uint32_t* hist, size_t pixels, uint8_t* lut) {
+	uint64_t cdf_min = 0;
+	for(int v = 0; v < 256 && cdf_min == 0; ++v) {
+		cdf_min = hist[v];
+	}
+	if(pixels <= cdf_min) {
+		// A single value, nothing to spread
+		for(int v = 0; v < 256; ++v) {
+			lut[v] = (uint8_t)v;
+		}
+		return;
+	}
+
+	uint64_t range = pixels - cdf_min;
+	uint64_t cdf = 0;
+	for(int v = 0; v < 256; ++v) {
+		cdf += hist[v];
+		lut[v] = cdf < cdf_min ? 0 : (uint8_t)(((cdf - cdf_min) * 255 + range / 2) / range);
+	}
+}
+
+void clahe_lut(uint32_t* hist, size_t pixels, double clip_limit, uint8_t* lut) {
+	if(pixels == 0) {
+		for(int v = 0; v < 256; ++v) {
+			lut[v] = (uint8_t)v;
+		}
+		return;
+	}
+
+	// Clip the peaks and hand what was cut off back to every bin evenly. The
+	// limit goes through 16.16 fixed point the same way the device computes it
+	uint64_t clip_q16 = clip_q16_of(clip_limit);
+	uint32_t limit = std::max<uint32_t>(1, (uint32_t)((clip_q16 * pixels) >> 24));
+	uint32_t excess = 0;
+	for(int v = 0; v < 256; ++v) {
+		if(hist[v] > limit) {
+			excess += hist[v] - limit;
+			hist[v] = limit;
+		}
+	}
+	uint32_t bonus = excess / 256, rest = excess % 256;
+	for(int v = 0; v < 256; ++v) {
+		hist[v] += bonus + (v < (int)rest ? 1 : 0);
+	}
+
+	uint64_t cdf = 0;
+	for(int v = 0; v < 256; ++v) {
+		cdf += hist[v];
+		lut[v] = (uint8_t)std::min<uint64_t>(255, (cdf * 255 + pixels / 2) / pixels);
+	}
+}
+
+}
+
+
+namespace ImageOps {
+
+static bool same_shape(const ImageView& src, const ImageView& dst, const char* op) {
+	if(src.w != dst.w || src.h != dst.h || src.channels != dst.channels || src.layout != dst.layout) {
+		printf("%s needs a destination with the shape and layout of the source\n", op);
+		return false;
+	}
+	return true;
+}
+
+void histogram(const ImageView& src, uint32_t* hist) {
+	int channels = src.channels;
+	memset(hist, 0, (size_t)channels * 256 * sizeof(uint32_t));
+	if(channels > 4) {
+		printf("histogram supports up to 4 channels\n");
+		return;
+	}
+
+	#pragma omp parallel
+	{
+		// Four copies per thread, neighbouring samples of the same value land
+		// in different counters so the increments do not wait on each other
+		uint32_t local[4][4][256];
+		memset(local, 0, sizeof(local));
+
+		#pragma omp for schedule(static)
+		for(int y = 0; y < src.h; ++y) {
+			if(src.layout == PLANAR) {
+				for(int c = 0; c < channels; ++c) {
+					const uint8_t* p = src.row(y, c);
+					for(int x = 0; x < src.w; ++x) {
+						++local[x & 3][c][p[x]];
+					}
+				}
+			}
+			else {
+				const uint8_t* p = src.row(y);
+				for(int x = 0; x < src.w; ++x) {
+					for(int c = 0; c < channels; ++c) {
+						++local[x & 3][c][p[x * channels + c]];
+					}
+				}
+			}
+		}
+
+		#pragma omp critical
+		for(int c = 0; c < channels; ++c) {
+			for(int v = 0; v < 256; ++v) {
+				hist[c * 256 + v] += local[0][c][v] + local[1][c][v] + local[2][c][v] + local[3][c][v];
+			}
+		}
+	}
+}
+
+void apply_lut(const ImageView& src, const ImageView& dst, const uint8_t* lut) {
+	if(!same_shape(src, dst, "apply_lut")) {
+		return;
+	}
+	size_t step = src.pixel_step();
+
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < src.h; ++y) {
+		for(int c = 0; c < src.channels; ++c) {
+			const uint8_t* in = src.channel_start(c) + y * src.stride;
+			uint8_t* out = dst.channel_start(c) + y * dst.stride;
+			const uint8_t* map = lut + c * 256;
+			for(int x = 0; x < src.w; ++x) {
+				out[x * step] = map[in[x * step]];
+			}
+		}
+	}
+}
+
+void equalize(const ImageView& src, const ImageView& dst) {
+	if(!same_shape(src, dst, "equalize") || src.channels > 4) {
+		return;
+	}
+	uint32_t hist[4 * 256];
+	uint8_t lut[4 * 256];
+	histogram(src, hist);
+	for(int c = 0; c < src.channels; ++c) {
+		Histogram::equalize_lut(hist + c * 256, (size_t)src.w * src.h, lut + c * 256);
+	}
+	apply_lut(src, dst, lut);
+}
+
+// Where a pixel sits between tile centres: the lower and upper tile and the
+// weight of the upper one in 1/256ths. Integer only so the device agrees exactly.
+static void tile_axis(int x, int size, int tiles, int& t0, int& t1, int& a) {
+	long num = (long)(2 * x + 1) * tiles - size;
+	if(num <= 0) {
+		t0 = t1 = 0;
+		a = 0;
+		return;
+	}
+	long g = num * 256 / (2L * size);
+	t0 = (int)(g >> 8);
+	a = (int)(g & 255);
+	if(t0 >= tiles - 1) {
+		t0 = t1 = tiles - 1;
+		a = 0;
+		return;
+	}
+	t1 = t0 + 1;
+}
+
+void clahe(const ImageView& src, const ImageView& dst, int tiles_x, int tiles_y, double clip_limit) {
+	if(!same_shape(src, dst, "clahe") || src.channels > 4) {
+		return;
+	}
+	int w = src.w, h = src.h, channels = src.channels;
+	tiles_x = std::min(std::max(tiles_x, 1), w);
+	tiles_y = std::min(std::max(tiles_y, 1), h);
+	size_t step = src.pixel_step();
+
+	// One mapping per tile and channel
+	std::vector<uint8_t> luts((size_t)tiles_x * tiles_y * channels * 256);
+
+	#pragma omp parallel for collapse(2) schedule(dynamic)
+	for(int ty = 0; ty < tiles_y; ++ty) {
+		for(int tx = 0; tx < tiles_x; ++tx) {
+			int x0 = tx * w / tiles_x, x1 = (tx + 1) * w / tiles_x;
+			int y0 = ty * h / tiles_y, y1 = (ty + 1) * h / tiles_y;
+			for(int c = 0; c < channels; ++c) {
+				uint32_t hist[256] = {};
+				for(int y = y0; y < y1; ++y) {
+					const uint8_t* p = src.channel_start(c) + y * src.stride;
+					for(int x = x0; x < x1; ++x) {
+						++hist[p[x * step]];
+					}
+				}
+				uint8_t* lut = &luts[(((size_t)ty * tiles_x + tx) * channels + c) * 256];
+				Histogram::clahe_lut(hist, (size_t)(x1 - x0) * (y1 - y0), clip_limit, lut);
+			}
+		}
+	}
+
+	std::vector<int> tx0(w), tx1(w), ax(w);
+	for(int x = 0; x < w; ++x) {
+		tile_axis(x, w, tiles_x, tx0[x], tx1[x], ax[x]);
+	}
+
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < h; ++y) {
+		int ty0, ty1, ay;
+		tile_axis(y, h, tiles_y, ty0, ty1, ay);
+		for(int c = 0; c < channels; ++c) {
+			const uint8_t* in = src.channel_start(c) + y * src.stride;
+			uint8_t* out = dst.channel_start(c) + y * dst.stride;
+			for(int x = 0; x < w; ++x) {
+				int v = in[x * step];
+				int top_left = luts[(((size_t)ty0 * tiles_x + tx0[x]) * channels + c) * 256 + v];
+				int top_right = luts[(((size_t)ty0 * tiles_x + tx1[x]) * channels + c) * 256 + v];
+				int bottom_left = luts[(((size_t)ty1 * tiles_x + tx0[x]) * channels + c) * 256 + v];
+				int bottom_right = luts[(((size_t)ty1 * tiles_x + tx1[x]) * channels + c) * 256 + v];
+				int top = top_left * (256 - ax[x]) + top_right * ax[x];
+				int bottom = bottom_left * (256 - ax[x]) + bottom_right * ax[x];
+				out[x * step] = (uint8_t)((top * (256 - ay) + bottom * ay + 32768) >> 16);
+			}
+		}
+	}
+}
+
+}
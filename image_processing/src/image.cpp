@@ -2,12 +2,71 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #define BYTE_BOUND(value) std::min(std::max((value), 0), 255)
 
+#include "image_allocator.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+// While Image::read decodes, stb's buffers come from the image's allocator
+// and their sizes are kept for deallocate. The decoded pixels are then
+// adopted as they are, and a stream of same sized frames recycles stb's
+// working buffers too. Outside read, stb uses the plain heap.
+struct StbAllocations {
+	ImageAllocator* allocator;
+	std::unordered_map<void*, size_t> sizes;
+};
+static thread_local StbAllocations* stb_allocations = NULL;
+
+static void* stb_malloc(size_t bytes) {
+	if(stb_allocations == NULL) {
+		return malloc(bytes);
+	}
+	uint8_t* data = stb_allocations->allocator->allocate(bytes);
+	stb_allocations->sizes[data] = bytes;
+	return data;
+}
+
+static void stb_free(void* data) {
+	if(stb_allocations == NULL || data == NULL) {
+		free(data);
+		return;
+	}
+	auto it = stb_allocations->sizes.find(data);
+	stb_allocations->allocator->deallocate((uint8_t*)data, it->second);
+	stb_allocations->sizes.erase(it);
+}
+
+static void* stb_realloc(void* data, size_t bytes) {
+	if(stb_allocations == NULL) {
+		return realloc(data, bytes);
+	}
+	void* grown = stb_malloc(bytes);
+	if(data != NULL) {
+		memcpy(grown, data, std::min(bytes, stb_allocations->sizes[data]));
+		stb_free(data);
+	}
+	return grown;
+}
+
+#define STBI_MALLOC(bytes) stb_malloc(bytes)
+#define STBI_REALLOC(data, bytes) stb_realloc(data, bytes)
+#define STBI_FREE(data) stb_free(data)
+
 #include "stb_image.h"
 #include "stb_image_write.h"
 
 #include "image.h"
-
-Image::Image(const char* filename, int channel_force) {
+#include "raw_image.h"
+#include "cpu_dispatch.h"
+#include "rank.h"
+#include "morphology.h"
+#include "edge_preserving.h"
+#include "edges.h"
+#include "unsharp.h"
+#include <tmmintrin.h>
+
+Image::Image(const char* filename, int channel_force, ImageAllocator* allocator) : allocator(allocator) {
 	if(read(filename, channel_force)) {
 		printf("Read %s\n", filename);
 		size = w*h*channels;
@@ -17,27 +76,147 @@ Image::Image(const char* filename, int channel_force) {
 	}
 }
 
-Image::Image(int w, int h, int channels) : w(w), h(h), channels(channels) {
+Image::Image(int w, int h, int channels, ImageAllocator* allocator) : w(w), h(h), channels(channels), allocator(allocator) {
 	size = w*h*channels;
-	data = new uint8_t[size];
+	capacity = size;
+	data = allocator->allocate(size);
+}
+
+Image::Image(const ImageView& view, ImageAllocator* allocator) : Image(view.w, view.h, view.channels, allocator) {
+	layout = view.layout;
+	view.copy_to(this->view());
+}
+
+Image::Image(Image&& img) noexcept
+	: data(img.data), size(img.size), w(img.w), h(img.h), channels(img.channels), layout(img.layout),
+	allocator(img.allocator), capacity(img.capacity), map_base(img.map_base), map_length(img.map_length) {
+	img.data = NULL;
+	img.size = 0;
+	img.capacity = 0;
+	img.map_base = NULL;
+	img.map_length = 0;
+}
+
+Image& Image::operator=(Image&& img) noexcept {
+	if(this != &img) {
+		free_data();
+		data = img.data;
+		size = img.size;
+		w = img.w;
+		h = img.h;
+		channels = img.channels;
+		layout = img.layout;
+		allocator = img.allocator;
+		capacity = img.capacity;
+		map_base = img.map_base;
+		map_length = img.map_length;
+
+		img.data = NULL;
+		img.size = 0;
+		img.capacity = 0;
+		img.map_base = NULL;
+		img.map_length = 0;
+	}
+	return *this;
 }
 
-Image::Image(const Image& img) : Image(img.w, img.h, img.channels) {
-	memcpy(data, img.data, size);
+Image Image::clone(ImageAllocator* allocator) const {
+	Image copy(w, h, channels, allocator);
+	copy.layout = layout;
+	memcpy(copy.data, data, size);
+	return copy;
 }
 
 Image::~Image() {
-	stbi_image_free(data);
+	free_data();
+}
+
+void Image::free_data() {
+	if(map_base != NULL) {
+		RawImage::Mapping mapping;
+		mapping.base = map_base;
+		mapping.length = map_length;
+		RawImage::unmap(mapping);
+		map_base = NULL;
+		map_length = 0;
+	}
+	else if(data != NULL) {
+		allocator->deallocate(data, capacity);
+	}
+	data = NULL;
+	capacity = 0;
+}
+
+void Image::replace_data(uint8_t* buffer, size_t bytes) {
+	free_data();
+	data = buffer;
+	capacity = bytes;
 }
 
 bool Image::read(const char* filename, int channel_force) {
-	data = stbi_load(filename, &w, &h, &channels, channel_force);
+	if(get_file_type(filename) == RAW) {
+		return read_raw(filename, channel_force);
+	}
+	StbAllocations allocations = { allocator, {} };
+	stb_allocations = &allocations;
+	uint8_t* decoded = stbi_load(filename, &w, &h, &channels, channel_force);
+	stb_allocations = NULL;
+	if(decoded == NULL) {
+		return false;
+	}
 	channels = channel_force == 0 ? channels : channel_force;
-	return data != NULL;
+
+	// Already in the allocator's storage, capacity is what stb asked for
+	data = decoded;
+	capacity = allocations.sizes[decoded];
+	return true;
+}
+
+bool Image::read_raw(const char* filename, int channel_force) {
+	RawImage::Mapping mapping;
+	if(!RawImage::map(filename, mapping)) {
+		return false;
+	}
+
+	const RawImage::Header& header = mapping.header;
+	if(channel_force != 0 && channel_force != (int)header.channels) {
+		printf("%s has %u channels, cannot force %d\n", filename, header.channels, channel_force);
+		RawImage::unmap(mapping);
+		return false;
+	}
+
+	w = header.w;
+	h = header.h;
+	channels = header.channels;
+	layout = header.layout == RawImage::PLANAR ? PLANAR : INTERLEAVED;
+	size_t row_bytes = row_stride();
+	size_t rows = layout == PLANAR ? (size_t)h * channels : (size_t)h;
+
+	if(header.stride == row_bytes) {
+		// Zero copy, the image borrows the mapped pages
+		data = mapping.pixels;
+		map_base = mapping.base;
+		map_length = mapping.length;
+		return true;
+	}
+
+	// Padded rows, repack into a dense buffer
+	capacity = row_bytes * rows;
+	data = allocator->allocate(capacity);
+	for(size_t y = 0; y < rows; ++y) {
+		memcpy(data + y * row_bytes, mapping.pixels + y * header.stride, row_bytes);
+	}
+	RawImage::unmap(mapping);
+	return true;
 }
 
-bool Image::write(const char* filename) {
+bool Image::write(const char* filename, int jpg_quality) const {
 	ImageType type = get_file_type(filename);
+	if(layout == PLANAR && type != RAW) {
+		// stb only writes interleaved pixels
+		Image interleaved = clone();
+		return interleaved.to_interleaved_cpu().write(filename, jpg_quality);
+	}
 	int success;
   switch (type) {
     case PNG:
@@ -47,11 +226,15 @@ bool Image::write(const char* filename) {
       success = stbi_write_bmp(filename, w, h, channels, data);
       break;
     case JPG:
-      success = stbi_write_jpg(filename, w, h, channels, data, 100);
+      success = stbi_write_jpg(filename, w, h, channels, data, jpg_quality);
       break;
 	case JPEG:
-		success = stbi_write_jpg(filename, w, h, channels, data, 100);
+		success = stbi_write_jpg(filename, w, h, channels, data, jpg_quality);
       	break;
+	case RAW:
+		success = RawImage::write(filename, data, w, h, channels, row_stride(),
+			layout == PLANAR ? RawImage::PLANAR : RawImage::INTERLEAVED);
+		break;
 
   }
   if(success != 0) {
@@ -64,7 +247,7 @@ bool Image::write(const char* filename) {
   }
 }
 
-ImageType Image::get_file_type(const char* filename) {
+ImageType Image::get_file_type(const char* filename) const {
 	const char* ext = strrchr(filename, '.');
 	if(ext != nullptr) {
 		if(strcmp(ext, ".png") == 0) {
@@ -79,271 +262,717 @@ ImageType Image::get_file_type(const char* filename) {
 		else if(strcmp(ext, ".jpeg") == 0) {
 			return JPEG;
 		}
+		else if(strcmp(ext, ".rimg") == 0) {
+			return RAW;
+		}
 		
 	}
 	return PNG;
 }
 
-Image& Image::grayscale_avg_cpu() {
-	if(channels < 3) {
-		printf("Image %p has less than 3 channels, it is assumed to already be grayscale.", this);
+// pshufb masks for 16 pixels of 2-4 channels. deinterleave[c][j] pulls the
+// bytes of channel c out of interleaved chunk j, interleave[j][c] places plane
+// c into interleaved chunk j. -128 zeroes the lane so partial results can be or'ed.
+struct ShuffleMasks {
+	alignas(16) int8_t deinterleave[4][4][16];
+	alignas(16) int8_t interleave[4][4][16];
+
+	explicit ShuffleMasks(int channels) {
+		for(int c = 0; c < channels; ++c) {
+			for(int j = 0; j < channels; ++j) {
+				for(int k = 0; k < 16; ++k) {
+					int src = k * channels + c;
+					deinterleave[c][j][k] = src / 16 == j ? src % 16 : -128;
+					int dst = j * 16 + k;
+					interleave[j][c][k] = dst % channels == c ? dst / channels : -128;
+				}
+			}
+		}
 	}
-	else {
-		#pragma omp parallel for num_threads(4) schedule(static)
-		for(int i = 0; i < size; i+=channels) {
-			//(r+g+b)/3
-			int gray = (data[i] + data[i+1] + data[i+2])/3;
-			memset(data+i, gray, 3);
+};
+
+static const ShuffleMasks& shuffle_masks(int channels) {
+	static const ShuffleMasks masks[3] = { ShuffleMasks(2), ShuffleMasks(3), ShuffleMasks(4) };
+	return masks[channels - 2];
+}
+
+static bool has_ssse3() {
+	static const bool supported = __builtin_cpu_supports("ssse3");
+	return supported;
+}
+
+__attribute__((target("ssse3")))
+static int deinterleave_row_ssse3(const uint8_t* src, uint8_t* const* dst, int w, int channels) {
+	const ShuffleMasks& m = shuffle_masks(channels);
+	int x = 0;
+	for(; x + 16 <= w; x += 16) {
+		__m128i chunk[4];
+		for(int j = 0; j < channels; ++j) {
+			chunk[j] = _mm_loadu_si128((const __m128i*)(src + x * channels + j * 16));
+		}
+		for(int c = 0; c < channels; ++c) {
+			__m128i v = _mm_setzero_si128();
+			for(int j = 0; j < channels; ++j) {
+				v = _mm_or_si128(v, _mm_shuffle_epi8(chunk[j], _mm_load_si128((const __m128i*)m.deinterleave[c][j])));
+			}
+			_mm_storeu_si128((__m128i*)(dst[c] + x), v);
 		}
 	}
-	return *this;
+	return x;
 }
 
+__attribute__((target("ssse3")))
+static int interleave_row_ssse3(const uint8_t* const* src, uint8_t* dst, int w, int channels) {
+	const ShuffleMasks& m = shuffle_masks(channels);
+	int x = 0;
+	for(; x + 16 <= w; x += 16) {
+		__m128i plane[4];
+		for(int c = 0; c < channels; ++c) {
+			plane[c] = _mm_loadu_si128((const __m128i*)(src[c] + x));
+		}
+		for(int j = 0; j < channels; ++j) {
+			__m128i v = _mm_setzero_si128();
+			for(int c = 0; c < channels; ++c) {
+				v = _mm_or_si128(v, _mm_shuffle_epi8(plane[c], _mm_load_si128((const __m128i*)m.interleave[j][c])));
+			}
+			_mm_storeu_si128((__m128i*)(dst + x * channels + j * 16), v);
+		}
+	}
+	return x;
+}
 
-Image& Image::grayscale_lum_cpu() {
-	if(channels < 3) {
-		printf("Image %p has less than 3 channels, it is assumed to already be grayscale.", this);
+static void deinterleave_row(const uint8_t* src, uint8_t* const* dst, int w, int channels) {
+	int x = 0;
+	if(channels >= 2 && channels <= 4 && has_ssse3()) {
+		x = deinterleave_row_ssse3(src, dst, w, channels);
 	}
-	else {
-		for(int i = 0; i < size; i+=channels) {
-			int gray = 0.2126*data[i] + 0.7152*data[i+1] + 0.0722*data[i+2];
-			memset(data+i, gray, 3);
+	for(; x < w; ++x) {
+		for(int c = 0; c < channels; ++c) {
+			dst[c][x] = src[x * channels + c];
 		}
 	}
+}
+
+static void interleave_row(const uint8_t* const* src, uint8_t* dst, int w, int channels) {
+	int x = 0;
+	if(channels >= 2 && channels <= 4 && has_ssse3()) {
+		x = interleave_row_ssse3(src, dst, w, channels);
+	}
+	for(; x < w; ++x) {
+		for(int c = 0; c < channels; ++c) {
+			dst[x * channels + c] = src[c][x];
+		}
+	}
+}
+
+Image& Image::to_planar_cpu() {
+	if(layout == PLANAR || channels == 1) {
+		layout = PLANAR;
+		return *this;
+	}
+	if(channels > 4) {
+		printf("Image %p has more than 4 channels, planar conversion is not supported\n", this);
+		return *this;
+	}
+
+	uint8_t* planar = allocate(size);
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < h; ++y) {
+		uint8_t* dst[4];
+		for(int c = 0; c < channels; ++c) {
+			dst[c] = planar + (size_t)c * w * h + (size_t)y * w;
+		}
+		deinterleave_row(data + (size_t)y * w * channels, dst, w, channels);
+	}
+
+	replace_data(planar, size);
+	layout = PLANAR;
 	return *this;
 }
 
-Image& Image::diffmap_cpu(Image& img) {
+Image& Image::to_interleaved_cpu() {
+	if(layout == INTERLEAVED || channels == 1) {
+		layout = INTERLEAVED;
+		return *this;
+	}
+	if(channels > 4) {
+		printf("Image %p has more than 4 channels, planar conversion is not supported\n", this);
+		return *this;
+	}
+
+	uint8_t* interleaved = allocate(size);
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < h; ++y) {
+		const uint8_t* src[4];
+		for(int c = 0; c < channels; ++c) {
+			src[c] = data + (size_t)c * w * h + (size_t)y * w;
+		}
+		interleave_row(src, interleaved + (size_t)y * w * channels, w, channels);
+	}
+
+	replace_data(interleaved, size);
+	layout = INTERLEAVED;
+	return *this;
+}
+
+ImageView::ImageView(uint8_t* data, int w, int h, int channels, size_t stride, PixelLayout layout, size_t plane_pitch)
+	: data(data), w(w), h(h), channels(channels), stride(stride), layout(layout), plane_pitch(plane_pitch) {
+	if(this->stride == 0) {
+		this->stride = row_bytes();
+	}
+	if(this->plane_pitch == 0 && layout == PLANAR) {
+		this->plane_pitch = this->stride * h;
+	}
+}
+
+ImageView ImageView::sub(int x, int y, int sw, int sh) const {
+	x = std::min(std::max(x, 0), w);
+	y = std::min(std::max(y, 0), h);
+	sw = std::min(std::max(sw, 0), w - x);
+	sh = std::min(std::max(sh, 0), h - y);
+
+	ImageView roi = *this;
+	roi.data = data + (size_t)y * stride + (size_t)x * pixel_step();
+	roi.w = sw;
+	roi.h = sh;
+	return roi;
+}
+
+void ImageView::copy_to(const ImageView& dst) const {
+	if(layout != dst.layout || channels != dst.channels) {
+		printf("copy_to needs views with the same layout and channels\n");
+		return;
+	}
+	int cw = std::min(w, dst.w);
+	int ch = std::min(h, dst.h);
+	size_t bytes = layout == PLANAR ? (size_t)cw : (size_t)cw * channels;
+	for(int c = 0; c < planes(); ++c) {
+		for(int y = 0; y < ch; ++y) {
+			memcpy(dst.row(y, c), row(y, c), bytes);
+		}
+	}
+}
+
+bool ImageView::require_interleaved(const char* op) const {
+	if(layout == PLANAR) {
+		printf("%s needs an interleaved image, call to_interleaved_cpu() first\n", op);
+		return false;
+	}
+	return true;
+}
+
+void ImageView::grayscale_avg() const {
+	ImageOps::grayscale(*this, *this, GRAY_AVERAGE);
+}
+
+void ImageView::grayscale_lum() const {
+	ImageOps::grayscale(*this, *this, GRAY_LUMINANCE);
+}
+
+void ImageView::diffmap(const ImageView& img) const {
+	if(!require_interleaved("diffmap_cpu") || !img.require_interleaved("diffmap_cpu")) {
+		return;
+	}
 	int compare_width = fmin(w,img.w);
 	int compare_height = fmin(h,img.h);
 	int compare_channels = fmin(channels,img.channels);
-	for(uint32_t i=0; i<compare_height; ++i) {
-		for(uint32_t j=0; j<compare_width; ++j) {
-			for(uint8_t k=0; k<compare_channels; ++k) {
-				data[(i*w+j)*channels+k] = BYTE_BOUND(abs(data[(i*w+j)*channels+k] - img.data[(i*img.w+j)*img.channels+k]));
+	if(channels == img.channels) {
+		// Overlapping part of each row is one contiguous run
+		auto absdiff = CpuDispatch::kernels().absdiff;
+		#pragma omp parallel for schedule(static)
+		for(int i=0; i<compare_height; ++i) {
+			absdiff(row(i), img.row(i), (size_t)compare_width*channels);
+		}
+		return;
+	}
+	for(int i=0; i<compare_height; ++i) {
+		uint8_t* a = row(i);
+		const uint8_t* b = img.row(i);
+		for(int j=0; j<compare_width; ++j) {
+			for(int k=0; k<compare_channels; ++k) {
+				a[j*channels+k] = BYTE_BOUND(abs(a[j*channels+k] - b[j*img.channels+k]));
 			}
 		}
 	}
-	return *this;
 }
 
-Image& Image::diffmap_scale_cpu(Image& img, uint8_t scl) {
+void ImageView::diffmap_scale(const ImageView& img, uint8_t scl) const {
+	if(!require_interleaved("diffmap_scale_cpu") || !img.require_interleaved("diffmap_scale_cpu")) {
+		return;
+	}
 	int compare_width = fmin(w,img.w);
 	int compare_height = fmin(h,img.h);
 	int compare_channels = fmin(channels,img.channels);
-	uint8_t largest = 0;
-	for(uint32_t i=0; i<compare_height; ++i) {
-		for(uint32_t j=0; j<compare_width; ++j) {
-			for(uint8_t k=0; k<compare_channels; ++k) {
-				data[(i*w+j)*channels+k] = BYTE_BOUND(abs(data[(i*w+j)*channels+k] - img.data[(i*img.w+j)*img.channels+k]));
-				largest = fmax(largest, data[(i*w+j)*channels+k]);
+	int largest = 0;
+	#pragma omp parallel for reduction(max:largest)
+	for(int i=0; i<compare_height; ++i) {
+		uint8_t* a = row(i);
+		const uint8_t* b = img.row(i);
+		for(int j=0; j<compare_width; ++j) {
+			for(int k=0; k<compare_channels; ++k) {
+				a[j*channels+k] = BYTE_BOUND(abs(a[j*channels+k] - b[j*img.channels+k]));
+				largest = std::max<int>(largest, a[j*channels+k]);
 			}
 		}
 	}
 	scl = 255/fmax(1, fmax(scl, largest));
-	for(int i=0; i<size; ++i) {
-		data[i] *= scl;
+	#pragma omp parallel for
+	for(int i=0; i<h; ++i) {
+		uint8_t* a = row(i);
+		for(size_t j=0; j<row_bytes(); ++j) {
+			a[j] *= scl;
+		}
 	}
-	return *this;
 }
 
-Image& Image::flipX_cpu() {
-	uint8_t tmp[4];
-	uint8_t* px1;
-	uint8_t* px2;
-	for(int y = 0;y < h;++y) {
-		for(int x = 0;x < w/2;++x) {
-			px1 = &data[(x + y * w) * channels];
-			px2 = &data[((w - 1 - x) + y * w) * channels];
-			
-			memcpy(tmp, px1, channels);
-			memcpy(px1, px2, channels);
-			memcpy(px2, tmp, channels);
+void ImageView::flipX() const {
+	auto reverse = CpuDispatch::kernels().reverse_pixels;
+	size_t step = pixel_step();
+	int rows = h * planes();
+
+	#pragma omp parallel
+	{
+		std::vector<uint8_t> tmp(row_bytes());
+		#pragma omp for schedule(static)
+		for(int r = 0; r < rows; ++r) {
+			uint8_t* line = row(r % h, r / h);
+			reverse(line, tmp.data(), w, step);
+			memcpy(line, tmp.data(), tmp.size());
 		}
 	}
-	return *this;
 }
 
-Image& Image::flipY_cpu() {
-	uint8_t tmp[4];
-	uint8_t* px1;
-	uint8_t* px2;
-	for(int x = 0;x < w;++x) {
-		for(int y = 0;y < h/2;++y) {
-			px1 = &data[(x + y * w) * channels];
-			px2 = &data[(x + (h - 1 - y) * w) * channels];
-
-			memcpy(tmp, px1, channels);
-			memcpy(px1, px2, channels);
-			memcpy(px2, tmp, channels);
+void ImageView::flipY() const {
+	int pairs = h / 2;
+
+	#pragma omp parallel
+	{
+		std::vector<uint8_t> tmp(row_bytes());
+		#pragma omp for schedule(static)
+		for(int r = 0; r < pairs * planes(); ++r) {
+			int y = r % pairs, c = r / pairs;
+			uint8_t* row1 = row(y, c);
+			uint8_t* row2 = row(h - 1 - y, c);
+
+			memcpy(tmp.data(), row1, tmp.size());
+			memcpy(row1, row2, tmp.size());
+			memcpy(row2, tmp.data(), tmp.size());
 		}
 	}
-	return *this;
 }
 
 
-Image& Image::std_convolve_clamp_to_0_cpu(uint8_t channel, const Mask::BaseMask* mask) {
-	
-	std::vector<uint8_t> new_data(w*h);
-	uint32_t ker_w = mask->getWidth(), ker_h = mask->getHeight(), cr = mask->getCenterRow(), cc = mask->getCenterColumn();
-	const double* ker = mask->getData(); 
-
-
-	uint64_t center = cr*ker_w + cc;
-	for(uint64_t k=channel; k<size; k+=channels) {
-		double c = 0;
-		for(long i = -((long)cr); i<(long)ker_h-cr; ++i) {
-			long row = ((long)k/channels)/w-i;
-			if(row < 0 || row > h-1) {
-				continue;
-			}
-			for(long j = -((long)cc); j<(long)ker_w-cc; ++j) {
-				long col = ((long)k/channels)%w-j;
-				if(col < 0 || col > w-1) {
-					continue;
-				}
-				c += ker[center+i*(long)ker_w+j]*data[(row*w+col)*channels+channel];
-			}
+// One channel through the convolution built for this CPU
+template<bool CLAMP_TO_BORDER>
+static void convolve_channel(const uint8_t* src, size_t sstep, size_t sstride, int w, int h, const Mask::BaseMask* mask,
+	uint8_t* dst, size_t dstep, size_t dstride) {
+	const CpuKernels& kernels = CpuDispatch::kernels();
+	auto convolve = CLAMP_TO_BORDER ? kernels.convolve_border : kernels.convolve_0;
+	// The fixed masks are all one of these sizes
+	if(mask->getWidth() == 3 && mask->getHeight() == 3) {
+		convolve = CLAMP_TO_BORDER ? kernels.convolve_3x3_border : kernels.convolve_3x3_0;
+	}
+	else if(mask->getWidth() == 5 && mask->getHeight() == 5) {
+		convolve = CLAMP_TO_BORDER ? kernels.convolve_5x5_border : kernels.convolve_5x5_0;
+	}
+	convolve(src, sstep, sstride, w, h, mask->getData(), mask->getWidth(), mask->getHeight(),
+		mask->getCenterRow(), mask->getCenterColumn(), dst, dstep, dstride);
+}
+
+template<bool CLAMP_TO_BORDER>
+static void convolve_view(const ImageView& src, const ImageView& dst, uint8_t channel, const Mask::BaseMask* mask) {
+	if(src.data != dst.data) {
+		convolve_channel<CLAMP_TO_BORDER>(src.channel_start(channel), src.pixel_step(), src.stride, src.w, src.h, mask,
+			dst.channel_start(channel), dst.pixel_step(), dst.stride);
+		return;
+	}
+
+	// In place, go through a scratch plane that each thread keeps between calls
+	static thread_local std::vector<uint8_t> scratch;
+	scratch.resize((size_t)src.w*src.h);
+	convolve_channel<CLAMP_TO_BORDER>(src.channel_start(channel), src.pixel_step(), src.stride, src.w, src.h, mask,
+		scratch.data(), 1, src.w);
+
+	uint8_t* out = dst.channel_start(channel);
+	size_t step = dst.pixel_step();
+	for(int y = 0; y < dst.h; ++y) {
+		uint8_t* line = out + y * dst.stride;
+		const uint8_t* result = scratch.data() + (size_t)y * src.w;
+		for(int x = 0; x < dst.w; ++x) {
+			line[x*step] = result[x];
 		}
+	}
+}
+
+void ImageView::std_convolve_clamp_to_0(uint8_t channel, const Mask::BaseMask* mask) const {
+	convolve_view<false>(*this, *this, channel, mask);
+}
 
-		new_data[k/channels] = (uint8_t)BYTE_BOUND((int)round(c));
+void ImageView::std_convolve_clamp_to_border(uint8_t channel, const Mask::BaseMask* mask) const {
+	convolve_view<true>(*this, *this, channel, mask);
+}
+
+
+namespace ImageOps {
+
+static bool same_shape(const ImageView& src, const ImageView& dst, const char* op) {
+	if(src.w != dst.w || src.h != dst.h || src.channels != dst.channels || src.layout != dst.layout) {
+		printf("%s needs a destination with the shape and layout of the source\n", op);
+		return false;
 	}
-	for(uint64_t k=channel; k<size; k+=channels) {
-		data[k] = new_data[k/channels];
+	return true;
+}
+
+void grayscale_avg(const ImageView& src, const ImageView& dst) {
+	if(!same_shape(src, dst, "grayscale_avg")) {
+		return;
 	}
-	return *this;
+	grayscale(src, dst, GRAY_AVERAGE);
 }
 
-Image& Image::std_convolve_clamp_to_border_cpu(uint8_t channel, const Mask::BaseMask* mask) {
-	std::vector<uint8_t> new_data(w*h);
-	uint32_t ker_w = mask->getWidth(), ker_h = mask->getHeight(), cr = mask->getCenterRow(), cc = mask->getCenterColumn();
-	const double* ker = mask->getData(); 
-
-	uint64_t center = cr*ker_w + cc;
-	for(uint64_t k=channel; k<size; k+=channels) {
-		double c = 0;
-		for(long i = -((long)cr); i<(long)ker_h-cr; ++i) {
-			long row = ((long)k/channels)/w-i;
-			if(row < 0) {
-				row = 0;
-			}
-			else if(row > h-1) {
-				row = h-1;
+void grayscale_lum(const ImageView& src, const ImageView& dst) {
+	if(!same_shape(src, dst, "grayscale_lum")) {
+		return;
+	}
+	grayscale(src, dst, GRAY_LUMINANCE);
+}
+
+void diffmap(const ImageView& src, const ImageView& img, const ImageView& dst) {
+	if(!same_shape(src, dst, "diffmap")) {
+		return;
+	}
+	if(src.data != dst.data) {
+		src.copy_to(dst);
+	}
+	dst.diffmap(img);
+}
+
+void flipX(const ImageView& src, const ImageView& dst) {
+	if(!same_shape(src, dst, "flipX")) {
+		return;
+	}
+	if(src.data == dst.data) {
+		dst.flipX();
+		return;
+	}
+	auto reverse = CpuDispatch::kernels().reverse_pixels;
+	size_t step = src.pixel_step();
+	int rows = src.h * src.planes();
+
+	#pragma omp parallel for schedule(static)
+	for(int r = 0; r < rows; ++r) {
+		reverse(src.row(r % src.h, r / src.h), dst.row(r % src.h, r / src.h), src.w, step);
+	}
+}
+
+void flipY(const ImageView& src, const ImageView& dst) {
+	if(!same_shape(src, dst, "flipY")) {
+		return;
+	}
+	if(src.data == dst.data) {
+		dst.flipY();
+		return;
+	}
+	int rows = src.h * src.planes();
+
+	// Whole rows, in reverse order
+	#pragma omp parallel for schedule(static)
+	for(int r = 0; r < rows; ++r) {
+		int y = r % src.h, c = r / src.h;
+		memcpy(dst.row(src.h - 1 - y, c), src.row(y, c), src.row_bytes());
+	}
+}
+
+// Rotations and transpose read src and write dst a block at a time, so they
+// cannot work in place
+static bool rotated_shape(const ImageView& src, const ImageView& dst, bool swapped, const char* op) {
+	int w = swapped ? src.h : src.w, h = swapped ? src.w : src.h;
+	if(dst.w != w || dst.h != h || src.channels != dst.channels || src.layout != dst.layout) {
+		printf("%s needs a %dx%d destination with the channels and layout of the source\n", op, w, h);
+		return false;
+	}
+	if(src.data == dst.data) {
+		printf("%s cannot run in place\n", op);
+		return false;
+	}
+	return true;
+}
+
+static void transpose_planes(const ImageView& src, const ImageView& dst, bool flip_rows, bool flip_cols) {
+	auto transpose = CpuDispatch::kernels().transpose;
+	for(int c = 0; c < src.planes(); ++c) {
+		transpose(src.row(0, c), src.stride, src.w, src.h, dst.row(0, c), dst.stride, flip_rows, flip_cols, src.pixel_step());
+	}
+}
+
+void transpose(const ImageView& src, const ImageView& dst) {
+	if(rotated_shape(src, dst, true, "transpose")) {
+		transpose_planes(src, dst, false, false);
+	}
+}
+
+void rotate(const ImageView& src, const ImageView& dst, Rotation rotation) {
+	const char* op = rotation == ROTATE_90 ? "rotate 90" : rotation == ROTATE_180 ? "rotate 180" : "rotate 270";
+	if(!rotated_shape(src, dst, rotation != ROTATE_180, op)) {
+		return;
+	}
+	switch(rotation) {
+		// Row y of the source becomes column h-1-y
+		case ROTATE_90: transpose_planes(src, dst, false, true); break;
+		// Column x of the source becomes row w-1-x
+		case ROTATE_270: transpose_planes(src, dst, true, false); break;
+		case ROTATE_180: {
+			auto reverse = CpuDispatch::kernels().reverse_pixels;
+			size_t step = src.pixel_step();
+			int rows = src.h * src.planes();
+
+			#pragma omp parallel for schedule(static)
+			for(int r = 0; r < rows; ++r) {
+				int y = r % src.h, c = r / src.h;
+				reverse(src.row(y, c), dst.row(src.h - 1 - y, c), src.w, step);
 			}
-			for(long j = -((long)cc); j<(long)ker_w-cc; ++j) {
-				long col = ((long)k/channels)%w-j;
-				if(col < 0) {
-					col = 0;
-				}
-				else if(col > w-1) {
-					col = w-1;
-				}
-				c += ker[center+i*(long)ker_w+j]*data[(row*w+col)*channels+channel];
+			break;
+		}
+	}
+}
+
+void std_convolve_clamp_to_0(const ImageView& src, const ImageView& dst, uint8_t channel, const Mask::BaseMask* mask) {
+	if(same_shape(src, dst, "std_convolve_clamp_to_0")) {
+		convolve_view<false>(src, dst, channel, mask);
+	}
+}
+
+void std_convolve_clamp_to_border(const ImageView& src, const ImageView& dst, uint8_t channel, const Mask::BaseMask* mask) {
+	if(same_shape(src, dst, "std_convolve_clamp_to_border")) {
+		convolve_view<true>(src, dst, channel, mask);
+	}
+}
+
+void crop(const ImageView& src, const ImageView& dst, int cx, int cy) {
+	// Whatever falls outside the source stays black
+	for(int c = 0; c < dst.planes(); ++c) {
+		for(int y = 0; y < dst.h; ++y) {
+			memset(dst.row(y, c), 0, dst.row_bytes());
+		}
+	}
+	src.sub(cx, cy, dst.w, dst.h).copy_to(dst);
+}
+
+void resizeNN(const ImageView& src, const ImageView& dst) {
+	float scaleX = (float)dst.w / (src.w);
+	float scaleY = (float)dst.h / (src.h);
+	size_t step = src.pixel_step();
+
+	for(int c = 0; c < src.planes(); ++c) {
+		for(uint16_t y = 0;y < dst.h;++y) {
+			const uint8_t* in = src.row((uint16_t)(y / scaleY), c);
+			uint8_t* out = dst.row(y, c);
+			for(uint16_t x = 0;x < dst.w;++x) {
+				memcpy(out + x * step, in + (uint16_t)(x / scaleX) * step, step);
 			}
 		}
-		new_data[k/channels] = (uint8_t)BYTE_BOUND((int)round(c));
 	}
-	for(uint64_t k=channel; k<size; k+=channels) {
-		data[k] = new_data[k/channels];
+}
+
+void resizeBilinear(const ImageView& src, const ImageView& dst) {
+	int w = src.w, h = src.h, nw = dst.w, nh = dst.h;
+	float scaleX = (float)(w - 1) / (nw - 1);
+	float scaleY = (float)(h - 1) / (nh - 1);
+	size_t sstep = src.pixel_step(), dstep = dst.pixel_step();
+	auto resize_row = CpuDispatch::kernels().resize_bilinear_row;
+
+	#pragma omp parallel for schedule(static)
+	for (int ny = 0; ny < nh; ++ny) {
+		float fy = ny * scaleY;
+		uint16_t iy = (uint16_t)fy;
+		float fy1 = fy - iy;
+		uint16_t iy1 = iy + 1 < h ? iy + 1 : iy;
+
+		// Planar channels are each read with unit stride
+		for (int c = 0; c < src.channels; ++c) {
+			const uint8_t* row0 = src.channel_start(c) + iy * src.stride;
+			const uint8_t* row1 = src.channel_start(c) + iy1 * src.stride;
+			uint8_t* out = dst.channel_start(c) + ny * dst.stride;
+			resize_row(row0, row1, sstep, w, fy1, scaleX, out, dstep, nw);
+		}
 	}
-	return *this;
 }
 
-Image& Image::crop(uint16_t cx, uint16_t cy, uint16_t cw, uint16_t ch) {
-	size = cw * ch * channels;
-	uint8_t* croppedImage = new uint8_t[size];
-	memset(croppedImage, 0, size);
-
-	for(uint16_t y = 0;y < ch;++y) {
-		if(y + cy >= h) {break;}
-		for(uint16_t x = 0;x < cw;++x) {
-			if(x + cx >= w) {break;}
-			memcpy(&croppedImage[(x + y * cw) * channels], &data[(x + cx + (y + cy) * w) * channels], channels);
+// Whether any plane of a, first to last byte, overlaps any plane of b
+static bool overlaps(const ImageView& a, const ImageView& b) {
+	if(a.bytes() == 0 || b.bytes() == 0) {
+		return false;
+	}
+	for(int i = 0; i < a.planes(); ++i) {
+		const uint8_t* a_first = a.row(0, i);
+		const uint8_t* a_last = a.row(a.h - 1, i) + a.row_bytes();
+		for(int j = 0; j < b.planes(); ++j) {
+			const uint8_t* b_first = b.row(0, j);
+			const uint8_t* b_last = b.row(b.h - 1, j) + b.row_bytes();
+			if(a_first < b_last && b_first < a_last) {
+				return true;
+			}
 		}
 	}
+	return false;
+}
 
-	w = cw;
-	h = ch;
-	
+std::unique_ptr<Image> unaliased(const ImageView& src, const ImageView& dst) {
+	if(!overlaps(src, dst)) {
+		return nullptr;
+	}
+	return std::unique_ptr<Image>(new Image(src));
+}
 
-	delete[] data;
-	data = croppedImage;
-	croppedImage = nullptr;
+}
 
+
+Image& Image::grayscale_avg_cpu() {
+	view().grayscale_avg();
 	return *this;
 }
 
+Image& Image::grayscale_lum_cpu() {
+	view().grayscale_lum();
+	return *this;
+}
 
-Image& Image::resizeNN(uint16_t nw, uint16_t nh) {
-	size = nw * nh * channels;
-	uint8_t* newImage = new uint8_t[size];
+Image Image::grayscale_channel_cpu(GrayWeights weights) const {
+	Image gray(w, h, 1, allocator);
+	ImageOps::grayscale(view(), gray.view(), weights);
+	return gray;
+}
 
-	float scaleX = (float)nw / (w);
-	float scaleY = (float)nh / (h);
-	uint16_t sx, sy;
+Image& Image::diffmap_cpu(Image& img) {
+	view().diffmap(img.view());
+	return *this;
+}
 
-	for(uint16_t y = 0;y < nh;++y) {
-		sy = (uint16_t)(y / scaleY);
-		for(uint16_t x = 0;x < nw;++x) {
-			sx = (uint16_t)(x / scaleX);
+Image& Image::diffmap_scale_cpu(Image& img, uint8_t scl) {
+	view().diffmap_scale(img.view(), scl);
+	return *this;
+}
 
-			memcpy(&newImage[(x + y * nw) * channels], &data[(sx + sy * w) * channels], channels);
+Image& Image::flipX_cpu() {
+	view().flipX();
+	return *this;
+}
 
-		}
+Image& Image::flipY_cpu() {
+	view().flipY();
+	return *this;
+}
+
+Image& Image::transpose_cpu() {
+	uint8_t* newImage = allocate(size);
+	ImageOps::transpose(view(), ImageView(newImage, h, w, channels, 0, layout));
+
+	std::swap(w, h);
+	replace_data(newImage, size);
+
+	return *this;
+}
+
+Image& Image::rotate_cpu(Rotation rotation) {
+	uint8_t* newImage = allocate(size);
+	bool swapped = rotation != ROTATE_180;
+	ImageOps::rotate(view(), ImageView(newImage, swapped ? h : w, swapped ? w : h, channels, 0, layout), rotation);
+
+	if(swapped) {
+		std::swap(w, h);
 	}
+	replace_data(newImage, size);
 
+	return *this;
+}
+
+Image& Image::std_convolve_clamp_to_0_cpu(uint8_t channel, const Mask::BaseMask* mask) {
+	view().std_convolve_clamp_to_0(channel, mask);
+	return *this;
+}
+
+Image& Image::std_convolve_clamp_to_border_cpu(uint8_t channel, const Mask::BaseMask* mask) {
+	view().std_convolve_clamp_to_border(channel, mask);
+	return *this;
+}
+
+Image& Image::median_cpu(int radius) {
+	ImageOps::median(view(), view(), radius);
+	return *this;
+}
+
+Image& Image::rank_filter_cpu(int radius, double percent) {
+	ImageOps::rank_filter(view(), view(), radius, percent);
+	return *this;
+}
+
+Image& Image::morphology_cpu(MorphologyOp op, int rx, int ry, StructuringElement shape) {
+	ImageOps::morphology(view(), view(), op, rx, ry, shape);
+	return *this;
+}
+
+Image& Image::bilateral_cpu(double sigma_space, double sigma_range) {
+	ImageOps::bilateral(view(), view(), sigma_space, sigma_range);
+	return *this;
+}
+
+Image& Image::guided_cpu(double sigma_space, double sigma_range) {
+	ImageOps::guided(view(), view(), view(), sigma_space, sigma_range);
+	return *this;
+}
+
+Image Image::sobel_cpu() const {
+	Image gray = channels == 1 ? clone() : grayscale_channel_cpu(GRAY_LUMINANCE);
+	ImageOps::sobel(gray.view(), gray.view());
+	return gray;
+}
+
+Image Image::canny_cpu(int low, int high) const {
+	Image gray = channels == 1 ? clone() : grayscale_channel_cpu(GRAY_LUMINANCE);
+	ImageOps::canny(gray.view(), gray.view(), low, high);
+	return gray;
+}
+
+Image& Image::unsharp_cpu(double amount, double radius, int threshold) {
+	ImageOps::unsharp(view(), view(), amount, radius, threshold);
+	return *this;
+}
+
+Image& Image::crop(uint16_t cx, uint16_t cy, uint16_t cw, uint16_t ch) {
+	size_t bytes = (size_t)cw * ch * channels;
+	uint8_t* croppedImage = allocate(bytes);
+	ImageOps::crop(view(), ImageView(croppedImage, cw, ch, channels, 0, layout), cx, cy);
+
+	w = cw;
+	h = ch;
+	size = bytes;
+	replace_data(croppedImage, size);
+
+	return *this;
+}
+
+Image& Image::resizeNN(uint16_t nw, uint16_t nh) {
+	size_t bytes = (size_t)nw * nh * channels;
+	uint8_t* newImage = allocate(bytes);
+	ImageOps::resizeNN(view(), ImageView(newImage, nw, nh, channels, 0, layout));
 
 	w = nw;
 	h = nh;
-	delete[] data;
-	data = newImage;
-	newImage = nullptr;
+	size = bytes;
+	replace_data(newImage, size);
 
 	return *this;
 }
 
 Image& Image::resizeBilinear_cpu(uint16_t nw, uint16_t nh) {
-    size = nw * nh * channels;
-    uint8_t* newImage = new uint8_t[size];
-
-    float scaleX = (float)(w - 1) / (nw - 1);
-    float scaleY = (float)(h - 1) / (nh - 1);
-    int x, y, index;
-    float fx, fy, fx1, fy1;
-    uint16_t ix, iy, ix1, iy1;
-
-    for (uint16_t ny = 0; ny < nh; ++ny) {
-        fy = ny * scaleY;
-        iy = (uint16_t)fy;
-        fy1 = fy - iy;
-        for (uint16_t nx = 0; nx < nw; ++nx) {
-            fx = nx * scaleX;
-            ix = (uint16_t)fx;
-            fx1 = fx - ix;
-
-            ix1 = ix + 1;
-            iy1 = iy + 1;
-            if (ix1 >= w) ix1 = ix;
-            if (iy1 >= h) iy1 = iy;
-			
-			std::cout<<"low_x: "<<ix<<" high_x: "<<ix1<<"\n";
-
-            for (int c = 0; c < channels; ++c) {
-                float value = (1 - fx1) * (1 - fy1) * data[(ix + iy * w) * channels + c] +
-                              fx1 * (1 - fy1) * data[(ix1 + iy * w) * channels + c] +
-                              (1 - fx1) * fy1 * data[(ix + iy1 * w) * channels + c] +
-                              fx1 * fy1 * data[(ix1 + iy1 * w) * channels + c];
-
-                newImage[(nx + ny * nw) * channels + c] = (uint8_t)value;
-            }
-        }
-    }
-
-    w = nw;
-    h = nh;
-    delete[] data;
-    data = newImage;
-    newImage = nullptr;
-
-    return *this;
-}
\ No newline at end of file
+	size_t bytes = (size_t)nw * nh * channels;
+	uint8_t* newImage = allocate(bytes);
+	ImageOps::resizeBilinear(view(), ImageView(newImage, nw, nh, channels, 0, layout));
+
+	w = nw;
+	h = nh;
+	size = bytes;
+	replace_data(newImage, size);
+
+	return *this;
+}
@@ -0,0 +1,116 @@
+#include "image_allocator.h"
+#include <cstdlib>
+#include <new>
+
+static uint8_t* aligned_new(size_t bytes) {
+	// aligned_alloc wants a multiple of the alignment
+	size_t rounded = (bytes + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+	void* data = aligned_alloc(IMAGE_ALIGNMENT, rounded == 0 ? IMAGE_ALIGNMENT : rounded);
+	if (data == nullptr) {
+		throw std::bad_alloc();
+	}
+	return (uint8_t*)data;
+}
+
+class HeapAllocator : public ImageAllocator {
+public:
+	uint8_t* allocate(size_t bytes) override {
+		return aligned_new(bytes);
+	}
+	void deallocate(uint8_t* data, size_t) override {
+		free(data);
+	}
+};
+
+ImageAllocator* ImageAllocator::heap() {
+	static HeapAllocator allocator;
+	return &allocator;
+}
+
+
+struct LocalFrameCache {
+	struct Slot {
+		uint8_t* data;
+		size_t bytes;
+	};
+	Slot slots[FramePoolAllocator::LOCAL_BUFFERS];
+	size_t count = 0;
+
+	~LocalFrameCache() {
+		for (size_t i = 0; i < count; ++i) {
+			FramePoolAllocator::instance()->give_back(slots[i].data, slots[i].bytes);
+		}
+	}
+};
+
+static thread_local LocalFrameCache local_cache;
+
+FramePoolAllocator* FramePoolAllocator::instance() {
+	static FramePoolAllocator allocator;
+	return &allocator;
+}
+
+uint8_t* FramePoolAllocator::allocate(size_t bytes) {
+	for (size_t i = 0; i < local_cache.count; ++i) {
+		if (local_cache.slots[i].bytes == bytes) {
+			uint8_t* data = local_cache.slots[i].data;
+			local_cache.slots[i] = local_cache.slots[--local_cache.count];
+			return data;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		auto it = pool.find(bytes);
+		if (it != pool.end()) {
+			uint8_t* data = it->second;
+			pool.erase(it);
+			pooled_bytes -= bytes;
+			return data;
+		}
+		++fresh;
+	}
+	return aligned_new(bytes);
+}
+
+void FramePoolAllocator::deallocate(uint8_t* data, size_t bytes) {
+	if (data == nullptr) {
+		return;
+	}
+	if (local_cache.count < LOCAL_BUFFERS) {
+		local_cache.slots[local_cache.count++] = { data, bytes };
+		return;
+	}
+	give_back(data, bytes);
+}
+
+void FramePoolAllocator::give_back(uint8_t* data, size_t bytes) {
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		if (pooled_bytes + bytes <= capacity) {
+			pool.emplace(bytes, data);
+			pooled_bytes += bytes;
+			return;
+		}
+	}
+	free(data);
+}
+
+void FramePoolAllocator::set_capacity(size_t bytes) {
+	std::lock_guard<std::mutex> lk(lock);
+	capacity = bytes;
+}
+
+void FramePoolAllocator::trim() {
+	for (size_t i = 0; i < local_cache.count; ++i) {
+		free(local_cache.slots[i].data);
+	}
+	local_cache.count = 0;
+
+	std::lock_guard<std::mutex> lk(lock);
+	for (auto& entry : pool) {
+		free(entry.second);
+	}
+	pool.clear();
+	pooled_bytes = 0;
+}
@@ -1,16 +1,44 @@
 #include "image.h"
 #include "opencl_image.h"
+#include "batch.h"
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <chrono>
 
 
+// ./ImageProcessing --batch <output dir> <images...>
+// Blurs every input on the GPU and writes it to the output dir under the same name
+int run_batch(int argc, char** argv) {
+    std::string out_dir = argv[2];
+    std::vector<BatchJob> jobs;
+    for (int i = 3; i < argc; ++i) {
+        const char* name = strrchr(argv[i], '/');
+        jobs.push_back({ argv[i], out_dir + "/" + (name ? name + 1 : argv[i]) });
+    }
+
+    Mask::GaussianDynamic2D gaussianBlur((int) 1);
+
+    OpenCLImageProcessor processor;
+    BatchProcessor batch(processor);
+    BatchReport report = batch.run(jobs, [&](OpenCLImageProcessor& p, Image& img) {
+        p.std_convolve_clamp_to_border(img, &gaussianBlur);
+    });
+    report.print();
+
+    return report.failed == 0 ? 0 : 1;
+}
+
 int main(int argc, char** argv) {
+    if (argc > 2 && strcmp(argv[1], "--batch") == 0) {
+        return run_batch(argc, argv);
+    }
+
 	// Image test("imgs/test.png");
     Image testHD("imgs/testHD.jpeg");
     Image cat("imgs/cat.jpeg");
 
-    Image gpu_test = testHD;
+    Image gpu_test = testHD.clone();
 
     // std::cout<<cat.channels<<"\n";
 
@@ -0,0 +1,118 @@
+#include "mask_factory.h"
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <tuple>
+
+FactoryMask::FactoryMask(std::vector<double> taps, int w, int h)
+	: w(w), h(h), taps(std::move(taps)), float_taps(this->taps.begin(), this->taps.end()), fixed_taps(this->taps.size()) {
+	const int one = 1 << FIXED_BITS;
+	int sum = 0;
+	for(size_t i = 0; i < this->taps.size(); ++i) {
+		fixed_taps[i] = (int16_t)lround(this->taps[i] * one);
+		sum += fixed_taps[i];
+	}
+	fixed_taps[(h / 2) * w + w / 2] += (int16_t)(one - sum);
+}
+
+
+namespace MaskFactory {
+
+typedef std::tuple<MaskType, double, MaskOrientation> Key;
+typedef std::shared_ptr<const FactoryMask> Entry;
+
+static std::mutex lock;
+// Most recently used first
+static std::list<std::pair<Key, Entry>> cache;
+
+static Entry lookup(const Key& key) {
+	std::lock_guard<std::mutex> guard(lock);
+	for(auto it = cache.begin(); it != cache.end(); ++it) {
+		if(it->first == key) {
+			cache.splice(cache.begin(), cache, it);
+			return it->second;
+		}
+	}
+	return Entry();
+}
+
+// Another thread may have made the same mask meanwhile, the first one stays
+static Entry insert(const Key& key, Entry mask) {
+	std::lock_guard<std::mutex> guard(lock);
+	for(auto it = cache.begin(); it != cache.end(); ++it) {
+		if(it->first == key) {
+			return it->second;
+		}
+	}
+	cache.emplace_front(key, mask);
+	if(cache.size() > CACHE_SIZE) {
+		cache.pop_back();
+	}
+	return mask;
+}
+
+static std::vector<double> line_taps(MaskType type, double sigma) {
+	if(type == MASK_GAUSSIAN) {
+		return Mask::gaussian_taps(sigma);
+	}
+	int radius = std::max(1, (int)std::ceil(sigma * std::sqrt(3.0)));
+	return std::vector<double>(2 * radius + 1, 1.0 / (2 * radius + 1));
+}
+
+Entry get(MaskType type, double sigma, MaskOrientation orientation) {
+	if(!(sigma > 0 && sigma <= 64)) {
+		printf("MaskFactory: sigma %g is outside (0, 64]\n", sigma);
+		return Entry();
+	}
+
+	Key key(type, sigma, orientation);
+	Entry mask = lookup(key);
+	if(mask) {
+		return mask;
+	}
+
+	if(orientation == MASK_2D) {
+		Entry row = get(type, sigma, MASK_ROW);
+		int n = row->getWidth();
+		const double* taps = row->getData();
+		std::vector<double> outer((size_t)n * n);
+		for(int i = 0; i < n; ++i) {
+			for(int j = 0; j < n; ++j) {
+				outer[(size_t)i * n + j] = taps[i] * taps[j];
+			}
+		}
+		mask = std::make_shared<const FactoryMask>(std::move(outer), n, n);
+	}
+	else if(orientation == MASK_COLUMN) {
+		// The row's taps standing up
+		Entry row = get(type, sigma, MASK_ROW);
+		std::vector<double> taps(row->getData(), row->getData() + row->getWidth());
+		mask = std::make_shared<const FactoryMask>(std::move(taps), 1, row->getWidth());
+	}
+	else {
+		std::vector<double> taps = line_taps(type, sigma);
+		int n = (int)taps.size();
+		mask = std::make_shared<const FactoryMask>(std::move(taps), n, 1);
+	}
+	return insert(key, mask);
+}
+
+Entry gaussian(double sigma, MaskOrientation orientation) {
+	return get(MASK_GAUSSIAN, sigma, orientation);
+}
+
+Entry box(double sigma, MaskOrientation orientation) {
+	return get(MASK_BOX, sigma, orientation);
+}
+
+size_t size() {
+	std::lock_guard<std::mutex> guard(lock);
+	return cache.size();
+}
+
+void clear() {
+	std::lock_guard<std::mutex> guard(lock);
+	cache.clear();
+}
+
+}
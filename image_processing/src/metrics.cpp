@@ -0,0 +1,168 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace Metrics {
+
+void ssim_weights(float* weights) {
+	float total = 0;
+	for(int d = -SSIM_RADIUS; d <= SSIM_RADIUS; ++d) {
+		weights[d + SSIM_RADIUS] = expf(-(float)(d * d) / (2 * SSIM_SIGMA * SSIM_SIGMA));
+		total += weights[d + SSIM_RADIUS];
+	}
+	for(int i = 0; i < 2 * SSIM_RADIUS + 1; ++i) {
+		weights[i] /= total;
+	}
+}
+
+double psnr_from_mse(double mse) {
+	if(mse <= 0) {
+		return std::numeric_limits<double>::infinity();
+	}
+	return 10 * log10(255.0 * 255.0 / mse);
+}
+
+}
+
+
+namespace ImageOps {
+
+static bool same_shape(const ImageView& a, const ImageView& b, const char* op) {
+	if(a.w != b.w || a.h != b.h || a.channels != b.channels || a.layout != b.layout) {
+		printf("%s needs two images with the same shape and layout\n", op);
+		return false;
+	}
+	return true;
+}
+
+// Samples per block, 4096 * 255^2 still fits a 32 bit sum
+static const int SQUARED_BLOCK = 4096;
+
+double mse(const ImageView& a, const ImageView& b) {
+	if(!same_shape(a, b, "mse")) {
+		return -1;
+	}
+	int rows = a.h * a.planes();
+	size_t len = a.row_bytes();
+	uint64_t total = 0;
+
+	#pragma omp parallel for reduction(+:total) schedule(static)
+	for(int r = 0; r < rows; ++r) {
+		const uint8_t* p = a.row(r % a.h, r / a.h);
+		const uint8_t* q = b.row(r % b.h, r / b.h);
+		for(size_t start = 0; start < len; start += SQUARED_BLOCK) {
+			int n = (int)std::min<size_t>(SQUARED_BLOCK, len - start);
+			uint32_t sum = 0;
+			#pragma omp simd reduction(+:sum)
+			for(int i = 0; i < n; ++i) {
+				int d = (int)p[start + i] - (int)q[start + i];
+				sum += (uint32_t)(d * d);
+			}
+			total += sum;
+		}
+	}
+
+	size_t samples = (size_t)a.w * a.h * a.channels;
+	return samples ? (double)total / samples : 0.0;
+}
+
+double psnr(const ImageView& a, const ImageView& b) {
+	double e = mse(a, b);
+	return e < 0 ? e : Metrics::psnr_from_mse(e);
+}
+
+double ssim(const ImageView& a, const ImageView& b) {
+	if(!same_shape(a, b, "ssim")) {
+		return -1;
+	}
+	int w = a.w, h = a.h;
+	const int R = Metrics::SSIM_RADIUS;
+	float weights[2 * R + 1];
+	Metrics::ssim_weights(weights);
+	size_t step = a.pixel_step();
+	double total = 0;
+
+	for(int c = 0; c < a.channels; ++c) {
+		// Horizontal pass: local means of a, b, a^2, b^2 and ab with the
+		// window clamped to the border
+		std::vector<float> moments((size_t)5 * w * h);
+		float* mu_a = moments.data();
+		float* mu_b = mu_a + (size_t)w * h;
+		float* aa = mu_b + (size_t)w * h;
+		float* bb = aa + (size_t)w * h;
+		float* ab = bb + (size_t)w * h;
+
+		#pragma omp parallel for schedule(static)
+		for(int y = 0; y < h; ++y) {
+			const uint8_t* p = a.channel_start(c) + y * a.stride;
+			const uint8_t* q = b.channel_start(c) + y * b.stride;
+			for(int x = 0; x < w; ++x) {
+				float sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+				for(int d = -R; d <= R; ++d) {
+					int xx = std::min(std::max(x + d, 0), w - 1);
+					float va = p[xx * step], vb = q[xx * step];
+					float k = weights[d + R];
+					sa += k * va;
+					sb += k * vb;
+					saa += k * va * va;
+					sbb += k * vb * vb;
+					sab += k * va * vb;
+				}
+				size_t i = (size_t)y * w + x;
+				mu_a[i] = sa;
+				mu_b[i] = sb;
+				aa[i] = saa;
+				bb[i] = sbb;
+				ab[i] = sab;
+			}
+		}
+
+		// Vertical pass straight into the SSIM map's sum, a whole row of each
+		// moment at a time so the inner loops run along x
+		double channel_total = 0;
+		#pragma omp parallel reduction(+:channel_total)
+		{
+			std::vector<float> acc((size_t)5 * w);
+			#pragma omp for schedule(static)
+			for(int y = 0; y < h; ++y) {
+				std::fill(acc.begin(), acc.end(), 0.0f);
+				for(int d = -R; d <= R; ++d) {
+					size_t offset = (size_t)std::min(std::max(y + d, 0), h - 1) * w;
+					float k = weights[d + R];
+					for(int m = 0; m < 5; ++m) {
+						const float* in = moments.data() + (size_t)m * w * h + offset;
+						float* out = acc.data() + (size_t)m * w;
+						#pragma omp simd
+						for(int x = 0; x < w; ++x) {
+							out[x] += k * in[x];
+						}
+					}
+				}
+
+				const float* ma = acc.data();
+				const float* mb = ma + w;
+				const float* saa = mb + w;
+				const float* sbb = saa + w;
+				const float* sab = sbb + w;
+				float row_total = 0;
+				#pragma omp simd reduction(+:row_total)
+				for(int x = 0; x < w; ++x) {
+					float var_a = saa[x] - ma[x] * ma[x];
+					float var_b = sbb[x] - mb[x] * mb[x];
+					float cov = sab[x] - ma[x] * mb[x];
+					row_total += ((2 * ma[x] * mb[x] + Metrics::SSIM_C1) * (2 * cov + Metrics::SSIM_C2)) /
+						((ma[x] * ma[x] + mb[x] * mb[x] + Metrics::SSIM_C1) * (var_a + var_b + Metrics::SSIM_C2));
+				}
+				channel_total += row_total;
+			}
+		}
+		total += channel_total;
+	}
+
+	size_t samples = (size_t)w * h * a.channels;
+	return samples ? total / samples : 1.0;
+}
+
+}
@@ -0,0 +1,148 @@
+#include "morphology.h"
+#include "cpu_dispatch.h"
+#include <algorithm>
+#include <memory>
+
+namespace Morphology {
+
+bool valid_radii(int rx, int ry, const char* op) {
+	if(rx < 0 || ry < 0 || rx > MAX_RADIUS || ry > MAX_RADIUS) {
+		printf("%s: radii %d, %d are outside 0 to %d\n", op, rx, ry, MAX_RADIUS);
+		return false;
+	}
+	return true;
+}
+
+}
+
+
+namespace ImageOps {
+
+// Bytes per column pass strip, so a strip's suffix rows stay in cache
+static const size_t COLUMN_STRIP = 256;
+
+// Dense image with the view's shape and layout
+static Image like(const ImageView& view) {
+	Image image(view.w, view.h, view.channels);
+	image.layout = view.layout;
+	return image;
+}
+
+static void extreme_rows(const ImageView& src, const ImageView& dst, int radius, bool take_max) {
+	const CpuKernels& kernels = CpuDispatch::kernels();
+	int planes = src.planes();
+
+	#pragma omp parallel
+	{
+		std::vector<uint8_t> work(src.w + 2 * radius);
+		#pragma omp for collapse(2) schedule(static)
+		for(int c = 0; c < planes; ++c) {
+			for(int y = 0; y < src.h; ++y) {
+				kernels.extreme_row(src.row(y, c), src.pixel_step(), src.w, radius, take_max, dst.row(y, c), work.data());
+			}
+		}
+	}
+}
+
+static void extreme_columns(const ImageView& src, const ImageView& dst, int radius, bool take_max) {
+	const CpuKernels& kernels = CpuDispatch::kernels();
+	int planes = src.planes();
+	size_t n = src.row_bytes();
+	int strips = (int)((n + COLUMN_STRIP - 1) / COLUMN_STRIP);
+
+	#pragma omp parallel
+	{
+		std::vector<uint8_t> work((size_t)(src.h + 2 * radius + 2) * COLUMN_STRIP);
+		#pragma omp for collapse(2) schedule(static)
+		for(int c = 0; c < planes; ++c) {
+			for(int s = 0; s < strips; ++s) {
+				size_t x = s * COLUMN_STRIP;
+				kernels.extreme_columns(src.row(0, c) + x, src.stride, std::min(COLUMN_STRIP, n - x), src.h, radius,
+					take_max, dst.row(0, c) + x, dst.stride, work.data());
+			}
+		}
+	}
+}
+
+static void extreme_filter(const ImageView& src, const ImageView& dst, int rx, int ry, StructuringElement shape, bool take_max) {
+	Image rows = like(src);
+	extreme_rows(src, rows.view(), rx, take_max);
+
+	if(shape == MORPH_RECT) {
+		extreme_columns(rows.view(), dst, ry, take_max);
+		return;
+	}
+	// Both lines read src, the column pass can write over it
+	extreme_columns(src, dst, ry, take_max);
+	const CpuKernels& kernels = CpuDispatch::kernels();
+	for(int c = 0; c < dst.planes(); ++c) {
+		for(int y = 0; y < dst.h; ++y) {
+			kernels.extreme(dst.row(y, c), rows.view().row(y, c), dst.row(y, c), dst.row_bytes(), take_max);
+		}
+	}
+}
+
+// a = |a - b| row by row, b never larger or never smaller than a
+static void difference(const ImageView& a, const ImageView& b) {
+	const CpuKernels& kernels = CpuDispatch::kernels();
+
+	#pragma omp parallel for collapse(2) schedule(static)
+	for(int c = 0; c < a.planes(); ++c) {
+		for(int y = 0; y < a.h; ++y) {
+			kernels.absdiff(a.row(y, c), b.row(y, c), a.row_bytes());
+		}
+	}
+}
+
+void erode(const ImageView& src, const ImageView& dst, int rx, int ry, StructuringElement shape) {
+	morphology(src, dst, MORPH_ERODE, rx, ry, shape);
+}
+
+void dilate(const ImageView& src, const ImageView& dst, int rx, int ry, StructuringElement shape) {
+	morphology(src, dst, MORPH_DILATE, rx, ry, shape);
+}
+
+void morphology(const ImageView& src, const ImageView& dst, MorphologyOp op, int rx, int ry, StructuringElement shape) {
+	if(src.w != dst.w || src.h != dst.h || src.channels != dst.channels || src.layout != dst.layout) {
+		printf("morphology needs a destination with the shape and layout of the source\n");
+		return;
+	}
+	if(!Morphology::valid_radii(rx, ry, "morphology")) {
+		return;
+	}
+
+	// The differences read src again after dst is written
+	std::unique_ptr<Image> copy;
+	if(op == MORPH_GRADIENT || op == MORPH_TOPHAT || op == MORPH_BLACKHAT) {
+		copy = unaliased(src, dst);
+	}
+	ImageView input = copy ? copy->view() : src;
+
+	switch(op) {
+		case MORPH_ERODE:
+		case MORPH_DILATE:
+			extreme_filter(input, dst, rx, ry, shape, op == MORPH_DILATE);
+			break;
+		case MORPH_OPEN:
+		case MORPH_CLOSE: {
+			Image first = like(input);
+			extreme_filter(input, first.view(), rx, ry, shape, op == MORPH_CLOSE);
+			extreme_filter(first.view(), dst, rx, ry, shape, op == MORPH_OPEN);
+			break;
+		}
+		case MORPH_GRADIENT: {
+			Image dilated = like(input);
+			extreme_filter(input, dilated.view(), rx, ry, shape, true);
+			extreme_filter(input, dst, rx, ry, shape, false);
+			difference(dst, dilated.view());
+			break;
+		}
+		case MORPH_TOPHAT:
+		case MORPH_BLACKHAT:
+			morphology(input, dst, op == MORPH_TOPHAT ? MORPH_OPEN : MORPH_CLOSE, rx, ry, shape);
+			difference(dst, input);
+			break;
+	}
+}
+
+}
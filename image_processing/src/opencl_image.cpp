@@ -1,7 +1,15 @@
 #include "../include/opencl_image.h"
+#include "../include/raw_image.h"
+#include "../include/result_cache.h"
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include<cstdlib>
+#include <cstring>
+
+// The resize kernels call planar.cl's pixel helpers
+static const std::vector<std::string> RESIZE_SOURCES = { "include/kernels/resize.cl", "include/kernels/planar.cl" };
 
 
 std::string OpenCLImageProcessor::getErrorString(cl_int error) {
@@ -30,16 +38,38 @@ void OpenCLImageProcessor::init() {
     }
 
     cl::Platform default_platform = all_platforms[0];
-    std::cout << "Using platform: " <<default_platform.getInfo<CL_PLATFORM_NAME>() << "\n";
 
-    // Select a device
-    // TODO make this configurable
+    // Select a device, the first of the type IMAGE_CL_DEVICE (cpu or gpu)
+    // names on any platform, else the first of the first platform
     std::vector<cl::Device> all_devices;
-    default_platform.getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
+    const char* requested = getenv("IMAGE_CL_DEVICE");
+    if (requested != NULL && *requested != '\0') {
+        cl_device_type type = strcmp(requested, "cpu") == 0 ? CL_DEVICE_TYPE_CPU
+            : strcmp(requested, "gpu") == 0 ? CL_DEVICE_TYPE_GPU : 0;
+        if (type == 0) {
+            std::cout << "Unknown IMAGE_CL_DEVICE=" << requested << ", expected cpu or gpu\n";
+        }
+        for (size_t i = 0; type != 0 && i < all_platforms.size() && all_devices.empty(); ++i) {
+            // getDevices fails when the platform has none of the type
+            if (all_platforms[i].getDevices(type, &all_devices) == CL_SUCCESS && !all_devices.empty()) {
+                default_platform = all_platforms[i];
+            }
+            else {
+                all_devices.clear();
+            }
+        }
+        if (type != 0 && all_devices.empty()) {
+            std::cout << "No " << requested << " device found for IMAGE_CL_DEVICE, using the default\n";
+        }
+    }
+    if (all_devices.empty()) {
+        default_platform.getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
+    }
     if (all_devices.size() == 0) {
         std::cout << " No devices found.\n";
         exit(1);
     }
+    std::cout << "Using platform: " <<default_platform.getInfo<CL_PLATFORM_NAME>() << "\n";
 
     device = all_devices[0];
     std::cout << "Using device: " << device.getInfo<CL_DEVICE_NAME>() << "\n";
@@ -47,12 +77,8 @@ void OpenCLImageProcessor::init() {
     size_t max_work_group_size = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
     std::cout << "Maximum work-group size: " << max_work_group_size << "\n";
 
-    // Define properties for the command queue
-#ifdef PROFILE
+    // Profiling events feed timings()
     cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
-#else
-    cl_command_queue_properties properties = 0;
-#endif
 
     //create context, kernel source and queue to push commands to the device.
     context = cl::Context({ device });
@@ -74,87 +100,140 @@ std::string OpenCLImageProcessor::loadKernelSource(const std::string& fileName)
     return sourceStr;
 }
 
-void OpenCLImageProcessor::grayscale_avg(Image& image) {
+bool OpenCLImageProcessor::sameShape(const ImageView& src, const ImageView& dst, const char* op) {
+    if (src.w != dst.w || src.h != dst.h || src.channels != dst.channels || src.layout != dst.layout) {
+        std::cout << op << " needs a destination with the shape and layout of the source." << std::endl;
+        return false;
+    }
+    return true;
+}
 
-    if(image.channels < 3) {
-		std::cout<<"Image "<<&image<<" has less than 3 channels, it is assumed to already be grayscale."<<std::endl;
+cl::Buffer OpenCLImageProcessor::scratch(ScratchSlot slot, size_t bytes) {
+    // Device buffers are kept between calls and only grow, so repeated work on
+    // same sized images never allocates device memory
+    if (scratch_bytes[slot] < bytes) {
+        scratch_buffers[slot] = cl::Buffer(context, CL_MEM_READ_WRITE, bytes);
+        scratch_bytes[slot] = bytes;
+    }
+    return scratch_buffers[slot];
+}
+
+cl::Buffer OpenCLImageProcessor::hostBuffer(uint8_t* data, size_t bytes, ScratchSlot slot) {
+    if (host_data[slot] != data || host_bytes[slot] != bytes) {
+        host_buffers[slot] = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, bytes, data);
+        host_data[slot] = data;
+        host_bytes[slot] = bytes;
+        return host_buffers[slot];
+    }
+
+    // Same pixels as last time, but they may have been written since. Mapping
+    // for writing and unmapping hands them to the runtime again, which costs
+    // nothing where the device reads host memory directly.
+    void* mapped = queue.enqueueMapBuffer(host_buffers[slot], CL_TRUE, CL_MAP_WRITE, 0, bytes);
+    queue.enqueueUnmapMemObject(host_buffers[slot], mapped);
+    return host_buffers[slot];
+}
+
+cl::Buffer OpenCLImageProcessor::uploadView(const ImageView& view, ScratchSlot slot, bool read_only) {
+    size_t bytes = view.bytes();
+
+    if (view.contiguous()) {
+        // Page aligned pixels (mapped .rimg files) are read by the runtime in place
+        if (read_only && (uintptr_t)view.data % RawImage::page_size() == 0) {
+            return hostBuffer(view.data, bytes, slot);
+        }
+        cl::Buffer buffer = scratch(slot, bytes);
+        cl::Event event;
+        queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, bytes, view.data, nullptr, &event);
+        device_timings.transfer_ms += eventMs(event);
+        return buffer;
+    }
+
+    // Strided region of a larger image, gather it into a dense buffer
+    cl::Buffer buffer = scratch(slot, bytes);
+    size_t row_bytes = view.row_bytes();
+    std::array<size_t, 3> origin = {0, 0, 0};
+    std::array<size_t, 3> region = {row_bytes, (size_t)view.h, (size_t)view.planes()};
+    cl::Event event;
+    queue.enqueueWriteBufferRect(buffer, CL_TRUE, origin, origin, region,
+        row_bytes, row_bytes * view.h, view.stride, view.planes() > 1 ? view.plane_pitch : 0, view.data,
+        nullptr, &event);
+    device_timings.transfer_ms += eventMs(event);
+    return buffer;
+}
+
+void OpenCLImageProcessor::downloadView(const cl::Buffer& buffer, const ImageView& view) {
+    cl::Event event;
+    if (view.contiguous()) {
+        queue.enqueueReadBuffer(buffer, CL_TRUE, 0, view.bytes(), view.data, nullptr, &event);
+        device_timings.transfer_ms += eventMs(event);
+        return;
+    }
+
+    size_t row_bytes = view.row_bytes();
+    std::array<size_t, 3> origin = {0, 0, 0};
+    std::array<size_t, 3> region = {row_bytes, (size_t)view.h, (size_t)view.planes()};
+    queue.enqueueReadBufferRect(buffer, CL_TRUE, origin, origin, region,
+        row_bytes, row_bytes * view.h, view.stride, view.planes() > 1 ? view.plane_pitch : 0, view.data,
+        nullptr, &event);
+    device_timings.transfer_ms += eventMs(event);
+}
+
+void OpenCLImageProcessor::grayscale_avg(const ImageView& src, const ImageView& dst) {
+
+    if (!sameShape(src, dst, "grayscale_avg")) {
+        return;
+    }
+
+    if (src.layout == PLANAR) {
+        std::cout << "grayscale_avg expects an interleaved image, call to_interleaved() first." << std::endl;
+        return;
+    }
+
+    if(src.channels < 3) {
+		std::cout<<"Image "<<&src<<" has less than 3 channels, it is assumed to already be grayscale."<<std::endl;
         return;
 	}
 
     // Prepare memory
-    size_t bytes_i = image.size * sizeof(uint8_t);
-    cl::Buffer data_d(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, bytes_i, image.data);
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT, false);
 
     // Load Kernel
-    std::string kernel_code = loadKernelSource("include/kernels/grayscale.cl");
-    //Appending the kernel, which is presented here as a string. 
-    cl::Program::Sources sources;
-    sources.push_back({ kernel_code.c_str(),kernel_code.length() });
-
-    // Compile program
-    cl::Program program(context, sources);
-    if (program.build({ device }) != CL_SUCCESS) {
-        std::cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
-        exit(1);
-    }
+    cl::Program program = buildProgram("include/kernels/grayscale.cl");
 
     // Load in kernel args
     cl::Kernel kernel(program, "grayscale_avg");
     kernel.setArg(0, data_d);
-    kernel.setArg(1, image.channels);
+    kernel.setArg(1, src.channels);
 
     // Set dimensions
-    cl::NDRange global(image.w * image.h);
+    cl::NDRange global(src.w * src.h);
     
 
-#ifdef PROFILE
-    // For Profiling
-    cl::Event event;
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange, nullptr, &event);
-#else
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange);
-#endif
-
-    queue.finish();
+    runKernel(kernel, global);
 
     // Read back the results
-    queue.enqueueReadBuffer(data_d, CL_TRUE, 0, bytes_i, image.data);
-
-#ifdef PROFILE
-    // Get profiling information
-    cl_ulong time_start;
-    cl_ulong time_end;
-    event.getProfilingInfo(CL_PROFILING_COMMAND_START, &time_start);
-    event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time_end);
+    downloadView(data_d, dst);
 
-    // Compute the elapsed time in nanoseconds
-    cl_ulong elapsed_time = time_end - time_start;
+}
 
-    std::cout << "Kernel execution time: " << (double) elapsed_time / 1000000 << " ms" << std::endl;
-#endif
+void OpenCLImageProcessor::diffmap(const ImageView& image1, const ImageView& image2, const ImageView& dst) {
 
-}
+    if (!sameShape(image1, dst, "diffmap")) {
+        return;
+    }
 
-void OpenCLImageProcessor::diffmap(Image& image1, Image& image2) {
+    if (image1.layout == PLANAR || image2.layout == PLANAR) {
+        std::cout << "diffmap expects interleaved images, call to_interleaved() first." << std::endl;
+        return;
+    }
 
     // Prepare memory
-    size_t bytes_i = image1.size * sizeof(uint8_t);
-    size_t bytes_o = image2.size * sizeof(uint8_t);
-    cl::Buffer image1_d(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, bytes_i, image1.data);
-    cl::Buffer image2_d(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytes_o, image2.data);
+    cl::Buffer image1_d = uploadView(image1, SCRATCH_INPUT, false);
+    cl::Buffer image2_d = uploadView(image2, SCRATCH_SECOND);
 
     // Load Kernel
-    std::string kernel_code = loadKernelSource("include/kernels/diffmap.cl");
-    //Appending the kernel, which is presented here as a string. 
-    cl::Program::Sources sources;
-    sources.push_back({ kernel_code.c_str(),kernel_code.length() });
-
-    // Compile program
-    cl::Program program(context, sources);
-    if (program.build({ device }) != CL_SUCCESS) {
-        std::cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
-        exit(1);
-    }
+    cl::Program program = buildProgram("include/kernels/diffmap.cl");
 
     // Preprocessing
     int compare_width = fmin(image1.w,image2.w);
@@ -178,303 +257,264 @@ void OpenCLImageProcessor::diffmap(Image& image1, Image& image2) {
     // Set dimensions
     cl::NDRange global(image1.w, image1.h, image1.channels);
 
-#ifdef PROFILE
-    // For Profiling
-    cl::Event event;
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange, nullptr, &event);
-#else
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange);
-#endif
-
-    queue.finish();
+    runKernel(kernel, global);
 
     // Read back the results
-    queue.enqueueReadBuffer(image1_d, CL_TRUE, 0, bytes_i, image1.data);
-
-#ifdef PROFILE
-    // Get profiling information
-    cl_ulong time_start;
-    cl_ulong time_end;
-    event.getProfilingInfo(CL_PROFILING_COMMAND_START, &time_start);
-    event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time_end);
-
-    // Compute the elapsed time in nanoseconds
-    cl_ulong elapsed_time = time_end - time_start;
-
-    std::cout << "Kernel execution time: " << (double) elapsed_time / 1000000 << " ms" << std::endl;
-#endif
+    downloadView(image1_d, dst);
 
 }
 
-void OpenCLImageProcessor::flipX(Image& image) {
+void OpenCLImageProcessor::flipX(const ImageView& src, const ImageView& dst) {
+
+    if (!sameShape(src, dst, "flipX")) {
+        return;
+    }
 
     // Prepare memory
-    size_t bytes_i = image.size * sizeof(uint8_t);
-    cl::Buffer data_d(context, CL_MEM_READ_WRITE, bytes_i);
-    queue.enqueueWriteBuffer(data_d, CL_TRUE, 0, bytes_i, image.data);
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT, false);
 
     // Load Kernel
-    std::string kernel_code = loadKernelSource("include/kernels/flip.cl");
-    //Appending the kernel, which is presented here as a string. 
-    cl::Program::Sources sources;
-    sources.push_back({ kernel_code.c_str(),kernel_code.length() });
-
-    // Compile program
-    cl::Program program(context, sources);
-    if (program.build({ device }) != CL_SUCCESS) {
-        std::cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
-        exit(1);
-    }
+    cl::Program program = buildProgram("include/kernels/flip.cl");
 
     // Load in kernel args
     cl::Kernel kernel(program, "flipX2d");
     kernel.setArg(0, data_d);
-    kernel.setArg(1, image.w);
-    kernel.setArg(2, image.h);
-    kernel.setArg(3, image.channels);
+    // Planes stacked on top of each other flip like one single channel image
+    int rows = src.h * src.planes();
+    int channels = src.layout == PLANAR ? 1 : src.channels;
+    kernel.setArg(1, src.w);
+    kernel.setArg(2, rows);
+    kernel.setArg(3, channels);
 
     // Set dimensions
-    cl::NDRange global(image.w, image.h);
-    // cl::NDRange global(image.w, image.h, image.channels);
+    cl::NDRange global(src.w, rows);
+    // cl::NDRange global(src.w, src.h, src.channels);
     
 
-#ifdef PROFILE
-    // For Profiling
-    cl::Event event;
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange, nullptr, &event);
-#else
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange);
-#endif
+    runKernel(kernel, global);
 
-    queue.finish();
+    // Read back the results
+    downloadView(data_d, dst);
+
+}
+
+void OpenCLImageProcessor::flipY(const ImageView& src, const ImageView& dst) {
+
+    if (!sameShape(src, dst, "flipY")) {
+        return;
+    }
+
+    // Prepare memory
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT, false);
+
+    cl::Program program = buildProgram("include/kernels/flip.cl");
+
+    // Load in kernel args
+    cl::Kernel kernel(program, "flipY2d");
+    kernel.setArg(0, data_d);
+    kernel.setArg(1, src.w);
+    kernel.setArg(2, src.h);
+    kernel.setArg(3, src.layout == PLANAR ? 1 : src.channels);
+
+    // One work-item per pixel of the top half, per plane
+    runKernel(kernel, cl::NDRange(src.w, src.h / 2, src.planes()));
 
     // Read back the results
-    queue.enqueueReadBuffer(data_d, CL_TRUE, 0, bytes_i, image.data);
+    downloadView(data_d, dst);
+}
 
-#ifdef PROFILE
-    // Get profiling information
-    cl_ulong time_start;
-    cl_ulong time_end;
-    event.getProfilingInfo(CL_PROFILING_COMMAND_START, &time_start);
-    event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time_end);
+bool OpenCLImageProcessor::rotatedShape(const ImageView& src, const ImageView& dst, bool swapped, const char* op) {
+    int w = swapped ? src.h : src.w, h = swapped ? src.w : src.h;
+    if (dst.w != w || dst.h != h || src.channels != dst.channels || src.layout != dst.layout) {
+        std::cout << op << " needs a " << w << "x" << h << " destination with the channels and layout of the source." << std::endl;
+        return false;
+    }
+    if (src.channels > 4) {
+        std::cout << op << " supports up to 4 channels." << std::endl;
+        return false;
+    }
+    return true;
+}
 
-    // Compute the elapsed time in nanoseconds
-    cl_ulong elapsed_time = time_end - time_start;
+void OpenCLImageProcessor::transposeDevice(const ImageView& src, const ImageView& dst, bool flip_rows, bool flip_cols) {
 
-    std::cout << "Kernel execution time: " << (double) elapsed_time / 1000000 << " ms" << std::endl;
-#endif
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+
+    const size_t tile = 16;
+    cl::Program program = buildProgram("include/kernels/geometry.cl", "-DTILE=" + std::to_string(tile));
+
+    cl::Kernel kernel(program, "transpose_tiled");
+    kernel.setArg(0, data_d);
+    kernel.setArg(1, output_d);
+    kernel.setArg(2, src.w);
+    kernel.setArg(3, src.h);
+    kernel.setArg(4, src.layout == PLANAR ? 1 : src.channels);
+    kernel.setArg(5, (int)flip_rows);
+    kernel.setArg(6, (int)flip_cols);
+
+    // Whole tiles, edge work-items only take part in the barrier
+    size_t gw = (src.w + tile - 1) / tile * tile, gh = (src.h + tile - 1) / tile * tile;
+    runKernel(kernel, cl::NDRange(gw, gh, src.planes()), cl::NDRange(tile, tile, 1));
 
+    // Read back the results
+    downloadView(output_d, dst);
 }
 
-void OpenCLImageProcessor::flipY(Image& image) {
+void OpenCLImageProcessor::transpose(const ImageView& src, const ImageView& dst) {
+    if (rotatedShape(src, dst, true, "transpose")) {
+        transposeDevice(src, dst, false, false);
+    }
+}
 
-    // Prepare memory
-    size_t bytes_i = image.size * sizeof(uint8_t);
-    cl::Buffer data_d(context, CL_MEM_READ_WRITE, bytes_i);
-    queue.enqueueWriteBuffer(data_d, CL_TRUE, 0, bytes_i, image.data);
+void OpenCLImageProcessor::rotate(const ImageView& src, const ImageView& dst, Rotation rotation) {
 
-    // Load Kernel
-    std::string kernel_code = loadKernelSource("include/kernels/flip.cl");
-    //Appending the kernel, which is presented here as a string. 
-    cl::Program::Sources sources;
-    sources.push_back({ kernel_code.c_str(),kernel_code.length() });
+    if (!rotatedShape(src, dst, rotation != ROTATE_180, "rotate")) {
+        return;
+    }
 
-    // Compile program
-    cl::Program program(context, sources);
-    if (program.build({ device }) != CL_SUCCESS) {
-        std::cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
-        exit(1);
+    if (rotation == ROTATE_90) {
+        transposeDevice(src, dst, false, true);
+        return;
+    }
+    if (rotation == ROTATE_270) {
+        transposeDevice(src, dst, true, false);
+        return;
     }
 
-    // Load in kernel args
-    cl::Kernel kernel(program, "flipY2d");
-    kernel.setArg(0, data_d);
-    kernel.setArg(1, image.w);
-    kernel.setArg(2, image.h);
-    kernel.setArg(3, image.channels);
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, dst.bytes());
 
-    // Set dimensions
-    cl::NDRange global(image.w, image.h);
-    // cl::NDRange global(image.w, image.h, image.channels);
-    
+    cl::Program program = buildProgram("include/kernels/geometry.cl");
 
-#ifdef PROFILE
-    // For Profiling
-    cl::Event event;
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange, nullptr, &event);
-#else
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange);
-#endif
+    cl::Kernel kernel(program, "rotate_180");
+    kernel.setArg(0, data_d);
+    kernel.setArg(1, output_d);
+    kernel.setArg(2, src.w);
+    kernel.setArg(3, src.h);
+    kernel.setArg(4, src.layout == PLANAR ? 1 : src.channels);
 
-    queue.finish();
+    runKernel(kernel, cl::NDRange(src.w, src.h, src.planes()));
 
     // Read back the results
-    queue.enqueueReadBuffer(data_d, CL_TRUE, 0, bytes_i, image.data);
+    downloadView(output_d, dst);
+}
 
-#ifdef PROFILE
-    // Get profiling information
-    cl_ulong time_start;
-    cl_ulong time_end;
-    event.getProfilingInfo(CL_PROFILING_COMMAND_START, &time_start);
-    event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time_end);
+void OpenCLImageProcessor::transpose(Image& image) {
+    uint8_t* newImage = image.allocate(image.size);
+    transpose(image.view(), ImageView(newImage, image.h, image.w, image.channels, 0, image.layout));
 
-    // Compute the elapsed time in nanoseconds
-    cl_ulong elapsed_time = time_end - time_start;
+    std::swap(image.w, image.h);
+    image.replace_data(newImage, image.size);
+}
 
-    std::cout << "Kernel execution time: " << (double) elapsed_time / 1000000 << " ms" << std::endl;
-#endif
+void OpenCLImageProcessor::rotate(Image& image, Rotation rotation) {
+    bool swapped = rotation != ROTATE_180;
+    uint8_t* newImage = image.allocate(image.size);
+    rotate(image.view(), ImageView(newImage, swapped ? image.h : image.w, swapped ? image.w : image.h,
+        image.channels, 0, image.layout), rotation);
 
+    if (swapped) {
+        std::swap(image.w, image.h);
+    }
+    image.replace_data(newImage, image.size);
 }
 
-void OpenCLImageProcessor::std_convolve_clamp_to_0(Image& image, const Mask::BaseMask* mask) {
+void OpenCLImageProcessor::std_convolve_clamp_to_0(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask) {
+
+    if (!sameShape(src, dst, "std_convolve_clamp_to_0")) {
+        return;
+    }
+    if (mask->isStatic()) {
+        convolveStatic(src, dst, mask, CLAMP_TO_0);
+        return;
+    }
 
     // Preprocessing for mask data
     // Mask offset is basically center row or center column
     uint32_t MASK_W = mask->getWidth(), MASK_OFFSET_W = mask->getCenterColumn();
     uint32_t MASK_H = mask->getHeight(), MASK_OFFSET_H = mask->getCenterRow();
-	const double* ker = mask->getData(); 
 
     // Prepare memory
-    size_t bytes_i = image.size * sizeof(uint8_t);
-    size_t bytes_m = MASK_H * MASK_W * sizeof(double);
-    cl::Buffer data_d(context, CL_MEM_READ_ONLY, bytes_i);
-    cl::Buffer result_d(context, CL_MEM_WRITE_ONLY, bytes_i);
-    cl::Buffer mask_d(context, CL_MEM_READ_ONLY, bytes_m);
-    queue.enqueueWriteBuffer(data_d, CL_TRUE, 0, bytes_i, image.data);
-    queue.enqueueWriteBuffer(mask_d, CL_TRUE, 0, bytes_m, ker);
+    size_t bytes_i = src.bytes();
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer result_d = scratch(SCRATCH_OUTPUT, bytes_i);
+    cl::Buffer mask_d = maskBuffer(mask);
 
     // Load Kernel
-    std::string kernel_code = loadKernelSource("include/kernels/convolution.cl");
-    //Appending the kernel, which is presented here as a string. 
-    cl::Program::Sources sources;
-    sources.push_back({ kernel_code.c_str(),kernel_code.length() });
-
-    // Compile program
-    cl::Program program(context, sources);
-    if (program.build({ device }) != CL_SUCCESS) {
-        std::cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
-        exit(1);
-    }
+    cl::Program program = buildProgram("include/kernels/convolution.cl");
 
-    // Load in kernel args
-    cl::Kernel kernel(program, "convolution_0");
+    // Load in kernel args, planar images run one work-item per channel sample
+    bool planar = src.layout == PLANAR && src.channels > 1;
+    cl::Kernel kernel(program, planar ? "convolution_planar_0" : "convolution_0");
     kernel.setArg(0, data_d);
     kernel.setArg(1, result_d);
     kernel.setArg(2, mask_d);
-    kernel.setArg(3, image.w);
-    kernel.setArg(4, image.h);
-    kernel.setArg(5, image.channels);
+    kernel.setArg(3, src.w);
+    kernel.setArg(4, src.h);
+    kernel.setArg(5, src.channels);
     kernel.setArg(6, MASK_W);
     kernel.setArg(7, MASK_H);
     kernel.setArg(8, MASK_OFFSET_W);
     kernel.setArg(9, MASK_OFFSET_H);
 
     // Set dimensions
-    cl::NDRange global(image.w, image.h);
-    // cl::NDRange global(image.w, image.h, image.channels);
+    cl::NDRange global = planar ? cl::NDRange(src.w, src.h, src.channels) : cl::NDRange(src.w, src.h);
     
 
-#ifdef PROFILE
-    // For Profiling
-    cl::Event event;
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange, nullptr, &event);
-#else
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange);
-#endif
-
-    queue.finish();
+    runKernel(kernel, global);
 
     // Read back the results
-    queue.enqueueReadBuffer(result_d, CL_TRUE, 0, bytes_i, image.data);
-
-#ifdef PROFILE
-    // Get profiling information
-    cl_ulong time_start;
-    cl_ulong time_end;
-    event.getProfilingInfo(CL_PROFILING_COMMAND_START, &time_start);
-    event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time_end);
-
-    // Compute the elapsed time in nanoseconds
-    cl_ulong elapsed_time = time_end - time_start;
-
-    std::cout << "Kernel execution time: " << (double) elapsed_time / 1000000 << " ms" << std::endl;
-#endif
+    downloadView(result_d, dst);
 
 }
 
-void OpenCLImageProcessor::std_convolve_clamp_to_border(Image& image, const Mask::BaseMask* mask) {
+void OpenCLImageProcessor::std_convolve_clamp_to_border(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask) {
+
+    if (!sameShape(src, dst, "std_convolve_clamp_to_border")) {
+        return;
+    }
+    if (mask->isStatic()) {
+        convolveStatic(src, dst, mask, CLAMP_TO_BORDER);
+        return;
+    }
 
     // Preprocessing for mask data
     // Mask offset is basically center row or center column
     uint32_t MASK_W = mask->getWidth(), MASK_OFFSET_W = mask->getCenterColumn();
     uint32_t MASK_H = mask->getHeight(), MASK_OFFSET_H = mask->getCenterRow();
-	const double* ker = mask->getData(); 
 
     // Prepare memory
-    size_t bytes_i = image.size * sizeof(uint8_t);
-    size_t bytes_m = MASK_H * MASK_W * sizeof(double);
-    cl::Buffer data_d(context, CL_MEM_READ_ONLY, bytes_i);
-    cl::Buffer result_d(context, CL_MEM_WRITE_ONLY, bytes_i);
-    cl::Buffer mask_d(context, CL_MEM_READ_ONLY, bytes_m);
-    queue.enqueueWriteBuffer(data_d, CL_TRUE, 0, bytes_i, image.data);
-    queue.enqueueWriteBuffer(mask_d, CL_TRUE, 0, bytes_m, ker);
+    size_t bytes_i = src.bytes();
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer result_d = scratch(SCRATCH_OUTPUT, bytes_i);
+    cl::Buffer mask_d = maskBuffer(mask);
 
     // Load Kernel
-    std::string kernel_code = loadKernelSource("include/kernels/convolution.cl");
-    //Appending the kernel, which is presented here as a string. 
-    cl::Program::Sources sources;
-    sources.push_back({ kernel_code.c_str(),kernel_code.length() });
-
-    // Compile program
-    cl::Program program(context, sources);
-    if (program.build({ device }) != CL_SUCCESS) {
-        std::cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
-        exit(1);
-    }
+    cl::Program program = buildProgram("include/kernels/convolution.cl");
 
-    // Load in kernel args
-    cl::Kernel kernel(program, "convolution_border");
+    // Load in kernel args, planar images run one work-item per channel sample
+    bool planar = src.layout == PLANAR && src.channels > 1;
+    cl::Kernel kernel(program, planar ? "convolution_planar_border" : "convolution_border");
     kernel.setArg(0, data_d);
     kernel.setArg(1, result_d);
     kernel.setArg(2, mask_d);
-    kernel.setArg(3, image.w);
-    kernel.setArg(4, image.h);
-    kernel.setArg(5, image.channels);
+    kernel.setArg(3, src.w);
+    kernel.setArg(4, src.h);
+    kernel.setArg(5, src.channels);
     kernel.setArg(6, MASK_W);
     kernel.setArg(7, MASK_H);
     kernel.setArg(8, MASK_OFFSET_W);
     kernel.setArg(9, MASK_OFFSET_H);
 
     // Set dimensions
-    cl::NDRange global(image.w, image.h);
-    // cl::NDRange global(image.w, image.h, image.channels);
+    cl::NDRange global = planar ? cl::NDRange(src.w, src.h, src.channels) : cl::NDRange(src.w, src.h);
     
 
-#ifdef PROFILE
-    // For Profiling
-    cl::Event event;
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange, nullptr, &event);
-#else
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange);
-#endif
-
-    queue.finish();
+    runKernel(kernel, global);
 
     // Read back the results
-    queue.enqueueReadBuffer(result_d, CL_TRUE, 0, bytes_i, image.data);
-
-#ifdef PROFILE
-    // Get profiling information
-    cl_ulong time_start;
-    cl_ulong time_end;
-    event.getProfilingInfo(CL_PROFILING_COMMAND_START, &time_start);
-    event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time_end);
-
-    // Compute the elapsed time in nanoseconds
-    cl_ulong elapsed_time = time_end - time_start;
-
-    std::cout << "Kernel execution time: " << (double) elapsed_time / 1000000 << " ms" << std::endl;
-#endif
+    downloadView(result_d, dst);
 
 }
 
@@ -555,17 +595,7 @@ void OpenCLImageProcessor::std_convolve_clamp_to_cyclic(Image& image, const Mask
     queue.enqueueWriteBuffer(mask_d, CL_TRUE, 0, bytes_m, ker);
 
     // Load Kernel
-    std::string kernel_code = loadKernelSource("include/kernels/convolution.cl");
-    //Appending the kernel, which is presented here as a string. 
-    cl::Program::Sources sources;
-    sources.push_back({ kernel_code.c_str(),kernel_code.length() });
-
-    // Compile program
-    cl::Program program(context, sources);
-    if (program.build({ device }) != CL_SUCCESS) {
-        std::cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
-        exit(1);
-    }
+    cl::Program program = buildProgram("include/kernels/convolution.cl");
 
     // Load in kernel args
     cl::Kernel kernel(program, "convolution_circular");
@@ -613,158 +643,1495 @@ void OpenCLImageProcessor::std_convolve_clamp_to_cyclic(Image& image, const Mask
 
 }
 
-void OpenCLImageProcessor::resizeBilinear(Image& image, int nw, int nh) {
+void OpenCLImageProcessor::resizeBilinear(const ImageView& src, const ImageView& dst) {
 
     // Prepare memory
-    cl_int ret;
-    size_t bytes_i = image.size * sizeof(uint8_t);
-    size_t bytes_o = nw * nh * image.channels * sizeof(uint8_t);
-    cl::Buffer data_d(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytes_i, image.data);
-    cl::Buffer output_d(context, CL_MEM_WRITE_ONLY, bytes_o);
+    int nw = dst.w, nh = dst.h;
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, dst.bytes());
 
     // Load Kernel
-    std::string kernel_code = loadKernelSource("include/kernels/resize.cl"); 
-    cl::Program::Sources sources;
-    sources.push_back({ kernel_code.c_str(),kernel_code.length() });
-
-    // Compile program
-    cl::Program program(context, sources);
-    if (program.build({ device }) != CL_SUCCESS) {
-        std::cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
-        exit(1);
-    }
+    cl::Program program = buildProgram(RESIZE_SOURCES);
 
-    float scaleX = (float) (image.w-1) / (nw-1);
-    float scaleY = (float) (image.h-1) / (nh-1);
+    float scaleX = (float) (src.w-1) / (nw-1);
+    float scaleY = (float) (src.h-1) / (nh-1);
 
     // Load in kernel args
-    cl::Kernel kernel(program, "resize_bilinear");
+    bool planar = src.layout == PLANAR && src.channels > 1;
+    cl::Kernel kernel(program, planar ? "resize_bilinear_planar" : "resize_bilinear");
     kernel.setArg(0, data_d);
     kernel.setArg(1, output_d);
     kernel.setArg(2, nw);
     kernel.setArg(3, nh);
-    kernel.setArg(4, image.w);
-    kernel.setArg(5, image.h);
-    kernel.setArg(6, image.channels);
+    kernel.setArg(4, src.w);
+    kernel.setArg(5, src.h);
+    kernel.setArg(6, src.channels);
     kernel.setArg(7, scaleX);
     kernel.setArg(8, scaleY);
 
     // Set dimensions
-    cl::NDRange global(nw, nh);
+    cl::NDRange global = planar ? cl::NDRange(nw, nh, src.channels) : cl::NDRange(nw, nh);
     
 
-#ifdef PROFILE
-    // For Profiling
-    cl::Event event;
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange, nullptr, &event);
-#else
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange);
-#endif
-
-    queue.finish();
+    runKernel(kernel, global);
 
     // Read back the results
-    image.size = nw * nh * image.channels;
-	uint8_t* newImage = new uint8_t[image.size];
-    image.w = nw;
-	image.h = nh;
-	delete[] image.data;
-	image.data = newImage;
-	newImage = nullptr;
-    ret = queue.enqueueReadBuffer(output_d, CL_TRUE, 0, bytes_o, image.data);
-    if (ret != CL_SUCCESS) {
-        std::cerr << "Failed to read out buffer: " << ret << "\n";
-        return;
-    }
-#ifdef PROFILE
-    // Get profiling information
-    cl_ulong time_start;
-    cl_ulong time_end;
-    event.getProfilingInfo(CL_PROFILING_COMMAND_START, &time_start);
-    event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time_end);
+    downloadView(output_d, dst);
 
-    // Compute the elapsed time in nanoseconds
-    cl_ulong elapsed_time = time_end - time_start;
+}
 
-    std::cout << "Kernel execution time: " << (double) elapsed_time / 1000000 << " ms" << std::endl;
-#endif
+void OpenCLImageProcessor::resizeBilinear(Image& image, int nw, int nh) {
+    size_t bytes = (size_t)nw * nh * image.channels;
+    uint8_t* newImage = image.allocate(bytes);
+    resizeBilinear(image.view(), ImageView(newImage, nw, nh, image.channels, 0, image.layout));
 
+    image.w = nw;
+    image.h = nh;
+    image.size = bytes;
+    image.replace_data(newImage, bytes);
 }
 
-void OpenCLImageProcessor::resizeBicubic(Image& image, int nw, int nh) {
+void OpenCLImageProcessor::resizeBicubic(const ImageView& src, const ImageView& dst) {
 
     // Prepare memory
-    cl_int ret;
-    size_t bytes_i = image.size * sizeof(uint8_t);
-    size_t bytes_o = nw * nh * image.channels * sizeof(uint8_t);
-    cl::Buffer data_d(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytes_i, image.data);
-    cl::Buffer output_d(context, CL_MEM_WRITE_ONLY, bytes_o);
+    int nw = dst.w, nh = dst.h;
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, dst.bytes());
 
     // Load Kernel
-    std::string kernel_code = loadKernelSource("include/kernels/resize.cl"); 
-    cl::Program::Sources sources;
-    sources.push_back({ kernel_code.c_str(),kernel_code.length() });
+    cl::Program program = buildProgram(RESIZE_SOURCES);
 
-    // Compile program
-    cl::Program program(context, sources);
-    if (program.build({ device }) != CL_SUCCESS) {
-        std::cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
-        exit(1);
-    }
-
-    float scaleX = (float) (image.w-1) / (nw-1);
-    float scaleY = (float) (image.h-1) / (nh-1);
+    float scaleX = (float) (src.w-1) / (nw-1);
+    float scaleY = (float) (src.h-1) / (nh-1);
 
     // Load in kernel args
-    cl::Kernel kernel(program, "resize_bicubic");
+    bool planar = src.layout == PLANAR && src.channels > 1;
+    cl::Kernel kernel(program, planar ? "resize_bicubic_planar" : "resize_bicubic");
     kernel.setArg(0, data_d);
     kernel.setArg(1, output_d);
     kernel.setArg(2, nw);
     kernel.setArg(3, nh);
-    kernel.setArg(4, image.w);
-    kernel.setArg(5, image.h);
-    kernel.setArg(6, image.channels);
+    kernel.setArg(4, src.w);
+    kernel.setArg(5, src.h);
+    kernel.setArg(6, src.channels);
     kernel.setArg(7, scaleX);
     kernel.setArg(8, scaleY);
 
     // Set dimensions
-    cl::NDRange global(nw, nh);
+    cl::NDRange global = planar ? cl::NDRange(nw, nh, src.channels) : cl::NDRange(nw, nh);
     
 
-#ifdef PROFILE
-    // For Profiling
-    cl::Event event;
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange, nullptr, &event);
-#else
-    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, cl::NullRange);
-#endif
-
-    queue.finish();
+    runKernel(kernel, global);
 
     // Read back the results
-    image.size = nw * nh * image.channels;
-	uint8_t* newImage = new uint8_t[image.size];
+    downloadView(output_d, dst);
+
+}
+
+void OpenCLImageProcessor::resizeBicubic(Image& image, int nw, int nh) {
+    size_t bytes = (size_t)nw * nh * image.channels;
+    uint8_t* newImage = image.allocate(bytes);
+    resizeBicubic(image.view(), ImageView(newImage, nw, nh, image.channels, 0, image.layout));
+
     image.w = nw;
-	image.h = nh;
-	delete[] image.data;
-	image.data = newImage;
-	newImage = nullptr;
-    ret = queue.enqueueReadBuffer(output_d, CL_TRUE, 0, bytes_o, image.data);
+    image.h = nh;
+    image.size = bytes;
+    image.replace_data(newImage, bytes);
+}
+
+void OpenCLImageProcessor::to_planar(Image& image) {
+    convertLayout(image, PLANAR);
+}
+
+void OpenCLImageProcessor::to_interleaved(Image& image) {
+    convertLayout(image, INTERLEAVED);
+}
+
+void OpenCLImageProcessor::convertLayout(Image& image, PixelLayout target) {
+
+    if (image.layout == target) {
+        return;
+    }
+    if (image.channels == 1) {
+        image.layout = target;
+        return;
+    }
+
+    // Prepare memory
+    cl_int ret;
+    size_t bytes_i = image.size * sizeof(uint8_t);
+    cl::Buffer data_d = uploadView(image.view(), SCRATCH_INPUT);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, bytes_i);
+
+    // Load Kernel
+    cl::Program program = buildProgram("include/kernels/planar.cl");
+
+    // Load in kernel args
+    cl::Kernel kernel(program, target == PLANAR ? "deinterleave" : "interleave");
+    kernel.setArg(0, data_d);
+    kernel.setArg(1, output_d);
+    kernel.setArg(2, image.w);
+    kernel.setArg(3, image.h);
+    kernel.setArg(4, image.channels);
+
+    // Set dimensions, each work-item moves 4 pixels
+    cl::NDRange global((image.w + 3) / 4, image.h);
+
+    runKernel(kernel, global);
+
+    // Read back into fresh storage, the input buffer may still alias image.data
+    uint8_t* newImage = image.allocate(image.size);
+    ret = queue.enqueueReadBuffer(output_d, CL_TRUE, 0, bytes_i, newImage);
     if (ret != CL_SUCCESS) {
         std::cerr << "Failed to read out buffer: " << ret << "\n";
+        image.get_allocator()->deallocate(newImage, image.size);
         return;
     }
-#ifdef PROFILE
-    // Get profiling information
+    image.replace_data(newImage, image.size);
+    image.layout = target;
+
+}
+
+cl::Program OpenCLImageProcessor::buildProgram(const std::string& fileName, const std::string& options) {
+    return buildProgram(std::vector<std::string>(1, fileName), options);
+}
+
+cl::Program OpenCLImageProcessor::buildProgram(const std::vector<std::string>& fileNames, const std::string& options) {
+    std::string key;
+    for (const std::string& fileName : fileNames) {
+        key += fileName + "\n";
+    }
+    key += options;
+    for (auto it = program_cache.begin(); it != program_cache.end(); ++it) {
+        if (it->first == key) {
+            program_cache.splice(program_cache.begin(), program_cache, it);
+            return it->second;
+        }
+    }
+
+    std::string kernel_code;
+    for (const std::string& fileName : fileNames) {
+        kernel_code += loadKernelSource(fileName);
+    }
+    cl::Program::Sources sources;
+    sources.push_back({ kernel_code.c_str(),kernel_code.length() });
+
+    cl::Program program(context, sources);
+    if (program.build({ device }, options.c_str()) != CL_SUCCESS) {
+        std::cout << " Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << "\n";
+        exit(1);
+    }
+    device_timings.builds++;
+
+    program_cache.emplace_front(key, program);
+    if (program_cache.size() > PROGRAM_CACHE_SIZE) {
+        program_cache.pop_back();
+    }
+    return program;
+}
+
+double OpenCLImageProcessor::eventMs(const cl::Event& event) {
     cl_ulong time_start;
     cl_ulong time_end;
     event.getProfilingInfo(CL_PROFILING_COMMAND_START, &time_start);
     event.getProfilingInfo(CL_PROFILING_COMMAND_END, &time_end);
+    return (double) (time_end - time_start) / 1000000;
+}
 
-    // Compute the elapsed time in nanoseconds
-    cl_ulong elapsed_time = time_end - time_start;
+void OpenCLImageProcessor::runKernel(const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local) {
+    cl::Event event;
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, nullptr, &event);
+    queue.finish();
 
-    std::cout << "Kernel execution time: " << (double) elapsed_time / 1000000 << " ms" << std::endl;
+    double elapsed = eventMs(event);
+    device_timings.kernel_ms += elapsed;
+#ifdef PROFILE
+    std::cout << "Kernel execution time: " << elapsed << " ms" << std::endl;
 #endif
+}
+
+void OpenCLImageProcessor::histogram(const ImageView& src, uint32_t* hist) {
+
+    const int SUB_HISTOGRAMS = 4;
+    const size_t LOCAL_SIZE = 256;
+
+    // Prepare memory
+    size_t bytes_h = (size_t)src.channels * 256 * sizeof(cl_uint);
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer hist_d = scratch(SCRATCH_OUTPUT, bytes_h);
+    queue.enqueueFillBuffer(hist_d, (cl_uint)0, 0, bytes_h);
+
+    cl::Program program = buildProgram("include/kernels/histogram.cl",
+        "-D SUB_HISTOGRAMS=" + std::to_string(SUB_HISTOGRAMS));
+
+    // Load in kernel args
+    cl::Kernel kernel(program, "histogram");
+    kernel.setArg(0, data_d);
+    kernel.setArg(1, hist_d);
+    kernel.setArg(2, src.w);
+    kernel.setArg(3, src.h);
+    kernel.setArg(4, src.channels);
+    kernel.setArg(5, (int)(src.layout == PLANAR));
+    kernel.setArg(6, cl::Local(SUB_HISTOGRAMS * bytes_h));
+
+    // Just enough work-groups to fill the device, each work-item strides over
+    // the image so the merge into global memory happens once per group
+    size_t groups = reductionGroups(src.bytes(), LOCAL_SIZE);
+    runKernel(kernel, cl::NDRange(groups * LOCAL_SIZE), cl::NDRange(LOCAL_SIZE));
+
+    // Read back the results
+    queue.enqueueReadBuffer(hist_d, CL_TRUE, 0, bytes_h, hist);
+}
+
+void OpenCLImageProcessor::equalize(const ImageView& src, const ImageView& dst) {
+
+    if (!sameShape(src, dst, "equalize") || src.channels > 4) {
+        return;
+    }
+
+    // The mapping is 256 entries per channel, built on the host from the device histogram
+    uint32_t hist[4 * 256];
+    uint8_t lut[4 * 256];
+    histogram(src, hist);
+    for (int c = 0; c < src.channels; ++c) {
+        Histogram::equalize_lut(hist + c * 256, (size_t)src.w * src.h, lut + c * 256);
+    }
+
+    // Prepare memory
+    size_t bytes_i = src.bytes();
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, bytes_i);
+    cl::Buffer lut_d = scratch(SCRATCH_MASK, src.channels * 256);
+    queue.enqueueWriteBuffer(lut_d, CL_TRUE, 0, src.channels * 256, lut);
+
+    cl::Program program = buildProgram("include/kernels/histogram.cl");
+
+    // Load in kernel args
+    cl::Kernel kernel(program, "apply_lut");
+    kernel.setArg(0, data_d);
+    kernel.setArg(1, output_d);
+    kernel.setArg(2, lut_d);
+    kernel.setArg(3, src.w);
+    kernel.setArg(4, src.h);
+    kernel.setArg(5, src.channels);
+    kernel.setArg(6, (int)(src.layout == PLANAR));
+
+    runKernel(kernel, cl::NDRange(bytes_i));
+
+    // Read back the results
+    downloadView(output_d, dst);
+}
+
+void OpenCLImageProcessor::clahe(const ImageView& src, const ImageView& dst, int tiles_x, int tiles_y, double clip_limit) {
+
+    if (!sameShape(src, dst, "clahe")) {
+        return;
+    }
+    tiles_x = std::min(std::max(tiles_x, 1), src.w);
+    tiles_y = std::min(std::max(tiles_y, 1), src.h);
+    int planar = src.layout == PLANAR;
+
+    // Prepare memory
+    size_t bytes_i = src.bytes();
+    size_t bytes_l = (size_t)tiles_x * tiles_y * src.channels * 256;
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, bytes_i);
+    cl::Buffer luts_d = scratch(SCRATCH_MASK, bytes_l);
+
+    cl::Program program = buildProgram("include/kernels/histogram.cl");
+
+    // One work-group per tile and channel builds that tile's mapping
+    cl::Kernel tiles(program, "clahe_tiles");
+    tiles.setArg(0, data_d);
+    tiles.setArg(1, luts_d);
+    tiles.setArg(2, src.w);
+    tiles.setArg(3, src.h);
+    tiles.setArg(4, src.channels);
+    tiles.setArg(5, planar);
+    tiles.setArg(6, tiles_x);
+    tiles.setArg(7, tiles_y);
+    tiles.setArg(8, (cl_uint)Histogram::clip_q16_of(clip_limit));
+    tiles.setArg(9, cl::Local(256 * sizeof(cl_uint)));
+    runKernel(tiles, cl::NDRange(tiles_x * 256, tiles_y, src.channels), cl::NDRange(256, 1, 1));
+
+    // Every sample blends the mappings of its four nearest tiles
+    cl::Kernel apply(program, "clahe_apply");
+    apply.setArg(0, data_d);
+    apply.setArg(1, output_d);
+    apply.setArg(2, luts_d);
+    apply.setArg(3, src.w);
+    apply.setArg(4, src.h);
+    apply.setArg(5, src.channels);
+    apply.setArg(6, planar);
+    apply.setArg(7, tiles_x);
+    apply.setArg(8, tiles_y);
+    runKernel(apply, cl::NDRange(src.w, src.h, src.channels));
+
+    // Read back the results
+    downloadView(output_d, dst);
+}
+
+ImageStats OpenCLImageProcessor::reduceBuffer(const cl::Buffer& data_d, int w, int channels,
+    int region_w, int region_h, int region_ch, uint8_t threshold) {
+
+    const size_t LOCAL_SIZE = 256;
+    const int PARTIALS = 5;
+
+    ImageStats stats;
+    stats.count = (uint64_t)region_w * region_h * region_ch;
+    if (stats.count == 0) {
+        return stats;
+    }
+
+    cl::Program program = buildProgram("include/kernels/reduce.cl",
+        "-D LOCAL_SIZE=" + std::to_string(LOCAL_SIZE));
+
+    // The partials pass is a single group no matter the image size
+    size_t groups = reductionGroups(stats.count, LOCAL_SIZE);
+    cl::Buffer partials_d = scratch(SCRATCH_PARTIALS, groups * PARTIALS * sizeof(cl_ulong));
+    cl::Buffer result_d = scratch(SCRATCH_MASK, PARTIALS * sizeof(cl_ulong));
+
+    cl::Kernel stats_kernel(program, "reduce_stats");
+    stats_kernel.setArg(0, data_d);
+    stats_kernel.setArg(1, w);
+    stats_kernel.setArg(2, channels);
+    stats_kernel.setArg(3, region_w);
+    stats_kernel.setArg(4, region_h);
+    stats_kernel.setArg(5, region_ch);
+    stats_kernel.setArg(6, (int)threshold);
+    stats_kernel.setArg(7, partials_d);
+    runKernel(stats_kernel, cl::NDRange(groups * LOCAL_SIZE), cl::NDRange(LOCAL_SIZE));
+
+    cl::Kernel partials_kernel(program, "reduce_partials");
+    partials_kernel.setArg(0, partials_d);
+    partials_kernel.setArg(1, (int)groups);
+    partials_kernel.setArg(2, result_d);
+    runKernel(partials_kernel, cl::NDRange(LOCAL_SIZE), cl::NDRange(LOCAL_SIZE));
+
+    // Only the five totals come back
+    cl_ulong result[PARTIALS];
+    queue.enqueueReadBuffer(result_d, CL_TRUE, 0, sizeof(result), result);
+    stats.min = (uint8_t)result[0];
+    stats.max = (uint8_t)result[1];
+    stats.sum = result[2];
+    stats.sum_sq = result[3];
+    stats.above = result[4];
+    return stats;
+}
+
+ImageStats OpenCLImageProcessor::reduce(const ImageView& src, uint8_t threshold) {
+    // Layout does not matter, every sample is counted once either way
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    int samples = (int)src.row_bytes();
+    return reduceBuffer(data_d, samples, 1, samples, src.h * src.planes(), 1, threshold);
+}
+
+bool OpenCLImageProcessor::is_black(const ImageView& src, uint8_t threshold) {
+    return reduce(src, threshold).above == 0;
+}
+
+void OpenCLImageProcessor::diffmap_scale(const ImageView& image1, const ImageView& image2, const ImageView& dst, uint8_t scl) {
+
+    if (!sameShape(image1, dst, "diffmap_scale")) {
+        return;
+    }
+
+    if (image1.layout == PLANAR || image2.layout == PLANAR) {
+        std::cout << "diffmap_scale expects interleaved images, call to_interleaved() first." << std::endl;
+        return;
+    }
+
+    // Prepare memory
+    cl::Buffer image1_d = uploadView(image1, SCRATCH_INPUT, false);
+    cl::Buffer image2_d = uploadView(image2, SCRATCH_SECOND);
+
+    cl::Program program = buildProgram("include/kernels/diffmap.cl");
+
+    int compare_width = fmin(image1.w,image2.w);
+    int compare_height = fmin(image1.h,image2.h);
+    int compare_channels = fmin(image1.channels,image2.channels);
+
+    cl::Kernel kernel(program, "diffmap");
+    kernel.setArg(0, image1_d);
+    kernel.setArg(1, image2_d);
+    kernel.setArg(2, image1.w);
+    kernel.setArg(3, image1.h);
+    kernel.setArg(4, image1.channels);
+    kernel.setArg(5, image2.w);
+    kernel.setArg(6, image2.h);
+    kernel.setArg(7, image2.channels);
+    kernel.setArg(8, compare_width);
+    kernel.setArg(9, compare_height);
+    kernel.setArg(10,compare_channels);
+    runKernel(kernel, cl::NDRange(image1.w, image1.h, image1.channels));
+
+    // The largest difference is found on the device, the map itself stays there
+    ImageStats stats = reduceBuffer(image1_d, image1.w, image1.channels,
+        compare_width, compare_height, compare_channels, 255);
+    int factor = 255 / std::max(1, std::max((int)scl, (int)stats.max));
+
+    int n = (int)image1.bytes();
+    cl::Kernel scale(program, "scale");
+    scale.setArg(0, image1_d);
+    scale.setArg(1, n);
+    scale.setArg(2, factor);
+    runKernel(scale, cl::NDRange(n));
+
+    // Read back the results
+    downloadView(image1_d, dst);
+}
+
+size_t OpenCLImageProcessor::reductionGroups(size_t items, size_t local_size) {
+    // Just enough groups to fill the device, so few partials come back
+    size_t groups = std::min((items + local_size - 1) / local_size,
+        (size_t)device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 8);
+    return std::max(groups, (size_t)1);
+}
+
+double OpenCLImageProcessor::mse(const ImageView& a, const ImageView& b) {
+
+    if (!sameShape(a, b, "mse")) {
+        return -1;
+    }
+
+    const size_t LOCAL_SIZE = 256;
+    int n = (int)a.bytes();
+    if (n == 0) {
+        return 0;
+    }
+
+    // Prepare memory
+    cl::Buffer a_d = uploadView(a, SCRATCH_INPUT);
+    cl::Buffer b_d = uploadView(b, SCRATCH_SECOND);
+    size_t groups = reductionGroups(n, LOCAL_SIZE);
+    cl::Buffer partials_d = scratch(SCRATCH_PARTIALS, groups * sizeof(cl_ulong));
+
+    cl::Program program = buildProgram("include/kernels/metrics.cl",
+        "-D LOCAL_SIZE=" + std::to_string(LOCAL_SIZE));
+
+    // Difference, square and sum in one pass
+    cl::Kernel kernel(program, "squared_error");
+    kernel.setArg(0, a_d);
+    kernel.setArg(1, b_d);
+    kernel.setArg(2, n);
+    kernel.setArg(3, partials_d);
+    runKernel(kernel, cl::NDRange(groups * LOCAL_SIZE), cl::NDRange(LOCAL_SIZE));
+
+    std::vector<cl_ulong> partials(groups);
+    queue.enqueueReadBuffer(partials_d, CL_TRUE, 0, groups * sizeof(cl_ulong), partials.data());
+    cl_ulong total = 0;
+    for (cl_ulong p : partials) {
+        total += p;
+    }
+    return (double)total / n;
+}
+
+double OpenCLImageProcessor::psnr(const ImageView& a, const ImageView& b) {
+    double e = mse(a, b);
+    return e < 0 ? e : Metrics::psnr_from_mse(e);
+}
+
+double OpenCLImageProcessor::ssim(const ImageView& a, const ImageView& b) {
+
+    if (!sameShape(a, b, "ssim")) {
+        return -1;
+    }
+
+    const size_t LOCAL_SIZE = 256;
+    size_t n = (size_t)a.w * a.h * a.channels;
+    if (n == 0) {
+        return 1;
+    }
+
+    float weights[2 * Metrics::SSIM_RADIUS + 1];
+    Metrics::ssim_weights(weights);
+
+    // Prepare memory, the moments never leave the device
+    cl::Buffer a_d = uploadView(a, SCRATCH_INPUT);
+    cl::Buffer b_d = uploadView(b, SCRATCH_SECOND);
+    cl::Buffer moments_d = scratch(SCRATCH_OUTPUT, 5 * n * sizeof(cl_float));
+    cl::Buffer weights_d = scratch(SCRATCH_MASK, sizeof(weights));
+    queue.enqueueWriteBuffer(weights_d, CL_TRUE, 0, sizeof(weights), weights);
+    size_t groups = reductionGroups(n, LOCAL_SIZE);
+    cl::Buffer partials_d = scratch(SCRATCH_PARTIALS, groups * sizeof(cl_float));
+
+    cl::Program program = buildProgram("include/kernels/metrics.cl",
+        "-D LOCAL_SIZE=" + std::to_string(LOCAL_SIZE) + " -D SSIM_RADIUS=" + std::to_string(Metrics::SSIM_RADIUS));
+
+    cl::Kernel moments(program, "ssim_moments");
+    moments.setArg(0, a_d);
+    moments.setArg(1, b_d);
+    moments.setArg(2, a.w);
+    moments.setArg(3, a.h);
+    moments.setArg(4, a.channels);
+    moments.setArg(5, (int)(a.layout == PLANAR));
+    moments.setArg(6, weights_d);
+    moments.setArg(7, moments_d);
+    runKernel(moments, cl::NDRange(a.w, a.h, a.channels));
+
+    cl::Kernel map(program, "ssim_map");
+    map.setArg(0, moments_d);
+    map.setArg(1, a.w);
+    map.setArg(2, a.h);
+    map.setArg(3, a.channels);
+    map.setArg(4, weights_d);
+    map.setArg(5, Metrics::SSIM_C1);
+    map.setArg(6, Metrics::SSIM_C2);
+    map.setArg(7, partials_d);
+    runKernel(map, cl::NDRange(groups * LOCAL_SIZE), cl::NDRange(LOCAL_SIZE));
+
+    std::vector<cl_float> partials(groups);
+    queue.enqueueReadBuffer(partials_d, CL_TRUE, 0, groups * sizeof(cl_float), partials.data());
+    double total = 0;
+    for (cl_float p : partials) {
+        total += p;
+    }
+    return total / n;
+}
 
-}
\ No newline at end of file
+void OpenCLImageProcessor::convertColor(const cl::Buffer& src_d, const cl::Buffer& dst_d, int w, int h, int channels,
+    bool src_planar, bool dst_planar, ColorSpace space, bool from_rgb) {
+
+    static const char* from_kernels[] = { "rgb_to_ycbcr", "rgb_to_ycbcr", "rgb_to_hsv", "rgb_to_lab" };
+    static const char* to_kernels[] = { "ycbcr_to_rgb", "ycbcr_to_rgb", "hsv_to_rgb", "lab_to_rgb" };
+
+    cl::Program program = buildProgram("include/kernels/color.cl");
+
+    cl::Kernel kernel(program, from_rgb ? from_kernels[space] : to_kernels[space]);
+    kernel.setArg(0, src_d);
+    kernel.setArg(1, dst_d);
+    kernel.setArg(2, w);
+    kernel.setArg(3, h);
+    kernel.setArg(4, channels);
+    kernel.setArg(5, (int)src_planar);
+    kernel.setArg(6, (int)dst_planar);
+
+    if (Color::is_ycbcr(space)) {
+        // Same fixed point coefficients as the CPU path
+        const Color::YCbCrCoefficients& coefficients = Color::ycbcr(space);
+        const int* m = from_rgb ? coefficients.forward : coefficients.inverse;
+        size_t bytes_m = (from_rgb ? 9 : 4) * sizeof(int);
+        cl::Buffer m_d = scratch(SCRATCH_MASK, bytes_m);
+        queue.enqueueWriteBuffer(m_d, CL_TRUE, 0, bytes_m, m);
+        kernel.setArg(7, m_d);
+    }
+
+    runKernel(kernel, cl::NDRange((size_t)w * h));
+}
+
+bool OpenCLImageProcessor::colorShape(const ImageView& src, const ImageView& dst, const char* op) {
+    if (src.w != dst.w || src.h != dst.h || src.channels != dst.channels) {
+        std::cout << op << " needs a destination with the size and channels of the source." << std::endl;
+        return false;
+    }
+    if (src.channels < 3) {
+        std::cout << op << " needs at least 3 channels." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void OpenCLImageProcessor::convert_from_rgb(const ImageView& src, const ImageView& dst, ColorSpace space) {
+
+    if (!colorShape(src, dst, "convert_from_rgb")) {
+        return;
+    }
+
+    cl::Buffer src_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer dst_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+    convertColor(src_d, dst_d, src.w, src.h, src.channels, src.layout == PLANAR, dst.layout == PLANAR, space, true);
+
+    // Read back the results
+    downloadView(dst_d, dst);
+}
+
+void OpenCLImageProcessor::convert_to_rgb(const ImageView& src, const ImageView& dst, ColorSpace space) {
+
+    if (!colorShape(src, dst, "convert_to_rgb")) {
+        return;
+    }
+
+    cl::Buffer src_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer dst_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+    convertColor(src_d, dst_d, src.w, src.h, src.channels, src.layout == PLANAR, dst.layout == PLANAR, space, false);
+
+    // Read back the results
+    downloadView(dst_d, dst);
+}
+
+void OpenCLImageProcessor::convolve_luma(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask, ColorSpace space) {
+
+    if (!colorShape(src, dst, "convolve_luma")) {
+        return;
+    }
+
+    if (!Color::is_ycbcr(space)) {
+        std::cout << "convolve_luma needs a YCbCr colour space." << std::endl;
+        return;
+    }
+
+    // One upload and one download, the planar YCbCr copy stays on the device
+    size_t plane = (size_t)src.w * src.h;
+    cl::Buffer src_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer ycc_d = scratch(SCRATCH_SECOND, plane * src.channels);
+    cl::Buffer luma_d = scratch(SCRATCH_PARTIALS, plane);
+    convertColor(src_d, ycc_d, src.w, src.h, src.channels, src.layout == PLANAR, true, space, true);
+
+    // The Y plane is the first w * h bytes, filtered as a single channel image
+    uint32_t MASK_W = mask->getWidth(), MASK_OFFSET_W = mask->getCenterColumn();
+    uint32_t MASK_H = mask->getHeight(), MASK_OFFSET_H = mask->getCenterRow();
+    cl::Buffer mask_d = maskBuffer(mask);
+
+    cl::Program program = buildProgram("include/kernels/convolution.cl");
+    cl::Kernel kernel(program, "convolution_border");
+    kernel.setArg(0, ycc_d);
+    kernel.setArg(1, luma_d);
+    kernel.setArg(2, mask_d);
+    kernel.setArg(3, src.w);
+    kernel.setArg(4, src.h);
+    kernel.setArg(5, 1);
+    kernel.setArg(6, MASK_W);
+    kernel.setArg(7, MASK_H);
+    kernel.setArg(8, MASK_OFFSET_W);
+    kernel.setArg(9, MASK_OFFSET_H);
+    runKernel(kernel, cl::NDRange(src.w, src.h));
+
+    // Put the filtered luminance back next to the chroma and recombine
+    queue.enqueueCopyBuffer(luma_d, ycc_d, 0, 0, plane);
+    cl::Buffer dst_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+    convertColor(ycc_d, dst_d, src.w, src.h, src.channels, true, dst.layout == PLANAR, space, false);
+
+    // Read back the results
+    downloadView(dst_d, dst);
+}
+
+
+cl::Buffer OpenCLImageProcessor::remapBuffer(const WarpMap& map) {
+    for (auto it = remap_cache.begin(); it != remap_cache.end(); ++it) {
+        if (it->first == map.id()) {
+            remap_cache.splice(remap_cache.begin(), remap_cache, it);
+            return it->second;
+        }
+    }
+
+    cl::Buffer positions_d(context, CL_MEM_READ_ONLY, map.bytes());
+    queue.enqueueWriteBuffer(positions_d, CL_TRUE, 0, map.bytes(), map.positions());
+    device_timings.table_uploads++;
+
+    remap_cache.emplace_front(map.id(), positions_d);
+    if (remap_cache.size() > REMAP_CACHE_SIZE) {
+        remap_cache.pop_back();
+    }
+    return positions_d;
+}
+
+void OpenCLImageProcessor::warpDevice(const ImageView& src, const ImageView& dst, const char* kernel_name,
+    const cl::Buffer& params_d, Interpolation interpolation) {
+
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+
+    cl::Program program = buildProgram("include/kernels/warp.cl");
+
+    cl::Kernel kernel(program, kernel_name);
+    kernel.setArg(0, data_d);
+    kernel.setArg(1, output_d);
+    kernel.setArg(2, params_d);
+    kernel.setArg(3, src.w);
+    kernel.setArg(4, src.h);
+    kernel.setArg(5, dst.w);
+    kernel.setArg(6, dst.h);
+    kernel.setArg(7, src.layout == PLANAR ? 1 : src.channels);
+    kernel.setArg(8, (int)(interpolation == INTERP_BICUBIC));
+
+    runKernel(kernel, cl::NDRange(dst.w, dst.h, src.planes()));
+
+    // Read back the results
+    downloadView(output_d, dst);
+}
+
+void OpenCLImageProcessor::warp(const ImageView& src, const ImageView& dst, const Eigen::Matrix3d& transform,
+    Interpolation interpolation) {
+
+    if (src.channels != dst.channels || src.layout != dst.layout) {
+        std::cout << "warp needs a destination with the channels and layout of the source." << std::endl;
+        return;
+    }
+
+    float m[9];
+    if (!Warp::inverse_of(transform, m)) {
+        std::cout << "warp needs an invertible transform." << std::endl;
+        return;
+    }
+    cl::Buffer m_d = scratch(SCRATCH_MASK, sizeof(m));
+    queue.enqueueWriteBuffer(m_d, CL_TRUE, 0, sizeof(m), m);
+
+    warpDevice(src, dst, "warp", m_d, interpolation);
+}
+
+void OpenCLImageProcessor::remap(const ImageView& src, const ImageView& dst, const WarpMap& map) {
+
+    if (src.channels != dst.channels || src.layout != dst.layout) {
+        std::cout << "remap needs a destination with the channels and layout of the source." << std::endl;
+        return;
+    }
+    if (!map.valid()) {
+        return;
+    }
+    if (dst.w != map.width() || dst.h != map.height()) {
+        std::cout << "remap needs a " << map.width() << "x" << map.height() << " destination." << std::endl;
+        return;
+    }
+
+    warpDevice(src, dst, "remap", remapBuffer(map), map.interpolation());
+}
+
+
+void OpenCLImageProcessor::convolve(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask,
+    ConvolutionBorder border, ConvolutionMethod method) {
+
+    if (!sameShape(src, dst, "convolve")) {
+        return;
+    }
+    if (method == CONVOLVE_AUTO) {
+        method = Convolution::choose(src.w, src.h, mask);
+    }
+
+    std::vector<double> column, row;
+    if (method == CONVOLVE_SEPARABLE && !Convolution::separable(mask, column, row)) {
+        std::cout << "convolve: mask is not separable, filtering directly." << std::endl;
+        method = CONVOLVE_DIRECT;
+    }
+
+    if (method == CONVOLVE_SEPARABLE) {
+        convolveSeparable(src, dst, column, row, mask->getCenterRow(), mask->getCenterColumn(), border);
+    }
+    else if (method == CONVOLVE_FFT) {
+        convolveFft(src, dst, mask, border);
+    }
+    else if (border == CLAMP_TO_0) {
+        std_convolve_clamp_to_0(src, dst, mask);
+    }
+    else {
+        std_convolve_clamp_to_border(src, dst, mask);
+    }
+}
+
+void OpenCLImageProcessor::convolveSeparable(const ImageView& src, const ImageView& dst, const std::vector<double>& column,
+    const std::vector<double>& row, int cr, int cc, ConvolutionBorder border) {
+
+    int kw = (int)row.size(), kh = (int)column.size();
+    int channels = src.layout == PLANAR ? 1 : src.channels;
+
+    // Row taps then column taps in one buffer
+    std::vector<double> taps(row);
+    taps.insert(taps.end(), column.begin(), column.end());
+    size_t bytes_m = taps.size() * sizeof(double);
+    cl::Buffer taps_d = scratch(SCRATCH_MASK, bytes_m);
+    queue.enqueueWriteBuffer(taps_d, CL_TRUE, 0, bytes_m, taps.data());
+
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer tmp_d = scratch(SCRATCH_WORK_A, src.bytes() * sizeof(double));
+    cl::Buffer result_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+
+    cl::Program program = buildProgram("include/kernels/convolution.cl");
+    cl::NDRange global(src.w, src.h, src.planes());
+
+    cl::Kernel rows(program, "convolution_rows");
+    rows.setArg(0, data_d);
+    rows.setArg(1, tmp_d);
+    rows.setArg(2, taps_d);
+    rows.setArg(3, src.w);
+    rows.setArg(4, src.h);
+    rows.setArg(5, channels);
+    rows.setArg(6, kw);
+    rows.setArg(7, cc);
+    rows.setArg(8, (int)(border == CLAMP_TO_BORDER));
+    runKernel(rows, global);
+
+    cl::Kernel cols(program, "convolution_cols");
+    cols.setArg(0, tmp_d);
+    cols.setArg(1, result_d);
+    cols.setArg(2, taps_d);
+    cols.setArg(3, src.w);
+    cols.setArg(4, src.h);
+    cols.setArg(5, channels);
+    cols.setArg(6, kw);
+    cols.setArg(7, kh);
+    cols.setArg(8, cr);
+    cols.setArg(9, (int)(border == CLAMP_TO_BORDER));
+    runKernel(cols, global);
+
+    // Read back the results
+    downloadView(result_d, dst);
+}
+
+cl::Buffer OpenCLImageProcessor::maskBuffer(const Mask::BaseMask* mask) {
+    int shape[4] = { mask->getWidth(), mask->getHeight(), mask->getCenterRow(), mask->getCenterColumn() };
+    size_t bytes_m = (size_t)shape[0] * shape[1] * sizeof(double);
+    uint64_t key = fast_hash(mask->getData(), bytes_m, fast_hash(shape, sizeof(shape)));
+    for (auto it = mask_cache.begin(); it != mask_cache.end(); ++it) {
+        if (it->first == key) {
+            mask_cache.splice(mask_cache.begin(), mask_cache, it);
+            return it->second;
+        }
+    }
+
+    cl::Buffer mask_d(context, CL_MEM_READ_ONLY, bytes_m);
+    queue.enqueueWriteBuffer(mask_d, CL_TRUE, 0, bytes_m, mask->getData());
+    device_timings.table_uploads++;
+
+    mask_cache.emplace_front(key, mask_d);
+    if (mask_cache.size() > MASK_CACHE_SIZE) {
+        mask_cache.pop_back();
+    }
+    return mask_d;
+}
+
+cl::Buffer OpenCLImageProcessor::spectrumBuffer(const Mask::BaseMask* mask, const Convolution::FftLayout& layout) {
+    uint64_t key = Convolution::spectrum_key(mask, layout, true);
+    for (auto it = spectrum_cache.begin(); it != spectrum_cache.end(); ++it) {
+        if (it->first == key) {
+            spectrum_cache.splice(spectrum_cache.begin(), spectrum_cache, it);
+            return it->second;
+        }
+    }
+
+    // Transformed once on the host in double, the device only needs floats
+    auto spectrum = Convolution::mask_spectrum(mask, layout, true);
+    std::vector<cl_float2> values(spectrum->size());
+    for (size_t i = 0; i < values.size(); ++i) {
+        values[i] = {{ (float)(*spectrum)[i].real(), (float)(*spectrum)[i].imag() }};
+    }
+    size_t bytes = values.size() * sizeof(cl_float2);
+    cl::Buffer spectrum_d(context, CL_MEM_READ_ONLY, bytes);
+    queue.enqueueWriteBuffer(spectrum_d, CL_TRUE, 0, bytes, values.data());
+    device_timings.table_uploads++;
+
+    spectrum_cache.emplace_front(key, spectrum_d);
+    if (spectrum_cache.size() > SPECTRUM_CACHE_SIZE) {
+        spectrum_cache.pop_back();
+    }
+    return spectrum_d;
+}
+
+void OpenCLImageProcessor::fftRows(const cl::Program& program, const cl::Buffer& data, const cl::Buffer& work,
+    int n, int rows, bool inverse) {
+
+    if (n < 2) {
+        return;
+    }
+
+    // A row and its partner buffer in local memory take every stage without
+    // touching global memory in between
+    size_t local_bytes = 2 * (size_t)n * sizeof(cl_float2);
+    if (local_bytes <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / 2) {
+        cl::Kernel kernel(program, "fft_rows_local");
+        size_t max_local = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+        size_t local = std::max<size_t>(1, n / 4);
+        while (local > max_local || local > 256) {
+            local /= 2;
+        }
+        kernel.setArg(0, data);
+        kernel.setArg(1, n);
+        kernel.setArg(2, (int)inverse);
+        kernel.setArg(3, cl::Local(local_bytes / 2));
+        kernel.setArg(4, cl::Local(local_bytes / 2));
+        runKernel(kernel, cl::NDRange(local * rows), cl::NDRange(local));
+        return;
+    }
+
+    // One launch per stage, bouncing between the two buffers
+    cl::Kernel kernel(program, "fft_stage");
+    const cl::Buffer* in = &data;
+    const cl::Buffer* out = &work;
+    for (int len = n, s = 1; len > 1; ) {
+        kernel.setArg(0, *in);
+        kernel.setArg(1, *out);
+        kernel.setArg(2, n);
+        kernel.setArg(3, len);
+        kernel.setArg(4, s);
+        kernel.setArg(5, (int)inverse);
+        runKernel(kernel, cl::NDRange(len % 4 == 0 ? n / 4 : n / 2, rows));
+        if (len % 4 == 0) {
+            len /= 4;
+            s *= 4;
+        }
+        else {
+            len = 1;
+            s *= 2;
+        }
+        std::swap(in, out);
+    }
+    if (in != &data) {
+        queue.enqueueCopyBuffer(*in, data, 0, 0, (size_t)n * rows * sizeof(cl_float2));
+        queue.finish();
+    }
+}
+
+void OpenCLImageProcessor::transposeComplex(const cl::Program& program, const cl::Buffer& in, const cl::Buffer& out, int w, int h) {
+    const size_t tile = 16;
+    cl::Kernel kernel(program, "transpose_complex");
+    kernel.setArg(0, in);
+    kernel.setArg(1, out);
+    kernel.setArg(2, w);
+    kernel.setArg(3, h);
+    size_t gw = (w + tile - 1) / tile * tile, gh = (h + tile - 1) / tile * tile;
+    runKernel(kernel, cl::NDRange(gw, gh), cl::NDRange(tile, tile));
+}
+
+void OpenCLImageProcessor::convolveFft(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask,
+    ConvolutionBorder border) {
+
+    // Read the way round convolution.cl reads masks
+    Convolution::FftLayout l = Convolution::layout(src.w, src.h, mask, true);
+    cl::Buffer spectrum_d = spectrumBuffer(mask, l);
+
+    size_t n = (size_t)l.W * l.H;
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer result_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+    cl::Buffer a_d = scratch(SCRATCH_WORK_A, n * sizeof(cl_float2));
+    cl::Buffer b_d = scratch(SCRATCH_WORK_B, n * sizeof(cl_float2));
+
+    cl::Program program = buildProgram("include/kernels/fft.cl");
+    cl::Kernel pack(program, "fft_pack");
+    cl::Kernel multiply(program, "spectrum_multiply");
+    cl::Kernel unpack(program, "fft_unpack");
+    int planar = src.layout == PLANAR;
+
+    // Two channels per transform, as the real and the imaginary part
+    for (int c0 = 0; c0 < src.channels; c0 += 2) {
+        int c1 = c0 + 1 < src.channels ? c0 + 1 : -1;
+
+        pack.setArg(0, data_d);
+        pack.setArg(1, a_d);
+        pack.setArg(2, src.w);
+        pack.setArg(3, src.h);
+        pack.setArg(4, src.channels);
+        pack.setArg(5, planar);
+        pack.setArg(6, c0);
+        pack.setArg(7, c1);
+        pack.setArg(8, l.W);
+        pack.setArg(9, l.H);
+        pack.setArg(10, l.ox);
+        pack.setArg(11, l.oy);
+        pack.setArg(12, (int)(border == CLAMP_TO_BORDER));
+        runKernel(pack, cl::NDRange(l.W, l.H));
+
+        // Rows, then columns as the rows of the transpose, like Fft::transform_2d
+        fftRows(program, a_d, b_d, l.W, l.H, false);
+        transposeComplex(program, a_d, b_d, l.W, l.H);
+        fftRows(program, b_d, a_d, l.H, l.W, false);
+
+        multiply.setArg(0, b_d);
+        multiply.setArg(1, spectrum_d);
+        multiply.setArg(2, (int)n);
+        runKernel(multiply, cl::NDRange(n));
+
+        fftRows(program, b_d, a_d, l.H, l.W, true);
+        transposeComplex(program, b_d, a_d, l.H, l.W);
+        fftRows(program, a_d, b_d, l.W, l.H, true);
+
+        unpack.setArg(0, a_d);
+        unpack.setArg(1, result_d);
+        unpack.setArg(2, src.w);
+        unpack.setArg(3, src.h);
+        unpack.setArg(4, src.channels);
+        unpack.setArg(5, planar);
+        unpack.setArg(6, c0);
+        unpack.setArg(7, c1);
+        unpack.setArg(8, l.W);
+        unpack.setArg(9, l.ox);
+        unpack.setArg(10, l.oy);
+        runKernel(unpack, cl::NDRange(src.w, src.h));
+    }
+
+    // Read back the results
+    downloadView(result_d, dst);
+}
+
+void OpenCLImageProcessor::rank_filter(const ImageView& src, const ImageView& dst, int radius, double percent) {
+
+    int rank;
+    if (!sameShape(src, dst, "rank_filter") || !Rank::window_rank(radius, percent, rank, "rank_filter")) {
+        return;
+    }
+
+    const size_t tile = 16;
+    bool network = radius <= 2;
+    size_t span = tile + 2 * radius;
+    if (!network && span * span > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()) {
+        std::cout << "rank_filter: radius " << radius << " does not fit a tile in local memory." << std::endl;
+        return;
+    }
+
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+
+    cl::Program program = buildProgram("include/kernels/rank.cl", "-DTILE=" + std::to_string(tile) +
+        " -DRADIUS=" + std::to_string(radius) + " -DRANK=" + std::to_string(rank));
+
+    cl::Kernel kernel(program, network ? "rank_network" : "rank_tiled");
+    kernel.setArg(0, data_d);
+    kernel.setArg(1, output_d);
+    kernel.setArg(2, src.w);
+    kernel.setArg(3, src.h);
+    kernel.setArg(4, src.channels);
+    kernel.setArg(5, (int)(src.layout == PLANAR));
+
+    if (network) {
+        // Four pixels per work-item
+        runKernel(kernel, cl::NDRange((src.w + 3) / 4, src.h, src.channels));
+    }
+    else {
+        // Whole tiles, edge work-items only help load the tile
+        size_t gw = (src.w + tile - 1) / tile * tile, gh = (src.h + tile - 1) / tile * tile;
+        runKernel(kernel, cl::NDRange(gw, gh, src.channels), cl::NDRange(tile, tile, 1));
+    }
+
+    // Read back the results
+    downloadView(output_d, dst);
+}
+
+void OpenCLImageProcessor::extremeLine(const cl::Program& program, const ImageView& view, const cl::Buffer& in_d,
+    const cl::Buffer& out_d, int radius, bool vertical, bool take_max) {
+
+    int lines = vertical ? view.w : view.h;
+    int padded = (vertical ? view.h : view.w) + 2 * radius;
+    int blocks = (padded + 2 * radius) / (2 * radius + 1);
+    size_t bytes = (size_t)view.channels * padded * lines;
+    cl::Buffer prefix_d = scratch(SCRATCH_WORK_A, bytes);
+    cl::Buffer suffix_d = scratch(SCRATCH_WORK_B, bytes);
+    int planar = view.layout == PLANAR;
+
+    cl::Kernel blocks_kernel(program, "extreme_blocks");
+    blocks_kernel.setArg(0, in_d);
+    blocks_kernel.setArg(1, prefix_d);
+    blocks_kernel.setArg(2, suffix_d);
+    blocks_kernel.setArg(3, view.w);
+    blocks_kernel.setArg(4, view.h);
+    blocks_kernel.setArg(5, view.channels);
+    blocks_kernel.setArg(6, planar);
+    blocks_kernel.setArg(7, (int)vertical);
+    blocks_kernel.setArg(8, radius);
+    blocks_kernel.setArg(9, (int)take_max);
+    runKernel(blocks_kernel, cl::NDRange(lines, blocks, view.channels));
+
+    cl::Kernel combine(program, "extreme_combine");
+    combine.setArg(0, prefix_d);
+    combine.setArg(1, suffix_d);
+    combine.setArg(2, out_d);
+    combine.setArg(3, view.w);
+    combine.setArg(4, view.h);
+    combine.setArg(5, view.channels);
+    combine.setArg(6, planar);
+    combine.setArg(7, (int)vertical);
+    combine.setArg(8, radius);
+    combine.setArg(9, (int)take_max);
+    runKernel(combine, cl::NDRange(view.w, view.h, view.channels));
+}
+
+void OpenCLImageProcessor::extremeDevice(const cl::Program& program, const ImageView& view, const cl::Buffer& in_d,
+    const cl::Buffer& out_d, int rx, int ry, StructuringElement shape, bool take_max) {
+
+    cl::Buffer rows_d = scratch(SCRATCH_WORK_C, view.bytes());
+    extremeLine(program, view, in_d, rows_d, rx, false, take_max);
+
+    if (shape == MORPH_RECT) {
+        extremeLine(program, view, rows_d, out_d, ry, true, take_max);
+        return;
+    }
+
+    // Cross: both lines from the input, then the extreme of the two
+    extremeLine(program, view, in_d, out_d, ry, true, take_max);
+    cl::Kernel kernel(program, "extreme_images");
+    kernel.setArg(0, rows_d);
+    kernel.setArg(1, out_d);
+    kernel.setArg(2, (int)view.bytes());
+    kernel.setArg(3, (int)take_max);
+    runKernel(kernel, cl::NDRange(view.bytes()));
+}
+
+void OpenCLImageProcessor::morphology(const ImageView& src, const ImageView& dst, MorphologyOp op, int rx, int ry,
+    StructuringElement shape) {
+
+    if (!sameShape(src, dst, "morphology") || !Morphology::valid_radii(rx, ry, "morphology")) {
+        return;
+    }
+
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+    cl::Program program = buildProgram("include/kernels/morphology.cl");
+    int n = (int)src.bytes();
+
+    switch (op) {
+        case MORPH_ERODE:
+        case MORPH_DILATE:
+            extremeDevice(program, src, data_d, output_d, rx, ry, shape, op == MORPH_DILATE);
+            break;
+        case MORPH_OPEN:
+        case MORPH_CLOSE:
+        case MORPH_TOPHAT:
+        case MORPH_BLACKHAT: {
+            bool opening = op == MORPH_OPEN || op == MORPH_TOPHAT;
+            cl::Buffer first_d = scratch(SCRATCH_WORK_D, src.bytes());
+            extremeDevice(program, src, data_d, first_d, rx, ry, shape, !opening);
+            extremeDevice(program, src, first_d, output_d, rx, ry, shape, opening);
+            if (op == MORPH_TOPHAT || op == MORPH_BLACKHAT) {
+                cl::Kernel subtract(program, "subtract_images");
+                subtract.setArg(0, op == MORPH_TOPHAT ? data_d : output_d);
+                subtract.setArg(1, op == MORPH_TOPHAT ? output_d : data_d);
+                subtract.setArg(2, output_d);
+                subtract.setArg(3, n);
+                runKernel(subtract, cl::NDRange(n));
+            }
+            break;
+        }
+        case MORPH_GRADIENT: {
+            cl::Buffer dilated_d = scratch(SCRATCH_WORK_D, src.bytes());
+            extremeDevice(program, src, data_d, dilated_d, rx, ry, shape, true);
+            extremeDevice(program, src, data_d, output_d, rx, ry, shape, false);
+            cl::Kernel subtract(program, "subtract_images");
+            subtract.setArg(0, dilated_d);
+            subtract.setArg(1, output_d);
+            subtract.setArg(2, output_d);
+            subtract.setArg(3, n);
+            runKernel(subtract, cl::NDRange(n));
+            break;
+        }
+    }
+
+    // Read back the results
+    downloadView(output_d, dst);
+}
+
+void OpenCLImageProcessor::bilateral(const ImageView& src, const ImageView& dst, double sigma_space, double sigma_range) {
+
+    if (!EdgePreserving::valid_args(src, dst, sigma_space, sigma_range, "bilateral")) {
+        return;
+    }
+
+    const size_t tile = 16;
+    int radius = EdgePreserving::bilateral_radius(sigma_space);
+    size_t span = tile + 2 * radius;
+    if (span * span * 4 > device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() ||
+        (2 * radius + 1 + 256) * sizeof(float) > device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>()) {
+        std::cout << "bilateral: sigma_space " << sigma_space << " does not fit a tile in local memory." << std::endl;
+        return;
+    }
+
+    float range[256];
+    EdgePreserving::range_weights(sigma_range, range);
+    std::vector<float> spatial = EdgePreserving::spatial_weights(sigma_space);
+    if (spatial.empty()) {
+        return;
+    }
+    // Both tables in one buffer, the spatial weights after the range ones
+    std::vector<float> weights(range, range + 256);
+    weights.insert(weights.end(), spatial.begin(), spatial.end());
+    size_t bytes_w = weights.size() * sizeof(float);
+    cl::Buffer weights_d = scratch(SCRATCH_MASK, bytes_w);
+    queue.enqueueWriteBuffer(weights_d, CL_TRUE, 0, bytes_w, weights.data());
+
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+
+    cl::Program program = buildProgram("include/kernels/edge_preserving.cl",
+        "-DTILE=" + std::to_string(tile) + " -DRADIUS=" + std::to_string(radius));
+
+    cl::Kernel kernel(program, "bilateral");
+    kernel.setArg(0, data_d);
+    kernel.setArg(1, output_d);
+    kernel.setArg(2, weights_d);
+    kernel.setArg(3, src.w);
+    kernel.setArg(4, src.h);
+    kernel.setArg(5, src.channels);
+    kernel.setArg(6, (int)(src.layout == PLANAR));
+
+    // Whole tiles, edge work-items only help load the tile
+    size_t gw = (src.w + tile - 1) / tile * tile, gh = (src.h + tile - 1) / tile * tile;
+    runKernel(kernel, cl::NDRange(gw, gh), cl::NDRange(tile, tile));
+
+    // Read back the results
+    downloadView(output_d, dst);
+}
+
+void OpenCLImageProcessor::boxMeans(const cl::Program& program, const cl::Buffer& data_d, const cl::Buffer& tmp_d,
+    int w, int h, int planes, int radius) {
+
+    cl::Kernel rows(program, "box_rows");
+    rows.setArg(0, data_d);
+    rows.setArg(1, tmp_d);
+    rows.setArg(2, w);
+    rows.setArg(3, h);
+    rows.setArg(4, radius);
+    runKernel(rows, cl::NDRange(h, planes));
+
+    cl::Kernel cols(program, "box_cols");
+    cols.setArg(0, tmp_d);
+    cols.setArg(1, data_d);
+    cols.setArg(2, w);
+    cols.setArg(3, h);
+    cols.setArg(4, radius);
+    runKernel(cols, cl::NDRange(w, planes));
+}
+
+void OpenCLImageProcessor::guided(const ImageView& src, const ImageView& guide, const ImageView& dst,
+    double sigma_space, double sigma_range) {
+
+    if (!EdgePreserving::valid_args(src, dst, sigma_space, sigma_range, "guided")) {
+        return;
+    }
+    if (guide.w != src.w || guide.h != src.h || (guide.channels != 1 && guide.channels != src.channels) ||
+        (guide.channels > 1 && guide.layout != src.layout)) {
+        std::cout << "guided needs a guide of the source's size and layout with one channel or as many as the source." << std::endl;
+        return;
+    }
+
+    int w = src.w, h = src.h, channels = src.channels;
+    int radius = EdgePreserving::guided_radius(sigma_space);
+    int planar = src.layout == PLANAR;
+    size_t n = (size_t)w * h;
+
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer guide_d = guide.data == src.data ? data_d : uploadView(guide, SCRATCH_SECOND);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+    // I, p, I p and I I planes of every channel, then a and b
+    cl::Buffer stats_d = scratch(SCRATCH_WORK_A, 4 * channels * n * sizeof(float));
+    cl::Buffer tmp_d = scratch(SCRATCH_WORK_B, 4 * channels * n * sizeof(float));
+    cl::Buffer coefficients_d = scratch(SCRATCH_WORK_C, 2 * channels * n * sizeof(float));
+
+    cl::Program program = buildProgram("include/kernels/edge_preserving.cl");
+
+    cl::Kernel stats(program, "guided_stats");
+    stats.setArg(0, data_d);
+    stats.setArg(1, guide_d);
+    stats.setArg(2, stats_d);
+    stats.setArg(3, w);
+    stats.setArg(4, h);
+    stats.setArg(5, channels);
+    stats.setArg(6, planar);
+    stats.setArg(7, guide.channels);
+    runKernel(stats, cl::NDRange(w, h, channels));
+    boxMeans(program, stats_d, tmp_d, w, h, 4 * channels, radius);
+
+    cl::Kernel coefficients(program, "guided_coefficients");
+    coefficients.setArg(0, stats_d);
+    coefficients.setArg(1, coefficients_d);
+    coefficients.setArg(2, (int)n);
+    coefficients.setArg(3, channels);
+    coefficients.setArg(4, (float)(sigma_range * sigma_range));
+    runKernel(coefficients, cl::NDRange(n, channels));
+    boxMeans(program, coefficients_d, tmp_d, w, h, 2 * channels, radius);
+
+    cl::Kernel output(program, "guided_output");
+    output.setArg(0, coefficients_d);
+    output.setArg(1, guide_d);
+    output.setArg(2, output_d);
+    output.setArg(3, w);
+    output.setArg(4, h);
+    output.setArg(5, channels);
+    output.setArg(6, planar);
+    output.setArg(7, guide.channels);
+    runKernel(output, cl::NDRange(w, h, channels));
+
+    // Read back the results
+    downloadView(output_d, dst);
+}
+
+void OpenCLImageProcessor::sobel(const ImageView& src, const ImageView& magnitude, const ImageView& orientation) {
+
+    if (!Edges::single_channel(src, magnitude, "sobel") ||
+        (orientation.data && !Edges::single_channel(src, orientation, "sobel"))) {
+        return;
+    }
+
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer magnitude_d = scratch(SCRATCH_OUTPUT, magnitude.bytes());
+    cl::Buffer orientation_d = scratch(SCRATCH_WORK_A, src.bytes());
+
+    const size_t tile = 16;
+    cl::Program program = buildProgram("include/kernels/edges.cl", "-DTILE=" + std::to_string(tile));
+
+    cl::Kernel kernel(program, "sobel");
+    kernel.setArg(0, data_d);
+    kernel.setArg(1, magnitude_d);
+    kernel.setArg(2, orientation_d);
+    kernel.setArg(3, src.w);
+    kernel.setArg(4, src.h);
+    kernel.setArg(5, (int)(orientation.data != NULL));
+
+    size_t gw = (src.w + tile - 1) / tile * tile, gh = (src.h + tile - 1) / tile * tile;
+    runKernel(kernel, cl::NDRange(gw, gh), cl::NDRange(tile, tile));
+
+    // Read back the results
+    downloadView(magnitude_d, magnitude);
+    if (orientation.data) {
+        downloadView(orientation_d, orientation);
+    }
+}
+
+void OpenCLImageProcessor::canny(const ImageView& src, const ImageView& dst, int low, int high) {
+
+    if (!Edges::single_channel(src, dst, "canny") || !Edges::valid_thresholds(low, high, "canny")) {
+        return;
+    }
+
+    int w = src.w, h = src.h;
+    size_t n = (size_t)w * h;
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer magnitude_d = scratch(SCRATCH_WORK_A, n * sizeof(cl_int));
+    cl::Buffer direction_d = scratch(SCRATCH_WORK_B, n);
+    cl::Buffer label_d = scratch(SCRATCH_WORK_C, n);
+    cl::Buffer changed_d = scratch(SCRATCH_PARTIALS, sizeof(cl_int));
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+
+    const size_t tile = 16;
+    cl::Program program = buildProgram("include/kernels/edges.cl", "-DTILE=" + std::to_string(tile));
+    cl::NDRange global((w + tile - 1) / tile * tile, (h + tile - 1) / tile * tile);
+    cl::NDRange local(tile, tile);
+
+    cl::Kernel gradient(program, "canny_gradient");
+    gradient.setArg(0, data_d);
+    gradient.setArg(1, magnitude_d);
+    gradient.setArg(2, direction_d);
+    gradient.setArg(3, w);
+    gradient.setArg(4, h);
+    runKernel(gradient, global, local);
+
+    cl::Kernel suppress(program, "canny_suppress");
+    suppress.setArg(0, magnitude_d);
+    suppress.setArg(1, direction_d);
+    suppress.setArg(2, label_d);
+    suppress.setArg(3, w);
+    suppress.setArg(4, h);
+    suppress.setArg(5, low * low);
+    suppress.setArg(6, high * high);
+    runKernel(suppress, cl::NDRange(w, h));
+
+    // Each round spreads edges across whole tiles, until a round promotes nothing
+    cl::Kernel hysteresis(program, "canny_hysteresis");
+    hysteresis.setArg(0, label_d);
+    hysteresis.setArg(1, changed_d);
+    hysteresis.setArg(2, w);
+    hysteresis.setArg(3, h);
+    cl_int changed;
+    do {
+        changed = 0;
+        queue.enqueueWriteBuffer(changed_d, CL_TRUE, 0, sizeof(cl_int), &changed);
+        runKernel(hysteresis, global, local);
+        queue.enqueueReadBuffer(changed_d, CL_TRUE, 0, sizeof(cl_int), &changed);
+    } while (changed);
+
+    cl::Kernel output(program, "canny_output");
+    output.setArg(0, label_d);
+    output.setArg(1, output_d);
+    output.setArg(2, (int)n);
+    runKernel(output, cl::NDRange(n));
+
+    // Read back the results
+    downloadView(output_d, dst);
+}
+
+void OpenCLImageProcessor::unsharp(const ImageView& src, const ImageView& dst, double amount, double radius, int threshold) {
+
+    if (!Unsharp::valid_args(src, dst, amount, radius, threshold, "unsharp")) {
+        return;
+    }
+
+    std::shared_ptr<const FactoryMask> row = MaskFactory::gaussian(radius, MASK_ROW);
+    int reach = row->getWidth() / 2;
+    size_t bytes_t = row->getWidth() * sizeof(float);
+    cl::Buffer taps_d = scratch(SCRATCH_MASK, bytes_t);
+    queue.enqueueWriteBuffer(taps_d, CL_TRUE, 0, bytes_t, row->getFloatData());
+
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer output_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+
+    const size_t tile = 16;
+    size_t span = tile + 2 * reach;
+    size_t local_bytes = span * span * 4 + tile * span * 4 * sizeof(float);
+    int planar = (int)(src.layout == PLANAR);
+
+    if (src.channels <= 4 && local_bytes <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()) {
+        cl::Program program = buildProgram("include/kernels/unsharp.cl",
+            "-DTILE=" + std::to_string(tile) + " -DRADIUS=" + std::to_string(reach));
+
+        cl::Kernel kernel(program, "unsharp");
+        kernel.setArg(0, data_d);
+        kernel.setArg(1, output_d);
+        kernel.setArg(2, taps_d);
+        kernel.setArg(3, src.w);
+        kernel.setArg(4, src.h);
+        kernel.setArg(5, src.channels);
+        kernel.setArg(6, planar);
+        kernel.setArg(7, (float)amount);
+        kernel.setArg(8, (float)threshold);
+
+        // Whole tiles, edge work-items only help load the tile
+        size_t gw = (src.w + tile - 1) / tile * tile, gh = (src.h + tile - 1) / tile * tile;
+        runKernel(kernel, cl::NDRange(gw, gh), cl::NDRange(tile, tile));
+    }
+    else {
+        cl::Program program = buildProgram("include/kernels/unsharp.cl");
+        cl::Buffer columns_d = scratch(SCRATCH_WORK_A, (size_t)src.w * src.h * src.channels * sizeof(float));
+
+        cl::Kernel columns(program, "unsharp_columns");
+        columns.setArg(0, data_d);
+        columns.setArg(1, columns_d);
+        columns.setArg(2, taps_d);
+        columns.setArg(3, reach);
+        columns.setArg(4, src.w);
+        columns.setArg(5, src.h);
+        columns.setArg(6, src.channels);
+        columns.setArg(7, planar);
+        runKernel(columns, cl::NDRange(src.w, src.h, src.channels));
+
+        cl::Kernel rows(program, "unsharp_rows");
+        rows.setArg(0, data_d);
+        rows.setArg(1, columns_d);
+        rows.setArg(2, output_d);
+        rows.setArg(3, taps_d);
+        rows.setArg(4, reach);
+        rows.setArg(5, src.w);
+        rows.setArg(6, src.h);
+        rows.setArg(7, src.channels);
+        rows.setArg(8, planar);
+        rows.setArg(9, (float)amount);
+        rows.setArg(10, (float)threshold);
+        runKernel(rows, cl::NDRange(src.w, src.h, src.channels));
+    }
+
+    // Read back the results
+    downloadView(output_d, dst);
+}
+
+void OpenCLImageProcessor::convolveStatic(const ImageView& src, const ImageView& dst, const Mask::BaseMask* mask,
+    ConvolutionBorder border) {
+
+    // The taps as -D constants, printed so they read back to the same doubles
+    std::ostringstream options;
+    options << std::setprecision(17) << "-DMASK_W=" << mask->getWidth() << " -DMASK_H=" << mask->getHeight()
+        << " -DMASK_CR=" << mask->getCenterRow() << " -DMASK_CC=" << mask->getCenterColumn() << " -DMASK_TAPS=";
+    const double* ker = mask->getData();
+    for (int i = 0; i < mask->getWidth() * mask->getHeight(); ++i) {
+        options << (i ? "," : "") << ker[i];
+    }
+
+    cl::Buffer data_d = uploadView(src, SCRATCH_INPUT);
+    cl::Buffer result_d = scratch(SCRATCH_OUTPUT, dst.bytes());
+
+    cl::Program program = buildProgram("include/kernels/convolution.cl", options.str());
+    cl::Kernel kernel(program, "convolution_static");
+    kernel.setArg(0, data_d);
+    kernel.setArg(1, result_d);
+    kernel.setArg(2, src.w);
+    kernel.setArg(3, src.h);
+    kernel.setArg(4, src.channels);
+    kernel.setArg(5, (int)(src.layout == PLANAR));
+    kernel.setArg(6, (int)(border == CLAMP_TO_BORDER));
+    runKernel(kernel, cl::NDRange(src.w, src.h, src.channels));
+
+    // Read back the results
+    downloadView(result_d, dst);
+}
@@ -0,0 +1,136 @@
+#include "perf_gate.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <omp.h>
+#include <regex>
+#include <sstream>
+
+namespace PerfGate {
+
+static double median_of(std::vector<double>& values) {
+	size_t n = values.size();
+	std::sort(values.begin(), values.end());
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+Sample summarize(std::vector<double> values) {
+	Sample sample;
+	if(values.empty()) {
+		return sample;
+	}
+	sample.median = median_of(values);
+	for(double& v : values) {
+		v = std::fabs(v - sample.median);
+	}
+	sample.mad = sample.median > 0 ? median_of(values) / sample.median : 0;
+	return sample;
+}
+
+double allowed_drop(const Sample& baseline, const Sample& current) {
+	double noise = NOISE_SIGMAS * 1.4826 * std::max(baseline.mad, current.mad);
+	return std::max(MIN_DROP, noise);
+}
+
+bool regressed(const Sample& baseline, const Sample& current) {
+	return current.median < baseline.median * (1 - allowed_drop(baseline, current));
+}
+
+static std::string escaped(const std::string& s) {
+	std::string out;
+	for(char c : s) {
+		if(c == '"' || c == '\\') {
+			out += '\\';
+		}
+		out += c;
+	}
+	return out;
+}
+
+static std::string string_field(const std::string& text, const char* name) {
+	std::smatch match;
+	std::regex field(std::string("\"") + name + "\"\\s*:\\s*\"((?:[^\"\\\\]|\\\\.)*)\"");
+	if(!std::regex_search(text, match, field)) {
+		return "";
+	}
+	return std::regex_replace(match[1].str(), std::regex("\\\\(.)"), "$1");
+}
+
+bool read(const char* path, Baseline& baseline) {
+	std::ifstream file(path);
+	if(!file.is_open()) {
+		printf("PerfGate: cannot read baseline %s\n", path);
+		return false;
+	}
+	std::stringstream buffer;
+	buffer << file.rdbuf();
+	std::string text = buffer.str();
+
+	baseline = Baseline();
+	baseline.cpu = string_field(text, "cpu");
+	baseline.device = string_field(text, "device");
+
+	std::regex entry("\"([\\w./-]+)\"\\s*:\\s*\\{\\s*\"median\"\\s*:\\s*([-+0-9.eE]+)\\s*,\\s*\"mad\"\\s*:\\s*([-+0-9.eE]+)\\s*\\}");
+	for(std::sregex_iterator it(text.begin(), text.end(), entry), end; it != end; ++it) {
+		Sample sample;
+		sample.median = std::stod((*it)[2].str());
+		sample.mad = std::stod((*it)[3].str());
+		baseline.workloads[(*it)[1].str()] = sample;
+	}
+	if(baseline.workloads.empty()) {
+		printf("PerfGate: no workloads in baseline %s\n", path);
+		return false;
+	}
+	return true;
+}
+
+bool write(const char* path, const Baseline& baseline) {
+	FILE* file = fopen(path, "w");
+	if(file == NULL) {
+		printf("PerfGate: cannot write baseline %s\n", path);
+		return false;
+	}
+	fprintf(file, "{\n  \"cpu\": \"%s\",\n  \"device\": \"%s\",\n  \"workloads\": {\n",
+		escaped(baseline.cpu).c_str(), escaped(baseline.device).c_str());
+	size_t i = 0;
+	for(const auto& workload : baseline.workloads) {
+		fprintf(file, "    \"%s\": { \"median\": %.6g, \"mad\": %.6g }%s\n", workload.first.c_str(),
+			workload.second.median, workload.second.mad, ++i < baseline.workloads.size() ? "," : "");
+	}
+	fprintf(file, "  }\n}\n");
+	fclose(file);
+	return true;
+}
+
+// Value of the first "key : value" line of /proc/cpuinfo for key
+static std::string cpuinfo_field(const std::string& text, const char* key) {
+	std::istringstream lines(text);
+	std::string line;
+	size_t n = strlen(key);
+	while(std::getline(lines, line)) {
+		if(line.compare(0, n, key) == 0) {
+			size_t start = line.find_first_not_of(" \t", line.find(':') + 1);
+			return start == std::string::npos ? "" : line.substr(start);
+		}
+	}
+	return "";
+}
+
+std::string cpu_fingerprint() {
+	std::ifstream file("/proc/cpuinfo");
+	std::stringstream buffer;
+	buffer << file.rdbuf();
+	std::string text = buffer.str();
+
+	std::string fingerprint = cpuinfo_field(text, "model name");
+	std::string cache = cpuinfo_field(text, "cache size");
+	if(!cache.empty()) {
+		fingerprint += (fingerprint.empty() ? "" : ", ") + cache + " cache";
+	}
+	fingerprint += (fingerprint.empty() ? "" : ", ") + std::to_string(omp_get_max_threads()) + " threads";
+	return fingerprint;
+}
+
+}
@@ -0,0 +1,195 @@
+#include "rank.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+namespace Rank {
+
+bool window_rank(int radius, double percent, int& rank, const char* op) {
+	if(radius < 0 || radius > MAX_RADIUS) {
+		printf("%s: radius %d is outside 0 to %d\n", op, radius, MAX_RADIUS);
+		return false;
+	}
+	int n = (2 * radius + 1) * (2 * radius + 1);
+	percent = std::min(std::max(percent, 0.0), 100.0);
+	rank = (int)lround(percent / 100.0 * (n - 1));
+	return true;
+}
+
+}
+
+
+namespace ImageOps {
+
+// Windows this small are cheaper to select from than to histogram
+static const int SELECT_RADIUS = 2;
+// Columns per parallel strip. Each strip keeps a histogram per column plus
+// the 2 radius columns either side of it.
+static const int STRIP = 256;
+
+// 16 coarse bins of 16 values each over the 256 fine ones
+struct Histogram {
+	uint16_t coarse[16];
+	uint16_t fine[256];
+};
+
+static inline void add_histogram(Histogram& to, const Histogram& from) {
+	for(int i = 0; i < 16; ++i) {
+		to.coarse[i] += from.coarse[i];
+	}
+	for(int i = 0; i < 256; ++i) {
+		to.fine[i] += from.fine[i];
+	}
+}
+
+static inline void sub_histogram(Histogram& to, const Histogram& from) {
+	for(int i = 0; i < 16; ++i) {
+		to.coarse[i] -= from.coarse[i];
+	}
+	for(int i = 0; i < 256; ++i) {
+		to.fine[i] -= from.fine[i];
+	}
+}
+
+// Value of the sample with the given rank, through the coarse bins first
+static inline uint8_t select_rank(const Histogram& hist, int rank) {
+	int below = 0;
+	int bin = 0;
+	while(below + hist.coarse[bin] <= rank) {
+		below += hist.coarse[bin++];
+	}
+	int value = bin * 16;
+	while(below + hist.fine[value] <= rank) {
+		below += hist.fine[value++];
+	}
+	return (uint8_t)value;
+}
+
+static void rank_select(const ImageView& src, const ImageView& dst, int c, int radius, int rank) {
+	const uint8_t* in = src.channel_start(c);
+	uint8_t* out = dst.channel_start(c);
+	size_t in_step = src.pixel_step(), out_step = dst.pixel_step();
+	int n = (2 * radius + 1) * (2 * radius + 1);
+
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < src.h; ++y) {
+		const uint8_t* rows[2 * SELECT_RADIUS + 1];
+		for(int i = -radius; i <= radius; ++i) {
+			rows[i + radius] = in + (size_t)std::min(std::max(y + i, 0), src.h - 1) * src.stride;
+		}
+		uint8_t window[(2 * SELECT_RADIUS + 1) * (2 * SELECT_RADIUS + 1)];
+		uint8_t* line = out + (size_t)y * dst.stride;
+
+		for(int x = 0; x < src.w; ++x) {
+			int k = 0;
+			for(int j = -radius; j <= radius; ++j) {
+				size_t sx = (size_t)std::min(std::max(x + j, 0), src.w - 1) * in_step;
+				for(int i = 0; i <= 2 * radius; ++i) {
+					window[k++] = rows[i][sx];
+				}
+			}
+			std::nth_element(window, window + rank, window + n);
+			line[x * out_step] = window[rank];
+		}
+	}
+}
+
+// Perreault and Hebert's median filtering in constant time. Every column keeps
+// a histogram of its 2 radius + 1 rows, moved down a row with one removal and
+// one insertion. The window's histogram moves right by adding the column
+// entering it and subtracting the one leaving, whatever the radius.
+static void rank_histogram(const ImageView& src, const ImageView& dst, int c, int radius, int rank) {
+	const uint8_t* in = src.channel_start(c);
+	uint8_t* out = dst.channel_start(c);
+	size_t in_step = src.pixel_step(), out_step = dst.pixel_step();
+	int strips = (src.w + STRIP - 1) / STRIP;
+
+	#pragma omp parallel for schedule(dynamic)
+	for(int s = 0; s < strips; ++s) {
+		int x0 = s * STRIP;
+		int x1 = std::min(x0 + STRIP, src.w);
+		// Column i holds image column x0 - radius + i, clamped to the image
+		int columns = x1 - x0 + 2 * radius;
+		std::vector<Histogram> column(columns);
+		std::vector<size_t> offset(columns);
+		for(int i = 0; i < columns; ++i) {
+			offset[i] = (size_t)std::min(std::max(x0 - radius + i, 0), src.w - 1) * in_step;
+		}
+		memset(column.data(), 0, columns * sizeof(Histogram));
+		for(int r = -radius; r <= radius; ++r) {
+			const uint8_t* line = in + (size_t)std::min(std::max(r, 0), src.h - 1) * src.stride;
+			for(int i = 0; i < columns; ++i) {
+				uint8_t v = line[offset[i]];
+				column[i].coarse[v >> 4]++;
+				column[i].fine[v]++;
+			}
+		}
+
+		Histogram window;
+		for(int y = 0; y < src.h; ++y) {
+			if(y > 0) {
+				const uint8_t* leaving = in + (size_t)std::max(y - radius - 1, 0) * src.stride;
+				const uint8_t* entering = in + (size_t)std::min(y + radius, src.h - 1) * src.stride;
+				for(int i = 0; i < columns; ++i) {
+					uint8_t v = leaving[offset[i]];
+					column[i].coarse[v >> 4]--;
+					column[i].fine[v]--;
+					v = entering[offset[i]];
+					column[i].coarse[v >> 4]++;
+					column[i].fine[v]++;
+				}
+			}
+
+			memset(&window, 0, sizeof(window));
+			for(int i = 0; i <= 2 * radius; ++i) {
+				add_histogram(window, column[i]);
+			}
+			uint8_t* line = out + (size_t)y * dst.stride;
+			for(int x = x0; x < x1; ++x) {
+				line[x * out_step] = select_rank(window, rank);
+				if(x + 1 < x1) {
+					add_histogram(window, column[x - x0 + 2 * radius + 1]);
+					sub_histogram(window, column[x - x0]);
+				}
+			}
+		}
+	}
+}
+
+void rank_filter(const ImageView& src, const ImageView& dst, int radius, double percent) {
+	if(src.w != dst.w || src.h != dst.h || src.channels != dst.channels) {
+		printf("rank_filter needs a destination with the size and channels of the source\n");
+		return;
+	}
+	int rank;
+	if(!Rank::window_rank(radius, percent, rank, "rank_filter")) {
+		return;
+	}
+
+	// Windows read around each pixel, so filtering in place works from a copy
+	std::unique_ptr<Image> copy = unaliased(src, dst);
+	ImageView input = copy ? copy->view() : src;
+
+	for(int c = 0; c < src.channels; ++c) {
+		if(radius <= SELECT_RADIUS) {
+			rank_select(input, dst, c, radius, rank);
+		}
+		else {
+			rank_histogram(input, dst, c, radius, rank);
+		}
+	}
+}
+
+void median(const ImageView& src, const ImageView& dst, int radius) {
+	rank_filter(src, dst, radius, 50);
+}
+
+void min_filter(const ImageView& src, const ImageView& dst, int radius) {
+	rank_filter(src, dst, radius, 0);
+}
+
+void max_filter(const ImageView& src, const ImageView& dst, int radius) {
+	rank_filter(src, dst, radius, 100);
+}
+
+}
@@ -0,0 +1,126 @@
+#include "raw_image.h"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace RawImage {
+
+size_t page_size() {
+	static const size_t size = (size_t)sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+static size_t align_to_page(size_t bytes) {
+	size_t page = page_size();
+	return (bytes + page - 1) / page * page;
+}
+
+bool map(const char* filename, Mapping& mapping) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+		close(fd);
+		return false;
+	}
+
+	// Private writable mapping, pages are only copied once they are modified
+	void* base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return false;
+	}
+
+	Header header;
+	memcpy(&header, base, sizeof(Header));
+	// Every row must lie inside the file. Sizes are checked by division
+	// against the file size so no product can wrap.
+	uint64_t file_size = (uint64_t)st.st_size;
+	uint64_t row_bytes = header.layout == PLANAR ? (uint64_t)header.w : (uint64_t)header.w * header.channels;
+	uint64_t plane_rows = header.layout == PLANAR ? (uint64_t)header.h * header.channels : header.h;
+	if (header.magic != MAGIC || header.version != VERSION
+		|| header.data_offset % page_size() != 0
+		|| row_bytes == 0 || plane_rows == 0
+		|| header.stride < row_bytes
+		|| header.data_offset > file_size
+		|| header.data_size > file_size - header.data_offset
+		|| plane_rows > header.data_size / header.stride
+		|| (plane_rows - 1) * header.stride + row_bytes > file_size - header.data_offset) {
+		printf("%s is not a valid raw image\n", filename);
+		munmap(base, st.st_size);
+		return false;
+	}
+
+	madvise(base, st.st_size, MADV_WILLNEED);
+
+	mapping.header = header;
+	mapping.base = base;
+	mapping.length = st.st_size;
+	mapping.pixels = (uint8_t*)base + header.data_offset;
+	return true;
+}
+
+void unmap(Mapping& mapping) {
+	if (mapping.base != nullptr) {
+		munmap(mapping.base, mapping.length);
+	}
+	mapping.base = nullptr;
+	mapping.pixels = nullptr;
+	mapping.length = 0;
+}
+
+bool write(const char* filename, const uint8_t* data, int w, int h, int channels, size_t stride, Layout layout) {
+	size_t row_bytes = layout == PLANAR ? (size_t)w : (size_t)w * channels;
+	size_t rows = layout == PLANAR ? (size_t)h * channels : (size_t)h;
+
+	Header header;
+	memset(&header, 0, sizeof(Header));
+	header.magic = MAGIC;
+	header.version = VERSION;
+	header.w = w;
+	header.h = h;
+	header.channels = channels;
+	header.layout = layout;
+	header.stride = row_bytes;
+	header.data_offset = align_to_page(sizeof(Header));
+	header.data_size = row_bytes * rows;
+
+	size_t length = header.data_offset + header.data_size;
+
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	if (ftruncate(fd, length) != 0) {
+		close(fd);
+		return false;
+	}
+
+	void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return false;
+	}
+
+	memcpy(base, &header, sizeof(Header));
+	uint8_t* pixels = (uint8_t*)base + header.data_offset;
+	if (stride == row_bytes) {
+		memcpy(pixels, data, header.data_size);
+	}
+	else {
+		for (size_t r = 0; r < rows; ++r) {
+			memcpy(pixels + r * row_bytes, data + r * stride, row_bytes);
+		}
+	}
+
+	munmap(base, length);
+	return true;
+}
+
+}
@@ -0,0 +1,76 @@
+#include "reduce.h"
+#include <algorithm>
+#include <cmath>
+
+double ImageStats::stddev() const {
+	if(count == 0) {
+		return 0.0;
+	}
+	double m = mean();
+	return sqrt(std::max(0.0, (double)sum_sq / count - m * m));
+}
+
+namespace ImageOps {
+
+// Samples per block, small enough that 32 bit sums of squares cannot overflow
+static const int REDUCE_BLOCK = 4096;
+
+static void reduce_run(const uint8_t* p, size_t n, uint8_t threshold, ImageStats& s) {
+	for(size_t start = 0; start < n; start += REDUCE_BLOCK) {
+		int len = (int)std::min<size_t>(REDUCE_BLOCK, n - start);
+		const uint8_t* q = p + start;
+		uint8_t mn = 255, mx = 0;
+		uint32_t sum = 0, sq = 0, above = 0;
+
+		// Plain loop the compiler turns into packed min/max/add
+		#pragma omp simd reduction(min:mn) reduction(max:mx) reduction(+:sum,sq,above)
+		for(int i = 0; i < len; ++i) {
+			uint32_t v = q[i];
+			mn = std::min<uint8_t>(mn, q[i]);
+			mx = std::max<uint8_t>(mx, q[i]);
+			sum += v;
+			sq += v * v;
+			above += q[i] > threshold;
+		}
+
+		s.min = std::min(s.min, mn);
+		s.max = std::max(s.max, mx);
+		s.sum += sum;
+		s.sum_sq += sq;
+		s.above += above;
+	}
+}
+
+ImageStats reduce(const ImageView& src, uint8_t threshold) {
+	int rows = src.h * (int)src.planes();
+	size_t len = src.row_bytes();
+
+	ImageStats total;
+	total.count = (uint64_t)src.w * src.h * src.channels;
+
+	#pragma omp parallel
+	{
+		ImageStats part;
+		#pragma omp for schedule(static) nowait
+		for(int r = 0; r < rows; ++r) {
+			// Planar views are planes() blocks of h rows
+			reduce_run(src.row(r % src.h, r / src.h), len, threshold, part);
+		}
+
+		#pragma omp critical
+		{
+			total.min = std::min(total.min, part.min);
+			total.max = std::max(total.max, part.max);
+			total.sum += part.sum;
+			total.sum_sq += part.sum_sq;
+			total.above += part.above;
+		}
+	}
+	return total;
+}
+
+bool is_black(const ImageView& src, uint8_t threshold) {
+	return reduce(src, threshold).above == 0;
+}
+
+}
@@ -0,0 +1,244 @@
+#include "result_cache.h"
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr uint64_t PRIME1 = 11400714785074694791ULL;
+static constexpr uint64_t PRIME2 = 14029467366897019727ULL;
+static constexpr uint64_t PRIME3 = 1609587929392839161ULL;
+static constexpr uint64_t PRIME4 = 9650029242287828579ULL;
+static constexpr uint64_t PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t read32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+	acc += input * PRIME2;
+	acc = rotl(acc, 31);
+	return acc * PRIME1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+	acc ^= xxh_round(0, val);
+	return acc * PRIME1 + PRIME4;
+}
+
+uint64_t fast_hash(const void* data, size_t len, uint64_t seed) {
+	const uint8_t* p = (const uint8_t*)data;
+	const uint8_t* end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		uint64_t v1 = seed + PRIME1 + PRIME2;
+		uint64_t v2 = seed + PRIME2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - PRIME1;
+		const uint8_t* limit = end - 32;
+		do {
+			v1 = xxh_round(v1, read64(p));
+			v2 = xxh_round(v2, read64(p + 8));
+			v3 = xxh_round(v3, read64(p + 16));
+			v4 = xxh_round(v4, read64(p + 24));
+			p += 32;
+		} while (p <= limit);
+
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	}
+	else {
+		h = seed + PRIME5;
+	}
+
+	h += (uint64_t)len;
+
+	while (p + 8 <= end) {
+		h ^= xxh_round(0, read64(p));
+		h = rotl(h, 27) * PRIME1 + PRIME4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)read32(p) * PRIME1;
+		h = rotl(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= (*p) * PRIME5;
+		h = rotl(h, 11) * PRIME1;
+		++p;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t parallel_hash(const void* data, size_t len, uint64_t seed) {
+	const size_t chunk = 1 << 20;
+	if (len <= chunk) {
+		return fast_hash(data, len, seed);
+	}
+
+	const uint8_t* p = (const uint8_t*)data;
+	long chunks = (long)((len + chunk - 1) / chunk);
+	std::vector<uint64_t> partial(chunks);
+
+	#pragma omp parallel for schedule(static)
+	for (long i = 0; i < chunks; ++i) {
+		size_t begin = (size_t)i * chunk;
+		size_t n = std::min(chunk, len - begin);
+		partial[i] = fast_hash(p + begin, n, seed + i);
+	}
+	return fast_hash(partial.data(), partial.size() * sizeof(uint64_t), seed ^ len);
+}
+
+
+CacheKey::CacheKey(const Image& input, const char* operation) {
+	int dims[4] = { input.w, input.h, input.channels, input.layout };
+	hash = parallel_hash(input.data, input.size);
+	mix(dims, sizeof(dims));
+	mix(operation, strlen(operation));
+}
+
+void CacheKey::mix(const void* bytes, size_t len) {
+	hash = fast_hash(bytes, len, hash);
+}
+
+CacheKey& CacheKey::add(int64_t value) {
+	mix(&value, sizeof(value));
+	return *this;
+}
+
+CacheKey& CacheKey::add(double value) {
+	mix(&value, sizeof(value));
+	return *this;
+}
+
+CacheKey& CacheKey::add(const Mask::BaseMask* mask) {
+	int dims[4] = { mask->getWidth(), mask->getHeight(), mask->getCenterRow(), mask->getCenterColumn() };
+	mix(dims, sizeof(dims));
+	mix(mask->getData(), (size_t)dims[0] * dims[1] * sizeof(double));
+	return *this;
+}
+
+
+ResultCache::ResultCache(size_t capacity_bytes, const std::string& disk_dir)
+	: capacity(capacity_bytes), disk_dir(disk_dir) {
+	if (!disk_dir.empty()) {
+		mkdir(disk_dir.c_str(), 0755);
+	}
+}
+
+ResultCache::~ResultCache() {}
+
+std::string ResultCache::disk_path(uint64_t key) const {
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.rimg", (unsigned long long)key);
+	return disk_dir + name;
+}
+
+void ResultCache::copy_into(const Image& src, Image& dst) {
+	if (dst.size != src.size) {
+		dst.replace_data(dst.allocate(src.size), src.size);
+		dst.size = src.size;
+	}
+	dst.w = src.w;
+	dst.h = src.h;
+	dst.channels = src.channels;
+	dst.layout = src.layout;
+	memcpy(dst.data, src.data, src.size);
+}
+
+bool ResultCache::lookup(uint64_t key, Image& image) {
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		auto it = index.find(key);
+		if (it != index.end()) {
+			lru.splice(lru.begin(), lru, it->second);
+			copy_into(*it->second->image, image);
+			++hit_count;
+			return true;
+		}
+	}
+
+	if (!disk_dir.empty()) {
+		std::string path = disk_path(key);
+		if (access(path.c_str(), F_OK) == 0) {
+			Image stored(path.c_str());
+			if (stored.data != NULL) {
+				copy_into(stored, image);
+				std::lock_guard<std::mutex> lk(lock);
+				insert(key, stored);
+				++disk_hit_count;
+				return true;
+			}
+		}
+	}
+
+	++miss_count;
+	return false;
+}
+
+void ResultCache::store(uint64_t key, const Image& image) {
+	{
+		std::lock_guard<std::mutex> lk(lock);
+		insert(key, image);
+	}
+	if (!disk_dir.empty()) {
+		std::string path = disk_path(key);
+		if (access(path.c_str(), F_OK) != 0) {
+			image.write(path.c_str());
+		}
+	}
+}
+
+void ResultCache::insert(uint64_t key, const Image& image) {
+	if (image.size > capacity || index.count(key) != 0) {
+		return;
+	}
+
+	while (used + image.size > capacity && !lru.empty()) {
+		used -= lru.back().image->size;
+		index.erase(lru.back().key);
+		lru.pop_back();
+	}
+
+	lru.push_front({ key, std::unique_ptr<Image>(new Image(image.clone())) });
+	index[key] = lru.begin();
+	used += image.size;
+}
+
+void ResultCache::clear() {
+	std::lock_guard<std::mutex> lk(lock);
+	lru.clear();
+	index.clear();
+	used = 0;
+}
+
+size_t ResultCache::entries() const {
+	std::lock_guard<std::mutex> lk(lock);
+	return lru.size();
+}
+
+size_t ResultCache::bytes() const {
+	std::lock_guard<std::mutex> lk(lock);
+	return used;
+}
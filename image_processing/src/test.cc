@@ -3,24 +3,43 @@
 #include "image.h"
 #include "opencl_image.h"
 #include "masks.h"
+#include "batch.h"
+#include "raw_image.h"
+#include "result_cache.h"
+#include "histogram.h"
+#include "reduce.h"
+#include "metrics.h"
+#include "color.h"
+#include "cpu_dispatch.h"
+#include "warp.h"
+#include "convolution.h"
+#include "rank.h"
+#include "morphology.h"
+#include "edge_preserving.h"
+#include "edges.h"
+#include "unsharp.h"
+#include "mask_factory.h"
+#include "perf_gate.h"
 #include <cstdlib>
 #include <iostream>
+#include <unistd.h>
+#include <thread>
 
-int is_image_black(const Image& img) {
-    int isBlack = 1;
-
-    #pragma omp parallel for num_threads(4) shared(isBlack)
-    for (int i = 0; i < img.size; ++i) {
-        if (img.data[i] > 5) {
-            #pragma omp critical
-            {
-                isBlack = 0;
-                // std::cout<<"Pixel: "<<i<<" has value "<<(int)img.data[i]<<"\n";
-            }
+// Reference images are decoded once and kept as .rimg in output/, later loads just map them
+std::string cached(const char* path) {
+    const char* name = strrchr(path, '/');
+    std::string raw = std::string("output/") + (name ? name + 1 : path) + ".rimg";
+    if (access(raw.c_str(), F_OK) != 0) {
+        Image src(path);
+        if (src.data != NULL) {
+            src.write(raw.c_str());
         }
     }
+    return raw;
+}
 
-    return isBlack;
+int is_image_black(const Image& img) {
+    return ImageOps::is_black(img.view(), 5);
 }
 
 int is_image_black_single(const Image& img) {
@@ -35,6 +54,26 @@ int is_image_black_single(const Image& img) {
     return 1;
 }
 
+// Runs op from the image less its last column onto the overlapping view one
+// pixel to the right, and counts the bytes that differ from running it into
+// an image of its own
+template <typename Op>
+int shifted_view_mismatches(const Image& source, Op op) {
+    int w = source.w - 1;
+    Image expected(w, source.h, source.channels);
+    op(source.view().sub(0, 0, w, source.h), expected.view());
+    Image shared = source.clone();
+    ImageView dst = shared.view().sub(1, 0, w, source.h);
+    op(shared.view().sub(0, 0, w, source.h), dst);
+    int mismatches = 0;
+    for (int y = 0; y < source.h; ++y) {
+        for (size_t i = 0; i < dst.row_bytes(); ++i) {
+            mismatches += dst.row(y)[i] != expected.data[y * dst.row_bytes() + i];
+        }
+    }
+    return mismatches;
+}
+
 // Demonstrate some basic assertions.
 TEST(HelloTest, BasicAssertions) {
   // Expect two strings not to be equal.
@@ -69,7 +108,7 @@ TEST(ImageTest, BasicDiffTest) {
 TEST(ImageTest, 2DDynamicGaus3) {
 
     Image testHD("imgs/cat.jpeg");
-    Image target("imgs/tests/2Dgaus3cat.jpeg");
+    Image target(cached("imgs/tests/2Dgaus3cat.jpeg").c_str());
 
     ASSERT_NE(testHD.data, nullptr) << "Failed to load test image.";
     ASSERT_NE(target.data, nullptr) << "Failed to load target image.";
@@ -96,7 +135,7 @@ TEST(ImageTest, 2DDynamicGaus3) {
 TEST(ImageTest, 1DDynamicGaus3_cpu) {
 
     Image testHD("imgs/cat.jpeg");
-    Image target("imgs/tests/2Dgaus3cat.jpeg");
+    Image target(cached("imgs/tests/2Dgaus3cat.jpeg").c_str());
 
     ASSERT_NE(testHD.data, nullptr) << "Failed to load test image.";
     ASSERT_NE(target.data, nullptr) << "Failed to load target image.";
@@ -136,7 +175,7 @@ TEST(ImageTest, 1DDynamicGaus3_cpu) {
 TEST(ImageTest, 1DDynamicGaus3Clamp0) {
 
     Image testHD("imgs/cat.jpeg");
-    Image target("imgs/tests/2Dgaus3cat0.jpeg");
+    Image target(cached("imgs/tests/2Dgaus3cat0.jpeg").c_str());
 
     ASSERT_NE(testHD.data, nullptr) << "Failed to load test image.";
     ASSERT_NE(target.data, nullptr) << "Failed to load target image.";
@@ -164,7 +203,7 @@ TEST(ImageTest, 1DDynamicGaus3Clamp0) {
 TEST(ImageTest, 1DDynamicGaus3Clampborder) {
 
     Image testHD("imgs/cat.jpeg");
-    Image target("imgs/tests/2Dgaus3cat.jpeg");
+    Image target(cached("imgs/tests/2Dgaus3cat.jpeg").c_str());
 
     ASSERT_NE(testHD.data, nullptr) << "Failed to load test image.";
     ASSERT_NE(target.data, nullptr) << "Failed to load target image.";
@@ -187,4 +226,1596 @@ TEST(ImageTest, 1DDynamicGaus3Clampborder) {
 
 
     EXPECT_EQ(is_black, 1);
-}
\ No newline at end of file
+}
+
+TEST(BatchTest, BoundedQueueBackpressure) {
+    BoundedQueue<int> queue(4);
+
+    for (int i = 0; i < (int)queue.capacity(); ++i) {
+        EXPECT_TRUE(queue.try_push(i));
+    }
+    EXPECT_FALSE(queue.try_push(99));
+
+    int value;
+    for (int i = 0; i < (int)queue.capacity(); ++i) {
+        ASSERT_TRUE(queue.try_pop(value));
+        EXPECT_EQ(value, i);
+    }
+    EXPECT_FALSE(queue.try_pop(value));
+}
+
+TEST(BatchTest, BoundedQueueBlockingHandoff) {
+    // A tiny queue keeps both sides sleeping and waking each other
+    BoundedQueue<int> queue(2);
+    const int per_thread = 20000;
+    std::atomic<long long> total{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < per_thread; ++i) {
+                if (t % 2 == 0 || !queue.try_push(i)) {
+                    queue.push(i);
+                }
+            }
+        });
+        threads.emplace_back([&, t]() {
+            int value;
+            for (int i = 0; i < per_thread; ++i) {
+                if (t % 2 == 0 || !queue.try_pop(value)) {
+                    queue.pop(value);
+                }
+                total += value;
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(total, 4LL * per_thread * (per_thread - 1) / 2);
+    int value;
+    EXPECT_FALSE(queue.try_pop(value));
+}
+
+TEST(BatchTest, ThreadPoolRunsEveryTask) {
+    std::atomic<int> counter{0};
+    {
+        ThreadPool pool(4, 16);
+        for (int i = 0; i < 1000; ++i) {
+            pool.submit([&]() { ++counter; });
+        }
+        pool.wait_idle();
+        EXPECT_EQ(counter, 1000);
+    }
+    EXPECT_EQ(counter, 1000);
+}
+
+TEST(BatchTest, BatchFlipX) {
+    std::vector<BatchJob> jobs;
+    for (int n = 0; n < 6; ++n) {
+        Image img(64, 48, 3);
+        for (size_t i = 0; i < img.size; ++i) {
+            img.data[i] = (uint8_t)(i * 7 + n);
+        }
+        std::string input = "output/batch_in" + std::to_string(n) + ".png";
+        ASSERT_TRUE(img.write(input.c_str()));
+        jobs.push_back({ input, "output/batch_out" + std::to_string(n) + ".png" });
+    }
+    jobs.push_back({ "output/does_not_exist.png", "output/batch_missing.png" });
+
+    OpenCLImageProcessor processor;
+    BatchConfig config;
+    config.queue_depth = 2;
+    BatchProcessor batch(processor, config);
+    BatchReport report = batch.run(jobs, [](OpenCLImageProcessor& p, Image& img) {
+        p.flipX(img);
+    });
+    report.print();
+
+    EXPECT_EQ(report.images, jobs.size());
+    EXPECT_EQ(report.failed, 1);
+
+    for (size_t n = 0; n + 1 < jobs.size(); ++n) {
+        Image in(jobs[n].input.c_str());
+        Image out(jobs[n].output.c_str());
+        ASSERT_NE(out.data, nullptr);
+        in.flipX_cpu();
+        EXPECT_EQ(memcmp(in.data, out.data, in.size), 0);
+    }
+}
+
+TEST(RawImageTest, MappedRoundTrip) {
+    Image img(333, 127, 3);
+    for (size_t i = 0; i < img.size; ++i) {
+        img.data[i] = (uint8_t)(i * 13);
+    }
+    ASSERT_TRUE(img.write("output/roundtrip.rimg"));
+
+    Image mapped("output/roundtrip.rimg");
+    ASSERT_NE(mapped.data, nullptr);
+    EXPECT_TRUE(mapped.is_mapped());
+    EXPECT_EQ((uintptr_t)mapped.data % RawImage::page_size(), 0);
+    ASSERT_EQ(mapped.w, img.w);
+    ASSERT_EQ(mapped.h, img.h);
+    ASSERT_EQ(mapped.channels, img.channels);
+    EXPECT_EQ(memcmp(mapped.data, img.data, img.size), 0);
+
+    // Edits are copy-on-write and never reach the file
+    mapped.flipX_cpu();
+    Image reread("output/roundtrip.rimg");
+    EXPECT_EQ(memcmp(reread.data, img.data, img.size), 0);
+
+    // Headers whose rows would run past the end of the file are refused
+    RawImage::Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = RawImage::MAGIC;
+    header.version = RawImage::VERSION;
+    header.w = 4000;
+    header.h = 30;
+    header.channels = 3;
+    header.data_offset = RawImage::page_size();
+    // Stride, pixel bytes in the file, and whether it maps
+    const size_t cases[4][3] = { { 0, 0, 0 }, { 11999, 11999 * 30, 0 }, { 12000, 12000 * 30, 1 }, { 12000, 12000 * 30 - 1, 0 } };
+    for (const auto& c : cases) {
+        header.stride = c[0];
+        header.data_size = c[0] * header.h;
+        FILE* file = fopen("output/bounds.rimg", "wb");
+        ASSERT_NE(file, nullptr);
+        fwrite(&header, sizeof(header), 1, file);
+        if (c[1] > 0) {
+            fseek(file, header.data_offset + c[1] - 1, SEEK_SET);
+            fputc(0, file);
+        }
+        fclose(file);
+        RawImage::Mapping mapping;
+        EXPECT_EQ(RawImage::map("output/bounds.rimg", mapping), c[2] == 1) << c[0] << " " << c[1];
+        RawImage::unmap(mapping);
+    }
+
+    // Mapped pixels feed OpenCL directly
+    OpenCLImageProcessor processor;
+    processor.diffmap(mapped, reread);
+    processor.flipX(img);
+    processor.diffmap(img, reread);
+    EXPECT_EQ(memcmp(mapped.data, img.data, img.size), 0);
+}
+
+TEST(ResultCacheTest, RepeatedOperationsHitCache) {
+    Image source(320, 240, 3);
+    for (size_t i = 0; i < source.size; ++i) {
+        source.data[i] = (uint8_t)(i * 31);
+    }
+
+    Mask::GaussianBlur3 gaussianBlur;
+    OpenCLImageProcessor processor;
+    ResultCache cache(64 << 20);
+    int computed = 0;
+
+    Image expected = source.clone();
+    processor.std_convolve_clamp_to_border(expected, &gaussianBlur);
+
+    for (int run = 0; run < 3; ++run) {
+        Image img = source.clone();
+        cache.apply(img, CacheKey(img, "std_convolve_clamp_to_border").add(&gaussianBlur), [&](Image& i) {
+            ++computed;
+            processor.std_convolve_clamp_to_border(i, &gaussianBlur);
+        });
+        EXPECT_EQ(memcmp(img.data, expected.data, expected.size), 0);
+    }
+    EXPECT_EQ(computed, 1);
+    EXPECT_EQ(cache.hits(), 2);
+    EXPECT_EQ(cache.misses(), 1);
+
+    // Different parameters are different entries
+    Image small = source.clone();
+    cache.apply(small, CacheKey(small, "resizeNN").add(100).add(50), [&](Image& i) {
+        ++computed;
+        i.resizeNN(100, 50);
+    });
+    EXPECT_EQ(small.w, 100);
+    EXPECT_EQ(computed, 2);
+}
+
+TEST(PlanarTest, MatchesInterleaved) {
+    Image source(257, 131, 3);
+    for (size_t i = 0; i < source.size; ++i) {
+        source.data[i] = (uint8_t)(i * 29 + (i >> 7));
+    }
+
+    // CPU round trip
+    Image planar = source.clone();
+    planar.to_planar_cpu();
+    ASSERT_EQ(planar.layout, PLANAR);
+    EXPECT_EQ(planar.plane(1)[0], source.data[1]);
+    EXPECT_EQ(planar.plane(2)[5], source.data[5 * 3 + 2]);
+    Image back = planar.clone();
+    back.to_interleaved_cpu();
+    EXPECT_EQ(memcmp(back.data, source.data, source.size), 0);
+
+    Mask::GaussianBlur3 gaussianBlur;
+
+    // CPU convolution gives the same pixels in either layout
+    Image expected = source.clone();
+    Image planar_cpu = planar.clone();
+    for (int c = 0; c < 3; ++c) {
+        expected.std_convolve_clamp_to_border_cpu(c, &gaussianBlur);
+        planar_cpu.std_convolve_clamp_to_border_cpu(c, &gaussianBlur);
+    }
+    planar_cpu.to_interleaved_cpu();
+    EXPECT_EQ(memcmp(planar_cpu.data, expected.data, expected.size), 0);
+
+    // Device conversion and planar kernels agree with the interleaved ones
+    OpenCLImageProcessor processor;
+    Image planar_gpu = source.clone();
+    processor.to_planar(planar_gpu);
+    EXPECT_EQ(memcmp(planar_gpu.data, planar.data, planar.size), 0);
+
+    Image interleaved_gpu = source.clone();
+    processor.std_convolve_clamp_to_border(interleaved_gpu, &gaussianBlur);
+    processor.std_convolve_clamp_to_border(planar_gpu, &gaussianBlur);
+    processor.resizeBilinear(interleaved_gpu, 100, 60);
+    processor.resizeBilinear(planar_gpu, 100, 60);
+    processor.to_interleaved(planar_gpu);
+    ASSERT_EQ(planar_gpu.layout, INTERLEAVED);
+    EXPECT_EQ(memcmp(planar_gpu.data, interleaved_gpu.data, interleaved_gpu.size), 0);
+}
+
+TEST(ImageViewTest, RegionOfInterest) {
+    Image source(200, 120, 3);
+    for (size_t i = 0; i < source.size; ++i) {
+        source.data[i] = (uint8_t)(i * 37 + (i >> 5));
+    }
+
+    Mask::GaussianBlur3 gaussianBlur;
+    OpenCLImageProcessor processor;
+
+    // Views share the parent's pixels, cropping them is free
+    Image img = source.clone();
+    ImageView roi = img.view(30, 20, 101, 57);
+    EXPECT_EQ(roi.data, img.data + (20 * 200 + 30) * 3);
+    EXPECT_EQ(roi.stride, img.row_stride());
+    EXPECT_FALSE(roi.contiguous());
+
+    // Processing a region matches processing a cropped copy of it
+    Image cropped = source.clone();
+    cropped.crop(30, 20, 101, 57);
+    for (int c = 0; c < 3; ++c) {
+        roi.std_convolve_clamp_to_border(c, &gaussianBlur);
+        cropped.std_convolve_clamp_to_border_cpu(c, &gaussianBlur);
+    }
+    Image packed(roi);
+    EXPECT_EQ(memcmp(packed.data, cropped.data, cropped.size), 0);
+
+    // Same on the device through rect transfers, planar regions included
+    for (int planar = 0; planar < 2; ++planar) {
+        Image gpu = source.clone();
+        Image gpu_cropped = source.clone();
+        gpu_cropped.crop(30, 20, 101, 57);
+        if (planar) {
+            gpu.to_planar_cpu();
+            gpu_cropped.to_planar_cpu();
+        }
+        processor.std_convolve_clamp_to_0(gpu.view(30, 20, 101, 57), &gaussianBlur);
+        processor.flipX(gpu.view(30, 20, 101, 57));
+        processor.std_convolve_clamp_to_0(gpu_cropped, &gaussianBlur);
+        processor.flipX(gpu_cropped);
+        Image gpu_packed(gpu.view(30, 20, 101, 57));
+        EXPECT_EQ(memcmp(gpu_packed.data, gpu_cropped.data, gpu_cropped.size), 0);
+
+        // Nothing outside the region is touched
+        Image reference = source.clone();
+        if (planar) {
+            reference.to_planar_cpu();
+        }
+        gpu.view(30, 20, 101, 57).copy_to(reference.view(30, 20, 101, 57));
+        EXPECT_EQ(memcmp(gpu.data, reference.data, reference.size), 0);
+    }
+}
+
+TEST(ImageAllocatorTest, MoveOnlyAlignedPooledFrames) {
+    Image a(123, 45, 3);
+    EXPECT_EQ((uintptr_t)a.data % IMAGE_ALIGNMENT, 0);
+    a.data[7] = 42;
+
+    // Moves hand the buffer over, clones copy it
+    uint8_t* pixels = a.data;
+    Image b(std::move(a));
+    EXPECT_EQ(b.data, pixels);
+    EXPECT_EQ(a.data, nullptr);
+    Image c = b.clone();
+    EXPECT_NE(c.data, b.data);
+    EXPECT_EQ(c.data[7], 42);
+    c = std::move(b);
+    EXPECT_EQ(c.data, pixels);
+
+    // Once warm, a stream of same sized frames no longer touches the heap
+    FramePoolAllocator* pool = FramePoolAllocator::instance();
+    size_t fresh = 0;
+    for (int frame = 0; frame < 100; ++frame) {
+        if (frame == 1) {
+            fresh = pool->fresh_allocations();
+        }
+        Image img(640, 480, 3, pool);
+        EXPECT_EQ((uintptr_t)img.data % IMAGE_ALIGNMENT, 0);
+        img.resizeBilinear_cpu(320, 240);
+        img.resizeBilinear_cpu(640, 480);
+    }
+    EXPECT_EQ(pool->fresh_allocations(), fresh);
+
+    // Decoding too, stb's buffers come from the pool and its pixels are kept
+    Image png(96, 64, 3);
+    for (size_t i = 0; i < png.size; ++i) {
+        png.data[i] = (uint8_t)(i * 13);
+    }
+    ASSERT_TRUE(png.write("output/pooled_decode.png"));
+    for (int frame = 0; frame < 20; ++frame) {
+        if (frame == 1) {
+            fresh = pool->fresh_allocations();
+        }
+        Image decoded("output/pooled_decode.png", 0, pool);
+        ASSERT_NE(decoded.data, nullptr);
+        EXPECT_EQ((uintptr_t)decoded.data % IMAGE_ALIGNMENT, 0);
+        EXPECT_EQ(memcmp(decoded.data, png.data, png.size), 0);
+    }
+    EXPECT_EQ(pool->fresh_allocations(), fresh);
+}
+
+TEST(OutOfPlaceTest, PingPongMatchesInPlace) {
+    Image source(160, 90, 3);
+    for (size_t i = 0; i < source.size; ++i) {
+        source.data[i] = (uint8_t)(i * 53 + (i >> 6));
+    }
+
+    Mask::GaussianBlur3 gaussianBlur;
+    OpenCLImageProcessor processor;
+
+    // Reference, in place
+    Image expected = source.clone();
+    Image expected_gpu = source.clone();
+    for (int pass = 0; pass < 4; ++pass) {
+        for (int c = 0; c < 3; ++c) {
+            expected.std_convolve_clamp_to_border_cpu(c, &gaussianBlur);
+        }
+        expected.flipX_cpu();
+        processor.std_convolve_clamp_to_border(expected_gpu, &gaussianBlur);
+        processor.flipY(expected_gpu);
+    }
+
+    // Same work bouncing between two preallocated buffers
+    Image ping = source.clone();
+    Image pong(source.w, source.h, source.channels);
+    Image ping_gpu = source.clone();
+    Image pong_gpu(source.w, source.h, source.channels);
+    for (int pass = 0; pass < 4; ++pass) {
+        for (int c = 0; c < 3; ++c) {
+            ImageOps::std_convolve_clamp_to_border(ping.view(), pong.view(), c, &gaussianBlur);
+        }
+        ImageOps::flipX(pong.view(), ping.view());
+
+        processor.std_convolve_clamp_to_border(ping_gpu.view(), pong_gpu.view(), &gaussianBlur);
+        processor.flipY(pong_gpu.view(), ping_gpu.view());
+    }
+    EXPECT_EQ(memcmp(ping.data, expected.data, expected.size), 0);
+    EXPECT_EQ(memcmp(ping_gpu.data, expected_gpu.data, expected_gpu.size), 0);
+
+    // Resizes write into whatever size dst has
+    Image small(80, 45, 3);
+    Image small_gpu(80, 45, 3);
+    ImageOps::resizeBilinear(source.view(), small.view());
+    processor.resizeBilinear(source.view(), small_gpu.view());
+    Image resized = source.clone();
+    resized.resizeBilinear_cpu(80, 45);
+    EXPECT_EQ(memcmp(small.data, resized.data, resized.size), 0);
+    Image resized_gpu = source.clone();
+    processor.resizeBilinear(resized_gpu, 80, 45);
+    EXPECT_EQ(memcmp(small_gpu.data, resized_gpu.data, resized_gpu.size), 0);
+}
+
+TEST(HistogramTest, EqualizeAndClahe) {
+    // Low contrast gradient, every value inside [96, 160)
+    Image source(200, 120, 3);
+    for (int y = 0; y < source.h; ++y) {
+        for (int x = 0; x < source.w; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                source.data[(y * source.w + x) * 3 + c] = (uint8_t)(96 + ((x + 2 * y + c * 7) * 13 % 64));
+            }
+        }
+    }
+
+    uint32_t naive[3 * 256] = {};
+    for (size_t i = 0; i < source.size; ++i) {
+        ++naive[(i % 3) * 256 + source.data[i]];
+    }
+    uint32_t hist[3 * 256];
+    ImageOps::histogram(source.view(), hist);
+    EXPECT_EQ(memcmp(hist, naive, sizeof(naive)), 0);
+
+    Image planar = source.clone();
+    planar.to_planar_cpu();
+    ImageOps::histogram(planar.view(), hist);
+    EXPECT_EQ(memcmp(hist, naive, sizeof(naive)), 0);
+
+    // Equalization stretches the values over the whole range
+    Image equalized(source.w, source.h, source.channels);
+    ImageOps::equalize(source.view(), equalized.view());
+    uint8_t lo = 255, hi = 0;
+    for (size_t i = 0; i < equalized.size; ++i) {
+        lo = std::min(lo, equalized.data[i]);
+        hi = std::max(hi, equalized.data[i]);
+    }
+    EXPECT_LE(lo, 8);
+    EXPECT_EQ(hi, 255);
+
+    Image tiled(source.w, source.h, source.channels);
+    ImageOps::clahe(source.view(), tiled.view(), 4, 3, 2.0);
+    Image tiled_planar(planar.w, planar.h, planar.channels);
+    tiled_planar.to_planar_cpu();
+    ImageOps::clahe(planar.view(), tiled_planar.view(), 4, 3, 2.0);
+    tiled_planar.to_interleaved_cpu();
+    EXPECT_EQ(memcmp(tiled.data, tiled_planar.data, tiled.size), 0);
+
+    // The device uses the same integer maths so it matches exactly
+    OpenCLImageProcessor processor;
+    uint32_t hist_gpu[3 * 256];
+    processor.histogram(source, hist_gpu);
+    EXPECT_EQ(memcmp(hist_gpu, naive, sizeof(naive)), 0);
+
+    Image equalized_gpu = source.clone();
+    processor.equalize(equalized_gpu);
+    EXPECT_EQ(memcmp(equalized_gpu.data, equalized.data, equalized.size), 0);
+
+    Image tiled_gpu = source.clone();
+    processor.clahe(tiled_gpu, 4, 3, 2.0);
+    EXPECT_EQ(memcmp(tiled_gpu.data, tiled.data, tiled.size), 0);
+}
+
+TEST(ReduceTest, StatsMatchOnDevice) {
+    Image image(333, 111, 3);
+    uint64_t sum = 0, sum_sq = 0, above = 0;
+    uint8_t lo = 255, hi = 0;
+    for (size_t i = 0; i < image.size; ++i) {
+        uint8_t v = (uint8_t)(20 + (i * 31 + (i >> 5)) % 200);
+        image.data[i] = v;
+        sum += v;
+        sum_sq += v * v;
+        above += v > 128;
+        lo = std::min(lo, v);
+        hi = std::max(hi, v);
+    }
+
+    ImageStats stats = ImageOps::reduce(image.view(), 128);
+    EXPECT_EQ(stats.min, lo);
+    EXPECT_EQ(stats.max, hi);
+    EXPECT_EQ(stats.sum, sum);
+    EXPECT_EQ(stats.sum_sq, sum_sq);
+    EXPECT_EQ(stats.above, above);
+    EXPECT_EQ(stats.count, image.size);
+    EXPECT_NEAR(stats.mean(), (double)sum / image.size, 1e-9);
+
+    // A region of interest only counts its own samples
+    ImageStats roi = ImageOps::reduce(image.view(10, 20, 50, 30), 128);
+    EXPECT_EQ(roi.count, 50u * 30 * 3);
+
+    OpenCLImageProcessor processor;
+    ImageStats stats_gpu = processor.reduce(image, 128);
+    EXPECT_EQ(stats_gpu.min, lo);
+    EXPECT_EQ(stats_gpu.max, hi);
+    EXPECT_EQ(stats_gpu.sum, sum);
+    EXPECT_EQ(stats_gpu.sum_sq, sum_sq);
+    EXPECT_EQ(stats_gpu.above, above);
+    EXPECT_EQ(processor.reduce(image.view(10, 20, 50, 30), 128).sum, roi.sum);
+
+    Image black(64, 64, 3);
+    memset(black.data, 3, black.size);
+    EXPECT_TRUE(ImageOps::is_black(black.view()));
+    EXPECT_TRUE(processor.is_black(black));
+    black.data[1000] = 6;
+    EXPECT_FALSE(ImageOps::is_black(black.view()));
+    EXPECT_FALSE(processor.is_black(black));
+
+    // Device diffmap_scale finds the largest difference without a read back
+    Image other = image.clone();
+    for (size_t i = 0; i < other.size; i += 7) {
+        other.data[i] = (uint8_t)(other.data[i] / 2);
+    }
+    Image expected = image.clone();
+    expected.diffmap_scale_cpu(other);
+    Image scaled = image.clone();
+    processor.diffmap_scale(scaled, other);
+    EXPECT_EQ(memcmp(scaled.data, expected.data, expected.size), 0);
+}
+
+TEST(MetricsTest, MsePsnrSsim) {
+    Image reference(240, 160, 3);
+    for (int y = 0; y < reference.h; ++y) {
+        for (int x = 0; x < reference.w; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                reference.data[(y * reference.w + x) * 3 + c] = (uint8_t)((x * 3 + y * 2 + c * 40) % 256);
+            }
+        }
+    }
+    Image noisy = reference.clone();
+    uint64_t squared = 0;
+    for (size_t i = 0; i < noisy.size; ++i) {
+        int d = (int)((uint32_t)(i * 2654435761u) >> 28) - 8;
+        int v = std::min(255, std::max(0, (int)noisy.data[i] + d));
+        squared += (uint64_t)((v - noisy.data[i]) * (v - noisy.data[i]));
+        noisy.data[i] = (uint8_t)v;
+    }
+
+    double expected_mse = (double)squared / reference.size;
+    EXPECT_DOUBLE_EQ(ImageOps::mse(reference.view(), noisy.view()), expected_mse);
+    EXPECT_NEAR(ImageOps::psnr(reference.view(), noisy.view()), 10 * log10(255.0 * 255.0 / expected_mse), 1e-9);
+    EXPECT_TRUE(std::isinf(ImageOps::psnr(reference.view(), reference.view())));
+    EXPECT_NEAR(ImageOps::ssim(reference.view(), reference.view()), 1.0, 1e-6);
+
+    double ssim_noisy = ImageOps::ssim(reference.view(), noisy.view());
+    EXPECT_LT(ssim_noisy, 0.99);
+    EXPECT_GT(ssim_noisy, 0.3);
+
+    // Blurring loses structure too
+    Mask::GaussianBlur3 gaussianBlur;
+    Image blurred = reference.clone();
+    for (int pass = 0; pass < 4; ++pass) {
+        for (int c = 0; c < 3; ++c) {
+            blurred.std_convolve_clamp_to_border_cpu(c, &gaussianBlur);
+        }
+    }
+    EXPECT_LT(ImageOps::ssim(reference.view(), blurred.view()), 1.0);
+
+    Image reference_planar = reference.clone();
+    Image noisy_planar = noisy.clone();
+    reference_planar.to_planar_cpu();
+    noisy_planar.to_planar_cpu();
+    EXPECT_DOUBLE_EQ(ImageOps::mse(reference_planar.view(), noisy_planar.view()), expected_mse);
+    EXPECT_NEAR(ImageOps::ssim(reference_planar.view(), noisy_planar.view()), ssim_noisy, 1e-9);
+
+    OpenCLImageProcessor processor;
+    EXPECT_DOUBLE_EQ(processor.mse(reference, noisy), expected_mse);
+    EXPECT_TRUE(std::isinf(processor.psnr(reference, reference)));
+    EXPECT_NEAR(processor.ssim(reference, noisy), ssim_noisy, 1e-4);
+    EXPECT_NEAR(processor.ssim(reference_planar, noisy_planar), ssim_noisy, 1e-4);
+}
+
+TEST(ColorTest, ConversionsRoundTrip) {
+    Image rgb(96, 64, 3);
+    for (int y = 0; y < rgb.h; ++y) {
+        for (int x = 0; x < rgb.w; ++x) {
+            uint8_t* px = rgb.data + (y * rgb.w + x) * 3;
+            px[0] = (uint8_t)(x * 255 / (rgb.w - 1));
+            px[1] = (uint8_t)(y * 255 / (rgb.h - 1));
+            px[2] = (uint8_t)((x * 7 + y * 13) % 256);
+        }
+    }
+    // Corners with known values: black, red, green, blue
+    const uint8_t corners[4][3] = {{0, 0, 0}, {255, 0, 0}, {0, 255, 0}, {0, 0, 255}};
+    for (int i = 0; i < 4; ++i) {
+        memcpy(rgb.data + i * 3, corners[i], 3);
+    }
+
+    Image hsv(rgb.w, rgb.h, 3);
+    ImageOps::convert_from_rgb(rgb.view(), hsv.view(), COLOR_HSV);
+    EXPECT_EQ(hsv.data[3], 0);
+    EXPECT_EQ(hsv.data[4], 255);
+    EXPECT_EQ(hsv.data[6], 85);
+    EXPECT_EQ(hsv.data[9], 171);
+
+    Image ycc(rgb.w, rgb.h, 3);
+    ImageOps::convert_from_rgb(rgb.view(), ycc.view(), COLOR_YCBCR_601);
+    EXPECT_EQ(ycc.data[3], 76);
+    EXPECT_EQ(ycc.data[1], 128);
+    EXPECT_EQ(ycc.data[2], 128);
+
+    Image lab(rgb.w, rgb.h, 3);
+    ImageOps::convert_from_rgb(rgb.view(), lab.view(), COLOR_LAB);
+    EXPECT_EQ(lab.data[0], 0);
+    EXPECT_EQ(lab.data[1], 128);
+
+    // Every space comes back within a few levels
+    const ColorSpace spaces[] = {COLOR_YCBCR_601, COLOR_YCBCR_709, COLOR_HSV, COLOR_LAB};
+    for (ColorSpace space : spaces) {
+        Image converted(rgb.w, rgb.h, 3);
+        Image back(rgb.w, rgb.h, 3);
+        ImageOps::convert_from_rgb(rgb.view(), converted.view(), space);
+        ImageOps::convert_to_rgb(converted.view(), back.view(), space);
+        int worst = 0;
+        double total = 0;
+        for (size_t i = 0; i < rgb.size; ++i) {
+            worst = std::max(worst, abs(back.data[i] - rgb.data[i]));
+            total += abs(back.data[i] - rgb.data[i]);
+        }
+        if (space == COLOR_LAB) {
+            // 8 bit a and b lose dark channels of saturated colours
+            EXPECT_LE(total / rgb.size, 1.0);
+        }
+        else {
+            EXPECT_LE(worst, space == COLOR_HSV ? 3 : 2) << "colour space " << space;
+        }
+
+        // Converting into a planar image deinterleaves on the way
+        Image planar(rgb.w, rgb.h, 3);
+        planar.layout = PLANAR;
+        ImageOps::convert_from_rgb(rgb.view(), planar.view(), space);
+        planar.to_interleaved_cpu();
+        EXPECT_EQ(memcmp(planar.data, converted.data, converted.size), 0);
+    }
+
+    // Filtering only the luminance leaves flat chroma alone
+    Mask::GaussianBlur3 gaussianBlur;
+    Image blurred(rgb.w, rgb.h, 3);
+    ImageOps::convolve_luma(rgb.view(), blurred.view(), &gaussianBlur);
+    Image expected = ycc.clone();
+    expected.std_convolve_clamp_to_border_cpu(0, &gaussianBlur);
+    ImageOps::convert_to_rgb(expected.view(), expected.view(), COLOR_YCBCR_601);
+    EXPECT_EQ(memcmp(blurred.data, expected.data, expected.size), 0);
+
+    OpenCLImageProcessor processor;
+    for (ColorSpace space : spaces) {
+        Image converted(rgb.w, rgb.h, 3);
+        Image converted_gpu(rgb.w, rgb.h, 3);
+        ImageOps::convert_from_rgb(rgb.view(), converted.view(), space);
+        processor.convert_from_rgb(rgb.view(), converted_gpu.view(), space);
+        Image back_gpu(rgb.w, rgb.h, 3);
+        processor.convert_to_rgb(converted_gpu.view(), back_gpu.view(), space);
+        Image back(rgb.w, rgb.h, 3);
+        ImageOps::convert_to_rgb(converted.view(), back.view(), space);
+        if (space == COLOR_LAB) {
+            // Float maths, allow a level either way
+            for (size_t i = 0; i < rgb.size; ++i) {
+                EXPECT_LE(abs(converted_gpu.data[i] - converted.data[i]), 1);
+            }
+        }
+        else {
+            EXPECT_EQ(memcmp(converted_gpu.data, converted.data, converted.size), 0);
+            EXPECT_EQ(memcmp(back_gpu.data, back.data, back.size), 0);
+        }
+    }
+
+    Image blurred_gpu = rgb.clone();
+    processor.convolve_luma(blurred_gpu, &gaussianBlur);
+    EXPECT_EQ(memcmp(blurred_gpu.data, blurred.data, blurred.size), 0);
+}
+
+TEST(GrayscaleTest, SimdMatchesScalar) {
+    // Widths leave tails after the 32 and 16 pixel SIMD blocks
+    const int widths[] = {5, 77, 250};
+    for (int w : widths) {
+        for (int channels = 3; channels <= 4; ++channels) {
+            Image image(w, 9, channels);
+            for (size_t i = 0; i < image.size; ++i) {
+                image.data[i] = (uint8_t)(i * 97 + (i >> 3) * 31);
+            }
+
+            Image avg = image.grayscale_channel_cpu(GRAY_AVERAGE);
+            Image lum = image.grayscale_channel_cpu(GRAY_LUMINANCE);
+            ASSERT_EQ(avg.channels, 1);
+            for (int i = 0; i < w * image.h; ++i) {
+                const uint8_t* px = image.data + i * channels;
+                EXPECT_EQ(avg.data[i], (px[0] + px[1] + px[2]) / 3);
+                EXPECT_EQ(lum.data[i], (54 * px[0] + 183 * px[1] + 19 * px[2] + 128) >> 8);
+            }
+
+            // In place keeps the channel count and alpha
+            Image in_place = image.clone();
+            in_place.grayscale_lum_cpu();
+            for (int i = 0; i < w * image.h; ++i) {
+                for (int c = 0; c < 3; ++c) {
+                    EXPECT_EQ(in_place.data[i * channels + c], lum.data[i]);
+                }
+                if (channels == 4) {
+                    EXPECT_EQ(in_place.data[i * 4 + 3], image.data[i * 4 + 3]);
+                }
+            }
+
+            Image planar = image.clone();
+            planar.to_planar_cpu();
+            Image planar_gray = planar.grayscale_channel_cpu(GRAY_AVERAGE);
+            EXPECT_EQ(memcmp(planar_gray.data, avg.data, avg.size), 0);
+        }
+    }
+}
+
+TEST(CpuDispatchTest, EveryIsaMatchesBaseline) {
+    Image source(203, 71, 3);
+    for (size_t i = 0; i < source.size; ++i) {
+        source.data[i] = (uint8_t)(i * 131 + (i >> 4) * 7);
+    }
+    Image other = source.clone();
+    other.flipY_cpu();
+    Mask::GaussianDynamic2D gaussian(2.0);
+
+    // Runs every dispatched kernel and returns the results back to back
+    auto run = [&]() {
+        std::vector<uint8_t> out;
+        Image conv = source.clone();
+        for (int c = 0; c < 3; ++c) {
+            conv.std_convolve_clamp_to_border_cpu(c, &gaussian);
+        }
+        conv.std_convolve_clamp_to_0_cpu(1, &gaussian);
+        Image resized = source.clone();
+        resized.resizeBilinear_cpu(301, 50);
+        Image flipped = source.clone();
+        flipped.flipX_cpu();
+        Image diff = source.clone();
+        diff.diffmap_cpu(other);
+        Image gray = source.grayscale_channel_cpu(GRAY_LUMINANCE);
+        // Every byte triple is valid in each space, so source converts both ways
+        Image ycc(source.w, source.h, 3), hsv(source.w, source.h, 3), rgb(source.w, source.h, 3);
+        ImageOps::convert_from_rgb(source.view(), ycc.view(), COLOR_YCBCR_709);
+        ImageOps::convert_from_rgb(source.view(), hsv.view(), COLOR_HSV);
+        ImageOps::convert_to_rgb(source.view(), rgb.view(), COLOR_HSV);
+        ImageOps::convert_to_rgb(ycc.view(), ycc.view(), COLOR_YCBCR_709);
+        for (const Image* image : {&conv, &resized, &flipped, &diff, &gray, &ycc, &hsv, &rgb}) {
+            out.insert(out.end(), image->data, image->data + image->size);
+        }
+        return out;
+    };
+
+    CpuIsa original = CpuDispatch::active();
+    ASSERT_EQ(CpuDispatch::select(ISA_SSE2), ISA_SSE2);
+    std::vector<uint8_t> baseline = run();
+    for (int isa = ISA_AVX2; isa <= CpuDispatch::detected(); ++isa) {
+        EXPECT_EQ(CpuDispatch::select((CpuIsa)isa), isa);
+        EXPECT_TRUE(run() == baseline) << CpuDispatch::name((CpuIsa)isa);
+    }
+    // Sets the CPU lacks fall back to the best it has
+    EXPECT_EQ(CpuDispatch::select(ISA_AVX512), CpuDispatch::detected());
+    CpuDispatch::select(original);
+}
+
+TEST(GeometryTest, RotateTransposeMatchReference) {
+    auto pattern = [](int channels) {
+        Image image(203, 71, channels);
+        for (size_t i = 0; i < image.size; ++i) {
+            image.data[i] = (uint8_t)(i * 97 + (i >> 5) * 3);
+        }
+        return image;
+    };
+    auto pixel = [](const Image& image, int x, int y) {
+        return image.data + ((size_t)y * image.w + x) * image.channels;
+    };
+
+    // Every pixel checked against where the rotation should put it, for
+    // each pixel size the SIMD paths shuffle differently
+    for (int channels : {1, 3, 4}) {
+        Image source = pattern(channels);
+        int w = source.w, h = source.h;
+        Image transposed = source.clone();
+        transposed.transpose_cpu();
+        Image rotated90 = source.clone();
+        rotated90.rotate_cpu(ROTATE_90);
+        Image rotated180 = source.clone();
+        rotated180.rotate_cpu(ROTATE_180);
+        Image rotated270 = source.clone();
+        rotated270.rotate_cpu(ROTATE_270);
+        ASSERT_EQ(transposed.w, h);
+        ASSERT_EQ(rotated90.w, h);
+        ASSERT_EQ(rotated180.w, w);
+        ASSERT_EQ(rotated270.w, h);
+        int mismatches = 0;
+        for (int y = 0; y < h; ++y) {
+            for (int x = 0; x < w; ++x) {
+                const uint8_t* p = pixel(source, x, y);
+                mismatches += memcmp(pixel(transposed, y, x), p, channels) != 0;
+                mismatches += memcmp(pixel(rotated90, h - 1 - y, x), p, channels) != 0;
+                mismatches += memcmp(pixel(rotated180, w - 1 - x, h - 1 - y), p, channels) != 0;
+                mismatches += memcmp(pixel(rotated270, y, w - 1 - x), p, channels) != 0;
+            }
+        }
+        EXPECT_EQ(mismatches, 0) << channels << " channels";
+    }
+
+    Image source = pattern(4);
+    Image rotated90 = source.clone();
+    rotated90.rotate_cpu(ROTATE_90);
+    // A quarter turn each way, and planar images per plane
+    rotated90.rotate_cpu(ROTATE_270);
+    EXPECT_EQ(memcmp(rotated90.data, source.data, source.size), 0);
+    Image planar = source.clone();
+    planar.to_planar_cpu().rotate_cpu(ROTATE_90).to_interleaved_cpu();
+    EXPECT_EQ(memcmp(planar.data, rotated90.rotate_cpu(ROTATE_90).data, source.size), 0);
+
+    // Same pixels from the device, including the planar flipY it used to refuse
+    OpenCLImageProcessor processor;
+    for (PixelLayout layout : {INTERLEAVED, PLANAR}) {
+        for (int r = 0; r < 4; ++r) {
+            Image expected = source.clone();
+            Image gpu = source.clone();
+            if (layout == PLANAR) {
+                expected.to_planar_cpu();
+                gpu.to_planar_cpu();
+            }
+            if (r == 3) {
+                expected.transpose_cpu();
+                processor.transpose(gpu);
+            }
+            else {
+                expected.rotate_cpu((Rotation)r);
+                processor.rotate(gpu, (Rotation)r);
+            }
+            EXPECT_EQ(gpu.w, expected.w);
+            EXPECT_EQ(memcmp(gpu.data, expected.data, expected.size), 0) << "rotation " << r << " layout " << layout;
+
+            expected.flipY_cpu();
+            processor.flipY(gpu);
+            EXPECT_EQ(memcmp(gpu.data, expected.data, expected.size), 0) << "flipY layout " << layout;
+        }
+    }
+}
+
+TEST(WarpTest, TransformsMapsAndDevice) {
+    Image source(96, 96, 4);
+    for (size_t i = 0; i < source.size; ++i) {
+        source.data[i] = (uint8_t)(i * 29 + (i >> 7) * 5);
+    }
+    auto warped = [&](const Image& src, const Eigen::Matrix3d& t, Interpolation interp) {
+        Image out(src.w, src.h, src.channels);
+        out.layout = src.layout;
+        ImageOps::warp(src.view(), out.view(), t, interp);
+        return out;
+    };
+
+    // The identity and a quarter turn about the centre land exactly on pixels
+    for (Interpolation interp : {INTERP_BILINEAR, INTERP_BICUBIC}) {
+        Image same = warped(source, Eigen::Matrix3d::Identity(), interp);
+        EXPECT_EQ(memcmp(same.data, source.data, source.size), 0);
+        Image turned = warped(source, Warp::rotation(47.5, 47.5, 90), interp);
+        Image expected = source.clone();
+        expected.rotate_cpu(ROTATE_90);
+        EXPECT_EQ(memcmp(turned.data, expected.data, expected.size), 0);
+    }
+
+    // Corners onto a trapezoid, as when rectifying a photographed page
+    Eigen::Vector2d from[4] = { {0, 0}, {95, 0}, {95, 95}, {0, 95} };
+    Eigen::Vector2d to[4] = { {10, 5}, {85, 0}, {95, 95}, {0, 90} };
+    Eigen::Matrix3d homography = Warp::perspective(from, to);
+    for (int i = 0; i < 4; ++i) {
+        Eigen::Vector3d p = homography * from[i].homogeneous();
+        EXPECT_NEAR(p.x() / p.z(), to[i].x(), 1e-9);
+        EXPECT_NEAR(p.y() / p.z(), to[i].y(), 1e-9);
+    }
+    Eigen::Matrix3d deskew = Warp::shear(0.2, 0) * Warp::rotation(40, 60, 12.5, 0.8);
+
+    // A prebuilt map gives what the direct warp does, on every instruction set
+    // and for planar images
+    CpuIsa original = CpuDispatch::active();
+    std::vector<uint8_t> baseline;
+    for (int isa = ISA_SSE2; isa <= CpuDispatch::detected(); ++isa) {
+        CpuDispatch::select((CpuIsa)isa);
+        std::vector<uint8_t> results;
+        for (const Eigen::Matrix3d& t : {homography, deskew}) {
+            for (Interpolation interp : {INTERP_BILINEAR, INTERP_BICUBIC}) {
+                Image direct = warped(source, t, interp);
+                Image mapped(96, 96, 4);
+                ImageOps::remap(source.view(), mapped.view(), WarpMap(t, 96, 96, interp));
+                EXPECT_EQ(memcmp(direct.data, mapped.data, direct.size), 0);
+                Image planar = source.clone();
+                planar.to_planar_cpu();
+                Image planar_warped = warped(planar, t, interp);
+                planar_warped.to_interleaved_cpu();
+                EXPECT_EQ(memcmp(direct.data, planar_warped.data, direct.size), 0);
+                results.insert(results.end(), direct.data, direct.data + direct.size);
+            }
+        }
+        if (isa == ISA_SSE2) {
+            baseline = results;
+        }
+        EXPECT_TRUE(results == baseline) << CpuDispatch::name((CpuIsa)isa);
+    }
+    CpuDispatch::select(original);
+
+    // The device agrees, whether it computes positions or reads a cached map.
+    // Perspective divides may round differently on the device, so the odd
+    // pixel is allowed to move by a 1/32 step.
+    OpenCLImageProcessor processor;
+    for (Interpolation interp : {INTERP_BILINEAR, INTERP_BICUBIC}) {
+        Image expected = warped(source, deskew, interp);
+        Image gpu(96, 96, 4);
+        processor.warp(source.view(), gpu.view(), deskew, interp);
+        EXPECT_EQ(memcmp(gpu.data, expected.data, expected.size), 0);
+
+        Image expected_perspective = warped(source, homography, interp);
+        processor.warp(source.view(), gpu.view(), homography, interp);
+        size_t differing = 0;
+        for (size_t i = 0; i < gpu.size; ++i) {
+            differing += gpu.data[i] != expected_perspective.data[i];
+        }
+        EXPECT_LE(differing, gpu.size / 1000);
+
+        // Frames after the first reuse the program and the map on the device
+        WarpMap map(homography, 96, 96, interp);
+        for (int frame = 0; frame < 3; ++frame) {
+            memset(gpu.data, 0, gpu.size);
+            processor.resetTimings();
+            processor.remap(source.view(), gpu.view(), map);
+            EXPECT_EQ(memcmp(gpu.data, expected_perspective.data, gpu.size), 0);
+            if (frame > 0) {
+                EXPECT_EQ(processor.timings().builds, 0);
+                EXPECT_EQ(processor.timings().table_uploads, 0);
+            }
+        }
+    }
+}
+
+// Any size of mask from an array, row by row
+struct ArrayMask : public Mask::BaseMask {
+    std::vector<double> taps;
+    int w, h, cr, cc;
+
+    ArrayMask(std::vector<double> taps, int w, int h, int cr, int cc) : taps(taps), w(w), h(h), cr(cr), cc(cc) {}
+    int getWidth() const override { return w; }
+    int getHeight() const override { return h; }
+    int getCenterRow() const override { return cr; }
+    int getCenterColumn() const override { return cc; }
+    double getFilterFactor() const override { return 1.0; }
+    const double* getData() const override { return taps.data(); }
+};
+
+TEST(ConvolutionTest, SeparableAndFftMatchDirect) {
+    // Radix 4 stages alone and with a last radix 2 stage, against the plain DFT
+    for (int n : {64, 128}) {
+        std::vector<Fft::Complex> x(n), y(n), work(n);
+        for (int i = 0; i < n; ++i) {
+            x[i] = Fft::Complex(i % 7, (i * 5) % 3);
+        }
+        y = x;
+        Fft::transform(y.data(), work.data(), n, false);
+        for (int k = 0; k < n; ++k) {
+            Fft::Complex sum = 0;
+            for (int i = 0; i < n; ++i) {
+                sum += x[i] * std::polar(1.0, -2 * M_PI * i * k / n);
+            }
+            EXPECT_LT(std::abs(sum - y[k]), 1e-9);
+        }
+        Fft::transform(y.data(), work.data(), n, true);
+        EXPECT_LT(std::abs(y[5] / (double)n - x[5]), 1e-12);
+    }
+
+    Image source(203, 97, 3);
+    for (size_t i = 0; i < source.size; ++i) {
+        source.data[i] = (uint8_t)(i * 131 + (i >> 4) * 7);
+    }
+    Mask::GaussianDynamic2D gaussian(3.0);
+    // Off centre and lopsided, so a flipped mask or a shifted image shows
+    std::vector<double> taps(9 * 7);
+    for (size_t i = 0; i < taps.size(); ++i) {
+        taps[i] = ((int)(i * 37 % 11) - 3) / 97.0;
+    }
+    ArrayMask lopsided(taps, 9, 7, 2, 6);
+    auto differing = [](const Image& a, const Image& b, int& largest) {
+        size_t count = 0;
+        largest = 0;
+        for (size_t i = 0; i < a.size; ++i) {
+            int d = abs(a.data[i] - b.data[i]);
+            count += d != 0;
+            largest = std::max(largest, d);
+        }
+        return count;
+    };
+
+    // Separable Gaussians and FFT agree with direct up to a pixel landing on a half
+    OpenCLImageProcessor processor;
+    for (ConvolutionBorder border : {CLAMP_TO_0, CLAMP_TO_BORDER}) {
+        for (const Mask::BaseMask* mask : {(const Mask::BaseMask*)&gaussian, (const Mask::BaseMask*)&lopsided}) {
+            Image direct = source.clone();
+            ImageOps::convolve(source.view(), direct.view(), mask, border, CONVOLVE_DIRECT);
+            Image direct_gpu = source.clone();
+            processor.convolve(direct_gpu, mask, border, CONVOLVE_DIRECT);
+
+            for (ConvolutionMethod method : {CONVOLVE_SEPARABLE, CONVOLVE_FFT}) {
+                if (method == CONVOLVE_SEPARABLE && mask == &lopsided) {
+                    continue;
+                }
+                int largest;
+                Image cpu = source.clone();
+                cpu.to_planar_cpu();
+                ImageOps::convolve(cpu.view(), cpu.view(), mask, border, method);
+                cpu.to_interleaved_cpu();
+                EXPECT_LE(differing(cpu, direct, largest), cpu.size / 100);
+                EXPECT_LE(largest, 1);
+
+                // A second frame reuses the device's copy of the spectrum
+                for (int frame = 0; frame < 2; ++frame) {
+                    Image gpu = source.clone();
+                    processor.convolve(gpu, mask, border, method);
+                    EXPECT_LE(differing(gpu, direct_gpu, largest), gpu.size / 100);
+                    EXPECT_LE(largest, 1);
+                }
+            }
+        }
+    }
+
+    // Small masks stay direct, Gaussians split, big arbitrary masks go through the FFT
+    Mask::BoxBlur box;
+    ArrayMask disk(std::vector<double>(25 * 25, 1.0 / 625), 25, 25, 12, 12);
+    disk.taps[0] = 0;
+    EXPECT_EQ(Convolution::choose(1024, 1024, &box), CONVOLVE_DIRECT);
+    EXPECT_EQ(Convolution::choose(1024, 1024, &gaussian), CONVOLVE_SEPARABLE);
+    EXPECT_EQ(Convolution::choose(1024, 1024, &disk), CONVOLVE_FFT);
+}
+
+TEST(RankTest, MatchesSortedWindows) {
+    // Wider than a column strip, so strips meet inside the image
+    Image source(300, 41, 3);
+    for (size_t i = 0; i < source.size; ++i) {
+        source.data[i] = (uint8_t)((i * 2654435761u) >> 24);
+    }
+    auto reference = [&](int radius, double percent) {
+        Image out = source.clone();
+        int n = (2 * radius + 1) * (2 * radius + 1);
+        int rank = (int)lround(percent / 100.0 * (n - 1));
+        std::vector<uint8_t> window;
+        for (int y = 0; y < source.h; ++y) {
+            for (int x = 0; x < source.w; ++x) {
+                for (int c = 0; c < source.channels; ++c) {
+                    window.clear();
+                    for (int i = -radius; i <= radius; ++i) {
+                        for (int j = -radius; j <= radius; ++j) {
+                            int sy = std::min(std::max(y + i, 0), source.h - 1);
+                            int sx = std::min(std::max(x + j, 0), source.w - 1);
+                            window.push_back(source.data[(sy * source.w + sx) * source.channels + c]);
+                        }
+                    }
+                    std::sort(window.begin(), window.end());
+                    out.data[(y * source.w + x) * source.channels + c] = window[rank];
+                }
+            }
+        }
+        return out;
+    };
+
+    OpenCLImageProcessor processor;
+    // Selection and histogram paths, in both layouts, and the device
+    for (int radius : {1, 2, 3, 7}) {
+        for (double percent : {0.0, 25.0, 50.0, 100.0}) {
+            Image expected = reference(radius, percent);
+
+            Image interleaved = source.clone();
+            interleaved.rank_filter_cpu(radius, percent);
+            EXPECT_EQ(memcmp(interleaved.data, expected.data, expected.size), 0) << radius << " " << percent;
+
+            Image planar = source.clone();
+            planar.to_planar_cpu();
+            Image planar_out = planar.clone();
+            ImageOps::rank_filter(planar.view(), planar_out.view(), radius, percent);
+            planar_out.to_interleaved_cpu();
+            EXPECT_EQ(memcmp(planar_out.data, expected.data, expected.size), 0) << radius << " " << percent;
+
+            Image gpu = source.clone();
+            processor.rank_filter(gpu, radius, percent);
+            EXPECT_EQ(memcmp(gpu.data, expected.data, expected.size), 0) << radius << " " << percent;
+            processor.rank_filter(planar, radius, percent);
+            planar.to_interleaved_cpu();
+            EXPECT_EQ(memcmp(planar.data, expected.data, expected.size), 0) << radius << " " << percent;
+        }
+    }
+
+    // A speck of salt in a flat patch goes with the median and spreads with the maximum
+    Image patch(9, 9, 1);
+    memset(patch.data, 100, patch.size);
+    patch.data[4 * 9 + 4] = 255;
+    Image grown = patch.clone();
+    ImageOps::max_filter(patch.view(), grown.view(), 1);
+    EXPECT_EQ(grown.data[3 * 9 + 3], 255);
+    EXPECT_EQ(grown.data[2 * 9 + 2], 100);
+    patch.median_cpu(1);
+    EXPECT_EQ(patch.data[4 * 9 + 4], 100);
+
+    // Overlapping views that start at different pixels read the source as it was
+    EXPECT_EQ(shifted_view_mismatches(source, [](const ImageView& src, const ImageView& dst) {
+        ImageOps::median(src, dst, 3);
+    }), 0);
+}
+
+TEST(MorphologyTest, MatchesNaiveWindows) {
+    Image source(300, 37, 3);
+    for (size_t i = 0; i < source.size; ++i) {
+        source.data[i] = (uint8_t)((i * 2654435761u) >> 24);
+    }
+    // Min or max over the element, pixels outside the image left out
+    auto reference = [](const Image& src, int rx, int ry, StructuringElement shape, bool take_max) {
+        Image out = src.clone();
+        for (int y = 0; y < src.h; ++y) {
+            for (int x = 0; x < src.w; ++x) {
+                for (int c = 0; c < src.channels; ++c) {
+                    int v = take_max ? 0 : 255;
+                    for (int i = -ry; i <= ry; ++i) {
+                        for (int j = -rx; j <= rx; ++j) {
+                            int sx = x + j, sy = y + i;
+                            if ((shape == MORPH_CROSS && i != 0 && j != 0) || sx < 0 || sy < 0 || sx >= src.w || sy >= src.h) {
+                                continue;
+                            }
+                            int s = src.data[(sy * src.w + sx) * src.channels + c];
+                            v = take_max ? std::max(v, s) : std::min(v, s);
+                        }
+                    }
+                    out.data[(y * src.w + x) * src.channels + c] = (uint8_t)v;
+                }
+            }
+        }
+        return out;
+    };
+
+    OpenCLImageProcessor processor;
+    for (StructuringElement shape : {MORPH_RECT, MORPH_CROSS}) {
+        for (std::pair<int, int> r : {std::make_pair(1, 1), std::make_pair(4, 2), std::make_pair(0, 9)}) {
+            Image eroded = reference(source, r.first, r.second, shape, false);
+            Image dilated = reference(source, r.first, r.second, shape, true);
+            Image opened = reference(eroded, r.first, r.second, shape, true);
+            Image closed = reference(dilated, r.first, r.second, shape, false);
+            Image expected[] = { eroded.clone(), dilated.clone(), opened.clone(), closed.clone(),
+                dilated.clone(), source.clone(), closed.clone() };
+            for (size_t i = 0; i < source.size; ++i) {
+                expected[MORPH_GRADIENT].data[i] -= eroded.data[i];
+                expected[MORPH_TOPHAT].data[i] -= opened.data[i];
+                expected[MORPH_BLACKHAT].data[i] -= source.data[i];
+            }
+
+            for (int op = MORPH_ERODE; op <= MORPH_BLACKHAT; ++op) {
+                Image cpu = source.clone();
+                cpu.morphology_cpu((MorphologyOp)op, r.first, r.second, shape);
+                EXPECT_EQ(memcmp(cpu.data, expected[op].data, cpu.size), 0) << op << " " << shape << " " << r.first;
+
+                Image gpu = source.clone();
+                processor.morphology(gpu, (MorphologyOp)op, r.first, r.second, shape);
+                EXPECT_EQ(memcmp(gpu.data, expected[op].data, gpu.size), 0) << op << " " << shape << " " << r.first;
+            }
+
+            // Planar rows and columns are passes over each plane
+            Image planar = source.clone();
+            planar.to_planar_cpu();
+            Image planar_gpu = planar.clone();
+            ImageOps::dilate(planar.view(), planar.view(), r.first, r.second, shape);
+            processor.dilate(planar_gpu.view(), planar_gpu.view(), r.first, r.second, shape);
+            planar.to_interleaved_cpu();
+            planar_gpu.to_interleaved_cpu();
+            EXPECT_EQ(memcmp(planar.data, dilated.data, planar.size), 0);
+            EXPECT_EQ(memcmp(planar_gpu.data, dilated.data, planar.size), 0);
+        }
+    }
+}
+
+TEST(EdgePreservingTest, BilateralAndGuidedMatchReference) {
+    // A vertical edge from 50 to 200 under a little noise
+    Image source(97, 45, 3);
+    for (int y = 0; y < source.h; ++y) {
+        for (int x = 0; x < source.w; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                int noise = (int)(((y * source.w + x) * 3 + c) * 2654435761u >> 29) - 4;
+                source.data[(y * source.w + x) * 3 + c] = (uint8_t)((x < 48 ? 50 : 200) + c * 10 + noise);
+            }
+        }
+    }
+    auto at = [&](int x, int y, int c) { return (double)source.data[(std::min(std::max(y, 0), source.h - 1) * source.w +
+        std::min(std::max(x, 0), source.w - 1)) * 3 + c]; };
+    auto within_one = [](const Image& a, const Image& b) {
+        int largest = 0;
+        for (size_t i = 0; i < a.size; ++i) {
+            largest = std::max(largest, abs(a.data[i] - b.data[i]));
+        }
+        return largest <= 1;
+    };
+
+    // Bilateral from its definition, weights over the colour distance
+    double sigma_space = 1.5, sigma_range = 20;
+    int radius = EdgePreserving::bilateral_radius(sigma_space);
+    Image bilateral = source.clone();
+    for (int y = 0; y < source.h; ++y) {
+        for (int x = 0; x < source.w; ++x) {
+            double sum[3] = {}, total = 0;
+            for (int i = -radius; i <= radius; ++i) {
+                for (int j = -radius; j <= radius; ++j) {
+                    double d2 = 0;
+                    for (int c = 0; c < 3; ++c) {
+                        d2 += pow(at(x + j, y + i, c) - at(x, y, c), 2);
+                    }
+                    double weight = exp(-(i * i + j * j) / (2 * sigma_space * sigma_space) - d2 / (2 * sigma_range * sigma_range));
+                    total += weight;
+                    for (int c = 0; c < 3; ++c) {
+                        sum[c] += weight * at(x + j, y + i, c);
+                    }
+                }
+            }
+            for (int c = 0; c < 3; ++c) {
+                bilateral.data[(y * source.w + x) * 3 + c] = (uint8_t)(sum[c] / total + 0.5);
+            }
+        }
+    }
+
+    // Guided by itself, box means taken directly
+    int box = EdgePreserving::guided_radius(sigma_space);
+    double eps = sigma_range * sigma_range;
+    Image guided = source.clone();
+    for (int c = 0; c < 3; ++c) {
+        auto box_mean = [&](const std::vector<double>& v, int x, int y) {
+            double sum = 0;
+            int count = 0;
+            for (int i = std::max(y - box, 0); i <= std::min(y + box, source.h - 1); ++i) {
+                for (int j = std::max(x - box, 0); j <= std::min(x + box, source.w - 1); ++j) {
+                    sum += v[i * source.w + j];
+                    ++count;
+                }
+            }
+            return sum / count;
+        };
+        std::vector<double> p(source.w * source.h), pp(p.size()), a(p.size()), b(p.size());
+        for (size_t k = 0; k < p.size(); ++k) {
+            p[k] = source.data[k * 3 + c];
+            pp[k] = p[k] * p[k];
+        }
+        for (int y = 0; y < source.h; ++y) {
+            for (int x = 0; x < source.w; ++x) {
+                double mean = box_mean(p, x, y), variance = box_mean(pp, x, y) - mean * mean;
+                a[y * source.w + x] = variance / (variance + eps);
+                b[y * source.w + x] = mean - a[y * source.w + x] * mean;
+            }
+        }
+        for (int y = 0; y < source.h; ++y) {
+            for (int x = 0; x < source.w; ++x) {
+                double q = box_mean(a, x, y) * p[y * source.w + x] + box_mean(b, x, y);
+                guided.data[(y * source.w + x) * 3 + c] = (uint8_t)std::min(std::max(q + 0.5, 0.0), 255.0);
+            }
+        }
+    }
+
+    Image cpu_bilateral = source.clone();
+    cpu_bilateral.bilateral_cpu(sigma_space, sigma_range);
+    EXPECT_TRUE(within_one(cpu_bilateral, bilateral));
+    Image cpu_guided = source.clone();
+    cpu_guided.guided_cpu(sigma_space, sigma_range);
+    EXPECT_TRUE(within_one(cpu_guided, guided));
+
+    OpenCLImageProcessor processor;
+    Image gpu_bilateral = source.clone();
+    processor.bilateral(gpu_bilateral, sigma_space, sigma_range);
+    EXPECT_TRUE(within_one(gpu_bilateral, bilateral));
+    Image gpu_guided = source.clone();
+    processor.guided(gpu_guided, sigma_space, sigma_range);
+    EXPECT_TRUE(within_one(gpu_guided, guided));
+
+    // The edge stays sharp where a blur would meet halfway. The guided filter
+    // lets a little across, as a fit over boxes straddling the edge does.
+    for (const Image* image : {&cpu_bilateral, &cpu_guided}) {
+        for (int y = 0; y < source.h; ++y) {
+            EXPECT_NEAR(image->data[(y * source.w + 47) * 3], 50, 10);
+            EXPECT_NEAR(image->data[(y * source.w + 48) * 3], 200, 10);
+        }
+    }
+}
+
+TEST(EdgesTest, SobelAndCannyMatchReference) {
+    // A vertical step at x = 20 whose contrast fades from 60 at the top to 21
+    // at the bottom, and a step of 30 further right
+    Image source(60, 40, 1);
+    for (int y = 0; y < source.h; ++y) {
+        for (int x = 0; x < source.w; ++x) {
+            source.data[y * source.w + x] = (uint8_t)(40 + (x >= 20 ? 60 - y : 0) + (x >= 45 ? 30 : 0));
+        }
+    }
+
+    // Gx and Gy straight from the masks, edge pixels repeated
+    Mask::EdgeSobelX sobel_x;
+    Mask::EdgeSobelY sobel_y;
+    Image magnitude(source.w, source.h, 1), orientation(source.w, source.h, 1);
+    ImageOps::sobel(source.view(), magnitude.view(), orientation.view());
+    for (int y = 0; y < source.h; ++y) {
+        for (int x = 0; x < source.w; ++x) {
+            double gx = 0, gy = 0;
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 3; ++j) {
+                    int sy = std::min(std::max(y + i - 1, 0), source.h - 1);
+                    int sx = std::min(std::max(x + j - 1, 0), source.w - 1);
+                    gx += sobel_x.getData()[i * 3 + j] * source.data[sy * source.w + sx];
+                    gy += sobel_y.getData()[i * 3 + j] * source.data[sy * source.w + sx];
+                }
+            }
+            EXPECT_EQ(magnitude.data[y * source.w + x], std::min(lround(sqrt(gx * gx + gy * gy)), 255L));
+            EXPECT_EQ(orientation.data[y * source.w + x], Edges::direction((int)gx, (int)gy));
+        }
+    }
+    EXPECT_EQ(orientation.data[10 * source.w + 20], GRADIENT_HORIZONTAL);
+    EXPECT_EQ(Edges::direction(0, 5), GRADIENT_VERTICAL);
+    EXPECT_EQ(Edges::direction(5, 5), GRADIENT_DIAGONAL_DOWN);
+    EXPECT_EQ(Edges::direction(5, -5), GRADIENT_DIAGONAL_UP);
+
+    // The step is 4 x contrast strong: at least 200 down to row 10, at least
+    // 100 down to row 35. Hysteresis keeps the weak part joined to the strong
+    // one and drops the step of 30, weak everywhere. One pixel wide at x = 20,
+    // where the fading adds a little Gy.
+    Image edges = source.canny_cpu(100, 200);
+    size_t count = 0;
+    for (int y = 0; y < source.h; ++y) {
+        EXPECT_EQ(edges.data[y * source.w + 20], y <= 35 ? 255 : 0) << y;
+        for (int x = 0; x < source.w; ++x) {
+            count += edges.data[y * source.w + x] != 0;
+        }
+    }
+    EXPECT_EQ(count, 36u);
+
+    // The device decides everything in integers too, so both match exactly
+    OpenCLImageProcessor processor;
+    Image gpu_magnitude(source.w, source.h, 1), gpu_orientation(source.w, source.h, 1);
+    processor.sobel(source.view(), gpu_magnitude.view(), gpu_orientation.view());
+    EXPECT_EQ(memcmp(gpu_magnitude.data, magnitude.data, magnitude.size), 0);
+    EXPECT_EQ(memcmp(gpu_orientation.data, orientation.data, orientation.size), 0);
+
+    // Hysteresis has to cross several tiles along a long diagonal ramp
+    Image ramp(300, 200, 1);
+    for (int y = 0; y < ramp.h; ++y) {
+        for (int x = 0; x < ramp.w; ++x) {
+            ramp.data[y * ramp.w + x] = (uint8_t)(x + y > 250 ? 40 + (x * 7 + y * 3) % 64 : 20);
+        }
+    }
+    for (const Image* image : {&source, &ramp}) {
+        Image cpu = image->canny_cpu(60, 150);
+        Image gpu = image->clone();
+        processor.canny(gpu, 60, 150);
+        EXPECT_EQ(memcmp(gpu.data, cpu.data, cpu.size), 0);
+    }
+}
+
+TEST(UnsharpTest, MatchesBlurSubtractAdd) {
+    // A bright square on a gentle ramp, under noise of a few levels
+    Image source(70, 50, 3);
+    for (int y = 0; y < source.h; ++y) {
+        for (int x = 0; x < source.w; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                int noise = (int)(((y * source.w + x) * 3 + c) * 2654435761u >> 30) - 2;
+                bool inside = x >= 30 && x < 45 && y >= 20 && y < 35;
+                source.data[(y * source.w + x) * 3 + c] = (uint8_t)((inside ? 180 : 60 + x / 2) + c * 10 + noise);
+            }
+        }
+    }
+
+    // Blur, subtract and add as three steps over the whole image
+    auto reference = [&](double amount, double radius, int threshold) {
+        auto row = MaskFactory::gaussian(radius, MASK_ROW);
+        const float* taps = row->getFloatData();
+        int reach = row->getWidth() / 2;
+        Image expected = source.clone();
+        for (int y = 0; y < source.h; ++y) {
+            for (int x = 0; x < source.w; ++x) {
+                for (int c = 0; c < 3; ++c) {
+                    double blur = 0;
+                    for (int i = -reach; i <= reach; ++i) {
+                        for (int j = -reach; j <= reach; ++j) {
+                            int sy = std::min(std::max(y + i, 0), source.h - 1);
+                            int sx = std::min(std::max(x + j, 0), source.w - 1);
+                            blur += (double)taps[i + reach] * taps[j + reach] * source.data[(sy * source.w + sx) * 3 + c];
+                        }
+                    }
+                    double v = source.data[(y * source.w + x) * 3 + c], d = v - blur;
+                    double r = fabs(d) < threshold ? v : std::min(std::max(v + amount * d, 0.0), 255.0);
+                    expected.data[(y * source.w + x) * 3 + c] = (uint8_t)(r + 0.5);
+                }
+            }
+        }
+        return expected;
+    };
+    auto largest_difference = [](const Image& a, const Image& b) {
+        int largest = 0;
+        for (size_t i = 0; i < a.size; ++i) {
+            largest = std::max(largest, abs(a.data[i] - b.data[i]));
+        }
+        return largest;
+    };
+
+    Image sharpened = source.clone();
+    sharpened.unsharp_cpu(1.5, 1.2, 0);
+    EXPECT_LE(largest_difference(sharpened, reference(1.5, 1.2, 0)), 1);
+
+    // Planar gives the same pixels
+    Image planar = source.clone();
+    planar.to_planar_cpu().unsharp_cpu(1.5, 1.2, 0).to_interleaved_cpu();
+    EXPECT_EQ(memcmp(planar.data, sharpened.data, sharpened.size), 0);
+
+    // The noise stays under the threshold, away from the square nothing changes
+    Image thresholded = source.clone();
+    thresholded.unsharp_cpu(1.5, 1.2, 10);
+    EXPECT_LE(largest_difference(thresholded, reference(1.5, 1.2, 10)), 1);
+    for (int y = 0; y < 10; ++y) {
+        EXPECT_EQ(memcmp(thresholded.data + y * source.w * 3, source.data + y * source.w * 3, source.w * 3), 0);
+    }
+    EXPECT_GT(largest_difference(thresholded, source), 20);
+
+    // Overlapping views that start at different pixels read the source as it was
+    EXPECT_EQ(shifted_view_mismatches(source, [](const ImageView& src, const ImageView& dst) {
+        ImageOps::unsharp(src, dst, 1.5, 1.2, 0);
+    }), 0);
+
+    // The fused kernel, and the two pass one for a radius too large for a tile
+    OpenCLImageProcessor processor;
+    for (double radius : {1.2, 40.0}) {
+        Image cpu = source.clone();
+        cpu.unsharp_cpu(0.8, radius, 3);
+        Image gpu = source.clone();
+        processor.unsharp(gpu, 0.8, radius, 3);
+        EXPECT_LE(largest_difference(gpu, cpu), 1) << radius;
+    }
+}
+
+TEST(StaticMaskTest, MatchesRuntimeMasks) {
+    // Built by the compiler, taps over the divisor
+    static_assert(Mask::GAUSSIAN_BLUR_3[4] == 0.25, "GaussianBlur3's centre is 4 / 16");
+    constexpr Mask::StaticMask<7, 7> gaussian = Mask::gaussian<3>(1.0);
+    static_assert(gaussian[24] > gaussian[23] && gaussian[0] < 1e-4, "peaks in the centre");
+    Mask::GaussianDynamic2D dynamic(1.0);
+    for (int i = 0; i < 49; ++i) {
+        EXPECT_NEAR(gaussian[i], dynamic.getData()[i], 1e-7);
+    }
+
+    // The fixed masks keep their taps and factors
+    Mask::GaussianBlur5 blur5;
+    Mask::SharpenMask sharpen;
+    EXPECT_EQ(blur5.getFilterFactor(), 273);
+    EXPECT_EQ(blur5.getData()[12], 41.0 / 273);
+    EXPECT_EQ(sharpen.getData()[0], -1.0 / 8);
+    EXPECT_EQ(sharpen.getCenterRow(), 2);
+    EXPECT_TRUE(sharpen.isStatic());
+
+    Image source(83, 41, 3);
+    for (size_t i = 0; i < source.size; ++i) {
+        source.data[i] = (uint8_t)((i * 2654435761u) >> 24);
+    }
+
+    // The unrolled kernels give the generic loops' bytes, centred or not
+    const CpuKernels& kernels = CpuDispatch::kernels();
+    for (int size : {3, 5}) {
+        for (int centre : {0, size / 2, size - 1}) {
+            std::vector<double> taps(size * size);
+            for (int i = 0; i < size * size; ++i) {
+                taps[i] = ((i * 37) % 11 - 4) / 7.0;
+            }
+            for (bool border : {false, true}) {
+                Image generic = source.clone(), fixed = source.clone();
+                (border ? kernels.convolve_border : kernels.convolve_0)(source.data + 1, 3, source.w * 3, source.w,
+                    source.h, taps.data(), size, size, centre, size - 1 - centre, generic.data + 1, 3, source.w * 3);
+                auto unrolled = size == 3 ? (border ? kernels.convolve_3x3_border : kernels.convolve_3x3_0)
+                    : (border ? kernels.convolve_5x5_border : kernels.convolve_5x5_0);
+                unrolled(source.data + 1, 3, source.w * 3, source.w, source.h, taps.data(), size, size, centre,
+                    size - 1 - centre, fixed.data + 1, 3, source.w * 3);
+                EXPECT_EQ(memcmp(generic.data, fixed.data, source.size), 0) << size << " " << centre << " " << border;
+            }
+        }
+    }
+
+    // A StaticMask straight into ImageOps::convolve is its runtime copy
+    ArrayMask copy(std::vector<double>(gaussian.taps.begin(), gaussian.taps.end()), 7, 7, 3, 3);
+    Image from_static = source.clone(), from_copy = source.clone();
+    ImageOps::convolve(source.view(), from_static.view(), gaussian, CLAMP_TO_BORDER, CONVOLVE_DIRECT);
+    ImageOps::convolve(source.view(), from_copy.view(), &copy, CLAMP_TO_BORDER, CONVOLVE_DIRECT);
+    EXPECT_EQ(memcmp(from_static.data, from_copy.data, source.size), 0);
+
+    // On the device the taps built into the program give the buffer's results
+    OpenCLImageProcessor processor;
+    Mask::EdgeSobelX sobel;
+    ArrayMask sobel_copy(std::vector<double>(sobel.getData(), sobel.getData() + 9), 3, 3, 1, 1);
+    ArrayMask blur5_copy(std::vector<double>(blur5.getData(), blur5.getData() + 25), 5, 5, 2, 2);
+    Image built_in(source.w, source.h, 3), from_buffer(source.w, source.h, 3);
+    processor.std_convolve_clamp_to_0(source.view(), built_in.view(), &sobel);
+    processor.std_convolve_clamp_to_0(source.view(), from_buffer.view(), &sobel_copy);
+    EXPECT_EQ(memcmp(built_in.data, from_buffer.data, source.size), 0);
+    processor.std_convolve_clamp_to_border(source.view(), built_in.view(), &blur5);
+    processor.std_convolve_clamp_to_border(source.view(), from_buffer.view(), &blur5_copy);
+    EXPECT_EQ(memcmp(built_in.data, from_buffer.data, source.size), 0);
+
+    // Both programs are kept, calling again compiles nothing
+    processor.resetTimings();
+    processor.std_convolve_clamp_to_0(source.view(), built_in.view(), &sobel);
+    processor.std_convolve_clamp_to_0(source.view(), from_buffer.view(), &sobel_copy);
+    EXPECT_EQ(processor.timings().builds, 0);
+}
+
+TEST(MaskFactoryTest, CachesOuterProducts) {
+    // The default Gaussian is sigma 1, and 2D is the 1D row times its column
+    Mask::GaussianDynamic2D by_default, one(1.0), two(2.0);
+    ASSERT_EQ(by_default.getWidth(), 7);
+    EXPECT_EQ(memcmp(by_default.getData(), one.getData(), 49 * sizeof(double)), 0);
+    Mask::GaussianDynamic1D row(2.0, false);
+    double sum = 0;
+    for (int i = 0; i < two.getHeight(); ++i) {
+        for (int j = 0; j < two.getWidth(); ++j) {
+            EXPECT_EQ(two.getData()[i * two.getWidth() + j], row.getData()[i] * row.getData()[j]);
+            sum += two.getData()[i * two.getWidth() + j];
+        }
+    }
+    EXPECT_NEAR(sum, 1.0, 1e-12);
+
+    // Made once and shared, with the dynamic mask's taps
+    MaskFactory::clear();
+    auto gaussian = MaskFactory::gaussian(2.0);
+    EXPECT_EQ(MaskFactory::gaussian(2.0), gaussian);
+    EXPECT_EQ(MaskFactory::size(), 2u);
+    EXPECT_EQ(memcmp(gaussian->getData(), two.getData(), 13 * 13 * sizeof(double)), 0);
+    auto column = MaskFactory::gaussian(2.0, MASK_COLUMN);
+    EXPECT_EQ(column->getWidth(), 1);
+    EXPECT_EQ(column->getHeight(), 13);
+    EXPECT_EQ(MaskFactory::get(MASK_GAUSSIAN, 0.0), nullptr);
+
+    // Float and fixed-point copies, the fixed taps summing to exactly one
+    auto box = MaskFactory::box(1.0);
+    EXPECT_EQ(box->getWidth(), 5);
+    int fixed_sum = 0;
+    for (int i = 0; i < 25; ++i) {
+        EXPECT_EQ(box->getFloatData()[i], (float)box->getData()[i]);
+        // The centre takes up what rounding the others lost
+        EXPECT_NEAR(box->getFixedData()[i], box->getData()[i] * (1 << FactoryMask::FIXED_BITS), i == 12 ? 12.5 : 0.5);
+        fixed_sum += box->getFixedData()[i];
+    }
+    EXPECT_EQ(fixed_sum, 1 << FactoryMask::FIXED_BITS);
+
+    // Threads asking for the same masks all get the same ones
+    std::vector<std::shared_ptr<const FactoryMask>> seen(8 * 4);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&seen, t]() {
+            for (int k = 0; k < 4; ++k) {
+                seen[t * 4 + k] = MaskFactory::gaussian(0.5 + k);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (int t = 1; t < 8; ++t) {
+        for (int k = 0; k < 4; ++k) {
+            EXPECT_EQ(seen[t * 4 + k], seen[k]);
+        }
+    }
+
+    // Old masks fall out, those still held stay valid
+    for (int k = 0; k < (int)MaskFactory::CACHE_SIZE; ++k) {
+        MaskFactory::gaussian(10 + k * 0.1, MASK_ROW);
+    }
+    EXPECT_EQ(MaskFactory::size(), MaskFactory::CACHE_SIZE);
+    EXPECT_NE(MaskFactory::gaussian(2.0), gaussian);
+    EXPECT_EQ(gaussian->getWidth(), 13);
+
+    // The device keeps masks it has seen, switching between them is still right
+    Image source(64, 48, 3);
+    for (size_t i = 0; i < source.size; ++i) {
+        source.data[i] = (uint8_t)((i * 2654435761u) >> 24);
+    }
+    OpenCLImageProcessor processor;
+    Image first(source.w, source.h, 3), other(source.w, source.h, 3), again(source.w, source.h, 3);
+    processor.std_convolve_clamp_to_border(source.view(), first.view(), gaussian.get());
+    processor.std_convolve_clamp_to_border(source.view(), other.view(), box.get());
+    processor.std_convolve_clamp_to_border(source.view(), again.view(), gaussian.get());
+    EXPECT_EQ(memcmp(first.data, again.data, source.size), 0);
+    EXPECT_NE(memcmp(first.data, other.data, source.size), 0);
+    // A repeated call neither rebuilds the program nor writes the mask again
+    processor.resetTimings();
+    processor.std_convolve_clamp_to_border(source.view(), again.view(), gaussian.get());
+    EXPECT_EQ(processor.timings().builds, 0);
+    EXPECT_EQ(processor.timings().table_uploads, 0);
+}
+
+TEST(PerfGateTest, NoiseAwareThresholdAndBaselineRoundTrip) {
+    // Median and MAD ignore one slow repetition
+    PerfGate::Sample quiet = PerfGate::summarize({ 100, 101, 99, 100, 40 });
+    EXPECT_EQ(quiet.median, 100);
+    EXPECT_DOUBLE_EQ(quiet.mad, 0.01);
+
+    // Quiet runs are held to MIN_DROP, noisy ones get 3 sigma
+    PerfGate::Sample slower = PerfGate::summarize({ 85, 86, 84 });
+    PerfGate::Sample bit_slower = PerfGate::summarize({ 95, 96, 94 });
+    EXPECT_TRUE(PerfGate::regressed(quiet, slower));
+    EXPECT_FALSE(PerfGate::regressed(quiet, bit_slower));
+    PerfGate::Sample noisy = PerfGate::summarize({ 100, 110, 90, 115, 85 });
+    EXPECT_NEAR(PerfGate::allowed_drop(noisy, slower), 3 * 1.4826 * 0.1, 1e-12);
+    EXPECT_FALSE(PerfGate::regressed(noisy, slower));
+
+    PerfGate::Baseline baseline;
+    baseline.cpu = "Some \"quoted\" CPU";
+    baseline.device = "pthread-cpu";
+    baseline.workloads["blur_4k_cpu"] = quiet;
+    baseline.workloads["blur_4k_cl"] = noisy;
+    ASSERT_TRUE(PerfGate::write("output/perf_baseline_test.json", baseline));
+    PerfGate::Baseline read;
+    ASSERT_TRUE(PerfGate::read("output/perf_baseline_test.json", read));
+    EXPECT_EQ(read.cpu, baseline.cpu);
+    EXPECT_EQ(read.device, baseline.device);
+    ASSERT_EQ(read.workloads.size(), 2u);
+    EXPECT_DOUBLE_EQ(read.workloads["blur_4k_cpu"].median, 100);
+    EXPECT_NEAR(read.workloads["blur_4k_cl"].mad, noisy.mad, 1e-6);
+    EXPECT_FALSE(PerfGate::read("output/no_such_baseline.json", read));
+}
@@ -0,0 +1,59 @@
+#include "unsharp.h"
+#include "cpu_dispatch.h"
+#include <algorithm>
+#include <memory>
+
+namespace Unsharp {
+
+bool valid_args(const ImageView& src, const ImageView& dst, double amount, double radius, int threshold, const char* op) {
+	if(src.w != dst.w || src.h != dst.h || src.channels != dst.channels || src.layout != dst.layout) {
+		printf("%s needs a destination with the shape and layout of the source\n", op);
+		return false;
+	}
+	if(!(radius > 0 && radius <= MAX_RADIUS) || !(amount >= 0) || threshold < 0 || threshold > 255) {
+		printf("%s needs 0 < radius <= %d, amount >= 0 and threshold 0-255\n", op, MAX_RADIUS);
+		return false;
+	}
+	return true;
+}
+
+}
+
+
+namespace ImageOps {
+
+void unsharp(const ImageView& src, const ImageView& dst, double amount, double radius, int threshold) {
+	if(!Unsharp::valid_args(src, dst, amount, radius, threshold, "unsharp")) {
+		return;
+	}
+
+	// Rows around each one are read, so sharpening in place works from a copy
+	std::unique_ptr<Image> copy = unaliased(src, dst);
+	ImageView input = copy ? copy->view() : src;
+
+	std::shared_ptr<const FactoryMask> row = MaskFactory::gaussian(radius, MASK_ROW);
+	const float* taps = row->getFloatData();
+	int width = row->getWidth(), reach = width / 2;
+	const CpuKernels& kernels = CpuDispatch::kernels();
+	int planes = input.planes();
+	size_t step = input.pixel_step(), n = input.row_bytes();
+
+	#pragma omp parallel
+	{
+		std::vector<const uint8_t*> rows(width);
+		std::vector<float> column(n), work((size_t)(input.w + 2 * reach) * step + n);
+		#pragma omp for collapse(2) schedule(static)
+		for(int c = 0; c < planes; ++c) {
+			for(int y = 0; y < input.h; ++y) {
+				for(int i = -reach; i <= reach; ++i) {
+					rows[i + reach] = input.row(std::min(std::max(y + i, 0), input.h - 1), c);
+				}
+				kernels.weighted_rows(rows.data(), taps, width, n, column.data());
+				kernels.unsharp_row(input.row(y, c), column.data(), taps, reach, step, input.w,
+					(float)amount, (float)threshold, dst.row(y, c), work.data());
+			}
+		}
+	}
+}
+
+}
@@ -0,0 +1,138 @@
+#include "warp.h"
+#include "cpu_dispatch.h"
+#include <atomic>
+#include <cmath>
+
+namespace Warp {
+
+Eigen::Matrix3d rotation(double cx, double cy, double degrees, double scale) {
+	Eigen::Affine2d t = Eigen::Translation2d(cx, cy) * Eigen::Rotation2Dd(degrees * M_PI / 180.0)
+		* Eigen::Scaling(scale) * Eigen::Translation2d(-cx, -cy);
+	return t.matrix();
+}
+
+Eigen::Matrix3d shear(double kx, double ky) {
+	Eigen::Affine2d t = Eigen::Affine2d::Identity();
+	t.linear() << 1, kx, ky, 1;
+	return t.matrix();
+}
+
+Eigen::Matrix3d perspective(const Eigen::Vector2d from[4], const Eigen::Vector2d to[4]) {
+	// Two equations per point pair in the eight unknowns of H with H(2, 2) = 1
+	Eigen::Matrix<double, 8, 8> a;
+	Eigen::Matrix<double, 8, 1> b;
+	for(int i = 0; i < 4; ++i) {
+		double x = from[i].x(), y = from[i].y(), u = to[i].x(), v = to[i].y();
+		a.row(2 * i) << x, y, 1, 0, 0, 0, -x * u, -y * u;
+		a.row(2 * i + 1) << 0, 0, 0, x, y, 1, -x * v, -y * v;
+		b(2 * i) = u;
+		b(2 * i + 1) = v;
+	}
+	Eigen::Matrix<double, 8, 1> h = a.colPivHouseholderQr().solve(b);
+
+	Eigen::Matrix3d m;
+	m << h(0), h(1), h(2), h(3), h(4), h(5), h(6), h(7), 1;
+	return m;
+}
+
+bool inverse_of(const Eigen::Matrix3d& transform, float m[9]) {
+	Eigen::Matrix3d inverse;
+	bool invertible;
+	transform.computeInverseWithCheck(inverse, invertible);
+	if(!invertible) {
+		return false;
+	}
+	// Scaled so an affine transform keeps an exact 1 in the corner
+	if(inverse(2, 2) != 0) {
+		inverse /= inverse(2, 2);
+	}
+	for(int i = 0; i < 9; ++i) {
+		m[i] = (float)inverse(i / 3, i % 3);
+	}
+	return true;
+}
+
+}
+
+
+static std::atomic<uint64_t> next_map_id(1);
+
+WarpMap::WarpMap(const Eigen::Matrix3d& transform, int dst_w, int dst_h, Interpolation interpolation)
+	: w(dst_w), h(dst_h), interp(interpolation), map_id(next_map_id++) {
+	float m[9];
+	if(!Warp::inverse_of(transform, m)) {
+		printf("WarpMap needs an invertible transform\n");
+		return;
+	}
+	xy.resize((size_t)w * h * 2);
+	auto positions = CpuDispatch::kernels().warp_positions;
+
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < h; ++y) {
+		positions(m, y, w, &xy[(size_t)y * w * 2]);
+	}
+}
+
+
+namespace ImageOps {
+
+static bool warp_shape(const ImageView& src, const ImageView& dst, const char* op) {
+	if(src.channels != dst.channels || src.layout != dst.layout) {
+		printf("%s needs a destination with the channels and layout of the source\n", op);
+		return false;
+	}
+	if(src.data == dst.data) {
+		printf("%s cannot run in place\n", op);
+		return false;
+	}
+	return true;
+}
+
+// One destination row from its source positions, a plane at a time when planar
+static void remap_rows(const ImageView& src, const ImageView& dst, int y, const int32_t* xy, bool bicubic) {
+	auto remap = CpuDispatch::kernels().remap_row;
+	int channels = src.layout == PLANAR ? 1 : src.channels;
+	for(int c = 0; c < src.planes(); ++c) {
+		remap(src.row(0, c), src.pixel_step(), src.stride, src.w, src.h, channels,
+			xy, dst.w, bicubic, dst.row(y, c), dst.pixel_step());
+	}
+}
+
+void warp(const ImageView& src, const ImageView& dst, const Eigen::Matrix3d& transform, Interpolation interpolation) {
+	float m[9];
+	if(!warp_shape(src, dst, "warp")) {
+		return;
+	}
+	if(!Warp::inverse_of(transform, m)) {
+		printf("warp needs an invertible transform\n");
+		return;
+	}
+	auto positions = CpuDispatch::kernels().warp_positions;
+
+	#pragma omp parallel
+	{
+		std::vector<int32_t> xy((size_t)dst.w * 2);
+		#pragma omp for schedule(static)
+		for(int y = 0; y < dst.h; ++y) {
+			positions(m, y, dst.w, xy.data());
+			remap_rows(src, dst, y, xy.data(), interpolation == INTERP_BICUBIC);
+		}
+	}
+}
+
+void remap(const ImageView& src, const ImageView& dst, const WarpMap& map) {
+	if(!warp_shape(src, dst, "remap") || !map.valid()) {
+		return;
+	}
+	if(dst.w != map.width() || dst.h != map.height()) {
+		printf("remap needs a %dx%d destination\n", map.width(), map.height());
+		return;
+	}
+
+	#pragma omp parallel for schedule(static)
+	for(int y = 0; y < dst.h; ++y) {
+		remap_rows(src, dst, y, map.positions() + (size_t)y * dst.w * 2, map.interpolation() == INTERP_BICUBIC);
+	}
+}
+
+}